@@ -18,6 +18,158 @@
 #	define COPYFILE_CALLBACK_OPCOUNT 64
 #endif
 
+/* the default number of worker threads is the number of CPUs,
+ * but not more than this */
+#ifndef COPYFILE_DEFAULT_THREADS_MAX
+#	define COPYFILE_DEFAULT_THREADS_MAX 8
+#endif
+
+/* the hard limit on the number of worker threads */
+#ifndef COPYFILE_THREADS_MAX
+#	define COPYFILE_THREADS_MAX 64
+#endif
+
+/* the amount of data copied between releasing the source space
+ * with COPYFILE_PUNCH_SOURCE */
+#ifndef COPYFILE_PUNCH_CHUNK
+#	define COPYFILE_PUNCH_CHUNK (64 * 1024 * 1024)
+#endif
+
+/* the length of a single FIDEDUPERANGE request (btrfs does not
+ * accept more) */
+#ifndef COPYFILE_DEDUPE_CHUNK
+#	define COPYFILE_DEDUPE_CHUNK (16 * 1024 * 1024)
+#endif
+/* the length the requests found differing are retried in */
+#ifndef COPYFILE_DEDUPE_SUBCHUNK
+#	define COPYFILE_DEDUPE_SUBCHUNK (1024 * 1024)
+#endif
+
+/* the granularity of matching with COPYFILE_PARTIAL_CLONE (rounded up
+ * to the filesystem block size) */
+#ifndef COPYFILE_PARTIAL_CLONE_BLOCK
+#	define COPYFILE_PARTIAL_CLONE_BLOCK (128 * 1024)
+#endif
+
+/* the number of inodes remembered with COPYFILE_PRESERVE_HARDLINKS
+ * (until all their links are seen), and the hash table size */
+#ifndef COPYFILE_LINK_MAP_MAX
+#	define COPYFILE_LINK_MAP_MAX 65536
+#endif
+#ifndef COPYFILE_LINK_MAP_BUCKETS
+#	define COPYFILE_LINK_MAP_BUCKETS 16384
+#endif
+
+/* the number of shared extents remembered with
+ * COPYFILE_PRESERVE_SHARING */
+#ifndef COPYFILE_EXTENT_MAP_MAX
+#	define COPYFILE_EXTENT_MAP_MAX 262144
+#endif
+
+/* COPYFILE_PREFETCH: the bounds of the number of files read ahead,
+ * the copy time considered slow (waiting for the storage), the amount
+ * read ahead per file and in total */
+#ifndef COPYFILE_PREFETCH_DEPTH_MIN
+#	define COPYFILE_PREFETCH_DEPTH_MIN 4
+#endif
+#ifndef COPYFILE_PREFETCH_DEPTH_MAX
+#	define COPYFILE_PREFETCH_DEPTH_MAX 128
+#endif
+#ifndef COPYFILE_PREFETCH_SLOW_US
+#	define COPYFILE_PREFETCH_SLOW_US 2000
+#endif
+#ifndef COPYFILE_PREFETCH_FILE_MAX
+#	define COPYFILE_PREFETCH_FILE_MAX (1024 * 1024)
+#endif
+#ifndef COPYFILE_PREFETCH_WINDOW
+#	define COPYFILE_PREFETCH_WINDOW (32 * 1024 * 1024)
+#endif
+
+/* the files up to this size (the smallest common filesystem block
+ * size) are copied with a single read and write, without trying
+ * to clone them */
+#ifndef COPYFILE_SMALL_FILE
+#	define COPYFILE_SMALL_FILE 4096
+#endif
+
+/* the tree walk: the size of the buffer the directories are read
+ * into, and the maximum number of directories kept open */
+#ifndef COPYFILE_WALK_BUFFER
+#	define COPYFILE_WALK_BUFFER 32768
+#endif
+#ifndef COPYFILE_WALK_FDS
+#	define COPYFILE_WALK_FDS 32
+#endif
+
+/* the maximum number of files (and directories) of a tree which are
+ * copied as a single batch */
+#ifndef COPYFILE_TREE_CHUNK
+#	define COPYFILE_TREE_CHUNK 4096
+#endif
+
+/* the number of metadata operations submitted at a time
+ * (the io_uring size) */
+#ifndef COPYFILE_URING_ENTRIES
+#	define COPYFILE_URING_ENTRIES 256
+#endif
+
+/* the smallest batch worth setting up a ring for, without a context */
+#ifndef COPYFILE_URING_MIN_BATCH
+#	define COPYFILE_URING_MIN_BATCH 16
+#endif
+
+/* the checkpoint journal: the smallest file whose copy is resumable,
+ * and how much of it is copied between the checkpoints */
+#ifndef COPYFILE_JOURNAL_LARGE_FILE
+#	define COPYFILE_JOURNAL_LARGE_FILE (128 * 1024 * 1024)
+#endif
+#ifndef COPYFILE_JOURNAL_STEP
+#	define COPYFILE_JOURNAL_STEP (64 * 1024 * 1024)
+#endif
+
+/* the minimal number of journal records to be dropped by rewriting
+ * the journal */
+#ifndef COPYFILE_JOURNAL_COMPACT
+#	define COPYFILE_JOURNAL_COMPACT 4096
+#endif
+
+/* the fan-out copy: the size and the number of the buffers shared
+ * by the destinations */
+#ifndef COPYFILE_FANOUT_BUFFER
+#	define COPYFILE_FANOUT_BUFFER (256 * 1024)
+#endif
+#ifndef COPYFILE_FANOUT_BUFFERS
+#	define COPYFILE_FANOUT_BUFFERS 4
+#endif
+
+/* the tree watch: the time to wait for the changes to settle (ms),
+ * the limit of waiting (in those periods), the interval of syncing
+ * the whole tree (s), and the size of the event buffer */
+#ifndef COPYFILE_WATCH_DEBOUNCE
+#	define COPYFILE_WATCH_DEBOUNCE 200
+#endif
+#ifndef COPYFILE_WATCH_MAX_DELAY
+#	define COPYFILE_WATCH_MAX_DELAY 10
+#endif
+#ifndef COPYFILE_WATCH_RECONCILE
+#	define COPYFILE_WATCH_RECONCILE 3600
+#endif
+#ifndef COPYFILE_WATCH_BUFFER
+#	define COPYFILE_WATCH_BUFFER 65536
+#endif
+
+/* the block device copy: the size of the writes, the alignment of
+ * the buffers and the granularity of finding zeros */
+#ifndef COPYFILE_BLOCKDEV_CHUNK
+#	define COPYFILE_BLOCKDEV_CHUNK (4 * 1024 * 1024)
+#endif
+#ifndef COPYFILE_BLOCKDEV_ALIGN
+#	define COPYFILE_BLOCKDEV_ALIGN 4096
+#endif
+#ifndef COPYFILE_BLOCKDEV_ZERO_BLOCK
+#	define COPYFILE_BLOCKDEV_ZERO_BLOCK (64 * 1024)
+#endif
+
 static const int not_reached = 0;
 
 /* default permissions */
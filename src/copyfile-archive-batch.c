@@ -0,0 +1,210 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+
+struct batch
+{
+	copyfile_batch_entry_t* entries;
+	unsigned int flags;
+	/* the order of starting the entries, NULL for the listed one */
+	size_t* order;
+
+	/* NULL unless preserving hard links */
+	struct copyfile_link_map* links;
+	/* NULL unless reading ahead */
+	struct copyfile_prefetch* prefetch;
+};
+
+#ifdef HAVE_LINK
+/* make @dest another link to @target, the copy of an earlier link
+ * to the same source. returns COPYFILE_ERROR_LINK if it is to be
+ * copied instead. */
+static copyfile_error_t link_copy(copyfile_ctx_t* ctx, const char* target,
+		const char* dest, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	copyfile_progress_t progress;
+	struct stat target_st, dest_st;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+
+	progress.hardlink.target = target;
+
+	if (callback && callback(COPYFILE_NO_ERROR, COPYFILE_HARDLINK,
+				progress, callback_data, 0))
+		return COPYFILE_ABORTED;
+
+	/* a tree synced again may be linked already */
+	if (lstat(dest, &dest_st) || lstat(target, &target_st)
+			|| dest_st.st_dev != target_st.st_dev
+			|| dest_st.st_ino != target_st.st_ino)
+	{
+		if (unlink(dest) && errno != ENOENT)
+			return COPYFILE_ERROR_UNLINK_DEST;
+		if (link(target, dest))
+			return COPYFILE_ERROR_LINK;
+		ret = copyfile_sync_dir(ctx, dest);
+	}
+
+	if (!ret)
+	{
+		if (result_flags)
+			*result_flags = COPYFILE_COPY_ALL_METADATA;
+		if (ctx)
+			++ctx->stats.links;
+		if (callback && callback(COPYFILE_EOF, COPYFILE_HARDLINK,
+					progress, callback_data, 0))
+			return COPYFILE_ABORTED;
+	}
+
+	return ret;
+}
+#endif /*HAVE_LINK*/
+
+static int archive_job(copyfile_ctx_t* ctx, size_t i, void* data,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct batch* b = data;
+	copyfile_batch_entry_t* e = &b->entries[b->order ? b->order[i] : i];
+	const struct stat* st = e->st;
+	enum copyfile_link_claim claim = COPYFILE_LINK_UNTRACKED;
+	struct timeval started;
+	int linked = 0;
+#ifdef HAVE_LINK
+	struct stat buf;
+#endif
+
+	if (b->prefetch)
+	{
+		copyfile_prefetch_start(b->prefetch, i);
+		gettimeofday(&started, 0);
+	}
+
+#ifdef HAVE_LINK
+	if (b->links && !st && !lstat(e->source, &buf))
+		st = &buf;
+
+	if (b->links && st && S_ISREG(st->st_mode) && st->st_nlink > 1)
+	{
+		char* target;
+
+		claim = copyfile_link_map_claim(b->links, st, &target);
+		if (claim == COPYFILE_LINK_FOUND)
+		{
+			e->result = link_copy(ctx, target, e->dest, &e->result_flags,
+					callback, callback_data);
+			free(target);
+			linked = e->result != COPYFILE_ERROR_LINK;
+		}
+	}
+#endif /*HAVE_LINK*/
+
+	if (!linked)
+		e->result = copyfile_archive_file_ctx(ctx, e->source, e->dest, st,
+				b->flags, &e->result_flags, callback, callback_data);
+	e->result_errno = e->result ? errno : 0;
+
+	if (claim == COPYFILE_LINK_FIRST)
+		copyfile_link_map_publish(b->links, st,
+				e->result ? 0 : e->dest);
+	if (b->prefetch)
+		copyfile_prefetch_done(b->prefetch, copyfile_elapsed_us(&started));
+
+	return e->result == COPYFILE_ABORTED;
+}
+
+copyfile_error_t copyfile_archive_batch_ctx(copyfile_ctx_t* ctx,
+		copyfile_batch_entry_t* entries, size_t count,
+		unsigned int flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct batch b;
+	copyfile_extent_map_t* extent_map = 0;
+#ifdef HAVE_LINK
+	struct copyfile_link_map links;
+#endif
+	struct copyfile_prefetch prefetch;
+	size_t i;
+
+	/* the entries which are not reached are reported as aborted */
+	for (i = 0; i < count; ++i)
+	{
+		entries[i].result = COPYFILE_ABORTED;
+		entries[i].result_errno = 0;
+		entries[i].result_flags = 0;
+	}
+
+	b.entries = entries;
+	b.flags = flags;
+	b.order = copyfile_schedule(ctx, entries, count);
+	b.links = 0;
+#ifdef HAVE_LINK
+	/* without the maps, the files are just copied. a tree copy
+	 * shares its map between the batches. */
+	if (ctx && ctx->link_map)
+		b.links = ctx->link_map;
+	else if (ctx && (ctx->options & COPYFILE_PRESERVE_HARDLINKS)
+			&& !copyfile_link_map_init(&links))
+		b.links = &links;
+#endif
+
+	b.prefetch = 0;
+	if (ctx && (ctx->options & COPYFILE_PREFETCH)
+			&& !copyfile_prefetch_init(&prefetch, entries, b.order, count))
+		b.prefetch = &prefetch;
+
+	if (ctx && (ctx->options & COPYFILE_PRESERVE_SHARING)
+			&& !ctx->extent_map)
+	{
+		extent_map = copyfile_extent_map_create();
+		ctx->extent_map = extent_map;
+	}
+
+	copyfile_parallel_run(ctx, count, archive_job, &b,
+			callback, callback_data);
+
+	if (b.prefetch)
+		copyfile_prefetch_free(b.prefetch);
+	free(b.order);
+#ifdef HAVE_LINK
+	if (b.links == &links)
+		copyfile_link_map_free(b.links);
+#endif
+	if (extent_map)
+	{
+		ctx->extent_map = 0;
+		copyfile_extent_map_destroy(extent_map);
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		if (entries[i].result)
+		{
+			errno = entries[i].result_errno;
+			return entries[i].result;
+		}
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+copyfile_error_t copyfile_archive_batch(copyfile_batch_entry_t* entries,
+		size_t count, unsigned int flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_archive_batch_ctx(0, entries, count, flags,
+			callback, callback_data);
+}
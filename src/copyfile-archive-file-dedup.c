@@ -9,12 +9,14 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #include <sys/stat.h>
 
-copyfile_error_t copyfile_archive_file_dedup(const char* source,
-		const char* dest, const char* dup_copy, const struct stat* st,
-		unsigned int flags, unsigned int* result_flags,
+copyfile_error_t copyfile_archive_file_dedup_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const char* dup_copy,
+		const struct stat* st, unsigned int flags,
+		unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data)
 {
 	struct stat buf;
@@ -33,7 +35,24 @@ copyfile_error_t copyfile_archive_file_dedup(const char* source,
 		st = &buf;
 	}
 
-	ret = copyfile_copy_file(dup_copy, dest, st, callback, callback_data);
+	if (copyfile_quick_check(ctx, dest, st, flags, result_flags, &ret,
+				callback, callback_data))
+		return ret;
+
+	if (ctx && (ctx->options & COPYFILE_PARTIAL_CLONE)
+			&& S_ISREG(st->st_mode))
+	{
+		ret = copyfile_clone_partial(ctx, source, dup_copy, dest, st,
+				callback, callback_data);
+		/* no cloning here, the duplicate is no use */
+		if (ret == COPYFILE_ERROR_IOCTL_CLONE
+				|| ret == COPYFILE_ERROR_UNSUPPORTED)
+			ret = copyfile_copy_file_ctx(ctx, source, dest, st,
+					callback, callback_data);
+	}
+	else
+		ret = copyfile_copy_file_ctx(ctx, dup_copy, dest, st,
+				callback, callback_data);
 	if (ret)
 	{
 		if (result_flags)
@@ -41,5 +60,14 @@ copyfile_error_t copyfile_archive_file_dedup(const char* source,
 		return ret;
 	}
 
-	return copyfile_copy_metadata(source, dest, st, flags, result_flags);
+	return copyfile_copy_metadata_ctx(ctx, source, dest, st, flags, result_flags);
+}
+
+copyfile_error_t copyfile_archive_file_dedup(const char* source,
+		const char* dest, const char* dup_copy, const struct stat* st,
+		unsigned int flags, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_archive_file_dedup_ctx(0, source, dest, dup_copy, st,
+			flags, result_flags, callback, callback_data);
 }
@@ -9,12 +9,74 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #include <sys/stat.h>
 
-copyfile_error_t copyfile_archive_file(const char* source,
-		const char* dest, const struct stat* st,
-		unsigned int flags, unsigned int* result_flags,
+static copyfile_error_t copy_archive(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int flags, unsigned int* result_flags, int may_link,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct copyfile_dedup_key key;
+	copyfile_error_t ret;
+
+	if (copyfile_quick_check(ctx, dest, st, flags, result_flags, &ret,
+				callback, callback_data))
+		return ret;
+
+	if (copyfile_dedup_archive(ctx, source, dest, st, flags, result_flags,
+				may_link, &key, &ret, callback, callback_data))
+		return ret;
+
+	if (copyfile_shared_archive(ctx, source, dest, st, flags, result_flags,
+				&ret, callback, callback_data))
+	{
+		copyfile_dedup_remember(ctx, dest, &key);
+		return ret;
+	}
+
+	if (copyfile_journal_archive(ctx, source, dest, st, flags, result_flags,
+				&ret, callback, callback_data))
+	{
+		copyfile_dedup_remember(ctx, dest, &key);
+		return ret;
+	}
+
+	/* copy the metadata before the file is published */
+	if (ctx && (ctx->options & COPYFILE_ATOMIC_PUBLISH)
+			&& S_ISREG(st->st_mode))
+	{
+		copyfile_error_t metadata_ret = COPYFILE_NO_ERROR;
+
+		ret = copyfile_copy_regular_atomic(ctx, source, dest,
+				st->st_size, st, flags, result_flags, &metadata_ret,
+				callback, callback_data);
+		if (ret)
+			return ret;
+
+		++ctx->stats.files;
+		copyfile_dedup_remember(ctx, dest, &key);
+		return metadata_ret;
+	}
+
+	ret = copyfile_copy_file_ctx(ctx, source, dest, st, callback, callback_data);
+	if (ret)
+	{
+		if (result_flags)
+			*result_flags = 0;
+		return ret;
+	}
+
+	ret = copyfile_copy_metadata_ctx(ctx, source, dest, st, flags, result_flags);
+	/* the mtime is recorded in the index, so this comes last */
+	copyfile_dedup_remember(ctx, dest, &key);
+	return ret;
+}
+
+static copyfile_error_t archive_file(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int flags, unsigned int* result_flags, int may_link,
 		copyfile_callback_t callback, void* callback_data)
 {
 	struct stat buf;
@@ -33,13 +95,40 @@ copyfile_error_t copyfile_archive_file(const char* source,
 		st = &buf;
 	}
 
-	ret = copyfile_copy_file(source, dest, st, callback, callback_data);
-	if (ret)
-	{
-		if (result_flags)
-			*result_flags = 0;
+	if (copyfile_manifest_check(ctx, source, dest, st, flags, result_flags,
+				&ret, callback, callback_data))
 		return ret;
-	}
 
-	return copyfile_copy_metadata(source, dest, st, flags, result_flags);
+	ret = copy_archive(ctx, source, dest, st, flags, result_flags, may_link,
+			callback, callback_data);
+	if (!ret)
+		copyfile_manifest_remember(ctx, source, dest, st);
+	return ret;
+}
+
+copyfile_error_t copyfile_archive_file_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int flags, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return archive_file(ctx, source, dest, st, flags, result_flags, 0,
+			callback, callback_data);
+}
+
+copyfile_error_t copyfile_archive_file_linking(copyfile_ctx_t* ctx,
+		const char* source, const char* dest,
+		unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return archive_file(ctx, source, dest, 0, COPYFILE_COPY_ALL_METADATA,
+			result_flags, 1, callback, callback_data);
+}
+
+copyfile_error_t copyfile_archive_file(const char* source,
+		const char* dest, const struct stat* st,
+		unsigned int flags, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_archive_file_ctx(0, source, dest, st, flags, result_flags,
+			callback, callback_data);
 }
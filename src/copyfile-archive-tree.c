@@ -0,0 +1,623 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* the directory an entry is in */
+struct tree_parent
+{
+	dev_t dev;
+	ino_t ino;
+};
+
+/* the files (and the directories done) gathered for a batch */
+struct tree_chunk
+{
+	copyfile_batch_entry_t* entries;
+	/* "source\0dest\0" of each file, its stat() and directory */
+	char** paths;
+	struct stat* st;
+	struct tree_parent* parents;
+	size_t nfiles;
+
+	/* the directories whose contents are all in the chunk */
+	char** dir_paths;
+	struct stat* dir_st;
+	struct tree_parent* dir_parents;
+	size_t ndirs;
+
+	/* with a journal, the directories with an entry which failed,
+	 * until they are done (so that they are not recorded) */
+	struct tree_parent* failed;
+	size_t nfailed;
+	size_t failed_size;
+	/* set if one could not be remembered */
+	int failed_lost;
+};
+
+static int chunk_init(struct tree_chunk* c)
+{
+	c->entries = malloc(COPYFILE_TREE_CHUNK * sizeof(*c->entries));
+	c->paths = malloc(COPYFILE_TREE_CHUNK * sizeof(*c->paths));
+	c->st = malloc(COPYFILE_TREE_CHUNK * sizeof(*c->st));
+	c->dir_paths = malloc(COPYFILE_TREE_CHUNK * sizeof(*c->dir_paths));
+	c->dir_st = malloc(COPYFILE_TREE_CHUNK * sizeof(*c->dir_st));
+	c->parents = malloc(COPYFILE_TREE_CHUNK * sizeof(*c->parents));
+	c->dir_parents = malloc(COPYFILE_TREE_CHUNK * sizeof(*c->dir_parents));
+	c->nfiles = 0;
+	c->ndirs = 0;
+	c->failed = 0;
+	c->nfailed = 0;
+	c->failed_size = 0;
+	c->failed_lost = 0;
+
+	return !c->entries || !c->paths || !c->st || !c->dir_paths
+		|| !c->dir_st || !c->parents || !c->dir_parents ? -1 : 0;
+}
+
+static void chunk_clear(struct tree_chunk* c)
+{
+	size_t i;
+
+	for (i = 0; i < c->nfiles; ++i)
+		free(c->paths[i]);
+	for (i = 0; i < c->ndirs; ++i)
+		free(c->dir_paths[i]);
+	c->nfiles = 0;
+	c->ndirs = 0;
+}
+
+static void chunk_free(struct tree_chunk* c)
+{
+	if (c->paths && c->dir_paths)
+		chunk_clear(c);
+	free(c->entries);
+	free(c->paths);
+	free(c->st);
+	free(c->dir_paths);
+	free(c->dir_st);
+	free(c->parents);
+	free(c->dir_parents);
+	free(c->failed);
+}
+
+/* "source\0dest\0" */
+static char* dup_paths(const char* source, const char* dest)
+{
+	size_t slen = strlen(source) + 1;
+	size_t dlen = strlen(dest) + 1;
+	char* ret = malloc(slen + dlen);
+
+	if (ret)
+	{
+		memcpy(ret, source, slen);
+		memcpy(&ret[slen], dest, dlen);
+	}
+	return ret;
+}
+
+static void set_parent(struct tree_parent* p, const struct stat* st)
+{
+	p->dev = st ? st->st_dev : 0;
+	p->ino = st ? st->st_ino : 0;
+}
+
+static int chunk_add_file(struct tree_chunk* c,
+		const struct copyfile_walk_entry* e, const struct stat* parent)
+{
+	char* paths = dup_paths(e->source, e->dest);
+	copyfile_batch_entry_t* be = &c->entries[c->nfiles];
+
+	if (!paths)
+		return -1;
+
+	c->paths[c->nfiles] = paths;
+	c->st[c->nfiles] = e->st;
+	be->source = paths;
+	be->dest = paths + strlen(paths) + 1;
+	be->st = &c->st[c->nfiles];
+	set_parent(&c->parents[c->nfiles], parent);
+	++c->nfiles;
+	return 0;
+}
+
+static int chunk_add_dir(struct tree_chunk* c,
+		const struct copyfile_walk_dir* d, const struct stat* parent)
+{
+	char* paths = dup_paths(d->source, d->dest);
+
+	if (!paths)
+		return -1;
+
+	c->dir_paths[c->ndirs] = paths;
+	c->dir_st[c->ndirs] = d->st;
+	set_parent(&c->dir_parents[c->ndirs], parent);
+	++c->ndirs;
+	return 0;
+}
+
+/* keep the first error (and its errno) in @ret */
+static void keep_error(copyfile_error_t* ret, int* saved_errno,
+		copyfile_error_t err)
+{
+	if (err && !*ret)
+	{
+		*ret = err;
+		*saved_errno = errno;
+	}
+}
+
+static void mark_failed(struct tree_chunk* c, const struct tree_parent* p)
+{
+	size_t i;
+
+	for (i = 0; i < c->nfailed; ++i)
+	{
+		if (c->failed[i].dev == p->dev && c->failed[i].ino == p->ino)
+			return;
+	}
+
+	if (c->nfailed == c->failed_size)
+	{
+		size_t new_size = c->failed_size ? c->failed_size * 2 : 16;
+		struct tree_parent* n = realloc(c->failed,
+				new_size * sizeof(*n));
+
+		if (!n)
+		{
+			c->failed_lost = 1;
+			return;
+		}
+		c->failed = n;
+		c->failed_size = new_size;
+	}
+
+	c->failed[c->nfailed++] = *p;
+}
+
+/* check whether the directory @st had an entry which failed,
+ * and forget it */
+static int take_failed(struct tree_chunk* c, const struct stat* st)
+{
+	size_t i;
+
+	for (i = 0; i < c->nfailed; ++i)
+	{
+		if (c->failed[i].dev == st->st_dev && c->failed[i].ino == st->st_ino)
+		{
+			c->failed[i] = c->failed[--c->nfailed];
+			return 1;
+		}
+	}
+
+	return c->failed_lost;
+}
+
+/* record the entry @st in @parent as done in @journal, unless it (or
+ * anything inside) failed -- then its parent is not done either */
+static void record(struct tree_chunk* c, copyfile_journal_t* journal,
+		const struct stat* st, const struct tree_parent* parent,
+		int failed)
+{
+	if (!journal)
+		return;
+
+	if (S_ISDIR(st->st_mode) && take_failed(c, st))
+		failed = 1;
+	if (failed || copyfile_journal_add(journal, st,
+				parent->dev, parent->ino))
+		mark_failed(c, parent);
+}
+
+/* the symlinks and special files can't be created over the ones left
+ * by an earlier copy; remove those (in a single batch). the errors
+ * are reported by creating them then. */
+static void remove_specials(copyfile_ctx_t* ctx, struct tree_chunk* c)
+{
+	struct copyfile_meta_op* ops;
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < c->nfiles; ++i)
+	{
+		if (!S_ISREG(c->st[i].st_mode))
+			++count;
+	}
+	if (!count)
+		return;
+
+	ops = malloc(count * sizeof(*ops));
+	if (!ops)
+		return;
+
+	count = 0;
+	for (i = 0; i < c->nfiles; ++i)
+	{
+		if (S_ISREG(c->st[i].st_mode))
+			continue;
+		ops[count].opcode = COPYFILE_META_UNLINK;
+		ops[count].path = c->entries[i].dest;
+		ops[count].st = 0;
+		ops[count].chain = 0;
+		++count;
+	}
+	copyfile_meta_run(ctx, ops, count);
+	free(ops);
+}
+
+/* copy the files of @c in parallel, then the metadata of
+ * the directories done (children first, as they were left) -- so that
+ * their modification times and permissions are not altered by
+ * creating the contents. with a journal, the entries done are recorded
+ * then (even if aborted). returns non-zero if aborted; the other
+ * errors are kept in @ret. */
+static int flush_chunk(copyfile_ctx_t* ctx, struct tree_chunk* c,
+		unsigned int flags, copyfile_error_t* ret, int* saved_errno,
+		copyfile_callback_t callback, void* callback_data)
+{
+	copyfile_journal_t* journal = ctx ? ctx->journal : 0;
+	copyfile_error_t lret = COPYFILE_NO_ERROR;
+	size_t i;
+
+	if (c->nfiles)
+	{
+		remove_specials(ctx, c);
+		lret = copyfile_archive_batch_ctx(ctx, c->entries, c->nfiles,
+				flags, callback, callback_data);
+	}
+	for (i = 0; i < c->nfiles; ++i)
+		record(c, journal, &c->st[i], &c->parents[i],
+				c->entries[i].result != COPYFILE_NO_ERROR);
+
+	for (i = 0; lret != COPYFILE_ABORTED && i < c->ndirs; ++i)
+	{
+		const char* source = c->dir_paths[i];
+
+		keep_error(ret, saved_errno, lret);
+		lret = copyfile_copy_metadata_ctx(ctx, source,
+				source + strlen(source) + 1, &c->dir_st[i], flags, 0);
+		record(c, journal, &c->dir_st[i], &c->dir_parents[i],
+				lret != COPYFILE_NO_ERROR);
+	}
+
+	if (journal && (c->nfiles || c->ndirs))
+	{
+		copyfile_error_t jret = COPYFILE_NO_ERROR;
+
+		/* the journal must not get ahead of the copies */
+		if ((ctx->durability & COPYFILE_SYNC_MODE_MASK)
+				== COPYFILE_SYNC_BATCH)
+			jret = copyfile_ctx_commit(ctx);
+		if (!jret)
+			jret = copyfile_journal_sync(journal);
+		keep_error(ret, saved_errno, jret);
+	}
+
+	chunk_clear(c);
+	if (lret == COPYFILE_ABORTED)
+		return 1;
+	keep_error(ret, saved_errno, lret);
+	return 0;
+}
+
+/* create the @count directories @dirs (siblings, or the top one).
+ * the existing ones are checked in a single batch; without a callback
+ * to report to, the missing ones are created in a single batch
+ * as well. returns non-zero if aborted; the other errors are kept
+ * in @ret. */
+static int make_dirs(copyfile_ctx_t* ctx,
+		const struct copyfile_walk_entry* dirs, size_t count,
+		copyfile_error_t* ret, int* saved_errno,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct copyfile_meta_op* ops;
+	struct stat* cur;
+	size_t* missing;
+	size_t nmissing = 0;
+	int aborted = 0;
+	size_t i;
+
+	if (!count)
+		return 0;
+
+	ops = malloc(count * sizeof(*ops));
+	cur = malloc(count * sizeof(*cur));
+	missing = malloc(count * sizeof(*missing));
+	if (!ops || !cur || !missing)
+	{
+		free(ops);
+		free(cur);
+		free(missing);
+		keep_error(ret, saved_errno, COPYFILE_ERROR_MALLOC);
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		ops[i].opcode = COPYFILE_META_LSTAT;
+		ops[i].path = dirs[i].dest;
+		ops[i].st = &cur[i];
+		ops[i].chain = 0;
+	}
+	copyfile_meta_run(ctx, ops, count);
+
+	for (i = 0; i < count; ++i)
+	{
+		if (ops[i].error || !S_ISDIR(cur[i].st_mode))
+			missing[nmissing++] = i;
+	}
+
+	if (!callback)
+	{
+		for (i = 0; i < nmissing; ++i)
+		{
+			ops[i].opcode = COPYFILE_META_MKDIR;
+			ops[i].path = dirs[missing[i]].dest;
+			ops[i].chain = 0;
+		}
+		copyfile_meta_run(ctx, ops, nmissing);
+	}
+
+	for (i = 0; i < nmissing; ++i)
+	{
+		const struct copyfile_walk_entry* e = &dirs[missing[i]];
+		copyfile_error_t lret;
+
+		if (!callback && !ops[i].error)
+		{
+			lret = COPYFILE_NO_ERROR;
+			if (ctx)
+			{
+				++ctx->stats.directories;
+				lret = copyfile_sync_dir(ctx, e->dest);
+			}
+		}
+		else
+			/* the regular way reports (and retries) the errors */
+			lret = copyfile_copy_file_ctx(ctx, e->source, e->dest, &e->st,
+					callback, callback_data);
+
+		if (lret == COPYFILE_ABORTED)
+		{
+			aborted = 1;
+			break;
+		}
+		keep_error(ret, saved_errno, lret);
+	}
+
+	free(ops);
+	free(cur);
+	free(missing);
+	return aborted;
+}
+
+/* the entries recorded as done are not walked again */
+static int skip_done(void* data, const struct stat* st)
+{
+	copyfile_ctx_t* ctx = data;
+
+	/* the other links need to find the copy in the link map */
+	if (ctx->link_map && !S_ISDIR(st->st_mode) && st->st_nlink > 1)
+		return 0;
+	return copyfile_journal_done(ctx->journal, st);
+}
+
+static copyfile_error_t copy_walk(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct copyfile_walk_entry top;
+	struct copyfile_walk w;
+	struct tree_chunk c;
+	copyfile_extent_map_t* extent_map = 0;
+#ifdef HAVE_LINK
+	struct copyfile_link_map links;
+	int own_links = 0;
+#endif
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	copyfile_error_t lret;
+	int saved_errno = 0;
+	int aborted;
+
+	/* the directories which exist are reused, so that a tree can be
+	 * synced again */
+	top.source = source;
+	top.dest = dest;
+	top.st = *st;
+	if (make_dirs(ctx, &top, 1, &ret, &saved_errno,
+				callback, callback_data))
+		return COPYFILE_ABORTED;
+
+	if (chunk_init(&c))
+	{
+		chunk_free(&c);
+		return COPYFILE_ERROR_MALLOC;
+	}
+
+	lret = copyfile_walk_open(&w, ctx, source, dest, st);
+	if (lret)
+	{
+		saved_errno = errno;
+		chunk_free(&c);
+		errno = saved_errno;
+		return lret;
+	}
+	if (ctx && ctx->journal)
+	{
+		w.skip = skip_done;
+		w.skip_data = ctx;
+	}
+
+	/* the maps are shared by all the batches */
+#ifdef HAVE_LINK
+	if (ctx && !ctx->link_map
+			&& (ctx->options & COPYFILE_PRESERVE_HARDLINKS)
+			&& !copyfile_link_map_init(&links))
+	{
+		ctx->link_map = &links;
+		own_links = 1;
+	}
+#endif
+	if (ctx && !ctx->extent_map
+			&& (ctx->options & COPYFILE_PRESERVE_SHARING))
+	{
+		extent_map = copyfile_extent_map_create();
+		ctx->extent_map = extent_map;
+	}
+
+	aborted = 0;
+	while (!aborted && !lret)
+	{
+		enum copyfile_walk_event event;
+		const struct copyfile_walk_dir* d;
+		const struct stat* parent;
+		size_t i;
+
+		lret = copyfile_walk_next(&w, &event, &d);
+		if (lret || event == COPYFILE_WALK_END)
+			break;
+
+		if (event == COPYFILE_WALK_BATCH)
+		{
+			aborted = make_dirs(ctx, d->dirs, d->ndirs, &ret, &saved_errno,
+					callback, callback_data);
+			for (i = 0; !aborted && !lret && i < d->nfiles; ++i)
+			{
+				if (c.nfiles == COPYFILE_TREE_CHUNK)
+					aborted = flush_chunk(ctx, &c, flags, &ret, &saved_errno,
+							callback, callback_data);
+				if (!aborted && chunk_add_file(&c, &d->files[i], &d->st))
+					lret = COPYFILE_ERROR_MALLOC;
+			}
+		}
+		else
+		{
+			/* the directory was left already */
+			parent = w.depth ? &w.dirs[w.depth - 1].st : 0;
+			if (c.ndirs == COPYFILE_TREE_CHUNK)
+				aborted = flush_chunk(ctx, &c, flags, &ret, &saved_errno,
+						callback, callback_data);
+			if (!aborted && chunk_add_dir(&c, d, parent))
+				lret = COPYFILE_ERROR_MALLOC;
+		}
+	}
+
+	/* the walk stops on errors; the files gathered are copied still */
+	keep_error(&ret, &saved_errno, lret);
+	if (!aborted)
+		aborted = flush_chunk(ctx, &c, flags, &ret, &saved_errno,
+				callback, callback_data);
+
+#ifdef HAVE_LINK
+	if (own_links)
+	{
+		ctx->link_map = 0;
+		copyfile_link_map_free(&links);
+	}
+#endif
+	if (extent_map)
+	{
+		ctx->extent_map = 0;
+		copyfile_extent_map_destroy(extent_map);
+	}
+	copyfile_walk_close(&w);
+	chunk_free(&c);
+
+	if (aborted)
+		return COPYFILE_ABORTED;
+	if (ret)
+		errno = saved_errno;
+	return ret;
+}
+
+copyfile_error_t copyfile_copy_tree(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	copyfile_ctx_t* own_ctx = 0;
+	copyfile_journal_t* journal;
+	unsigned int saved_options;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	int saved_errno;
+
+	if (!ctx)
+	{
+		ctx = own_ctx = copyfile_ctx_create();
+		if (!ctx)
+			return COPYFILE_ERROR_MALLOC;
+	}
+	journal = ctx->journal;
+
+	/* a tree is not mirrored onto device nodes, so the destination
+	 * files do not need to be checked one by one */
+	saved_options = ctx->options;
+	ctx->options |= COPYFILE_NO_BLOCKDEV;
+
+	if (journal)
+		ret = copyfile_journal_begin(journal, st, dest);
+	if (!ret)
+	{
+		/* the whole tree was done already */
+		if (!journal || !copyfile_journal_done(journal, st))
+			ret = copy_walk(ctx, source, dest, st, flags,
+					callback, callback_data);
+
+		if (journal)
+		{
+			saved_errno = errno;
+			copyfile_journal_end(journal);
+			errno = saved_errno;
+		}
+	}
+
+	saved_errno = errno;
+	ctx->options = saved_options;
+	copyfile_ctx_destroy(own_ctx);
+	errno = saved_errno;
+	return ret;
+}
+
+copyfile_error_t copyfile_archive_tree_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, unsigned int flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct stat st;
+
+#ifdef S_IFLNK
+	if (lstat(source, &st))
+		return COPYFILE_ERROR_STAT;
+#else
+	if (stat(source, &st))
+		return COPYFILE_ERROR_STAT;
+#endif
+
+	if (!S_ISDIR(st.st_mode))
+		return copyfile_archive_file_ctx(ctx, source, dest, &st, flags, 0,
+				callback, callback_data);
+
+	return copyfile_copy_tree(ctx, source, dest, &st, flags,
+			callback, callback_data);
+}
+
+copyfile_error_t copyfile_archive_tree(const char* source,
+		const char* dest, unsigned int flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_archive_tree_ctx(0, source, dest, flags,
+			callback, callback_data);
+}
@@ -0,0 +1,303 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_LINUX_FS_H
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#endif
+
+#ifdef FICLONERANGE
+
+struct partial
+{
+	copyfile_ctx_t* ctx;
+	int fd_in;
+	int fd_dup;
+	int fd_out;
+
+	copyfile_progress_t progress;
+	unsigned int opcount;
+	copyfile_callback_t callback;
+	void* callback_data;
+};
+
+static int clone_range(struct partial* p, off_t offset, off_t len)
+{
+	struct file_clone_range r;
+
+	r.src_fd = p->fd_dup;
+	r.src_offset = offset;
+	r.src_length = len;
+	r.dest_offset = offset;
+
+	return ioctl(p->fd_out, FICLONERANGE, &r);
+}
+
+/* read up to @len bytes at @offset, until EOF */
+static ssize_t read_full(struct partial* p, int fd, char* buf, size_t len,
+		off_t offset)
+{
+	size_t done = 0;
+
+	while (done < len)
+	{
+		ssize_t rd = pread(fd, buf + done, len - done, offset + done);
+
+		if (rd == -1)
+		{
+			if (p->callback
+					? !p->callback(COPYFILE_ERROR_READ, COPYFILE_REGULAR,
+						p->progress, p->callback_data, errno != EINTR)
+					: errno == EINTR)
+				continue;
+			return -1;
+		}
+		else if (rd == 0)
+			break;
+
+		done += rd;
+	}
+
+	return done;
+}
+
+static copyfile_error_t write_full(struct partial* p, const char* buf,
+		size_t len, off_t offset)
+{
+	while (len > 0)
+	{
+		ssize_t wr = pwrite(p->fd_out, buf, len, offset);
+
+		if (wr == -1)
+		{
+			if (p->callback
+					? !p->callback(COPYFILE_ERROR_WRITE, COPYFILE_REGULAR,
+						p->progress, p->callback_data, errno != EINTR)
+					: errno == EINTR)
+				continue;
+			return COPYFILE_ERROR_WRITE;
+		}
+
+		buf += wr;
+		len -= wr;
+		offset += wr;
+		p->ctx->stats.bytes += wr;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+/* clone the matching run [@start, @end); should that fail, copy it
+ * from the source */
+static copyfile_error_t flush_run(struct partial* p, char* buf,
+		size_t block, off_t start, off_t end)
+{
+	if (start == end || !clone_range(p, start, end - start))
+		return COPYFILE_NO_ERROR;
+
+	while (start < end)
+	{
+		size_t len = end - start < (off_t) block
+			? (size_t) (end - start) : block;
+		ssize_t rd = read_full(p, p->fd_in, buf, len, start);
+		copyfile_error_t ret;
+
+		if (rd == -1)
+			return COPYFILE_ERROR_READ;
+		if (rd == 0)
+			break;
+
+		ret = write_full(p, buf, rd, start);
+		if (ret)
+			return ret;
+		start += rd;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+static copyfile_error_t copy_blocks(struct partial* p, off_t dup_size,
+		size_t block)
+{
+	char* buf = copyfile_arena_reserve(&p->ctx->data, block * 2);
+	char* dup_buf = buf + block;
+	off_t run_start = 0;
+	off_t offset = 0;
+	copyfile_error_t ret;
+
+	if (!buf)
+		return COPYFILE_ERROR_MALLOC;
+
+	while (1)
+	{
+		ssize_t rd, dup_rd;
+
+		if (p->callback)
+		{
+			p->progress.data.offset = offset;
+			if (!p->opcount && p->callback(COPYFILE_NO_ERROR,
+						COPYFILE_REGULAR, p->progress, p->callback_data, 0))
+				return COPYFILE_ABORTED;
+			if (++p->opcount >= p->ctx->callback_opcount)
+				p->opcount = 0;
+		}
+
+		rd = read_full(p, p->fd_in, buf, block, offset);
+		if (rd == -1)
+			return COPYFILE_ERROR_READ;
+		if (rd == 0)
+			break;
+
+		/* only whole blocks can be cloned, except for the tail
+		 * of the duplicate */
+		dup_rd = 0;
+		if (offset < dup_size && ((size_t) rd == block
+					|| offset + rd == dup_size))
+		{
+			dup_rd = read_full(p, p->fd_dup, dup_buf, rd, offset);
+			if (dup_rd == -1)
+				return COPYFILE_ERROR_READ;
+		}
+
+		if (dup_rd != rd || memcmp(buf, dup_buf, rd))
+		{
+			/* the data is in the buffer already, so write it
+			 * before cloning the preceding run */
+			ret = write_full(p, buf, rd, offset);
+			if (!ret)
+				ret = flush_run(p, buf, block, run_start, offset);
+			if (ret)
+				return ret;
+			run_start = offset + rd;
+		}
+
+		offset += rd;
+		if ((size_t) rd < block)
+			break;
+	}
+
+	ret = flush_run(p, buf, block, run_start, offset);
+	p->progress.data.offset = offset;
+
+	/* the destination may have been longer */
+	if (!ret && ftruncate(p->fd_out, offset))
+		ret = COPYFILE_ERROR_TRUNCATE;
+	return ret;
+}
+
+#endif /*FICLONERANGE*/
+
+copyfile_error_t copyfile_clone_partial(copyfile_ctx_t* ctx,
+		const char* source, const char* dup_copy, const char* dest,
+		const struct stat* st,
+		copyfile_callback_t callback, void* callback_data)
+{
+#ifdef FICLONERANGE
+	struct partial p;
+	struct stat dup_st, dest_st;
+	size_t block = COPYFILE_PARTIAL_CLONE_BLOCK;
+	copyfile_error_t ret;
+	int hold_errno;
+
+	p.fd_dup = open(dup_copy, O_RDONLY);
+	if (p.fd_dup == -1)
+		return COPYFILE_ERROR_OPEN_SOURCE;
+	if (fstat(p.fd_dup, &dup_st))
+	{
+		hold_errno = errno;
+		close(p.fd_dup);
+		errno = hold_errno;
+		return COPYFILE_ERROR_STAT;
+	}
+
+	p.fd_out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, perm_file);
+	if (p.fd_out == -1)
+	{
+		hold_errno = errno;
+		close(p.fd_dup);
+		errno = hold_errno;
+		return COPYFILE_ERROR_OPEN_DEST;
+	}
+
+	/* find out whether cloning works here before anything is read,
+	 * so that the caller can use another way if it does not. the first
+	 * block is overwritten later if it does not match. */
+	if (!fstat(p.fd_out, &dest_st) && dest_st.st_blksize > 0
+			&& block % dest_st.st_blksize)
+		block += dest_st.st_blksize - block % dest_st.st_blksize;
+
+	p.ctx = ctx;
+	p.fd_in = -1;
+	if (!dup_st.st_size || clone_range(&p, 0, dup_st.st_size < (off_t) block
+				? dup_st.st_size : (off_t) block))
+	{
+		ret = dup_st.st_size ? COPYFILE_ERROR_IOCTL_CLONE
+			: COPYFILE_ERROR_UNSUPPORTED;
+		hold_errno = errno;
+		close(p.fd_dup);
+		close(p.fd_out);
+		errno = hold_errno;
+		return ret;
+	}
+
+	p.fd_in = open(source, O_RDONLY);
+	if (p.fd_in == -1)
+	{
+		hold_errno = errno;
+		close(p.fd_dup);
+		close(p.fd_out);
+		errno = hold_errno;
+		return COPYFILE_ERROR_OPEN_SOURCE;
+	}
+
+	p.progress.data.offset = 0;
+	p.progress.data.size = st->st_size;
+	p.opcount = 0;
+	p.callback = callback;
+	p.callback_data = callback_data;
+
+	ret = copy_blocks(&p, dup_st.st_size, block);
+	if (!ret)
+		ret = copyfile_sync_fd(ctx, p.fd_out, 0);
+	hold_errno = errno;
+
+	close(p.fd_in);
+	close(p.fd_dup);
+	if (close(p.fd_out) && !ret)
+	{
+		ret = COPYFILE_ERROR_WRITE;
+		hold_errno = errno;
+	}
+
+	if (!ret)
+	{
+		++ctx->stats.files;
+		if (callback && callback(COPYFILE_EOF, COPYFILE_REGULAR,
+					p.progress, callback_data, 0))
+			return COPYFILE_ABORTED;
+		return copyfile_sync_dir(ctx, dest);
+	}
+
+	errno = hold_errno;
+	return ret;
+#else
+	return COPYFILE_ERROR_UNSUPPORTED;
+#endif
+}
@@ -0,0 +1,489 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_LINUX_FS_H
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#endif
+
+/* a shared source extent, and where its first copy is */
+struct shared_extent
+{
+	dev_t dev;
+	off_t physical;
+	off_t length;
+
+	size_t owner;
+	off_t logical;
+};
+
+/* the extents sorted by (dev, physical), and the paths of the copies */
+struct copyfile_extent_map
+{
+	struct shared_extent* extents;
+	size_t count;
+	size_t size;
+
+	char** owners;
+	size_t nowners;
+	size_t owners_size;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+};
+
+copyfile_extent_map_t* copyfile_extent_map_create(void)
+{
+	copyfile_extent_map_t* map = malloc(sizeof(*map));
+
+	if (!map)
+		return 0;
+
+	memset(map, 0, sizeof(*map));
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&map->lock, 0);
+#endif
+
+	return map;
+}
+
+void copyfile_extent_map_destroy(copyfile_extent_map_t* map)
+{
+	size_t i;
+
+	if (!map)
+		return;
+
+	for (i = 0; i < map->nowners; ++i)
+		free(map->owners[i]);
+	free(map->owners);
+	free(map->extents);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&map->lock);
+#endif
+	free(map);
+}
+
+/* the index of the first extent starting after (@dev, @physical) */
+static size_t upper_bound(const copyfile_extent_map_t* map, dev_t dev,
+		off_t physical)
+{
+	size_t lo = 0;
+	size_t hi = map->count;
+
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		const struct shared_extent* e = &map->extents[mid];
+
+		if (e->dev < dev || (e->dev == dev && e->physical <= physical))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* find the copy of the data at @physical. returns a newly allocated
+ * path to it, with the offset and the length of the known copy
+ * stored in @logical and @length. */
+static char* find_copy(copyfile_extent_map_t* map, dev_t dev,
+		off_t physical, off_t* logical, off_t* length)
+{
+	char* ret = 0;
+	size_t i;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&map->lock);
+#endif
+
+	i = upper_bound(map, dev, physical);
+	if (i > 0)
+	{
+		const struct shared_extent* e = &map->extents[i - 1];
+
+		if (e->dev == dev && physical < e->physical + e->length)
+		{
+			*logical = e->logical + (physical - e->physical);
+			*length = e->physical + e->length - physical;
+			ret = strdup(map->owners[e->owner]);
+		}
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&map->lock);
+#endif
+
+	return ret;
+}
+
+/* remember @path as the copy of the @count shared @extents. once
+ * the map is full, further extents are ignored. */
+static void add_copies(copyfile_extent_map_t* map, dev_t dev,
+		const copyfile_extent_t* extents, size_t count,
+		const char* path)
+{
+	char* owner;
+	size_t i;
+
+	if (!count)
+		return;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&map->lock);
+#endif
+
+	if (map->count + count > map->size && map->size < COPYFILE_EXTENT_MAP_MAX)
+	{
+		size_t new_size = map->size ? map->size * 2 : 256;
+		struct shared_extent* new_extents;
+
+		while (new_size < map->count + count)
+			new_size *= 2;
+		if (new_size > COPYFILE_EXTENT_MAP_MAX)
+			new_size = COPYFILE_EXTENT_MAP_MAX;
+
+		new_extents = realloc(map->extents, new_size * sizeof(*new_extents));
+		if (new_extents)
+		{
+			map->extents = new_extents;
+			map->size = new_size;
+		}
+	}
+
+	if (map->nowners == map->owners_size)
+	{
+		size_t new_size = map->owners_size ? map->owners_size * 2 : 64;
+		char** new_owners = realloc(map->owners,
+				new_size * sizeof(*new_owners));
+
+		if (new_owners)
+		{
+			map->owners = new_owners;
+			map->owners_size = new_size;
+		}
+	}
+
+	owner = map->nowners < map->owners_size ? strdup(path) : 0;
+	if (owner)
+	{
+		map->owners[map->nowners] = owner;
+
+		for (i = 0; i < count && map->count < map->size; ++i)
+		{
+			const copyfile_extent_t* e = &extents[i];
+			size_t pos = upper_bound(map, dev, e->physical);
+			struct shared_extent* n;
+
+			/* another file may have been copied in the meantime */
+			if (pos > 0 && map->extents[pos - 1].dev == dev
+					&& map->extents[pos - 1].physical == e->physical)
+				continue;
+
+			n = &map->extents[pos];
+			memmove(n + 1, n, (map->count - pos) * sizeof(*n));
+			n->dev = dev;
+			n->physical = e->physical;
+			n->length = e->length;
+			n->owner = map->nowners;
+			n->logical = e->logical;
+			++map->count;
+		}
+
+		++map->nowners;
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&map->lock);
+#endif
+}
+
+#ifdef FICLONERANGE
+
+struct shared
+{
+	struct copyfile_range_copy c;
+	off_t size;
+
+	/* the last copy cloned from */
+	char* owner;
+	int fd_owner;
+};
+
+/* clone [@offset, @offset + @len) from @owner at @owner_offset.
+ * returns non-zero if it could not be done. */
+static int clone_from(struct shared* s, const char* owner,
+		off_t owner_offset, off_t offset, off_t len)
+{
+	struct file_clone_range r;
+
+	if (!s->owner || strcmp(s->owner, owner))
+	{
+		if (s->fd_owner != -1)
+			close(s->fd_owner);
+		free(s->owner);
+		s->owner = 0;
+
+		s->fd_owner = open(owner, O_RDONLY);
+		if (s->fd_owner == -1)
+			return -1;
+		s->owner = strdup(owner);
+	}
+
+	r.src_fd = s->fd_owner;
+	r.src_offset = owner_offset;
+	r.src_length = len;
+	r.dest_offset = offset;
+
+	if (ioctl(s->c.fd_out, FICLONERANGE, &r))
+		return -1;
+
+	s->c.ctx->stats.shared += len;
+	return 0;
+}
+
+/* copy the extents, cloning the shared ones which were copied
+ * already. the shared extents with no known copy are moved
+ * to the beginning of @extents, and their number is stored
+ * in @new_count. */
+static copyfile_error_t copy_extents(struct shared* s, dev_t dev,
+		copyfile_extent_t* extents, size_t count, size_t* new_count)
+{
+	size_t i;
+	copyfile_error_t ret;
+
+	*new_count = 0;
+
+	for (i = 0; i < count; ++i)
+	{
+		copyfile_extent_t e = extents[i];
+		off_t end = e.logical + e.length;
+		off_t offset = e.logical;
+
+		if (offset >= s->size)
+			break;
+		if (end > s->size)
+			end = s->size;
+
+		if (e.flags & COPYFILE_EXTENT_UNWRITTEN)
+		{
+			copyfile_preallocate(s->c.fd_out, offset, end - offset);
+			continue;
+		}
+
+		if (!(e.flags & COPYFILE_EXTENT_SHARED)
+				|| (e.flags & COPYFILE_EXTENT_UNKNOWN))
+		{
+			ret = copyfile_copy_range(&s->c, offset, end - offset);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		while (offset < end)
+		{
+			off_t owner_offset, len;
+			char* owner = find_copy(s->c.ctx->extent_map, dev,
+					e.physical + (offset - e.logical), &owner_offset, &len);
+
+			if (!owner)
+			{
+				/* the first copy of the remaining part */
+				ret = copyfile_copy_range(&s->c, offset, end - offset);
+				if (ret)
+					return ret;
+
+				e.physical += offset - e.logical;
+				e.length = end - offset;
+				e.logical = offset;
+				extents[(*new_count)++] = e;
+				break;
+			}
+
+			if (len > end - offset)
+				len = end - offset;
+
+			ret = copyfile_range_progress(&s->c, offset);
+			if (!ret && clone_from(s, owner, owner_offset, offset, len))
+				ret = copyfile_copy_range(&s->c, offset, len);
+			free(owner);
+			if (ret)
+				return ret;
+
+			offset += len;
+		}
+	}
+
+	s->c.progress.data.offset = s->size;
+	/* the holes are left unwritten */
+	if (ftruncate(s->c.fd_out, s->size))
+		return COPYFILE_ERROR_TRUNCATE;
+	return COPYFILE_NO_ERROR;
+}
+
+/* write the file, as a temporary one if it is to be published
+ * atomically. the metadata result is stored in @metadata_ret. */
+static copyfile_error_t write_shared(struct shared* s, const char* source,
+		const char* dest, const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_extent_t* extents,
+		size_t count, size_t* new_count, copyfile_error_t* metadata_ret)
+{
+	struct copyfile_tmpfile tmp;
+	int atomic = s->c.ctx->options & COPYFILE_ATOMIC_PUBLISH;
+	copyfile_error_t ret;
+	int hold_errno;
+
+	if (atomic)
+	{
+		ret = copyfile_tmpfile_open(&tmp, dest, perm_file);
+		if (ret)
+			return ret;
+		s->c.fd_out = tmp.fd;
+	}
+	else
+	{
+		s->c.fd_out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, perm_file);
+		if (s->c.fd_out == -1)
+			return COPYFILE_ERROR_OPEN_DEST;
+	}
+
+	ret = copy_extents(s, st->st_dev, extents, count, new_count);
+
+	if (atomic)
+	{
+		if (!ret)
+		{
+			*metadata_ret = copyfile_copy_metadata_to(s->c.ctx, source,
+					tmp.path, tmp.fd, st, flags, result_flags);
+			ret = copyfile_sync_fd(s->c.ctx, tmp.fd, 1);
+		}
+		if (ret)
+		{
+			copyfile_tmpfile_discard(&tmp);
+			return ret;
+		}
+
+		ret = copyfile_tmpfile_publish(&tmp, dest);
+	}
+	else
+	{
+		if (!ret)
+			ret = copyfile_sync_fd(s->c.ctx, s->c.fd_out, 0);
+		hold_errno = errno;
+		if (close(s->c.fd_out) && !ret)
+			return COPYFILE_ERROR_WRITE;
+		errno = hold_errno;
+	}
+
+	if (ret)
+		return ret;
+
+	++s->c.ctx->stats.files;
+	if (s->c.callback && s->c.callback(COPYFILE_EOF, COPYFILE_REGULAR,
+				s->c.progress, s->c.callback_data, 0))
+		return COPYFILE_ABORTED;
+
+	ret = copyfile_sync_dir(s->c.ctx, dest);
+	if (!ret && !atomic)
+		*metadata_ret = copyfile_copy_metadata_ctx(s->c.ctx, source, dest, st,
+				flags, result_flags);
+	return ret;
+}
+
+#endif /*FICLONERANGE*/
+
+int copyfile_shared_archive(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_error_t* ret,
+		copyfile_callback_t callback, void* callback_data)
+{
+#ifdef FICLONERANGE
+	struct shared s;
+	copyfile_extent_t* extents;
+	size_t count, new_count, i;
+	copyfile_error_t metadata_ret = COPYFILE_NO_ERROR;
+	int hold_errno;
+
+	if (!ctx || !ctx->extent_map || !S_ISREG(st->st_mode) || !st->st_size)
+		return 0;
+
+	s.c.fd_in = open(source, O_RDONLY);
+	if (s.c.fd_in == -1)
+		return 0;
+
+	/* without shared extents, the file is copied normally */
+	if (copyfile_get_extents_fd(s.c.fd_in, &extents, &count))
+	{
+		close(s.c.fd_in);
+		return 0;
+	}
+	for (i = 0; i < count; ++i)
+	{
+		if ((extents[i].flags & COPYFILE_EXTENT_SHARED)
+				&& !(extents[i].flags & COPYFILE_EXTENT_UNKNOWN))
+			break;
+	}
+	if (i == count)
+	{
+		free(extents);
+		close(s.c.fd_in);
+		return 0;
+	}
+
+	s.c.ctx = ctx;
+	s.size = st->st_size;
+	new_count = 0;
+	s.owner = 0;
+	s.fd_owner = -1;
+	s.c.progress.data.offset = 0;
+	s.c.progress.data.size = st->st_size;
+	s.c.opcount = 0;
+	s.c.callback = callback;
+	s.c.callback_data = callback_data;
+
+	*ret = write_shared(&s, source, dest, st, flags, result_flags,
+			extents, count, &new_count, &metadata_ret);
+	hold_errno = errno;
+
+	close(s.c.fd_in);
+	if (s.fd_owner != -1)
+		close(s.fd_owner);
+	free(s.owner);
+
+	if (!*ret)
+	{
+		/* the later copies can clone from this one */
+		add_copies(ctx->extent_map, st->st_dev, extents, new_count, dest);
+		*ret = metadata_ret;
+	}
+	else if (result_flags)
+		*result_flags = 0;
+
+	free(extents);
+	errno = hold_errno;
+	return 1;
+#else
+	return 0;
+#endif
+}
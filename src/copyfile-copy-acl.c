@@ -9,6 +9,7 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #ifdef HAVE_LIBACL
 #	include <sys/acl.h>
@@ -22,16 +23,23 @@ static const acl_type_t acl_types[] =
 };
 #endif /*HAVE_LIBACL*/
 
-copyfile_error_t copyfile_copy_acl(const char* source,
-		const char* dest, const struct stat* st)
+copyfile_error_t copyfile_copy_acl_to(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int dest_fd,
+		const struct stat* st)
 {
 #ifdef HAVE_LIBACL
 	{
 		copyfile_error_t ret = COPYFILE_NO_ERROR;
 		int saved_errno;
 
+		/* only regular files are passed by fd, and they can't have
+		 * the default ACL */
+		int types = dest_fd != -1 ? 1 : 2;
 		int i;
 
+		if (st && copyfile_fs_lacks(ctx, st->st_dev, COPYFILE_FS_NO_ACL))
+			return COPYFILE_NO_ERROR;
+
 #ifndef HAVE_ACL_GET_LINK_NP
 #	ifdef S_IFLNK
 		{
@@ -51,7 +59,7 @@ copyfile_error_t copyfile_copy_acl(const char* source,
 #	endif /*S_IFLNK*/
 #endif /*!HAVE_ACL_GET_LINK_NP*/
 
-		for (i = 0; i < 2; ++i)
+		for (i = 0; i < types; ++i)
 		{
 			acl_t acl;
 
@@ -64,10 +72,13 @@ copyfile_error_t copyfile_copy_acl(const char* source,
 			{
 				int aclret;
 
+				if (dest_fd != -1)
+					aclret = acl_set_fd(dest_fd, acl);
+				else
 #ifdef HAVE_ACL_GET_LINK_NP
-				aclret = acl_set_link_np(dest, acl_types[i], acl);
+					aclret = acl_set_link_np(dest, acl_types[i], acl);
 #else
-				aclret = acl_set_file(dest, acl_types[i], acl);
+					aclret = acl_set_file(dest, acl_types[i], acl);
 #endif
 				if (aclret && !ret)
 				{
@@ -81,7 +92,12 @@ copyfile_error_t copyfile_copy_acl(const char* source,
 			{
 				/* ACLs not supported? fine, nothing to copy. */
 				if (errno == EOPNOTSUPP)
+				{
+					if (st)
+						copyfile_fs_set_lacks(ctx, st->st_dev,
+								COPYFILE_FS_NO_ACL);
 					return COPYFILE_NO_ERROR;
+				}
 				else if (i > 0 && errno == EACCES)
 					/* ACL_TYPE_DEFAULT on non-dir, likely */;
 				else if (!ret)
@@ -100,3 +116,15 @@ copyfile_error_t copyfile_copy_acl(const char* source,
 
 	return COPYFILE_ERROR_UNSUPPORTED;
 }
+
+copyfile_error_t copyfile_copy_acl_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st)
+{
+	return copyfile_copy_acl_to(ctx, source, dest, -1, st);
+}
+
+copyfile_error_t copyfile_copy_acl(const char* source,
+		const char* dest, const struct stat* st)
+{
+	return copyfile_copy_acl_ctx(0, source, dest, st);
+}
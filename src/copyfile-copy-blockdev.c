@@ -0,0 +1,424 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#ifdef HAVE_LINUX_FS_H
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#endif
+
+#if defined(BLKGETSIZE64) && defined(BLKSSZGET)
+
+/* A block device can be neither truncated nor preallocated, and
+ * the data past the end of the copy is left alone. The zeros
+ * (the holes of the source, and the blocks of zeros read) are not
+ * written but zeroed out by the device -- discarded, if it reads them
+ * back as zeros. The data is written directly, bypassing the page
+ * cache, in large chunks aligned to the sectors of the device. */
+
+struct blockdev_copy
+{
+	struct copyfile_range_copy c;
+
+	/* the logical sector size, the flags without O_DIRECT, whether
+	 * it is set and whether it can be */
+	size_t sector;
+	int fl;
+	int direct;
+	int no_direct;
+
+	char* buf;
+	char* zeros;
+
+	/* the run of zeros to be zeroed out */
+	off_t zero_start;
+	off_t zero_len;
+};
+
+static void set_direct(struct blockdev_copy* b, int direct)
+{
+#ifdef O_DIRECT
+	if (b->direct != direct && !fcntl(b->c.fd_out, F_SETFL,
+				direct ? b->fl | O_DIRECT : b->fl))
+		b->direct = direct;
+#endif
+}
+
+/* write @len bytes of @buf at @offset, directly as far as aligned */
+static copyfile_error_t write_out(struct blockdev_copy* b,
+		const char* buf, off_t offset, size_t len)
+{
+	while (len > 0)
+	{
+		size_t n = len;
+		ssize_t wr;
+
+		if (b->no_direct || offset % b->sector || len < b->sector)
+			set_direct(b, 0);
+		else
+		{
+			set_direct(b, 1);
+			n -= n % b->sector;
+		}
+
+		wr = pwrite(b->c.fd_out, buf, n, offset);
+		if (wr == -1)
+		{
+			/* not aligned after all; write through the cache */
+			if (errno == EINVAL && b->direct)
+			{
+				b->no_direct = 1;
+				continue;
+			}
+			if (b->c.callback
+					? !b->c.callback(COPYFILE_ERROR_WRITE, COPYFILE_REGULAR,
+						b->c.progress, b->c.callback_data, errno != EINTR)
+					: errno == EINTR)
+				continue;
+			return COPYFILE_ERROR_WRITE;
+		}
+
+		buf += wr;
+		offset += wr;
+		len -= wr;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+static copyfile_error_t get_zeros(struct blockdev_copy* b)
+{
+	if (!b->zeros)
+	{
+		if (posix_memalign((void**) &b->zeros, COPYFILE_BLOCKDEV_ALIGN,
+					COPYFILE_BLOCKDEV_CHUNK))
+		{
+			b->zeros = 0;
+			return COPYFILE_ERROR_MALLOC;
+		}
+		memset(b->zeros, 0, COPYFILE_BLOCKDEV_CHUNK);
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+/* zero [@offset, @offset + @len) out, which is aligned */
+static copyfile_error_t zero_out(struct blockdev_copy* b,
+		off_t offset, off_t len)
+{
+	copyfile_error_t ret;
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+	/* discards the range if the device reads it back as zeros,
+	 * zeroes it otherwise */
+	if (!fallocate(b->c.fd_out, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				offset, len))
+		return COPYFILE_NO_ERROR;
+#endif
+#ifdef BLKZEROOUT
+	{
+		uint64_t range[2];
+
+		range[0] = offset;
+		range[1] = len;
+		if (!ioctl(b->c.fd_out, BLKZEROOUT, range))
+			return COPYFILE_NO_ERROR;
+	}
+#endif
+
+	/* write them after all */
+	ret = get_zeros(b);
+	while (len > 0 && !ret)
+	{
+		off_t n = len < COPYFILE_BLOCKDEV_CHUNK ? len
+			: COPYFILE_BLOCKDEV_CHUNK;
+
+		ret = write_out(b, b->zeros, offset, n);
+		offset += n;
+		len -= n;
+	}
+
+	return ret;
+}
+
+/* zero the run of zeros out. the unaligned ends are written. */
+static copyfile_error_t flush_zeros(struct blockdev_copy* b)
+{
+	off_t start = b->zero_start;
+	off_t end = start + b->zero_len;
+	off_t astart = (start + b->sector - 1) / b->sector * b->sector;
+	off_t aend = end / b->sector * b->sector;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+
+	b->zero_len = 0;
+	if (start == end)
+		return COPYFILE_NO_ERROR;
+
+	if (astart >= aend)
+		astart = aend = end;
+	/* the buffer may hold data yet to be written */
+	if (astart > start || end > aend)
+		ret = get_zeros(b);
+	if (!ret && astart > start)
+		ret = write_out(b, b->zeros, start, astart - start);
+	if (!ret && aend > astart)
+		ret = zero_out(b, astart, aend - astart);
+	if (!ret && end > aend)
+		ret = write_out(b, b->zeros, aend, end - aend);
+
+	return ret;
+}
+
+/* add [@offset, @offset + @len) to the run of zeros */
+static copyfile_error_t add_zeros(struct blockdev_copy* b,
+		off_t offset, off_t len)
+{
+	if (b->zero_len && b->zero_start + b->zero_len == offset)
+	{
+		b->zero_len += len;
+		return COPYFILE_NO_ERROR;
+	}
+
+	if (b->zero_len)
+	{
+		copyfile_error_t ret = flush_zeros(b);
+
+		if (ret)
+			return ret;
+	}
+
+	b->zero_start = offset;
+	b->zero_len = len;
+	return COPYFILE_NO_ERROR;
+}
+
+static int is_zero(const char* buf, size_t len)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+/* copy the @len bytes read into the buffer at @offset: the zero blocks
+ * go to the run, the others are written in one go */
+static copyfile_error_t copy_chunk(struct blockdev_copy* b,
+		off_t offset, size_t len)
+{
+	size_t pos = 0;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+
+	while (pos < len && !ret)
+	{
+		size_t data = pos;
+
+		/* the data blocks up to the next zero one */
+		while (data < len)
+		{
+			size_t n = len - data < COPYFILE_BLOCKDEV_ZERO_BLOCK
+				? len - data : COPYFILE_BLOCKDEV_ZERO_BLOCK;
+
+			if (is_zero(b->buf + data, n))
+				break;
+			data += n;
+		}
+
+		if (data > pos)
+		{
+			if (b->zero_len)
+				ret = flush_zeros(b);
+			if (!ret)
+				ret = write_out(b, b->buf + pos, offset + pos, data - pos);
+			pos = data;
+		}
+		else
+		{
+			size_t n = len - pos < COPYFILE_BLOCKDEV_ZERO_BLOCK
+				? len - pos : COPYFILE_BLOCKDEV_ZERO_BLOCK;
+
+			ret = add_zeros(b, offset + pos, n);
+			pos += n;
+		}
+	}
+
+	return ret;
+}
+
+/* copy [@offset, @end) of the source, which holds data */
+static copyfile_error_t copy_data(struct blockdev_copy* b,
+		off_t offset, off_t end)
+{
+	while (offset < end)
+	{
+		size_t n = end - offset < COPYFILE_BLOCKDEV_CHUNK ? end - offset
+			: COPYFILE_BLOCKDEV_CHUNK;
+		size_t got = 0;
+		copyfile_error_t ret = copyfile_range_progress(&b->c, offset);
+
+		if (ret)
+			return ret;
+
+		while (got < n)
+		{
+			ssize_t rd = pread(b->c.fd_in, b->buf + got, n - got,
+					offset + got);
+
+			if (rd == -1)
+			{
+				if (b->c.callback
+						? !b->c.callback(COPYFILE_ERROR_READ, COPYFILE_REGULAR,
+							b->c.progress, b->c.callback_data, errno != EINTR)
+						: errno == EINTR)
+					continue;
+				return COPYFILE_ERROR_READ;
+			}
+			/* truncated meanwhile; the rest reads as zeros */
+			if (rd == 0)
+			{
+				memset(b->buf + got, 0, n - got);
+				break;
+			}
+			got += rd;
+		}
+
+		ret = copy_chunk(b, offset, n);
+		if (ret)
+			return ret;
+		offset += n;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+static copyfile_error_t copy_to_device(struct blockdev_copy* b,
+		off_t size)
+{
+	off_t offset = 0;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+
+	while (offset < size && !ret)
+	{
+		off_t data = offset;
+		off_t hole = size;
+
+#ifdef SEEK_HOLE
+		/* the holes are zeros, without reading them */
+		data = lseek(b->c.fd_in, offset, SEEK_DATA);
+		if (data == -1)
+			data = errno == ENXIO ? size : offset;
+		else
+		{
+			hole = lseek(b->c.fd_in, data, SEEK_HOLE);
+			if (hole == -1 || hole > size)
+				hole = size;
+		}
+		if (data > size)
+			data = size;
+#endif
+
+		if (data > offset)
+			ret = add_zeros(b, offset, data - offset);
+		if (!ret)
+			ret = copy_data(b, data, hole);
+		offset = hole;
+	}
+
+	if (!ret && b->zero_len)
+		ret = flush_zeros(b);
+	return ret;
+}
+
+#endif /*BLKGETSIZE64 && BLKSSZGET*/
+
+copyfile_error_t copyfile_copy_blockdev(copyfile_ctx_t* ctx,
+		int fd_in, int fd_out,
+		copyfile_callback_t callback, void* callback_data)
+{
+#if defined(BLKGETSIZE64) && defined(BLKSSZGET)
+	struct blockdev_copy b;
+	struct stat st;
+	uint64_t dev_size;
+	int sector;
+	int was_direct = 0;
+	copyfile_error_t ret;
+	int saved_errno;
+
+	if (fstat(fd_in, &st))
+		return COPYFILE_ERROR_STAT;
+	if (ioctl(fd_out, BLKGETSIZE64, &dev_size)
+			|| ioctl(fd_out, BLKSSZGET, &sector) || sector <= 0)
+		return COPYFILE_ERROR_UNSUPPORTED;
+
+	/* nothing is written if it can't fit */
+	if (!S_ISREG(st.st_mode) || (uint64_t) st.st_size > dev_size)
+	{
+		errno = S_ISREG(st.st_mode) ? ENOSPC : EINVAL;
+		return COPYFILE_ERROR_WRITE;
+	}
+
+	b.c.ctx = ctx;
+	b.c.fd_in = fd_in;
+	b.c.fd_out = fd_out;
+	b.c.progress.data.offset = 0;
+	b.c.progress.data.size = st.st_size;
+	b.c.opcount = 0;
+	b.c.callback = callback;
+	b.c.callback_data = callback_data;
+	b.sector = sector;
+	b.direct = 0;
+	b.no_direct = 0;
+	b.zeros = 0;
+	b.zero_len = 0;
+
+	b.fl = fcntl(fd_out, F_GETFL);
+	if (b.fl == -1)
+		return COPYFILE_ERROR_OPEN_DEST;
+#ifdef O_DIRECT
+	was_direct = b.direct = !!(b.fl & O_DIRECT);
+	b.fl &= ~O_DIRECT;
+#endif
+
+	if (posix_memalign((void**) &b.buf, COPYFILE_BLOCKDEV_ALIGN,
+				COPYFILE_BLOCKDEV_CHUNK))
+		return COPYFILE_ERROR_MALLOC;
+
+	ret = copy_to_device(&b, st.st_size);
+	saved_errno = errno;
+
+	/* the fd is left as it was given */
+	set_direct(&b, was_direct);
+	free(b.buf);
+	free(b.zeros);
+
+	if (ret)
+	{
+		errno = saved_errno;
+		return ret;
+	}
+
+	if (ctx)
+		ctx->stats.bytes += st.st_size;
+	b.c.progress.data.offset = st.st_size;
+	if (callback && callback(COPYFILE_EOF, COPYFILE_REGULAR, b.c.progress,
+				callback_data, 0))
+		return COPYFILE_ABORTED;
+	return COPYFILE_NO_ERROR;
+#else
+	return COPYFILE_ERROR_UNSUPPORTED;
+#endif
+}
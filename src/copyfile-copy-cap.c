@@ -9,6 +9,7 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #ifdef HAVE_LIBCAP
 #	include <sys/capability.h>
@@ -16,8 +17,9 @@
 #	include <errno.h>
 #endif /*HAVE_LIBCAP*/
 
-copyfile_error_t copyfile_copy_cap(const char* source,
-		const char* dest, const struct stat* st)
+copyfile_error_t copyfile_copy_cap_to(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int dest_fd,
+		const struct stat* st)
 {
 #ifdef HAVE_LIBCAP
 	{
@@ -41,6 +43,8 @@ copyfile_error_t copyfile_copy_cap(const char* source,
 
 			if (!S_ISREG(st->st_mode))
 				return COPYFILE_NO_ERROR;
+			if (copyfile_fs_lacks(ctx, st->st_dev, COPYFILE_FS_NO_CAP))
+				return COPYFILE_NO_ERROR;
 		}
 
 		/* ENODATA - empty caps
@@ -49,13 +53,17 @@ copyfile_error_t copyfile_copy_cap(const char* source,
 		if (!cap && errno != ENODATA)
 		{
 			if (errno == ENOTSUP)
+			{
+				copyfile_fs_set_lacks(ctx, st->st_dev, COPYFILE_FS_NO_CAP);
 				return COPYFILE_NO_ERROR;
+			}
 			else
 				return COPYFILE_ERROR_CAP_GET;
 		}
 
 		/* ENODATA - empty->empty... */
-		if (cap_set_file(dest, cap) && errno != ENODATA)
+		if ((dest_fd != -1 ? cap_set_fd(dest_fd, cap)
+					: cap_set_file(dest, cap)) && errno != ENODATA)
 		{
 			cap_free(cap);
 			return COPYFILE_ERROR_CAP_SET;
@@ -69,3 +77,14 @@ copyfile_error_t copyfile_copy_cap(const char* source,
 	return COPYFILE_ERROR_UNSUPPORTED;
 }
 
+copyfile_error_t copyfile_copy_cap_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st)
+{
+	return copyfile_copy_cap_to(ctx, source, dest, -1, st);
+}
+
+copyfile_error_t copyfile_copy_cap(const char* source,
+		const char* dest, const struct stat* st)
+{
+	return copyfile_copy_cap_ctx(0, source, dest, st);
+}
@@ -0,0 +1,195 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+copyfile_error_t copyfile_range_progress(struct copyfile_range_copy* c,
+		off_t offset)
+{
+	c->progress.data.offset = offset;
+
+	if (c->callback)
+	{
+		if (!c->opcount && c->callback(COPYFILE_NO_ERROR,
+					COPYFILE_REGULAR, c->progress, c->callback_data, 0))
+			return COPYFILE_ABORTED;
+		if (++c->opcount >= (c->ctx ? c->ctx->callback_opcount
+					: COPYFILE_CALLBACK_OPCOUNT))
+			c->opcount = 0;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+copyfile_error_t copyfile_copy_range(struct copyfile_range_copy* c,
+		off_t offset, off_t len)
+{
+	char stack_buf[COPYFILE_BUFFER_SIZE];
+	char* buf = stack_buf;
+	size_t buf_size = sizeof(stack_buf);
+
+	if (c->ctx)
+	{
+		buf_size = c->ctx->buffer_size;
+		buf = copyfile_arena_reserve(&c->ctx->data, buf_size);
+		if (!buf)
+			return COPYFILE_ERROR_MALLOC;
+	}
+
+	while (len > 0)
+	{
+		size_t n = len < (off_t) buf_size ? (size_t) len : buf_size;
+		char* bufp = buf;
+		ssize_t rd;
+		copyfile_error_t ret = copyfile_range_progress(c, offset);
+
+		if (ret)
+			return ret;
+
+		rd = pread(c->fd_in, buf, n, offset);
+		if (rd == -1)
+		{
+			if (c->callback
+					? !c->callback(COPYFILE_ERROR_READ, COPYFILE_REGULAR,
+						c->progress, c->callback_data, errno != EINTR)
+					: errno == EINTR)
+				continue;
+			return COPYFILE_ERROR_READ;
+		}
+		else if (rd == 0)
+			break;
+
+		len -= rd;
+		while (rd > 0)
+		{
+			ssize_t wr = pwrite(c->fd_out, bufp, rd, offset);
+
+			if (wr == -1)
+			{
+				if (c->callback
+						? !c->callback(COPYFILE_ERROR_WRITE, COPYFILE_REGULAR,
+							c->progress, c->callback_data, errno != EINTR)
+						: errno == EINTR)
+					continue;
+				return COPYFILE_ERROR_WRITE;
+			}
+
+			bufp += wr;
+			rd -= wr;
+			offset += wr;
+			if (c->ctx)
+				c->ctx->stats.bytes += wr;
+		}
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+void copyfile_preallocate(int fd, off_t offset, off_t len)
+{
+	/* it's just a hint of the layout; the range reads back as zeros
+	 * either way */
+#if defined(HAVE_FALLOCATE)
+	fallocate(fd, 0, offset, len);
+#elif defined(HAVE_POSIX_FALLOCATE)
+	posix_fallocate(fd, offset, len);
+#endif
+}
+
+copyfile_error_t copyfile_copy_extents(copyfile_ctx_t* ctx,
+		int fd_in, int fd_out,
+		copyfile_callback_t callback, void* callback_data)
+{
+#if defined(HAVE_FTRUNCATE) && defined(SEEK_HOLE)
+	struct copyfile_range_copy c;
+	struct stat st;
+	off_t pos, offset;
+	int preallocated;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+
+	if (fstat(fd_in, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return COPYFILE_ERROR_UNSUPPORTED;
+
+	/* most files have no holes, and the plain copy does for them.
+	 * one probe tells, without flushing anything. */
+	pos = lseek(fd_in, 0, SEEK_CUR);
+	offset = lseek(fd_in, 0, SEEK_HOLE);
+	if (pos == -1 || lseek(fd_in, pos, SEEK_SET) == -1
+			|| offset == -1 || offset >= st.st_size)
+		return COPYFILE_ERROR_UNSUPPORTED;
+
+	/* the holes of a file with all of its blocks allocated are
+	 * unwritten extents (which read as holes); preallocate them */
+	preallocated = (off_t) st.st_blocks * 512 >= st.st_size;
+
+	c.ctx = ctx;
+	c.fd_in = fd_in;
+	c.fd_out = fd_out;
+	c.progress.data.offset = 0;
+	c.progress.data.size = st.st_size;
+	c.opcount = 0;
+	c.callback = callback;
+	c.callback_data = callback_data;
+
+	/* the destination may have old data where the holes are */
+	if (ftruncate(fd_out, 0))
+		ret = COPYFILE_ERROR_TRUNCATE;
+
+	for (offset = 0; !ret && offset < st.st_size; )
+	{
+		off_t data = lseek(fd_in, offset, SEEK_DATA);
+		off_t hole;
+
+		if (data == -1)
+		{
+			if (errno != ENXIO)
+			{
+				ret = COPYFILE_ERROR_READ;
+				break;
+			}
+			data = st.st_size;
+		}
+		if (data > st.st_size)
+			data = st.st_size;
+
+		if (preallocated && data > offset)
+			copyfile_preallocate(fd_out, offset, data - offset);
+		if (data == st.st_size)
+			break;
+
+		hole = lseek(fd_in, data, SEEK_HOLE);
+		if (hole == -1 || hole > st.st_size)
+			hole = st.st_size;
+
+		ret = copyfile_copy_range(&c, data, hole - data);
+		offset = hole;
+	}
+
+	if (!ret && ftruncate(fd_out, st.st_size))
+		ret = COPYFILE_ERROR_TRUNCATE;
+	if (ret)
+		return ret;
+
+	c.progress.data.offset = st.st_size;
+	if (callback && callback(COPYFILE_EOF, COPYFILE_REGULAR, c.progress,
+				callback_data, 0))
+		return COPYFILE_ABORTED;
+	return COPYFILE_NO_ERROR;
+#else
+	return COPYFILE_ERROR_UNSUPPORTED;
+#endif
+}
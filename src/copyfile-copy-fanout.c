@@ -0,0 +1,637 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+/* The source is read into a ring of buffers, and each destination
+ * writes them out in turn, in its own thread. A buffer is read into
+ * again once all the destinations still being written wrote it,
+ * so a slow destination holds the others back by the size
+ * of the ring at most. A destination which fails is dropped, giving
+ * up its share of the buffers. */
+
+struct fanout_state
+{
+	copyfile_fanout_entry_t* entries;
+	size_t count;
+	off_t expected_size;
+
+	char* bufs[COPYFILE_FANOUT_BUFFERS];
+	size_t lens[COPYFILE_FANOUT_BUFFERS];
+	/* the number of destinations yet to write each buffer */
+	unsigned int users[COPYFILE_FANOUT_BUFFERS];
+	/* the number of buffers read, and whether that's all */
+	unsigned long filled;
+	int done;
+	int aborted;
+	/* the number of destinations being written */
+	unsigned int active;
+
+	copyfile_callback_t callback;
+	void* callback_data;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_mutex_t callback_lock;
+#endif
+};
+
+static void state_lock(struct fanout_state* s)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&s->lock);
+#endif
+}
+
+static void state_unlock(struct fanout_state* s)
+{
+#ifdef HAVE_PTHREAD
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+#endif
+}
+
+/* the writers report their errors from their threads; only one of
+ * them is inside the user callback at a time */
+static int call_back(struct fanout_state* s, copyfile_error_t state,
+		copyfile_progress_t progress, int default_return)
+{
+	int saved_errno = errno;
+	int ret;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&s->callback_lock);
+#endif
+	errno = saved_errno;
+	ret = s->callback(state, COPYFILE_REGULAR, progress, s->callback_data,
+			default_return);
+	saved_errno = errno;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&s->callback_lock);
+#endif
+	errno = saved_errno;
+
+	return ret;
+}
+
+/* write @len bytes of @buf to the destination @e */
+static copyfile_error_t write_buf(struct fanout_state* s,
+		copyfile_fanout_entry_t* e, const char* buf, size_t len)
+{
+	copyfile_progress_t progress;
+
+	progress.data.size = s->expected_size;
+	while (len > 0)
+	{
+		ssize_t wr = write(e->fd, buf, len);
+
+		if (wr == -1)
+		{
+			progress.data.offset = e->written;
+			if (s->callback
+					? !call_back(s, COPYFILE_ERROR_WRITE, progress,
+						errno != EINTR)
+					: errno == EINTR)
+				continue;
+			return COPYFILE_ERROR_WRITE;
+		}
+
+		buf += wr;
+		len -= wr;
+		e->written += wr;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+/* stop writing the destination @e, which failed (with errno set)
+ * writing the buffer @seq */
+static void drop(struct fanout_state* s, copyfile_fanout_entry_t* e,
+		copyfile_error_t ret, unsigned long seq)
+{
+	e->result = ret;
+	e->result_errno = errno;
+
+	state_lock(s);
+	for (; seq < s->filled; ++seq)
+		--s->users[seq % COPYFILE_FANOUT_BUFFERS];
+	--s->active;
+	state_unlock(s);
+}
+
+#ifdef HAVE_PTHREAD
+
+struct fanout_writer
+{
+	pthread_t thread;
+	struct fanout_state* state;
+	copyfile_fanout_entry_t* entry;
+};
+
+static void* writer_main(void* data)
+{
+	struct fanout_writer* w = data;
+	struct fanout_state* s = w->state;
+	unsigned long seq;
+
+	for (seq = 0; ; ++seq)
+	{
+		size_t slot = seq % COPYFILE_FANOUT_BUFFERS;
+		copyfile_error_t ret;
+
+		pthread_mutex_lock(&s->lock);
+		while (s->filled == seq && !s->done)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->aborted || s->filled == seq)
+		{
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		ret = write_buf(s, w->entry, s->bufs[slot], s->lens[slot]);
+		if (ret)
+		{
+			drop(s, w->entry, ret, seq);
+			break;
+		}
+
+		state_lock(s);
+		--s->users[slot];
+		state_unlock(s);
+	}
+
+	return 0;
+}
+
+#endif /*HAVE_PTHREAD*/
+
+/* read the source into the ring, writing each buffer right away
+ * unless there are @writers. returns the read error (or abort). */
+static copyfile_error_t read_source(copyfile_ctx_t* ctx,
+		struct fanout_state* s, int fd_in, off_t expected_size,
+		size_t buf_size, int writers)
+{
+	unsigned int opcount = 0;
+	unsigned int max_opcount = ctx ? ctx->callback_opcount
+		: COPYFILE_CALLBACK_OPCOUNT;
+	copyfile_progress_t progress;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	unsigned long seq;
+	size_t i;
+
+	progress.data.offset = 0;
+	progress.data.size = expected_size;
+
+	for (seq = 0; ; ++seq)
+	{
+		size_t slot = seq % COPYFILE_FANOUT_BUFFERS;
+		ssize_t rd;
+
+		/* wait for the buffer to be written by all */
+		state_lock(s);
+#ifdef HAVE_PTHREAD
+		while (s->users[slot] && s->active)
+			pthread_cond_wait(&s->cond, &s->lock);
+#endif
+		if (!s->active)
+		{
+			state_unlock(s);
+			break;
+		}
+		state_unlock(s);
+
+		if (s->callback)
+		{
+			if (!opcount && call_back(s, COPYFILE_NO_ERROR, progress, 0))
+			{
+				ret = COPYFILE_ABORTED;
+				break;
+			}
+			if (++opcount >= max_opcount)
+				opcount = 0;
+		}
+
+		rd = read(fd_in, s->bufs[slot], buf_size);
+		if (rd == -1)
+		{
+			if (s->callback
+					? !call_back(s, COPYFILE_ERROR_READ, progress,
+						errno != EINTR)
+					: errno == EINTR)
+			{
+				--seq;
+				continue;
+			}
+			ret = COPYFILE_ERROR_READ;
+			break;
+		}
+		else if (rd == 0)
+			break;
+
+		progress.data.offset += rd;
+		state_lock(s);
+		s->lens[slot] = rd;
+		s->users[slot] = s->active;
+		s->filled = seq + 1;
+		state_unlock(s);
+
+		if (writers)
+			continue;
+
+		for (i = 0; i < s->count; ++i)
+		{
+			copyfile_fanout_entry_t* e = &s->entries[i];
+			copyfile_error_t lret;
+
+			if (e->fd == -1 || e->result)
+				continue;
+
+			lret = write_buf(s, e, s->bufs[slot], rd);
+			if (lret)
+				drop(s, e, lret, seq);
+			else
+				--s->users[slot];
+		}
+	}
+
+	state_lock(s);
+	s->done = 1;
+	if (ret == COPYFILE_ABORTED)
+		s->aborted = 1;
+	state_unlock(s);
+
+	return ret;
+}
+
+copyfile_error_t copyfile_copy_stream_fanout_ctx(copyfile_ctx_t* ctx,
+		int fd_in, copyfile_fanout_entry_t* entries, size_t count,
+		off_t expected_size,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct fanout_state s;
+	copyfile_progress_t progress;
+	copyfile_error_t ret;
+	int saved_errno;
+	size_t buf_size = COPYFILE_FANOUT_BUFFER;
+	char* buf;
+	size_t i;
+#ifdef HAVE_PTHREAD
+	struct fanout_writer* writers = 0;
+	size_t nwriters = 0;
+#endif
+
+	s.entries = entries;
+	s.count = count;
+	s.expected_size = expected_size;
+	s.filled = 0;
+	s.done = 0;
+	s.aborted = 0;
+	s.active = 0;
+	s.callback = callback;
+	s.callback_data = callback_data;
+
+	for (i = 0; i < count; ++i)
+	{
+		if (entries[i].fd == -1)
+			continue;
+		entries[i].result = COPYFILE_NO_ERROR;
+		entries[i].written = 0;
+		++s.active;
+	}
+	if (!s.active)
+		return COPYFILE_NO_ERROR;
+
+	/* the ring is the data buffer of the context, made larger */
+	if (ctx && ctx->buffer_size > buf_size)
+		buf_size = ctx->buffer_size;
+	buf = ctx ? copyfile_arena_reserve(&ctx->data,
+				buf_size * COPYFILE_FANOUT_BUFFERS)
+		: malloc(buf_size * COPYFILE_FANOUT_BUFFERS);
+	if (!buf)
+		return COPYFILE_ERROR_MALLOC;
+	for (i = 0; i < COPYFILE_FANOUT_BUFFERS; ++i)
+	{
+		s.bufs[i] = buf + i * buf_size;
+		s.users[i] = 0;
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&s.lock, 0);
+	pthread_cond_init(&s.cond, 0);
+	pthread_mutex_init(&s.callback_lock, 0);
+
+	/* a single destination is written by the reader */
+	if (s.active > 1)
+	{
+		writers = malloc(s.active * sizeof(*writers));
+		for (i = 0; writers && i < count; ++i)
+		{
+			struct fanout_writer* w = &writers[nwriters];
+
+			if (entries[i].fd == -1)
+				continue;
+
+			w->state = &s;
+			w->entry = &entries[i];
+			if (pthread_create(&w->thread, 0, writer_main, w))
+				break;
+			++nwriters;
+		}
+
+		/* write from the reader if the threads can't be had */
+		if (nwriters < s.active)
+		{
+			pthread_mutex_lock(&s.lock);
+			s.done = s.aborted = 1;
+			pthread_cond_broadcast(&s.cond);
+			pthread_mutex_unlock(&s.lock);
+
+			for (i = 0; i < nwriters; ++i)
+				pthread_join(writers[i].thread, 0);
+			nwriters = 0;
+			s.done = s.aborted = 0;
+		}
+	}
+
+	ret = read_source(ctx, &s, fd_in, expected_size, buf_size,
+			nwriters > 0);
+	saved_errno = errno;
+
+	for (i = 0; i < nwriters; ++i)
+		pthread_join(writers[i].thread, 0);
+	free(writers);
+
+	pthread_mutex_destroy(&s.callback_lock);
+	pthread_cond_destroy(&s.cond);
+	pthread_mutex_destroy(&s.lock);
+#else
+	ret = read_source(ctx, &s, fd_in, expected_size, buf_size, 0);
+	saved_errno = errno;
+#endif
+
+	if (!ctx)
+		free(buf);
+
+	progress.data.offset = 0;
+	for (i = 0; i < count; ++i)
+	{
+		copyfile_fanout_entry_t* e = &entries[i];
+
+		if (e->fd == -1 || e->result)
+			continue;
+
+		/* the reading failed for all those still written */
+		if (ret)
+		{
+			e->result = ret;
+			e->result_errno = saved_errno;
+			continue;
+		}
+
+		if (ctx)
+			ctx->stats.bytes += e->written;
+		if (e->written > progress.data.offset)
+			progress.data.offset = e->written;
+	}
+
+	if (ret)
+	{
+		errno = saved_errno;
+		return ret;
+	}
+
+	progress.data.size = expected_size;
+	if (callback && callback(COPYFILE_EOF, COPYFILE_REGULAR, progress,
+				callback_data, 0))
+		return COPYFILE_ABORTED;
+
+	for (i = 0; i < count; ++i)
+	{
+		if (entries[i].fd != -1 && entries[i].result)
+		{
+			errno = entries[i].result_errno;
+			return entries[i].result;
+		}
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+copyfile_error_t copyfile_copy_stream_fanout(int fd_in,
+		copyfile_fanout_entry_t* entries, size_t count,
+		off_t expected_size,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_copy_stream_fanout_ctx(0, fd_in, entries, count,
+			expected_size, callback, callback_data);
+}
+
+/* finish the copy into @e (open as @fd, or as @tmp if non-NULL):
+ * truncate, sync, close and publish it. */
+static copyfile_error_t finish(copyfile_ctx_t* ctx,
+		copyfile_fanout_entry_t* e, int fd, struct copyfile_tmpfile* tmp)
+{
+	copyfile_error_t ret = e->result;
+	int hold_errno = e->result_errno;
+
+#ifdef HAVE_FTRUNCATE
+	if (!ret && !e->cloned && ftruncate(fd, e->written))
+	{
+		ret = COPYFILE_ERROR_TRUNCATE;
+		hold_errno = errno;
+	}
+#endif
+	if (!ret)
+	{
+		ret = copyfile_sync_fd(ctx, fd, 0);
+		hold_errno = errno;
+	}
+
+	if (tmp)
+	{
+		if (ret)
+			copyfile_tmpfile_discard(tmp);
+		else
+		{
+			ret = copyfile_tmpfile_publish(tmp, e->dest);
+			hold_errno = errno;
+		}
+	}
+	else if (close(fd) && !ret) /* delayed error? */
+	{
+		ret = COPYFILE_ERROR_WRITE;
+		hold_errno = errno;
+	}
+
+	if (!ret)
+	{
+		ret = copyfile_sync_dir(ctx, e->dest);
+		hold_errno = errno;
+	}
+
+	e->result = ret;
+	e->result_errno = hold_errno;
+	return ret;
+}
+
+copyfile_error_t copyfile_copy_regular_fanout_ctx(copyfile_ctx_t* ctx,
+		const char* source, copyfile_fanout_entry_t* entries,
+		size_t count, off_t expected_size,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct copyfile_tmpfile* tmps = 0;
+	int* fds;
+	int fd_in;
+	int open_flags = O_WRONLY | O_CREAT;
+	int streamed = 0;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	size_t i;
+
+	/* see copyfile_copy_regular_ctx() */
+#ifndef HAVE_FTRUNCATE
+	open_flags |= O_TRUNC;
+#endif
+#ifdef HAVE_POSIX_FALLOCATE
+	open_flags |= O_TRUNC;
+#endif
+	if (expected_size > 0 && expected_size <= COPYFILE_SMALL_FILE)
+		open_flags |= O_TRUNC;
+
+	fds = malloc(count * sizeof(*fds));
+	if (ctx && (ctx->options & COPYFILE_ATOMIC_PUBLISH))
+		tmps = malloc(count * sizeof(*tmps));
+	if (!fds || (ctx && (ctx->options & COPYFILE_ATOMIC_PUBLISH) && !tmps))
+	{
+		free(fds);
+		free(tmps);
+		return COPYFILE_ERROR_MALLOC;
+	}
+
+	fd_in = open(source, O_RDONLY);
+	if (fd_in == -1)
+	{
+		int hold_errno = errno;
+
+		for (i = 0; i < count; ++i)
+		{
+			entries[i].result = COPYFILE_ERROR_OPEN_SOURCE;
+			entries[i].result_errno = hold_errno;
+		}
+		free(fds);
+		free(tmps);
+		errno = hold_errno;
+		return COPYFILE_ERROR_OPEN_SOURCE;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		copyfile_fanout_entry_t* e = &entries[i];
+
+		e->result = COPYFILE_NO_ERROR;
+		e->written = 0;
+		e->cloned = 0;
+		e->fd = -1;
+
+		if (tmps)
+		{
+			e->result = copyfile_tmpfile_open(&tmps[i], e->dest, perm_file);
+			fds[i] = e->result ? -1 : tmps[i].fd;
+		}
+		else
+		{
+			fds[i] = open(e->dest, open_flags, perm_file);
+			if (fds[i] == -1)
+				e->result = COPYFILE_ERROR_OPEN_DEST;
+		}
+		if (e->result)
+		{
+			e->result_errno = errno;
+			continue;
+		}
+
+		/* each destination may be cloned on its own */
+		if (expected_size > COPYFILE_SMALL_FILE
+				&& !copyfile_clone_stream(fd_in, fds[i]))
+		{
+			e->cloned = 1;
+			e->written = expected_size;
+			if (ctx)
+				++ctx->stats.clones;
+			continue;
+		}
+
+#ifdef HAVE_POSIX_FALLOCATE
+#	ifdef HAVE_FTRUNCATE
+		if (expected_size > COPYFILE_SMALL_FILE)
+			posix_fallocate(fds[i], 0, expected_size);
+#	endif
+#endif
+		e->fd = fds[i];
+		++streamed;
+	}
+
+	if (streamed)
+	{
+		ret = copyfile_copy_stream_fanout_ctx(ctx, fd_in, entries, count,
+				expected_size, callback, callback_data);
+		for (i = 0; i < count; ++i)
+			entries[i].fd = -1;
+	}
+	close(fd_in);
+
+	/* the others are finished even if the copy was aborted */
+	for (i = 0; i < count; ++i)
+	{
+		copyfile_error_t lret;
+
+		if (fds[i] == -1)
+			continue;
+		lret = finish(ctx, &entries[i], fds[i], tmps ? &tmps[i] : 0);
+		if (lret && !ret)
+			ret = lret;
+	}
+
+	free(fds);
+	free(tmps);
+
+	if (ret != COPYFILE_ABORTED)
+	{
+		ret = COPYFILE_NO_ERROR;
+		for (i = 0; i < count && !ret; ++i)
+		{
+			ret = entries[i].result;
+			errno = entries[i].result_errno;
+		}
+	}
+	return ret;
+}
+
+copyfile_error_t copyfile_copy_regular_fanout(const char* source,
+		copyfile_fanout_entry_t* entries, size_t count,
+		off_t expected_size,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_copy_regular_fanout_ctx(0, source, entries, count,
+			expected_size, callback, callback_data);
+}
@@ -9,15 +9,17 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #include <sys/stat.h>
 
-copyfile_error_t copyfile_copy_file(const char* source,
-		const char* dest, const struct stat* st,
+copyfile_error_t copyfile_copy_file_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
 		copyfile_callback_t callback, void* callback_data)
 {
 	struct stat buf;
 	mode_t ftype;
+	copyfile_error_t ret;
 
 	if (!st)
 	{
@@ -37,15 +39,41 @@ copyfile_error_t copyfile_copy_file(const char* source,
 	switch (ftype)
 	{
 		case S_IFREG:
-			return copyfile_copy_regular(source, dest, st->st_size,
+			ret = copyfile_copy_regular_ctx(ctx, source, dest, st->st_size,
 					callback, callback_data);
+			if (!ret && ctx)
+				++ctx->stats.files;
+			return ret;
 #ifdef S_IFLNK
 		case S_IFLNK:
-			return copyfile_copy_symlink(source, dest, st->st_size,
+			ret = copyfile_copy_symlink_ctx(ctx, source, dest, st->st_size,
 					callback, callback_data);
+			if (!ret && ctx)
+			{
+				++ctx->stats.symlinks;
+				ret = copyfile_sync_dir(ctx, dest);
+			}
+			return ret;
 #endif /*S_IFLNK*/
 		default:
-			return copyfile_create_special(dest, ftype, st->st_rdev,
+			ret = copyfile_create_special(dest, ftype, st->st_rdev,
 					callback, callback_data);
+			if (!ret && ctx)
+			{
+				if (ftype == S_IFDIR)
+					++ctx->stats.directories;
+				else
+					++ctx->stats.specials;
+				ret = copyfile_sync_dir(ctx, dest);
+			}
+			return ret;
 	}
 }
+
+copyfile_error_t copyfile_copy_file(const char* source,
+		const char* dest, const struct stat* st,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_copy_file_ctx(0, source, dest, st,
+			callback, callback_data);
+}
@@ -9,21 +9,114 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #include <sys/stat.h>
 #include <errno.h>
 
-copyfile_error_t copyfile_copy_metadata(const char* source,
-		const char* dest, const struct stat* st,
-		unsigned int flags, unsigned int* result_flags)
+#ifdef HAVE_LGETXATTR
+#	include <sys/xattr.h>
+
+/* copy the ACL xattrs verbatim. returns 0 on success. */
+static int copy_raw_acl(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, int dest_fd, unsigned int found)
+{
+	if ((found & COPYFILE_XATTR_FOUND_ACL_ACCESS)
+			&& copyfile_copy_xattr_raw(ctx, source, dest, dest_fd,
+				"system.posix_acl_access"))
+		return -1;
+	if ((found & COPYFILE_XATTR_FOUND_ACL_DEFAULT)
+			&& copyfile_copy_xattr_raw(ctx, source, dest, dest_fd,
+				"system.posix_acl_default"))
+		return -1;
+	return 0;
+}
+
+/* check whether the ACL xattrs are equal on both files. a default
+ * ACL missing on @source must be missing on @dest as well. */
+static int same_acl(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, int dest_fd, const struct stat* st)
+{
+	if (!copyfile_same_xattr(ctx, source, dest, dest_fd,
+				"system.posix_acl_access"))
+		return 0;
+	if (S_ISDIR(st->st_mode)
+			&& !copyfile_same_xattr(ctx, source, dest, dest_fd,
+				"system.posix_acl_default"))
+		return 0;
+	return 1;
+}
+
+/* remove the stale ACLs from @dest when @source has none. an access
+ * ACL (possibly inherited by a new file) is replaced with the one made
+ * of the mode of @source then, as copying it would; @changed is set
+ * as that changes the mode. */
+static copyfile_error_t drop_acls(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, int dest_fd, const struct stat* st, int* changed)
+{
+	int rm;
+
+#ifdef S_IFLNK
+	if (S_ISLNK(st->st_mode))
+		return COPYFILE_NO_ERROR;
+#endif
+
+	if (S_ISDIR(st->st_mode)
+			&& lremovexattr(dest, "system.posix_acl_default")
+			&& errno != ENODATA && errno != EOPNOTSUPP)
+		return COPYFILE_ERROR_ACL_SET;
+
+	rm = dest_fd != -1
+		? fremovexattr(dest_fd, "system.posix_acl_access")
+		: lremovexattr(dest, "system.posix_acl_access");
+	if (rm)
+		return errno == ENODATA || errno == EOPNOTSUPP
+			? COPYFILE_NO_ERROR : COPYFILE_ERROR_ACL_SET;
+
+	*changed = 1;
+	return copyfile_copy_acl_to(ctx, source, dest, dest_fd, st);
+}
+#endif /*HAVE_LGETXATTR*/
+
+/* stat() the destination, by fd if we have one */
+static int stat_dest(const char* dest, int dest_fd, struct stat* buf)
+{
+	if (dest_fd != -1)
+		return fstat(dest_fd, buf);
+#ifdef S_IFLNK
+	return lstat(dest, buf);
+#else
+	return stat(dest, buf);
+#endif
+}
+
+copyfile_error_t copyfile_copy_metadata_to(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int dest_fd,
+		const struct stat* st, unsigned int flags,
+		unsigned int* result_flags)
 {
 	struct stat buf;
 
+	/* current destination metadata, in COPYFILE_DIFF_METADATA mode */
+	struct stat dest_buf;
+	const struct stat* cur = 0;
+	/* whether cur may be outdated by now */
+	int cur_dirty = 0;
+
+	unsigned int done_flags = 0;
 	copyfile_error_t ret = COPYFILE_NO_ERROR;
 	int saved_errno;
 
-	if (!flags)
-		flags = COPYFILE_COPY_ALL_METADATA;
+#ifdef HAVE_LGETXATTR
+	char list_buf[COPYFILE_BUFFER_SIZE / 2];
+	struct copyfile_arena local_list;
+	struct copyfile_xattr_scan scan;
+	int scanned = 0;
+	const int diff = !!(flags & COPYFILE_DIFF_METADATA);
+#endif
+
+	if (!(flags & COPYFILE_COPY_ALL_METADATA))
+		flags |= COPYFILE_COPY_ALL_METADATA;
 	if (result_flags)
 		*result_flags = 0;
 	if (!st)
@@ -39,6 +132,12 @@ copyfile_error_t copyfile_copy_metadata(const char* source,
 		st = &buf;
 	}
 
+	if (flags & COPYFILE_DIFF_METADATA)
+	{
+		if (!stat_dest(dest, dest_fd, &dest_buf))
+			cur = &dest_buf;
+	}
+
 	/* Now, order is important.
 	 *
 	 * 1) chown() because changing owners can change modes,
@@ -49,23 +148,59 @@ copyfile_error_t copyfile_copy_metadata(const char* source,
 
 	if (flags & COPYFILE_COPY_OWNER)
 	{
-		unsigned int done = copyfile_set_stat(dest, st,
+		unsigned int done = copyfile_set_stat_diff(dest, dest_fd, st, cur,
 				flags & COPYFILE_COPY_OWNER);
 
+		/* chown() may reset the special mode bits */
+		if (done & COPYFILE_COPY_OWNER & ~(done >> COPYFILE_SAME_SHIFT))
+			cur_dirty = 1;
 		flags &= ~done;
-		if (result_flags)
-			*result_flags |= done;
+		done_flags |= done;
 	}
 
-	if (flags & COPYFILE_COPY_XATTR)
+#ifdef HAVE_LGETXATTR
+	/* On Linux, ACLs and capabilities are stored in xattrs. List them
+	 * all once, and use the list to copy the regular attributes
+	 * and skip ACL & capability calls if source has none. */
+	copyfile_arena_init(&local_list, list_buf, sizeof(list_buf));
+	if (flags & (COPYFILE_COPY_XATTR | COPYFILE_COPY_ACL
+				| COPYFILE_COPY_CAP))
 	{
-		copyfile_error_t lret = copyfile_copy_xattr(source, dest, st);
+		copyfile_error_t lret = copyfile_scan_xattr(ctx,
+				ctx ? &ctx->xattr_list : &local_list, source, st, &scan);
 
 		if (!lret)
+			scanned = 1;
+		else if (!ret)
 		{
-			if (result_flags)
-				*result_flags |= COPYFILE_COPY_XATTR;
+			ret = lret;
+			saved_errno = errno;
 		}
+	}
+#endif /*HAVE_LGETXATTR*/
+
+	if (flags & COPYFILE_COPY_XATTR)
+	{
+		copyfile_error_t lret;
+
+#ifdef HAVE_LGETXATTR
+		int same = 0;
+
+		if (scanned)
+			lret = copyfile_copy_xattr_list(ctx, source, dest, dest_fd,
+					&scan, diff ? &same : 0);
+		else
+			lret = COPYFILE_ERROR_XATTR_LIST;
+
+		if (!lret && same)
+			done_flags |= COPYFILE_SAME_XATTR;
+#else
+		/* anonymous files are Linux-only, so @dest is valid here */
+		lret = copyfile_copy_xattr_ctx(ctx, source, dest, st);
+#endif
+
+		if (!lret)
+			done_flags |= COPYFILE_COPY_XATTR;
 		else if (lret == COPYFILE_ERROR_XATTR_GET && !ret)
 		{
 			ret = lret;
@@ -75,13 +210,30 @@ copyfile_error_t copyfile_copy_metadata(const char* source,
 
 	if (flags & COPYFILE_COPY_CAP)
 	{
-		copyfile_error_t lret = copyfile_copy_cap(source, dest, st);
+		copyfile_error_t lret;
 
-		if (!lret)
+#ifdef HAVE_LGETXATTR
+		if (scanned && !(scan.found & COPYFILE_XATTR_FOUND_CAP))
+			lret = COPYFILE_NO_ERROR;
+		else if (scanned && diff && copyfile_same_xattr(ctx, source, dest,
+					dest_fd, "security.capability"))
 		{
-			if (result_flags)
-				*result_flags |= COPYFILE_COPY_CAP;
+			lret = COPYFILE_NO_ERROR;
+			done_flags |= COPYFILE_SAME_CAP;
 		}
+		/* if the raw copy fails, let libcap report or handle it */
+		else if (scanned && (flags & COPYFILE_RAW_METADATA)
+				&& !copyfile_copy_xattr_raw(ctx, source, dest, dest_fd,
+					"security.capability"))
+			lret = COPYFILE_NO_ERROR;
+		else
+			lret = copyfile_copy_cap_to(ctx, source, dest, dest_fd, st);
+#else
+		lret = copyfile_copy_cap_to(ctx, source, dest, dest_fd, st);
+#endif
+
+		if (!lret)
+			done_flags |= COPYFILE_COPY_CAP;
 		else if (lret == COPYFILE_ERROR_CAP_GET && !ret)
 		{
 			ret = lret;
@@ -91,13 +243,37 @@ copyfile_error_t copyfile_copy_metadata(const char* source,
 
 	if (flags & COPYFILE_COPY_ACL)
 	{
-		copyfile_error_t lret = copyfile_copy_acl(source, dest, st);
+		copyfile_error_t lret;
 
-		if (!lret)
+#ifdef HAVE_LGETXATTR
+		if (scanned && !(scan.found & COPYFILE_XATTR_FOUND_ACL))
+			lret = drop_acls(ctx, source, dest, dest_fd, st, &cur_dirty);
+		else if (scanned && diff && same_acl(ctx, source, dest,
+					dest_fd, st))
+		{
+			lret = COPYFILE_NO_ERROR;
+			done_flags |= COPYFILE_SAME_ACL;
+		}
+		else
 		{
-			if (result_flags)
-				*result_flags |= COPYFILE_COPY_ACL;
+			/* setting the ACL changes the mode */
+			cur_dirty = 1;
+
+			if (scanned && (flags & COPYFILE_RAW_METADATA)
+					&& !copy_raw_acl(ctx, source, dest, dest_fd,
+						scan.found))
+				lret = COPYFILE_NO_ERROR;
+			else
+				lret = copyfile_copy_acl_to(ctx, source, dest, dest_fd,
+						st);
 		}
+#else
+		lret = copyfile_copy_acl_to(ctx, source, dest, dest_fd, st);
+		cur_dirty = 1;
+#endif
+
+		if (!lret)
+			done_flags |= COPYFILE_COPY_ACL;
 		else if (lret == COPYFILE_ERROR_ACL_GET && !ret)
 		{
 			ret = lret;
@@ -107,13 +283,36 @@ copyfile_error_t copyfile_copy_metadata(const char* source,
 
 	if (flags & COPYFILE_COPY_STAT)
 	{
-		unsigned int done = copyfile_set_stat(dest, st, flags);
+		if (cur && cur_dirty && stat_dest(dest, dest_fd, &dest_buf))
+			cur = 0;
 
-		if (result_flags)
-			*result_flags |= done;
+		done_flags |= copyfile_set_stat_diff(dest, dest_fd, st, cur,
+				flags & COPYFILE_COPY_STAT);
 	}
 
+#ifdef HAVE_LGETXATTR
+	copyfile_arena_free(&local_list);
+#endif
+
+	if (result_flags)
+		*result_flags = done_flags;
 	if (ret)
 		errno = saved_errno;
 	return ret;
 }
+
+copyfile_error_t copyfile_copy_metadata_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int flags, unsigned int* result_flags)
+{
+	return copyfile_copy_metadata_to(ctx, source, dest, -1, st, flags,
+			result_flags);
+}
+
+copyfile_error_t copyfile_copy_metadata(const char* source,
+		const char* dest, const struct stat* st,
+		unsigned int flags, unsigned int* result_flags)
+{
+	return copyfile_copy_metadata_ctx(0, source, dest, st, flags,
+			result_flags);
+}
@@ -9,6 +9,7 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -16,51 +17,117 @@
 #include <unistd.h>
 #include <errno.h>
 
-copyfile_error_t copyfile_copy_regular(const char* source,
-		const char* dest, off_t expected_size,
+/* copy a small file using a single read and write. one byte more
+ * is read to notice if the file grew; the remainder is copied
+ * as a stream then. @fd_out needs to be empty. */
+static copyfile_error_t copy_small(copyfile_ctx_t* ctx,
+		int fd_in, int fd_out, off_t expected_size,
+		copyfile_callback_t callback, void* callback_data)
+{
+	char buf[COPYFILE_SMALL_FILE + 1];
+	char* bufp = buf;
+	copyfile_progress_t progress;
+	ssize_t rd, left;
+
+	progress.data.offset = 0;
+	progress.data.size = expected_size;
+
+	if (callback && callback(COPYFILE_NO_ERROR, COPYFILE_REGULAR,
+				progress, callback_data, 0))
+		return COPYFILE_ABORTED;
+
+	while (1)
+	{
+		rd = read(fd_in, buf, expected_size + 1);
+		if (rd != -1)
+			break;
+
+		if (callback
+				? !callback(COPYFILE_ERROR_READ, COPYFILE_REGULAR, progress,
+					callback_data, errno != EINTR)
+				: errno == EINTR)
+			continue;
+		return COPYFILE_ERROR_READ;
+	}
+
+	for (left = rd; left > 0; )
+	{
+		ssize_t wr = write(fd_out, bufp, left);
+
+		if (wr == -1)
+		{
+			if (callback
+					? !callback(COPYFILE_ERROR_WRITE, COPYFILE_REGULAR,
+						progress, callback_data, errno != EINTR)
+					: errno == EINTR)
+				continue;
+			return COPYFILE_ERROR_WRITE;
+		}
+
+		bufp += wr;
+		left -= wr;
+		progress.data.offset += wr;
+	}
+
+	if (ctx)
+		ctx->stats.bytes += rd;
+
+	if (rd > expected_size)
+	{
+		off_t offset = rd;
+
+		return copyfile_copy_stream_ctx(ctx, fd_in, fd_out, &offset,
+				expected_size, callback, callback_data);
+	}
+
+	if (callback && callback(COPYFILE_EOF, COPYFILE_REGULAR, progress,
+				callback_data, 0))
+		return COPYFILE_ABORTED;
+	return COPYFILE_NO_ERROR;
+}
+
+copyfile_error_t copyfile_copy_fd(copyfile_ctx_t* ctx,
+		int fd_in, int fd_out, int blockdev, off_t expected_size,
 		copyfile_callback_t callback, void* callback_data)
 {
-	int fd_in, fd_out;
 #ifdef HAVE_POSIX_FALLOCATE
 	int preallocated = 0;
 #endif
-	int open_flags = O_WRONLY | O_CREAT;
 
-	/* if there's no ftruncate(), we need to truncate when opening.
-	 * if there's posix_fallocate(), we truncate anyway trying to get
-	 * a less fragmented space. */
-#ifndef HAVE_FTRUNCATE
-	open_flags |= O_TRUNC;
-#endif
-#ifdef HAVE_POSIX_FALLOCATE
-	open_flags |= O_TRUNC;
-#endif
+	/* a file smaller than a block would not share anything with
+	 * a clone, and there's nothing to preallocate or truncate */
+	if (expected_size > 0 && expected_size <= COPYFILE_SMALL_FILE)
+		return copy_small(ctx, fd_in, fd_out, expected_size,
+				callback, callback_data);
 
-	fd_in = open(source, O_RDONLY);
-	if (fd_in == -1)
-		return COPYFILE_ERROR_OPEN_SOURCE;
-
-	fd_out = open(dest, open_flags, perm_file);
-	if (fd_out == -1)
+	/* a block device can be neither cloned into, preallocated
+	 * nor truncated */
+	if (blockdev)
 	{
-		int hold_errno = errno;
-
-		close(fd_in);
+		copyfile_error_t ret = copyfile_copy_blockdev(ctx, fd_in, fd_out,
+				callback, callback_data);
 
-		errno = hold_errno;
-		return COPYFILE_ERROR_OPEN_DEST;
+		if (ret != COPYFILE_ERROR_UNSUPPORTED)
+			return ret;
 	}
 
 	/* start by trying the atomic clone op */
 	if (!copyfile_clone_stream(fd_in, fd_out))
 	{
-		close(fd_in);
-		if (close(fd_out)) /* delayed error? */
-			return COPYFILE_ERROR_WRITE;
-
+		if (ctx)
+			++ctx->stats.clones;
 		return 0;
 	}
 
+	/* sparse or preallocated sources are copied along their extents */
+	{
+		copyfile_error_t ret = copyfile_copy_extents(ctx, fd_in, fd_out,
+				callback, callback_data);
+
+		if (ret != COPYFILE_ERROR_UNSUPPORTED)
+			return ret;
+	}
+
 	/* we can't use posix_fallocate() if we wouldn't be able to truncate
 	 * afterwards. not that any system can really have former without
 	 * the latter; but since autotools does the check already, we can
@@ -76,7 +143,7 @@ copyfile_error_t copyfile_copy_regular(const char* source,
 
 	{
 		off_t offset = 0;
-		copyfile_error_t ret = copyfile_copy_stream(fd_in, fd_out,
+		copyfile_error_t ret = copyfile_copy_stream_ctx(ctx, fd_in, fd_out,
 				&offset, expected_size, callback, callback_data);
 		int hold_errno = errno;
 
@@ -88,11 +155,186 @@ copyfile_error_t copyfile_copy_regular(const char* source,
 		}
 #endif
 
+		errno = hold_errno;
+		return ret;
+	}
+}
+
+/* whether @dest (or @fd, if not -1) is a block device, which is
+ * written in place. the files of a tree are not checked. */
+static int is_blockdev(copyfile_ctx_t* ctx, const char* dest, int fd)
+{
+	struct stat st;
+
+	if (ctx && (ctx->options & COPYFILE_NO_BLOCKDEV))
+		return 0;
+	if (fd != -1)
+		return !fstat(fd, &st) && S_ISBLK(st.st_mode);
+	return !stat(dest, &st) && S_ISBLK(st.st_mode);
+}
+
+/* copy @source onto @dest, opened for writing. @blockdev tells whether
+ * @dest is a block device, -1 if not known yet. */
+static copyfile_error_t copy_in_place(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int blockdev,
+		off_t expected_size,
+		copyfile_callback_t callback, void* callback_data)
+{
+	int fd_in, fd_out;
+	int open_flags = O_WRONLY | O_CREAT;
+	const int small = expected_size > 0
+		&& expected_size <= COPYFILE_SMALL_FILE;
+
+	/* if there's no ftruncate(), we need to truncate when opening.
+	 * if there's posix_fallocate(), we truncate anyway trying to get
+	 * a less fragmented space. (a block device ignores O_TRUNC.) */
+#ifndef HAVE_FTRUNCATE
+	open_flags |= O_TRUNC;
+#endif
+#ifdef HAVE_POSIX_FALLOCATE
+	open_flags |= O_TRUNC;
+#endif
+	/* the small files are copied without truncating afterwards */
+	if (small)
+		open_flags |= O_TRUNC;
+
+	fd_in = open(source, O_RDONLY);
+	if (fd_in == -1)
+		return COPYFILE_ERROR_OPEN_SOURCE;
+
+	fd_out = open(dest, open_flags, perm_file);
+	if (fd_out == -1)
+	{
+		int hold_errno = errno;
+
+		close(fd_in);
+
+		errno = hold_errno;
+		return COPYFILE_ERROR_OPEN_DEST;
+	}
+
+	/* a small file is not written onto a device any differently */
+	if (blockdev == -1)
+		blockdev = !small && is_blockdev(ctx, dest, fd_out);
+
+	{
+		copyfile_error_t ret = copyfile_copy_fd(ctx, fd_in, fd_out,
+				blockdev, expected_size, callback, callback_data);
+		int hold_errno;
+
+		if (!ret)
+			ret = copyfile_sync_fd(ctx, fd_out, 0);
+		hold_errno = errno;
+
 		close(fd_in);
 		if (close(fd_out) && !ret) /* delayed error? */
 			return COPYFILE_ERROR_WRITE;
 
+		if (!ret)
+			return copyfile_sync_dir(ctx, dest);
+
 		errno = hold_errno;
 		return ret;
 	}
 }
+
+copyfile_error_t copyfile_copy_regular_atomic(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, off_t expected_size,
+		const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_error_t* metadata_ret,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct copyfile_tmpfile tmp;
+	int fd_in;
+	copyfile_error_t ret;
+	int hold_errno;
+
+	if (result_flags)
+		*result_flags = 0;
+
+	/* publishing would replace the device node with a regular file */
+	if (is_blockdev(ctx, dest, -1))
+	{
+		ret = copy_in_place(ctx, source, dest, 1, expected_size,
+				callback, callback_data);
+		if (!ret && st)
+			*metadata_ret = copyfile_copy_metadata_ctx(ctx, source, dest,
+					st, flags, result_flags);
+		return ret;
+	}
+
+	fd_in = open(source, O_RDONLY);
+	if (fd_in == -1)
+		return COPYFILE_ERROR_OPEN_SOURCE;
+
+	ret = copyfile_tmpfile_open(&tmp, dest, perm_file);
+	if (ret)
+	{
+		hold_errno = errno;
+		close(fd_in);
+		errno = hold_errno;
+		return ret;
+	}
+
+	ret = copyfile_copy_fd(ctx, fd_in, tmp.fd, 0, expected_size,
+			callback, callback_data);
+	hold_errno = errno;
+	close(fd_in);
+
+	if (!ret)
+	{
+		/* set the metadata while the file is still invisible */
+		if (st)
+		{
+			*metadata_ret = copyfile_copy_metadata_to(ctx, source,
+					tmp.path, tmp.fd, st, flags, result_flags);
+			hold_errno = errno;
+		}
+
+		/* the contents must be durable before the name is */
+		ret = copyfile_sync_fd(ctx, tmp.fd, !!st);
+		if (ret)
+		{
+			hold_errno = errno;
+			copyfile_tmpfile_discard(&tmp);
+		}
+		else
+		{
+			ret = copyfile_tmpfile_publish(&tmp, dest);
+			if (!ret)
+				ret = copyfile_sync_dir(ctx, dest);
+		}
+
+		if (ret)
+		{
+			hold_errno = errno;
+			if (result_flags)
+				*result_flags = 0;
+		}
+	}
+	else
+		copyfile_tmpfile_discard(&tmp);
+
+	errno = hold_errno;
+	return ret;
+}
+
+copyfile_error_t copyfile_copy_regular_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, off_t expected_size,
+		copyfile_callback_t callback, void* callback_data)
+{
+	if (ctx && (ctx->options & COPYFILE_ATOMIC_PUBLISH))
+		return copyfile_copy_regular_atomic(ctx, source, dest,
+				expected_size, 0, 0, 0, 0, callback, callback_data);
+
+	return copy_in_place(ctx, source, dest, -1, expected_size,
+			callback, callback_data);
+}
+
+copyfile_error_t copyfile_copy_regular(const char* source,
+		const char* dest, off_t expected_size,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_copy_regular_ctx(0, source, dest, expected_size,
+			callback, callback_data);
+}
@@ -9,22 +9,38 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
 
-copyfile_error_t copyfile_copy_stream(int fd_in, int fd_out,
-		off_t* offset_store, off_t expected_size,
+copyfile_error_t copyfile_copy_stream_ctx(copyfile_ctx_t* ctx,
+		int fd_in, int fd_out, off_t* offset_store, off_t expected_size,
 		copyfile_callback_t callback, void* callback_data)
 {
-	char buf[COPYFILE_BUFFER_SIZE];
+	char stack_buf[COPYFILE_BUFFER_SIZE];
+	char* buf = stack_buf;
+	size_t buf_size = sizeof(stack_buf);
 
-	int opcount = 0;
+	unsigned int opcount = 0;
+	unsigned int max_opcount = COPYFILE_CALLBACK_OPCOUNT;
 	copyfile_progress_t progress;
+	off_t start_offset;
+
+	if (ctx)
+	{
+		buf_size = ctx->buffer_size;
+		max_opcount = ctx->callback_opcount;
+
+		buf = copyfile_arena_reserve(&ctx->data, buf_size);
+		if (!buf)
+			return COPYFILE_ERROR_MALLOC;
+	}
 
 	progress.data.offset = offset_store ? *offset_store : 0;
 	progress.data.size = expected_size;
+	start_offset = progress.data.offset;
 
 	while (1)
 	{
@@ -44,11 +60,11 @@ copyfile_error_t copyfile_copy_stream(int fd_in, int fd_out,
 				}
 			}
 
-			if (++opcount >= COPYFILE_CALLBACK_OPCOUNT)
+			if (++opcount >= max_opcount)
 				opcount = 0;
 		}
 
-		rd = read(fd_in, bufp, sizeof(buf));
+		rd = read(fd_in, bufp, buf_size);
 		if (rd == -1)
 		{
 			copyfile_error_t err = COPYFILE_ERROR_READ;
@@ -99,8 +115,18 @@ copyfile_error_t copyfile_copy_stream(int fd_in, int fd_out,
 
 	if (offset_store)
 		*offset_store = progress.data.offset;
+	if (ctx)
+		ctx->stats.bytes += progress.data.offset - start_offset;
 	if (callback && callback(COPYFILE_EOF, COPYFILE_REGULAR, progress,
 				callback_data, 0))
 		return COPYFILE_ABORTED;
 	return COPYFILE_NO_ERROR;
 }
+
+copyfile_error_t copyfile_copy_stream(int fd_in, int fd_out,
+		off_t* offset_store, off_t expected_size,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_copy_stream_ctx(0, fd_in, fd_out, offset_store,
+			expected_size, callback, callback_data);
+}
@@ -9,6 +9,7 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #ifdef S_IFLNK
 
@@ -28,7 +29,7 @@ static copyfile_error_t try_copy_symlink(const char* source,
 
 	if (rd < buf_size)
 	{
-		buf[rd + 1] = 0;
+		buf[rd] = 0;
 
 		if (symlink(buf, dest))
 			return COPYFILE_ERROR_SYMLINK;
@@ -39,133 +40,106 @@ static copyfile_error_t try_copy_symlink(const char* source,
 }
 #endif /*S_IFLNK*/
 
-copyfile_error_t copyfile_copy_symlink(const char* source,
-		const char* dest, size_t expected_length,
+copyfile_error_t copyfile_copy_symlink_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, size_t expected_length,
 		copyfile_callback_t callback, void* callback_data)
 {
 #ifdef S_IFLNK
 	/* remember that the last cell is for null-terminator */
 
 	/* try to avoid dynamic allocation */
-	char buf[COPYFILE_BUFFER_SIZE];
-	size_t buf_size = sizeof(buf);
+	char stack_buf[COPYFILE_BUFFER_SIZE];
+	struct copyfile_arena local_arena;
+	struct copyfile_arena* arena = &local_arena;
+	size_t buf_size;
+
+	/* size_t is always unsigned, so -1 safely becomes SIZE_MAX */
+	const size_t my_size_max = -1;
+	const size_t max_size = my_size_max > SSIZE_MAX
+		? SSIZE_MAX : my_size_max;
 
 	copyfile_progress_t progress;
+	copyfile_error_t ret;
+
+	copyfile_arena_init(&local_arena, stack_buf, sizeof(stack_buf));
+	if (ctx)
+		arena = &ctx->symlink;
 
 	progress.symlink.length = expected_length;
 	if (callback && callback(COPYFILE_NO_ERROR, COPYFILE_SYMLINK,
 				progress, callback_data, 0))
 		return COPYFILE_ABORTED;
 
-	if (expected_length < buf_size)
+	buf_size = expected_length < max_size ? expected_length + 1 : max_size;
+	/* use the whole buffer if it's there already */
+	if (buf_size < arena->size)
+		buf_size = arena->size;
+	if (buf_size < sizeof(stack_buf))
+		buf_size = sizeof(stack_buf);
+
+	while (1)
 	{
-		int ret;
+		char* buf = copyfile_arena_reserve(arena, buf_size);
 
-		while (1)
+		if (!buf)
 		{
-			ret = try_copy_symlink(source, dest, buf, buf_size);
-
-			if (ret != COPYFILE_EOF)
-			{
-				if (!ret)
-				{
-					if (callback)
-					{
-						progress.symlink.target = buf;
-						if (callback(COPYFILE_EOF, COPYFILE_SYMLINK,
-									progress, callback_data, 0))
-							return COPYFILE_ABORTED;
-					}
-
-					return ret;
-				}
+			ret = COPYFILE_ERROR_MALLOC;
 
-				/* does the user want to retry? */
-				if (!callback || callback(ret, COPYFILE_SYMLINK,
-							progress, callback_data, 1))
-					return ret;
-			}
-			else
-				break;
+			/* retry? */
+			if (callback && !callback(ret, COPYFILE_SYMLINK,
+						progress, callback_data, 1))
+				continue;
+			break;
 		}
 
-		buf_size *= 2;
-	}
-	else
-		buf_size = expected_length + 1;
-
-	{
-		char* buf = 0;
-		int ret;
+		ret = try_copy_symlink(source, dest, buf, buf_size);
 
-		/* size_t is always unsigned, so -1 safely becomes SIZE_MAX */
-		const size_t my_size_max = -1;
-		const size_t max_size = my_size_max > SSIZE_MAX
-			? SSIZE_MAX : my_size_max;
-
-		while (1)
+		if (!ret)
 		{
-			char* next_buf = realloc(buf, buf_size);
-
-			if (!next_buf)
-			{
-				ret = COPYFILE_ERROR_MALLOC;
-
-				/* retry? */
-				if (callback && !callback(ret, COPYFILE_SYMLINK,
-							progress, callback_data, 1))
-					continue;
-
-				if (!buf) /* avoid freeing in the less likely branch */
-					return ret;
-				break;
-			}
-			buf = next_buf;
-
-			ret = try_copy_symlink(source, dest, buf, buf_size);
-
-			if (!ret)
+			if (callback)
 			{
-				if (callback)
-				{
-					progress.symlink.target = buf;
-					if (callback(COPYFILE_EOF, COPYFILE_SYMLINK,
-								progress, callback_data, 0))
-					{
-						free(buf);
-						return COPYFILE_ABORTED;
-					}
-				}
-				break;
+				progress.symlink.target = buf;
+				if (callback(COPYFILE_EOF, COPYFILE_SYMLINK,
+							progress, callback_data, 0))
+					ret = COPYFILE_ABORTED;
 			}
-			else if (ret == COPYFILE_EOF)
+			break;
+		}
+		else if (ret == COPYFILE_EOF)
+		{
+			if (buf_size < max_size / 2)
+				buf_size *= 2;
+			else
 			{
-				if (buf_size < max_size / 2)
-					buf_size *= 2;
+				if (buf_size != max_size)
+					buf_size = max_size;
 				else
 				{
-					if (buf_size != max_size)
-						buf_size = max_size;
-					else
-					{
-						ret = COPYFILE_ERROR_SYMLINK_TARGET_TOO_LONG;
-						break;
-					}
-				}
-			}
-			else
-			{
-				/* does the user want to retry? */
-				if (callback && callback(ret, COPYFILE_SYMLINK,
-							progress, callback_data, 1))
+					ret = COPYFILE_ERROR_SYMLINK_TARGET_TOO_LONG;
 					break;
+				}
 			}
 		}
-
-		free(buf);
-		return ret;
+		else
+		{
+			/* does the user want to retry? */
+			if (!callback || callback(ret, COPYFILE_SYMLINK,
+						progress, callback_data, 1))
+				break;
+		}
 	}
+
+	copyfile_arena_free(&local_arena);
+	return ret;
 #endif /*S_IFLNK*/
 
 	return COPYFILE_ERROR_UNSUPPORTED;
 }
+
+copyfile_error_t copyfile_copy_symlink(const char* source,
+		const char* dest, size_t expected_length,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_copy_symlink_ctx(0, source, dest, expected_length,
+			callback, callback_data);
+}
@@ -9,6 +9,7 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #ifdef HAVE_XATTR
 #	include <stdlib.h>
@@ -23,23 +24,232 @@
 #	endif
 #endif
 
-copyfile_error_t copyfile_copy_xattr(const char* source,
-		const char* dest, const struct stat* st)
+#ifdef HAVE_LGETXATTR
+/* the f*xattr() functions are always available along with l*xattr() */
+static ssize_t dest_getxattr(const char* dest, int dest_fd,
+		const char* name, void* value, size_t size)
 {
-#ifdef HAVE_XATTR
+	if (dest_fd != -1)
+		return fgetxattr(dest_fd, name, value, size);
+	return lgetxattr(dest, name, value, size);
+}
+
+static int dest_setxattr(const char* dest, int dest_fd,
+		const char* name, const void* value, size_t size)
+{
+	if (dest_fd != -1)
+		return fsetxattr(dest_fd, name, value, size, 0);
+	return lsetxattr(dest, name, value, size, 0);
+}
+
+/* check whether @dest has @name set to @value. */
+static int dest_has_value(struct copyfile_arena* arena, const char* dest,
+		int dest_fd, const char* name, const char* value, ssize_t len)
+{
+	/* one more byte, so that a longer value fails with ERANGE */
+	char* buf = copyfile_arena_reserve(arena, len + 1);
+	ssize_t dest_len;
+
+	if (!buf)
+		return 0;
+
+	dest_len = dest_getxattr(dest, dest_fd, name, buf, len + 1);
+	return dest_len == len && !memcmp(buf, value, len);
+}
+
+int copyfile_same_xattr(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, int dest_fd, const char* name)
+{
+	char data_buf[COPYFILE_BUFFER_SIZE / 4];
+	char cmp_buf[COPYFILE_BUFFER_SIZE / 4];
+
+	struct copyfile_arena local_data, local_cmp;
+	struct copyfile_arena* data_arena = &local_data;
+	struct copyfile_arena* cmp_arena = &local_cmp;
+
+	ssize_t data_len;
+	int ret;
+
+	copyfile_arena_init(&local_data, data_buf, sizeof(data_buf));
+	copyfile_arena_init(&local_cmp, cmp_buf, sizeof(cmp_buf));
+	if (ctx)
+	{
+		data_arena = &ctx->xattr_value;
+		cmp_arena = &ctx->xattr_cmp;
+	}
+
+	data_len = copyfile_get_xattr(data_arena, source, name);
+	if (data_len != -1)
+		ret = dest_has_value(cmp_arena, dest, dest_fd, name,
+				data_arena->ptr, data_len);
+	else if (errno == ENODATA)
+		ret = dest_getxattr(dest, dest_fd, name, 0, 0) == -1
+			&& errno == ENODATA;
+	else
+		ret = 0;
+
+	copyfile_arena_free(&local_data);
+	copyfile_arena_free(&local_cmp);
+	return ret;
+}
+
+copyfile_error_t copyfile_copy_xattr_list(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int dest_fd,
+		const struct copyfile_xattr_scan* scan, int* same)
+{
+	char data_buf[COPYFILE_BUFFER_SIZE / 2];
+	char cmp_buf[COPYFILE_BUFFER_SIZE / 4];
+
+	struct copyfile_arena local_data, local_cmp;
+	struct copyfile_arena* data_arena = &local_data;
+	struct copyfile_arena* cmp_arena = &local_cmp;
+
+	const char* n;
+
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	int saved_errno;
+
+	if (same)
+		*same = 1;
+	if (!(scan->found & COPYFILE_XATTR_FOUND_REGULAR))
+		return COPYFILE_NO_ERROR;
+
+	copyfile_arena_init(&local_data, data_buf, sizeof(data_buf));
+	copyfile_arena_init(&local_cmp, cmp_buf, sizeof(cmp_buf));
+	if (ctx)
+	{
+		data_arena = &ctx->xattr_value;
+		cmp_arena = &ctx->xattr_cmp;
+	}
+
+	for (n = scan->list; n < &scan->list[scan->len]; n = strchr(n, 0) + 1)
+	{
+		ssize_t data_len;
+
+		/* On Linux, namespace is stored in the attribute name. */
+		if (strncmp(n, "user.", 5) && strncmp(n, "trusted.", 8))
+			continue;
+
+		data_len = copyfile_get_xattr(data_arena, source, n);
+		if (data_len == -1)
+		{
+			/* return the first error
+			 * but try to copy the remaining attributes first,
+			 * in case user ignored errors */
+			if (!ret)
+			{
+				ret = errno == ENOMEM ? COPYFILE_ERROR_MALLOC
+					: COPYFILE_ERROR_XATTR_GET;
+				saved_errno = errno;
+			}
+			continue;
+		}
+
+		if (same)
+		{
+			if (dest_has_value(cmp_arena, dest, dest_fd, n,
+						data_arena->ptr, data_len))
+				continue;
+			*same = 0;
+		}
+
+		if (dest_setxattr(dest, dest_fd, n, data_arena->ptr, data_len))
+		{
+			if (!ret)
+			{
+				ret = COPYFILE_ERROR_XATTR_SET;
+				saved_errno = errno;
+			}
+
+			/* further tries with same attr type will fail as well */
+			if (errno == ENOTSUP)
+				break;
+		}
+		else if (ctx)
+			++ctx->stats.xattrs;
+	}
+
+	copyfile_arena_free(&local_data);
+	copyfile_arena_free(&local_cmp);
+
+	if (ret)
+		errno = saved_errno;
+	return ret;
+}
+
+copyfile_error_t copyfile_copy_xattr_raw(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int dest_fd,
+		const char* name)
+{
+	char data_buf[COPYFILE_BUFFER_SIZE / 4];
+
+	struct copyfile_arena local_data;
+	struct copyfile_arena* data_arena = &local_data;
+
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	ssize_t data_len;
+	int saved_errno;
+
+	copyfile_arena_init(&local_data, data_buf, sizeof(data_buf));
+	if (ctx)
+		data_arena = &ctx->xattr_value;
+
+	data_len = copyfile_get_xattr(data_arena, source, name);
+	if (data_len == -1)
+		ret = COPYFILE_ERROR_XATTR_GET;
+	else if (dest_setxattr(dest, dest_fd, name, data_arena->ptr,
+				data_len))
+		ret = COPYFILE_ERROR_XATTR_SET;
+	else if (ctx)
+		++ctx->stats.xattrs;
+
+	saved_errno = errno;
+	copyfile_arena_free(&local_data);
+	errno = saved_errno;
+
+	return ret;
+}
+#endif /*HAVE_LGETXATTR*/
+
+copyfile_error_t copyfile_copy_xattr_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st)
+{
+#ifdef HAVE_LGETXATTR
+	{
+		char list_buf[COPYFILE_BUFFER_SIZE / 2];
+
+		struct copyfile_arena local_list;
+		struct copyfile_xattr_scan scan;
+
+		copyfile_error_t ret;
+		int saved_errno;
+
+		copyfile_arena_init(&local_list, list_buf, sizeof(list_buf));
+
+		ret = copyfile_scan_xattr(ctx, ctx ? &ctx->xattr_list : &local_list,
+				source, st, &scan);
+		if (!ret)
+			ret = copyfile_copy_xattr_list(ctx, source, dest, -1,
+					&scan, 0);
+
+		saved_errno = errno;
+		copyfile_arena_free(&local_list);
+		errno = saved_errno;
+
+		return ret;
+	}
+#elif defined(HAVE_EXTATTR_GET_LINK)
 	/* sadly, we can't use attr_copy_file() because it doesn't provide
 	 * any good way to distinguish between read and write errors. */
 	{
 		char list_buf[COPYFILE_BUFFER_SIZE / 2];
 		char data_buf[COPYFILE_BUFFER_SIZE / 2];
-		const ssize_t initial_buf_size = sizeof(list_buf);
 
-		char* list_bufp = list_buf;
-		ssize_t list_buf_size = initial_buf_size;
-
-		char* data_bufp = data_buf;
-		ssize_t data_buf_size = initial_buf_size;
+		struct copyfile_arena local_list, local_data;
+		struct copyfile_arena* list_arena = &local_list;
+		struct copyfile_arena* data_arena = &local_data;
 
+		char* list_bufp;
 		ssize_t list_len;
 
 		char* n;
@@ -47,83 +257,70 @@ copyfile_error_t copyfile_copy_xattr(const char* source,
 		copyfile_error_t ret = COPYFILE_NO_ERROR;
 		int saved_errno;
 
-#ifdef HAVE_EXTATTR_GET_LINK
 		unsigned char next_len;
-#endif
 
-#ifdef HAVE_LGETXATTR
-		list_len = llistxattr(source, 0, 0);
-#endif
-#ifdef HAVE_EXTATTR_GET_LINK
+		if (st && copyfile_fs_lacks(ctx, st->st_dev, COPYFILE_FS_NO_XATTR))
+			return COPYFILE_NO_ERROR;
+
+		copyfile_arena_init(&local_list, list_buf, sizeof(list_buf));
+		copyfile_arena_init(&local_data, data_buf, sizeof(data_buf));
+		if (ctx)
+		{
+			list_arena = &ctx->xattr_list;
+			data_arena = &ctx->xattr_value;
+		}
+
 		list_len = extattr_list_link(source, EXTATTR_NAMESPACE_USER,
 				0, 0);
-#endif
 		if (list_len == -1)
 		{
 			/* if source fs doesn't support them, it doesn't have them. */
 			if (errno == EOPNOTSUPP)
+			{
+				if (st)
+					copyfile_fs_set_lacks(ctx, st->st_dev,
+							COPYFILE_FS_NO_XATTR);
 				return COPYFILE_NO_ERROR;
+			}
 			else
 				return COPYFILE_ERROR_XATTR_LIST;
 		}
 
-		if (list_len > list_buf_size)
-		{
-			/* On BSD, the list is not null-terminated,
-			 * so we need one more cell for NULL. */
-			list_bufp = malloc(list_len + 1);
-			if (!list_bufp)
-				return COPYFILE_ERROR_MALLOC;
-			list_buf_size = list_len;
-		}
+		/* On BSD, the list is not null-terminated,
+		 * so we need one more cell for NULL. */
+		list_bufp = copyfile_arena_reserve(list_arena, list_len + 1);
+		if (!list_bufp)
+			return COPYFILE_ERROR_MALLOC;
 
-#ifdef HAVE_LGETXATTR
-		list_len = llistxattr(source, list_bufp, list_buf_size);
-#endif
-#ifdef HAVE_EXTATTR_GET_LINK
 		list_len = extattr_list_link(source, EXTATTR_NAMESPACE_USER,
-				list_bufp, list_buf_size);
-#endif
+				list_bufp, list_len);
 		if (list_len == -1)
 		{
-			if (list_bufp != list_buf)
-				free(list_bufp);
+			saved_errno = errno;
+			copyfile_arena_free(&local_list);
+			errno = saved_errno;
 
 			return COPYFILE_ERROR_XATTR_LIST;
 		}
 
 		n = list_bufp;
-#ifdef HAVE_EXTATTR_GET_LINK
 		/* This is safe since buffer will always have at least a few
 		 * bytes. */
 		next_len = *n++;
-#endif
 
 		for (; n < &list_bufp[list_len]; n = strchr(n, 0) + 1)
 		{
 			ssize_t data_len;
+			char* data_bufp;
 
-#ifdef HAVE_EXTATTR_GET_LINK
 			/* On BSD, the list consists of pascal strings...
 			 * let's null-terminate it. */
 			unsigned int next_len_tmp = n[next_len];
 			n[next_len] = 0; /* null-terminate */
 			next_len = next_len_tmp;
-#endif
 
-#ifdef HAVE_LGETXATTR
-			/* On Linux, namespace is stored in the attribute name. */
-			if (strcmp(n, "user.") && strcmp(n, "trusted."))
-				continue;
-#endif
-
-#ifdef HAVE_LGETXATTR
-			data_len = lgetxattr(source, n, 0, 0);
-#endif
-#ifdef HAVE_EXTATTR_GET_LINK
 			data_len = extattr_get_link(source, EXTATTR_NAMESPACE_USER,
 					n, 0, 0);
-#endif
 			if (data_len == -1)
 			{
 				/* return the first error
@@ -137,35 +334,20 @@ copyfile_error_t copyfile_copy_xattr(const char* source,
 				continue;
 			}
 
-			if (data_len > data_buf_size)
+			data_bufp = copyfile_arena_reserve(data_arena,
+					data_len ? data_len : 1);
+			if (!data_bufp)
 			{
-				char* new_data_bufp;
-
-				if (data_bufp == data_buf)
-					new_data_bufp = malloc(data_len);
-				else
-					new_data_bufp = realloc(data_bufp, data_len);
-
-				if (!new_data_bufp)
+				if (!ret)
 				{
-					if (!ret)
-					{
-						ret = COPYFILE_ERROR_MALLOC;
-						saved_errno = errno;
-					}
-					continue;
+					ret = COPYFILE_ERROR_MALLOC;
+					saved_errno = errno;
 				}
-				data_bufp = new_data_bufp;
-				data_buf_size = data_len;
+				continue;
 			}
 
-#ifdef HAVE_LGETXATTR
-			data_len = lgetxattr(source, n, data_bufp, data_buf_size);
-#endif
-#ifdef HAVE_EXTATTR_GET_LINK
 			data_len = extattr_get_link(source, EXTATTR_NAMESPACE_USER,
-					n, data_bufp, data_buf_size);
-#endif
+					n, data_bufp, data_arena->size);
 			if (data_len == -1)
 			{
 				if (!ret)
@@ -176,13 +358,8 @@ copyfile_error_t copyfile_copy_xattr(const char* source,
 				continue;
 			}
 
-#ifdef HAVE_LGETXATTR
-			if (lsetxattr(dest, n, data_bufp, data_len, 0))
-#endif
-#ifdef HAVE_EXTATTR_GET_LINK
 			if (extattr_set_link(dest, EXTATTR_NAMESPACE_USER, n,
 					data_bufp, data_len) != data_len)
-#endif
 			{
 				if (!ret)
 				{
@@ -194,12 +371,12 @@ copyfile_error_t copyfile_copy_xattr(const char* source,
 				if (errno == ENOTSUP)
 					break;
 			}
+			else if (ctx)
+				++ctx->stats.xattrs;
 		}
 
-		if (list_bufp != list_buf)
-			free(list_bufp);
-		if (data_bufp != data_buf)
-			free(data_bufp);
+		copyfile_arena_free(&local_list);
+		copyfile_arena_free(&local_data);
 
 		/* set COPYFILE_COPY_XATTR even if there were no regular xattrs,
 		 * failed_flags will unset it on failure */
@@ -207,7 +384,13 @@ copyfile_error_t copyfile_copy_xattr(const char* source,
 			errno = saved_errno;
 		return ret;
 	}
-#endif /*HAVE_ATTR*/
+#endif /*HAVE_EXTATTR_GET_LINK*/
 
 	return COPYFILE_ERROR_UNSUPPORTED;
 }
+
+copyfile_error_t copyfile_copy_xattr(const char* source,
+		const char* dest, const struct stat* st)
+{
+	return copyfile_copy_xattr_ctx(0, source, dest, st);
+}
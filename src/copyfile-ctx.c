@@ -0,0 +1,182 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+copyfile_ctx_t* copyfile_ctx_create(void)
+{
+	copyfile_ctx_t* ctx = malloc(sizeof(*ctx));
+
+	if (!ctx)
+		return 0;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->buffer_size = COPYFILE_BUFFER_SIZE;
+	ctx->callback_opcount = COPYFILE_CALLBACK_OPCOUNT;
+
+	copyfile_arena_init(&ctx->data, 0, 0);
+	copyfile_arena_init(&ctx->xattr_list, 0, 0);
+	copyfile_arena_init(&ctx->xattr_value, 0, 0);
+	copyfile_arena_init(&ctx->xattr_cmp, 0, 0);
+	copyfile_arena_init(&ctx->symlink, 0, 0);
+	copyfile_arena_init(&ctx->sync_last_dir, 0, 0);
+
+	return ctx;
+}
+
+void copyfile_ctx_destroy(copyfile_ctx_t* ctx)
+{
+	if (!ctx)
+		return;
+
+	copyfile_arena_free(&ctx->data);
+	copyfile_arena_free(&ctx->xattr_list);
+	copyfile_arena_free(&ctx->xattr_value);
+	copyfile_arena_free(&ctx->xattr_cmp);
+	copyfile_arena_free(&ctx->symlink);
+
+	/* anything not committed is not guaranteed to be synced */
+	copyfile_sync_forget(ctx);
+	free(ctx->sync_fs);
+
+	copyfile_meta_free(ctx);
+
+	free(ctx);
+}
+
+void copyfile_ctx_set_buffer_size(copyfile_ctx_t* ctx, size_t size)
+{
+	ctx->buffer_size = size ? size : COPYFILE_BUFFER_SIZE;
+}
+
+void copyfile_ctx_set_callback_opcount(copyfile_ctx_t* ctx,
+		unsigned int opcount)
+{
+	ctx->callback_opcount = opcount ? opcount : COPYFILE_CALLBACK_OPCOUNT;
+}
+
+void copyfile_ctx_set_options(copyfile_ctx_t* ctx, unsigned int options)
+{
+	ctx->options = options;
+}
+
+unsigned int copyfile_ctx_get_options(const copyfile_ctx_t* ctx)
+{
+	return ctx->options;
+}
+
+void copyfile_ctx_set_threads(copyfile_ctx_t* ctx, unsigned int threads)
+{
+	ctx->threads = threads > COPYFILE_THREADS_MAX
+		? COPYFILE_THREADS_MAX : threads;
+}
+
+void copyfile_ctx_set_schedule(copyfile_ctx_t* ctx,
+		copyfile_schedule_t schedule)
+{
+	ctx->schedule = schedule;
+}
+
+void copyfile_ctx_set_dedup_index(copyfile_ctx_t* ctx,
+		copyfile_dedup_index_t* index)
+{
+	ctx->dedup_index = index;
+}
+
+void copyfile_ctx_set_journal(copyfile_ctx_t* ctx,
+		copyfile_journal_t* journal)
+{
+	ctx->journal = journal;
+}
+
+void copyfile_ctx_set_manifest(copyfile_ctx_t* ctx,
+		const copyfile_manifest_t* manifest)
+{
+	ctx->manifest = manifest;
+}
+
+void copyfile_ctx_set_manifest_writer(copyfile_ctx_t* ctx,
+		copyfile_manifest_writer_t* writer)
+{
+	ctx->manifest_writer = writer;
+}
+
+void copyfile_ctx_set_durability(copyfile_ctx_t* ctx,
+		unsigned int durability)
+{
+	ctx->durability = durability;
+}
+
+const copyfile_stats_t* copyfile_ctx_get_stats(const copyfile_ctx_t* ctx)
+{
+	return &ctx->stats;
+}
+
+void copyfile_ctx_reset_stats(copyfile_ctx_t* ctx)
+{
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+void copyfile_ctx_flush_caches(copyfile_ctx_t* ctx)
+{
+	ctx->fs_cache_used = 0;
+	ctx->fs_cache_next = 0;
+}
+
+int copyfile_fs_lacks(const copyfile_ctx_t* ctx, dev_t dev,
+		enum copyfile_fs_lacks feature)
+{
+	unsigned int i;
+
+	if (!ctx)
+		return 0;
+
+	for (i = 0; i < ctx->fs_cache_used; ++i)
+	{
+		if (ctx->fs_cache[i].dev == dev)
+			return !!(ctx->fs_cache[i].lacks & feature);
+	}
+
+	return 0;
+}
+
+void copyfile_fs_set_lacks(copyfile_ctx_t* ctx, dev_t dev,
+		enum copyfile_fs_lacks feature)
+{
+	unsigned int i;
+
+	if (!ctx)
+		return;
+
+	for (i = 0; i < ctx->fs_cache_used; ++i)
+	{
+		if (ctx->fs_cache[i].dev == dev)
+		{
+			ctx->fs_cache[i].lacks |= feature;
+			return;
+		}
+	}
+
+	/* replace entries round-robin when full */
+	if (ctx->fs_cache_used < COPYFILE_FS_CACHE_SIZE)
+		i = ctx->fs_cache_used++;
+	else
+	{
+		i = ctx->fs_cache_next;
+		ctx->fs_cache_next = (i + 1) % COPYFILE_FS_CACHE_SIZE;
+	}
+
+	ctx->fs_cache[i].dev = dev;
+	ctx->fs_cache[i].lacks = feature;
+}
@@ -0,0 +1,114 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef HAVE_LINK
+/* whether a hard link to @dup would carry the metadata of @st */
+static int same_stat(const struct stat* dup, const struct stat* st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC /* BSD */
+	if (dup->st_mtimespec.tv_sec != st->st_mtimespec.tv_sec
+			|| dup->st_mtimespec.tv_nsec != st->st_mtimespec.tv_nsec)
+		return 0;
+#else /*!HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+	if (dup->st_mtim.tv_sec != st->st_mtim.tv_sec
+			|| dup->st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+		return 0;
+#endif /*HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+
+	return dup->st_mode == st->st_mode && dup->st_uid == st->st_uid
+		&& dup->st_gid == st->st_gid;
+}
+#endif /*HAVE_LINK*/
+
+int copyfile_dedup_archive(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, int may_link,
+		struct copyfile_dedup_key* key, copyfile_error_t* ret,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct stat dest_st;
+	const struct stat* exclude = 0;
+	char* dup_copy;
+	int saved_errno;
+
+	key->size = 0;
+	key->hashed = 0;
+
+	if (!ctx || !ctx->dedup_index || !S_ISREG(st->st_mode)
+			|| !st->st_size)
+		return 0;
+
+#ifdef S_IFLNK
+	if (!lstat(dest, &dest_st))
+#else
+	if (!stat(dest, &dest_st))
+#endif
+		exclude = &dest_st;
+
+	/* the index is just a hint; copy normally if it fails */
+	if (copyfile_dedup_find(ctx, ctx->dedup_index, source, st, exclude,
+				key, &dup_copy) || !dup_copy)
+		return 0;
+
+#ifdef HAVE_LINK
+	if (may_link)
+	{
+		struct stat dup_st;
+
+#	ifdef S_IFLNK
+		if (!lstat(dup_copy, &dup_st)
+#	else
+		if (!stat(dup_copy, &dup_st)
+#	endif
+				&& same_stat(&dup_st, st)
+				&& (!exclude || !unlink(dest))
+				&& !link(dup_copy, dest))
+		{
+			free(dup_copy);
+			if (result_flags)
+				*result_flags = COPYFILE_COPY_STAT & ~COPYFILE_COPY_ATIME;
+			++ctx->stats.deduplicated;
+			*ret = copyfile_sync_dir(ctx, dest);
+			return 1;
+		}
+	}
+#endif /*HAVE_LINK*/
+
+	*ret = copyfile_archive_file_dedup_ctx(ctx, source, dest, dup_copy,
+			st, flags, result_flags, callback, callback_data);
+	saved_errno = errno;
+	free(dup_copy);
+	if (!*ret)
+		++ctx->stats.deduplicated;
+
+	errno = saved_errno;
+	return 1;
+}
+
+void copyfile_dedup_remember(copyfile_ctx_t* ctx, const char* dest,
+		const struct copyfile_dedup_key* key)
+{
+	int saved_errno;
+
+	if (!ctx || !ctx->dedup_index || !key->size)
+		return;
+
+	saved_errno = errno;
+	copyfile_dedup_add(ctx, ctx->dedup_index, dest, key);
+	errno = saved_errno;
+}
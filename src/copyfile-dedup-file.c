@@ -0,0 +1,190 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_LINUX_FS_H
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#endif
+
+#ifdef FIDEDUPERANGE
+/* let the kernel compare and share the common contents of @fd_in
+ * and @fd_out, range by range. */
+static copyfile_error_t dedupe_fd(int fd_in, int fd_out, off_t* reclaimed)
+{
+	union
+	{
+		struct file_dedupe_range range;
+		char buf[sizeof(struct file_dedupe_range)
+			+ sizeof(struct file_dedupe_range_info)];
+	} req;
+	struct file_dedupe_range_info* info = &req.range.info[0];
+	struct stat st_in, st_out;
+	off_t size;
+	off_t offset = 0;
+	/* the chunk found differing, retried in smaller pieces */
+	off_t split_end = 0;
+
+	if (fstat(fd_in, &st_in) || fstat(fd_out, &st_out))
+		return COPYFILE_ERROR_STAT;
+
+	/* the tail is allowed to be unaligned only if it ends at EOF
+	 * in both files */
+	if (st_in.st_size == st_out.st_size)
+		size = st_in.st_size;
+	else
+	{
+		size = st_in.st_size < st_out.st_size
+			? st_in.st_size : st_out.st_size;
+		if (st_out.st_blksize > 0)
+			size -= size % st_out.st_blksize;
+	}
+
+	while (offset < size)
+	{
+		off_t len = size - offset;
+
+		/* the filesystems may limit the length of a single request;
+		 * keep the ranges large and aligned */
+		if (offset < split_end)
+		{
+			if (len > COPYFILE_DEDUPE_SUBCHUNK)
+				len = COPYFILE_DEDUPE_SUBCHUNK;
+		}
+		else if (len > COPYFILE_DEDUPE_CHUNK)
+			len = COPYFILE_DEDUPE_CHUNK;
+
+		memset(&req, 0, sizeof(req));
+		req.range.src_offset = offset;
+		req.range.src_length = len;
+		req.range.dest_count = 1;
+		info->dest_fd = fd_out;
+		info->dest_offset = offset;
+
+		if (ioctl(fd_in, FIDEDUPERANGE, &req.range))
+		{
+			if (errno == EINTR)
+				continue;
+			return COPYFILE_ERROR_IOCTL_DEDUPE;
+		}
+
+		if (info->status < 0)
+		{
+			errno = -info->status;
+			return COPYFILE_ERROR_IOCTL_DEDUPE;
+		}
+
+		/* a single differing block fails the whole request; see
+		 * which parts of it are the same */
+		if (info->status == FILE_DEDUPE_RANGE_DIFFERS
+				&& len > COPYFILE_DEDUPE_SUBCHUNK)
+		{
+			split_end = offset + len;
+			continue;
+		}
+
+		if (info->status == FILE_DEDUPE_RANGE_SAME && info->bytes_deduped)
+		{
+			*reclaimed += info->bytes_deduped;
+			/* it may have done less than asked */
+			if ((off_t) info->bytes_deduped < len)
+				len = info->bytes_deduped;
+		}
+
+		offset += len;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+#endif /*FIDEDUPERANGE*/
+
+copyfile_error_t copyfile_dedup_file_ctx(copyfile_ctx_t* ctx,
+		const char* dup_copy, const char* dest, off_t* reclaimed)
+{
+	char* found = 0;
+	off_t buf;
+	copyfile_error_t ret;
+
+	if (!reclaimed)
+		reclaimed = &buf;
+	*reclaimed = 0;
+
+	if (!dup_copy)
+	{
+		if (!ctx || !ctx->dedup_index)
+			return COPYFILE_NO_ERROR;
+
+		ret = copyfile_dedup_index_lookup(ctx->dedup_index, dest, 0,
+				&found);
+		if (ret || !found)
+			return ret;
+		dup_copy = found;
+	}
+
+#ifdef FIDEDUPERANGE
+	{
+		int fd_in, fd_out;
+		int hold_errno;
+
+		fd_in = open(dup_copy, O_RDONLY);
+		if (fd_in == -1)
+		{
+			hold_errno = errno;
+			free(found);
+			errno = hold_errno;
+			return COPYFILE_ERROR_OPEN_SOURCE;
+		}
+
+		/* the destination is not written; a read-only descriptor is
+		 * enough if we own the file */
+		fd_out = open(dest, O_RDWR);
+		if (fd_out == -1 && (errno == EACCES || errno == EROFS
+					|| errno == ETXTBSY))
+			fd_out = open(dest, O_RDONLY);
+		if (fd_out == -1)
+		{
+			hold_errno = errno;
+			close(fd_in);
+			free(found);
+			errno = hold_errno;
+			return COPYFILE_ERROR_OPEN_DEST;
+		}
+
+		ret = dedupe_fd(fd_in, fd_out, reclaimed);
+		hold_errno = errno;
+
+		close(fd_in);
+		close(fd_out);
+		free(found);
+
+		errno = hold_errno;
+		return ret;
+	}
+#else
+	free(found);
+	return COPYFILE_ERROR_UNSUPPORTED;
+#endif
+}
+
+copyfile_error_t copyfile_dedup_file(const char* dup_copy,
+		const char* dest, off_t* reclaimed)
+{
+	return copyfile_dedup_file_ctx(0, dup_copy, dest, reclaimed);
+}
@@ -0,0 +1,853 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_MMAP
+#	include <sys/mman.h>
+#endif
+#ifdef HAVE_FLOCK
+#	include <sys/file.h>
+#endif
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+copyfile_error_t copyfile_dedup_hash(copyfile_ctx_t* ctx, const char* path,
+		unsigned char hash[COPYFILE_SHA256_SIZE])
+{
+	char stack_buf[COPYFILE_BUFFER_SIZE];
+	char* buf = stack_buf;
+	size_t buf_size = sizeof(stack_buf);
+	struct copyfile_sha256 s;
+	int fd;
+
+	if (ctx)
+	{
+		buf_size = ctx->buffer_size;
+		buf = copyfile_arena_reserve(&ctx->data, buf_size);
+		if (!buf)
+			return COPYFILE_ERROR_MALLOC;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return COPYFILE_ERROR_OPEN_SOURCE;
+
+	copyfile_sha256_init(&s);
+	while (1)
+	{
+		ssize_t rd = read(fd, buf, buf_size);
+
+		if (rd == -1)
+		{
+			int saved_errno = errno;
+
+			if (errno == EINTR)
+				continue;
+
+			close(fd);
+			errno = saved_errno;
+			return COPYFILE_ERROR_READ;
+		}
+		else if (rd == 0)
+			break;
+
+		copyfile_sha256_update(&s, buf, rd);
+	}
+
+	close(fd);
+	copyfile_sha256_final(&s, hash);
+	return COPYFILE_NO_ERROR;
+}
+
+#ifdef HAVE_MMAP
+
+/* The index file consists of the header, the Bloom filter bitmap,
+ * the bucket heads, the entries and the path strings, in this order.
+ * The number of buckets and the size of the filter follow the entry
+ * capacity, and they are rebuilt whenever it grows. Entries are
+ * chained per bucket, the bucket being selected by the file size. */
+
+static const char index_magic[8] = "CFDEDUP1";
+
+#define INDEX_INITIAL_ENTRIES 1024
+#define INDEX_INITIAL_STRINGS 65536
+#define INDEX_BLOOM_BITS_PER_ENTRY 16
+#define INDEX_BLOOM_PROBES 4
+
+/* the file is gone or changed since it was indexed */
+#define INDEX_ENTRY_STALE 0x01
+
+struct index_header
+{
+	char magic[8];
+	uint32_t entries_size;
+	uint32_t nentries;
+	uint64_t strings_used;
+	uint64_t strings_size;
+};
+
+struct index_entry
+{
+	uint64_t size;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	/* the next entry in the bucket + 1, 0 for the last one */
+	uint32_t next;
+	uint64_t path_off;
+	uint32_t path_len;
+	uint32_t flags;
+	unsigned char hash[COPYFILE_SHA256_SIZE];
+};
+
+struct copyfile_dedup_index
+{
+	int fd;
+	char* map;
+	size_t map_size;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+};
+
+/* the layout of the file for a given capacity */
+struct index_layout
+{
+	size_t bloom_off;
+	size_t bloom_bits;
+	size_t buckets_off;
+	size_t nbuckets;
+	size_t entries_off;
+	size_t strings_off;
+	size_t total;
+};
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t) 7)
+
+static void get_layout(struct index_layout* l, size_t entries_size,
+		size_t strings_size)
+{
+	l->bloom_off = ALIGN8(sizeof(struct index_header));
+	l->bloom_bits = entries_size * INDEX_BLOOM_BITS_PER_ENTRY;
+	l->buckets_off = l->bloom_off + l->bloom_bits / 8;
+	l->nbuckets = entries_size;
+	l->entries_off = ALIGN8(l->buckets_off + l->nbuckets * sizeof(uint32_t));
+	l->strings_off = l->entries_off
+		+ entries_size * sizeof(struct index_entry);
+	l->total = l->strings_off + strings_size;
+}
+
+#define HEADER(idx) ((struct index_header*) (idx)->map)
+
+static void lock_index(copyfile_dedup_index_t* index)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&index->lock);
+#endif
+}
+
+static void unlock_index(copyfile_dedup_index_t* index)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&index->lock);
+#endif
+}
+
+static size_t bucket_of(uint64_t size, size_t nbuckets)
+{
+	return (size_t) ((size * 0x9E3779B97F4A7C15ULL) >> 32) % nbuckets;
+}
+
+/* the Bloom filter bit for @probe; the hash is uniformly distributed
+ * already, so its consecutive words serve as independent hashes. */
+static size_t bloom_bit(const unsigned char* hash, uint64_t size,
+		int probe, size_t bloom_bits)
+{
+	const unsigned char* p = &hash[probe * 4];
+	uint32_t h = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16
+		| (uint32_t) p[2] << 8 | (uint32_t) p[3];
+
+	return (h ^ (uint32_t) size ^ (uint32_t) (size >> 32)) % bloom_bits;
+}
+
+static void get_mtime(const struct stat* st, int64_t* sec, uint32_t* nsec)
+{
+#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC /* BSD */
+	*sec = st->st_mtimespec.tv_sec;
+	*nsec = st->st_mtimespec.tv_nsec;
+#else /*!HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+	*sec = st->st_mtim.tv_sec;
+	*nsec = st->st_mtim.tv_nsec;
+#endif /*HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+}
+
+/* link entry @i into its bucket and the Bloom filter */
+static void link_entry(copyfile_dedup_index_t* index,
+		const struct index_layout* l, uint32_t i)
+{
+	uint32_t* buckets = (uint32_t*) (index->map + l->buckets_off);
+	unsigned char* bloom = (unsigned char*) (index->map + l->bloom_off);
+	struct index_entry* e = (struct index_entry*)
+		(index->map + l->entries_off) + i;
+	size_t b = bucket_of(e->size, l->nbuckets);
+	int j;
+
+	e->next = buckets[b];
+	buckets[b] = i + 1;
+
+	for (j = 0; j < INDEX_BLOOM_PROBES; ++j)
+	{
+		size_t bit = bloom_bit(e->hash, e->size, j, l->bloom_bits);
+
+		bloom[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+static int map_index(copyfile_dedup_index_t* index, size_t size)
+{
+	void* map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			index->fd, 0);
+
+	if (map == MAP_FAILED)
+	{
+		index->map = 0;
+		return -1;
+	}
+
+	index->map = map;
+	index->map_size = size;
+	return 0;
+}
+
+/* make room for another entry with a path of @path_len bytes */
+static copyfile_error_t grow_index(copyfile_dedup_index_t* index,
+		size_t path_len)
+{
+	struct index_header old = *HEADER(index);
+	struct index_layout ol, nl;
+	size_t entries_size = old.entries_size;
+	size_t strings_size = old.strings_size;
+	struct index_entry* entries;
+	uint32_t i, j;
+
+	if (old.nentries == entries_size)
+		entries_size *= 2;
+	while (old.strings_used + path_len > strings_size)
+		strings_size *= 2;
+
+	get_layout(&ol, old.entries_size, old.strings_size);
+	get_layout(&nl, entries_size, strings_size);
+
+	if (ftruncate(index->fd, nl.total))
+		return COPYFILE_ERROR_INDEX;
+	munmap(index->map, index->map_size);
+	if (map_index(index, nl.total))
+		return COPYFILE_ERROR_INDEX;
+
+	/* everything moves towards the end, so start with the last part */
+	memmove(index->map + nl.strings_off, index->map + ol.strings_off,
+			old.strings_used);
+	memmove(index->map + nl.entries_off, index->map + ol.entries_off,
+			old.nentries * sizeof(struct index_entry));
+	memset(index->map + nl.bloom_off, 0, nl.entries_off - nl.bloom_off);
+
+	/* rebuild the buckets and the filter, dropping stale entries */
+	entries = (struct index_entry*) (index->map + nl.entries_off);
+	for (i = 0, j = 0; i < old.nentries; ++i)
+	{
+		if (entries[i].flags & INDEX_ENTRY_STALE)
+			continue;
+		if (i != j)
+			entries[j] = entries[i];
+		link_entry(index, &nl, j++);
+	}
+
+	HEADER(index)->entries_size = entries_size;
+	HEADER(index)->nentries = j;
+	HEADER(index)->strings_size = strings_size;
+	return COPYFILE_NO_ERROR;
+}
+
+/* check that the bucket chains and the paths of a loaded index stay
+ * within the mapping. the chains only lead to the earlier entries,
+ * so they can't loop either. */
+static int valid_entries(copyfile_dedup_index_t* index,
+		const struct index_layout* l)
+{
+	const struct index_header* h = HEADER(index);
+	const uint32_t* buckets = (const uint32_t*) (index->map + l->buckets_off);
+	const struct index_entry* entries = (const struct index_entry*)
+		(index->map + l->entries_off);
+	const char* strings = index->map + l->strings_off;
+	size_t i;
+
+	for (i = 0; i < l->nbuckets; ++i)
+	{
+		if (buckets[i] > h->nentries)
+			return 0;
+	}
+
+	for (i = 0; i < h->nentries; ++i)
+	{
+		const struct index_entry* e = &entries[i];
+
+		if (e->next > i
+				|| e->path_off >= h->strings_used
+				|| e->path_len >= h->strings_used - e->path_off
+				|| strings[e->path_off + e->path_len])
+			return 0;
+	}
+
+	return 1;
+}
+
+copyfile_error_t copyfile_dedup_index_open(copyfile_dedup_index_t** index,
+		const char* path)
+{
+	copyfile_dedup_index_t* idx = malloc(sizeof(*idx));
+	struct index_layout l;
+	struct stat st;
+	copyfile_error_t ret = COPYFILE_ERROR_INDEX;
+	int saved_errno;
+
+	*index = 0;
+	if (!idx)
+		return COPYFILE_ERROR_MALLOC;
+
+	idx->map = 0;
+	idx->fd = open(path, O_RDWR | O_CREAT, perm_file);
+	if (idx->fd == -1)
+		goto fail;
+
+#ifdef HAVE_FLOCK
+	/* the index can't be shared with other processes */
+	if (flock(idx->fd, LOCK_EX | LOCK_NB))
+		goto fail;
+#endif
+
+	if (fstat(idx->fd, &st))
+		goto fail;
+
+	if (st.st_size == 0)
+	{
+		struct index_header* h;
+
+		get_layout(&l, INDEX_INITIAL_ENTRIES, INDEX_INITIAL_STRINGS);
+		if (ftruncate(idx->fd, l.total) || map_index(idx, l.total))
+			goto fail;
+
+		h = HEADER(idx);
+		memcpy(h->magic, index_magic, sizeof(h->magic));
+		h->entries_size = INDEX_INITIAL_ENTRIES;
+		h->nentries = 0;
+		h->strings_used = 0;
+		h->strings_size = INDEX_INITIAL_STRINGS;
+	}
+	else
+	{
+		struct index_header* h;
+
+		if ((size_t) st.st_size < sizeof(*h)
+				|| map_index(idx, st.st_size))
+		{
+			errno = EINVAL;
+			goto fail;
+		}
+
+		h = HEADER(idx);
+		get_layout(&l, h->entries_size, h->strings_size);
+		if (memcmp(h->magic, index_magic, sizeof(h->magic))
+				|| !h->entries_size || !h->strings_size
+				|| h->nentries > h->entries_size
+				|| h->strings_used > h->strings_size
+				|| h->entries_size > (size_t) st.st_size
+					/ sizeof(struct index_entry)
+				|| h->strings_size > (size_t) st.st_size
+				|| l.total != (size_t) st.st_size
+				|| !valid_entries(idx, &l))
+		{
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&idx->lock, 0);
+#endif
+	*index = idx;
+	return COPYFILE_NO_ERROR;
+
+fail:
+	saved_errno = errno;
+	if (idx->map)
+		munmap(idx->map, idx->map_size);
+	if (idx->fd != -1)
+		close(idx->fd);
+	free(idx);
+	errno = saved_errno;
+	return ret;
+}
+
+void copyfile_dedup_index_close(copyfile_dedup_index_t* index)
+{
+	if (!index)
+		return;
+
+	if (index->map)
+		munmap(index->map, index->map_size);
+	close(index->fd);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&index->lock);
+#endif
+	free(index);
+}
+
+/* whether a file of @size is known */
+static int size_known(copyfile_dedup_index_t* index, uint64_t size)
+{
+	struct index_layout l;
+	const uint32_t* buckets;
+	const struct index_entry* entries;
+	uint32_t i;
+
+	get_layout(&l, HEADER(index)->entries_size,
+			HEADER(index)->strings_size);
+	buckets = (const uint32_t*) (index->map + l.buckets_off);
+	entries = (const struct index_entry*) (index->map + l.entries_off);
+
+	for (i = buckets[bucket_of(size, l.nbuckets)]; i; i = entries[i - 1].next)
+	{
+		if (entries[i - 1].size == size
+				&& !(entries[i - 1].flags & INDEX_ENTRY_STALE))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int bloom_test(copyfile_dedup_index_t* index,
+		const struct copyfile_dedup_key* key)
+{
+	struct index_layout l;
+	const unsigned char* bloom;
+	int j;
+
+	get_layout(&l, HEADER(index)->entries_size,
+			HEADER(index)->strings_size);
+	bloom = (const unsigned char*) (index->map + l.bloom_off);
+
+	for (j = 0; j < INDEX_BLOOM_PROBES; ++j)
+	{
+		size_t bit = bloom_bit(key->hash, key->size, j, l.bloom_bits);
+
+		if (!(bloom[bit / 8] & (1 << (bit % 8))))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* a candidate copied out of the index, to be checked without holding
+ * the lock */
+struct candidate
+{
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	char* path;
+};
+
+/* copy the entries matching @key out of the index, which is locked.
+ * returns the number of them, or -1 on allocation failure. */
+static int get_candidates(copyfile_dedup_index_t* index,
+		const struct copyfile_dedup_key* key, struct candidate** out)
+{
+	struct index_layout l;
+	const uint32_t* buckets;
+	const struct index_entry* entries;
+	struct candidate* c = 0;
+	int count = 0;
+	int pass;
+	uint32_t i;
+
+	get_layout(&l, HEADER(index)->entries_size,
+			HEADER(index)->strings_size);
+	buckets = (const uint32_t*) (index->map + l.buckets_off);
+	entries = (const struct index_entry*) (index->map + l.entries_off);
+
+	/* count them first, then copy them */
+	for (pass = 0; pass < 2; ++pass)
+	{
+		int n = 0;
+
+		for (i = buckets[bucket_of(key->size, l.nbuckets)]; i;
+				i = entries[i - 1].next)
+		{
+			const struct index_entry* e = &entries[i - 1];
+
+			if (e->size != (uint64_t) key->size
+					|| (e->flags & INDEX_ENTRY_STALE)
+					|| memcmp(e->hash, key->hash, sizeof(e->hash)))
+				continue;
+
+			if (pass)
+			{
+				c[n].mtime_sec = e->mtime_sec;
+				c[n].mtime_nsec = e->mtime_nsec;
+				c[n].path = malloc(e->path_len + 1);
+				if (!c[n].path)
+				{
+					while (n > 0)
+						free(c[--n].path);
+					free(c);
+					return -1;
+				}
+				memcpy(c[n].path, index->map + l.strings_off + e->path_off,
+						e->path_len + 1);
+			}
+			++n;
+		}
+
+		if (!pass)
+		{
+			count = n;
+			if (!count)
+				break;
+			c = malloc(count * sizeof(*c));
+			if (!c)
+				return -1;
+		}
+	}
+
+	*out = c;
+	return count;
+}
+
+/* mark the entry of @path matching @key as stale */
+static void mark_stale(copyfile_dedup_index_t* index,
+		const struct copyfile_dedup_key* key, const char* path)
+{
+	struct index_layout l;
+	const uint32_t* buckets;
+	struct index_entry* entries;
+	size_t path_len = strlen(path);
+	uint32_t i;
+
+	lock_index(index);
+	if (!index->map)
+	{
+		unlock_index(index);
+		return;
+	}
+
+	get_layout(&l, HEADER(index)->entries_size,
+			HEADER(index)->strings_size);
+	buckets = (const uint32_t*) (index->map + l.buckets_off);
+	entries = (struct index_entry*) (index->map + l.entries_off);
+
+	for (i = buckets[bucket_of(key->size, l.nbuckets)]; i;
+			i = entries[i - 1].next)
+	{
+		struct index_entry* e = &entries[i - 1];
+
+		if (e->size == (uint64_t) key->size && e->path_len == path_len
+				&& !memcmp(index->map + l.strings_off + e->path_off,
+					path, path_len)
+				&& !memcmp(e->hash, key->hash, sizeof(e->hash)))
+			e->flags |= INDEX_ENTRY_STALE;
+	}
+	unlock_index(index);
+}
+
+copyfile_error_t copyfile_dedup_find(copyfile_ctx_t* ctx,
+		copyfile_dedup_index_t* index, const char* path,
+		const struct stat* st, const struct stat* exclude,
+		struct copyfile_dedup_key* key, char** dup_copy)
+{
+	struct candidate* cands = 0;
+	int count;
+	int known;
+	int i;
+
+	*dup_copy = 0;
+	key->size = st->st_size;
+
+	lock_index(index);
+	known = index->map && size_known(index, key->size);
+	unlock_index(index);
+
+	/* most of the files have a unique size, and we don't need to
+	 * hash them at all */
+	if (!known)
+		return COPYFILE_NO_ERROR;
+
+	if (!key->hashed)
+	{
+		copyfile_error_t ret = copyfile_dedup_hash(ctx, path, key->hash);
+
+		if (ret)
+			return ret;
+		key->hashed = 1;
+	}
+
+	lock_index(index);
+	if (!index->map || !bloom_test(index, key))
+	{
+		unlock_index(index);
+		return COPYFILE_NO_ERROR;
+	}
+	count = get_candidates(index, key, &cands);
+	unlock_index(index);
+
+	if (count == -1)
+		return COPYFILE_ERROR_MALLOC;
+
+	/* the candidates are checked without blocking the other workers
+	 * on the filesystem */
+	for (i = 0; i < count; ++i)
+	{
+		struct stat cand_st;
+		int64_t sec;
+		uint32_t nsec;
+
+		if (*dup_copy)
+		{
+			free(cands[i].path);
+			continue;
+		}
+
+		/* make sure the file was not changed since it was indexed */
+#ifdef S_IFLNK
+		if (lstat(cands[i].path, &cand_st)
+#else
+		if (stat(cands[i].path, &cand_st)
+#endif
+				|| !S_ISREG(cand_st.st_mode)
+				|| cand_st.st_size != key->size)
+		{
+			mark_stale(index, key, cands[i].path);
+			free(cands[i].path);
+			continue;
+		}
+		get_mtime(&cand_st, &sec, &nsec);
+		if (sec != cands[i].mtime_sec || nsec != cands[i].mtime_nsec)
+		{
+			mark_stale(index, key, cands[i].path);
+			free(cands[i].path);
+			continue;
+		}
+
+		/* the file itself, or the one to be replaced */
+		if ((cand_st.st_dev == st->st_dev && cand_st.st_ino == st->st_ino)
+				|| (exclude && cand_st.st_dev == exclude->st_dev
+					&& cand_st.st_ino == exclude->st_ino))
+		{
+			free(cands[i].path);
+			continue;
+		}
+
+		*dup_copy = cands[i].path;
+	}
+
+	free(cands);
+	return COPYFILE_NO_ERROR;
+}
+
+copyfile_error_t copyfile_dedup_add(copyfile_ctx_t* ctx,
+		copyfile_dedup_index_t* index, const char* path,
+		const struct copyfile_dedup_key* key)
+{
+	struct copyfile_dedup_key buf;
+	struct index_layout l;
+	struct index_header* h;
+	struct index_entry* entries;
+	struct index_entry* e;
+	struct stat st;
+	size_t path_len = strlen(path);
+	int64_t sec;
+	uint32_t nsec;
+	uint32_t i;
+
+#ifdef S_IFLNK
+	if (lstat(path, &st))
+#else
+	if (stat(path, &st))
+#endif
+		return COPYFILE_ERROR_STAT;
+	if (!S_ISREG(st.st_mode))
+		return COPYFILE_ERROR_UNSUPPORTED;
+
+	if (!key || !key->hashed || key->size != st.st_size)
+	{
+		copyfile_error_t ret = copyfile_dedup_hash(ctx, path, buf.hash);
+
+		if (ret)
+			return ret;
+		buf.size = st.st_size;
+		buf.hashed = 1;
+		key = &buf;
+	}
+	get_mtime(&st, &sec, &nsec);
+
+	lock_index(index);
+	if (!index->map)
+	{
+		unlock_index(index);
+		errno = EBADF;
+		return COPYFILE_ERROR_INDEX;
+	}
+
+	get_layout(&l, HEADER(index)->entries_size,
+			HEADER(index)->strings_size);
+	entries = (struct index_entry*) (index->map + l.entries_off);
+
+	/* already known? just refresh it */
+	for (i = ((const uint32_t*) (index->map + l.buckets_off))
+				[bucket_of(key->size, l.nbuckets)];
+			i; i = entries[i - 1].next)
+	{
+		e = &entries[i - 1];
+		if (e->size == (uint64_t) key->size && e->path_len == path_len
+				&& !memcmp(index->map + l.strings_off + e->path_off,
+					path, path_len)
+				&& !memcmp(e->hash, key->hash, sizeof(e->hash)))
+		{
+			e->mtime_sec = sec;
+			e->mtime_nsec = nsec;
+			e->flags &= ~INDEX_ENTRY_STALE;
+			unlock_index(index);
+			return COPYFILE_NO_ERROR;
+		}
+	}
+
+	h = HEADER(index);
+	if (h->nentries == h->entries_size
+			|| h->strings_used + path_len + 1 > h->strings_size)
+	{
+		copyfile_error_t ret = grow_index(index, path_len + 1);
+
+		if (ret)
+		{
+			unlock_index(index);
+			return ret;
+		}
+
+		h = HEADER(index);
+		get_layout(&l, h->entries_size, h->strings_size);
+		entries = (struct index_entry*) (index->map + l.entries_off);
+	}
+
+	e = &entries[h->nentries];
+	e->size = key->size;
+	e->mtime_sec = sec;
+	e->mtime_nsec = nsec;
+	e->path_off = h->strings_used;
+	e->path_len = path_len;
+	e->flags = 0;
+	memcpy(e->hash, key->hash, sizeof(e->hash));
+	memcpy(index->map + l.strings_off + h->strings_used, path,
+			path_len + 1);
+
+	h->strings_used += path_len + 1;
+	link_entry(index, &l, h->nentries++);
+
+	unlock_index(index);
+	return COPYFILE_NO_ERROR;
+}
+
+#else /*!HAVE_MMAP*/
+
+copyfile_error_t copyfile_dedup_index_open(copyfile_dedup_index_t** index,
+		const char* path)
+{
+	(void) path;
+
+	*index = 0;
+	return COPYFILE_ERROR_UNSUPPORTED;
+}
+
+void copyfile_dedup_index_close(copyfile_dedup_index_t* index)
+{
+	(void) index;
+}
+
+copyfile_error_t copyfile_dedup_find(copyfile_ctx_t* ctx,
+		copyfile_dedup_index_t* index, const char* path,
+		const struct stat* st, const struct stat* exclude,
+		struct copyfile_dedup_key* key, char** dup_copy)
+{
+	(void) ctx;
+	(void) index;
+	(void) path;
+	(void) st;
+	(void) exclude;
+	(void) key;
+
+	*dup_copy = 0;
+	return COPYFILE_ERROR_UNSUPPORTED;
+}
+
+copyfile_error_t copyfile_dedup_add(copyfile_ctx_t* ctx,
+		copyfile_dedup_index_t* index, const char* path,
+		const struct copyfile_dedup_key* key)
+{
+	(void) ctx;
+	(void) index;
+	(void) path;
+	(void) key;
+
+	return COPYFILE_ERROR_UNSUPPORTED;
+}
+
+#endif /*HAVE_MMAP*/
+
+copyfile_error_t copyfile_dedup_index_lookup(copyfile_dedup_index_t* index,
+		const char* path, const struct stat* st, char** dup_copy)
+{
+	struct copyfile_dedup_key key;
+	struct stat buf;
+
+	*dup_copy = 0;
+
+	if (!st)
+	{
+#ifdef S_IFLNK
+		if (lstat(path, &buf))
+			return COPYFILE_ERROR_STAT;
+#else
+		if (stat(path, &buf))
+			return COPYFILE_ERROR_STAT;
+#endif
+
+		st = &buf;
+	}
+
+	if (!S_ISREG(st->st_mode))
+		return COPYFILE_NO_ERROR;
+
+	key.hashed = 0;
+	return copyfile_dedup_find(0, index, path, st, 0, &key, dup_copy);
+}
+
+copyfile_error_t copyfile_dedup_index_insert(copyfile_dedup_index_t* index,
+		const char* path)
+{
+	return copyfile_dedup_add(0, index, path, 0);
+}
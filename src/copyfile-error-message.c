@@ -93,6 +93,33 @@ const char* copyfile_error_message(copyfile_error_t err)
 		case COPYFILE_ERROR_UNLINK_DEST:
 			ret = "Unable to unlink destination file (before replacing)";
 			break;
+		case COPYFILE_ERROR_SYNC:
+			ret = "Unable to sync the destination to the disk";
+			break;
+		case COPYFILE_ERROR_READDIR:
+			ret = "Unable to read the source directory";
+			break;
+		case COPYFILE_ERROR_PUNCH_SOURCE:
+			ret = "Unable to release the space of the source file (while moving)";
+			break;
+		case COPYFILE_ERROR_INDEX:
+			ret = "Unable to open or update the deduplication index";
+			break;
+		case COPYFILE_ERROR_IOCTL_DEDUPE:
+			ret = "Unable to share the contents with the duplicate (FIDEDUPERANGE)";
+			break;
+		case COPYFILE_ERROR_IOCTL_FIEMAP:
+			ret = "Unable to get the extent map of the source file (FIEMAP)";
+			break;
+		case COPYFILE_ERROR_JOURNAL:
+			ret = "Unable to open or update the checkpoint journal";
+			break;
+		case COPYFILE_ERROR_MANIFEST:
+			ret = "Unable to open or write the manifest";
+			break;
+		case COPYFILE_ERROR_WATCH:
+			ret = "Unable to watch the source tree for changes";
+			break;
 
 		case COPYFILE_ERROR_INTERNAL:
 			ret = "Internal libcopyfile error (please report!)";
@@ -114,6 +141,7 @@ const char* copyfile_error_message(copyfile_error_t err)
 		 * missing cases. */
 		case COPYFILE_ERROR_DOMAIN_MAX:
 		case COPYFILE_EOF:
+		case COPYFILE_UP_TO_DATE:
 		case COPYFILE_ERROR_MAX:
 			break;
 	}
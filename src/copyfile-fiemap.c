@@ -0,0 +1,171 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_LINUX_FIEMAP_H
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#	include <linux/fiemap.h>
+#endif
+
+#if defined(HAVE_LINUX_FIEMAP_H) && defined(FS_IOC_FIEMAP)
+/* the number of extents requested at a time */
+#define FIEMAP_BATCH 64
+
+static unsigned int extent_flags(uint32_t fe_flags)
+{
+	unsigned int flags = 0;
+
+	if (fe_flags & FIEMAP_EXTENT_SHARED)
+		flags |= COPYFILE_EXTENT_SHARED;
+	if (fe_flags & FIEMAP_EXTENT_UNWRITTEN)
+		flags |= COPYFILE_EXTENT_UNWRITTEN;
+	/* the data is not (only) at fe_physical */
+	if (fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC
+				| FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED
+				| FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE
+				| FIEMAP_EXTENT_DATA_TAIL))
+		flags |= COPYFILE_EXTENT_UNKNOWN;
+
+	return flags;
+}
+#endif
+
+copyfile_error_t copyfile_get_extents_fd(int fd,
+		copyfile_extent_t** extents, size_t* count)
+{
+#if defined(HAVE_LINUX_FIEMAP_H) && defined(FS_IOC_FIEMAP)
+	union
+	{
+		struct fiemap map;
+		char buf[sizeof(struct fiemap)
+			+ FIEMAP_BATCH * sizeof(struct fiemap_extent)];
+	} req;
+	copyfile_extent_t* list = 0;
+	size_t used = 0;
+	size_t size = 0;
+	uint64_t start = 0;
+	int last = 0;
+
+	while (!last)
+	{
+		unsigned int i;
+
+		memset(&req.map, 0, sizeof(req.map));
+		req.map.fm_start = start;
+		req.map.fm_length = FIEMAP_MAX_OFFSET - start;
+		req.map.fm_flags = FIEMAP_FLAG_SYNC;
+		req.map.fm_extent_count = FIEMAP_BATCH;
+
+		if (ioctl(fd, FS_IOC_FIEMAP, &req.map))
+		{
+			int hold_errno = errno;
+
+			if (errno == EINTR)
+				continue;
+			free(list);
+			errno = hold_errno;
+			return COPYFILE_ERROR_IOCTL_FIEMAP;
+		}
+
+		if (!req.map.fm_mapped_extents)
+			break;
+
+		if (used + req.map.fm_mapped_extents > size)
+		{
+			size_t new_size = size ? size * 2 : FIEMAP_BATCH;
+			copyfile_extent_t* new_list;
+
+			new_list = realloc(list, new_size * sizeof(*list));
+			if (!new_list)
+			{
+				free(list);
+				return COPYFILE_ERROR_MALLOC;
+			}
+			list = new_list;
+			size = new_size;
+		}
+
+		for (i = 0; i < req.map.fm_mapped_extents; ++i)
+		{
+			const struct fiemap_extent* fe = &req.map.fm_extents[i];
+			copyfile_extent_t* e = &list[used++];
+
+			e->logical = fe->fe_logical;
+			e->physical = fe->fe_physical;
+			e->length = fe->fe_length;
+			e->flags = extent_flags(fe->fe_flags);
+
+			if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+				last = 1;
+			start = fe->fe_logical + fe->fe_length;
+		}
+	}
+
+	*extents = list;
+	*count = used;
+	return COPYFILE_NO_ERROR;
+#else
+	return COPYFILE_ERROR_UNSUPPORTED;
+#endif
+}
+
+int copyfile_first_extent(int fd, off_t* physical)
+{
+#if defined(HAVE_LINUX_FIEMAP_H) && defined(FS_IOC_FIEMAP)
+	union
+	{
+		struct fiemap map;
+		char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} req;
+
+	/* not synced; the layout of the data being written does not
+	 * matter much for ordering */
+	memset(&req.map, 0, sizeof(req.map));
+	req.map.fm_length = FIEMAP_MAX_OFFSET;
+	req.map.fm_extent_count = 1;
+
+	if (ioctl(fd, FS_IOC_FIEMAP, &req.map) || !req.map.fm_mapped_extents
+			|| (extent_flags(req.map.fm_extents[0].fe_flags)
+				& COPYFILE_EXTENT_UNKNOWN))
+		return -1;
+
+	*physical = req.map.fm_extents[0].fe_physical;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+copyfile_error_t copyfile_get_extents(const char* path,
+		copyfile_extent_t** extents, size_t* count)
+{
+	copyfile_error_t ret;
+	int fd, hold_errno;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return COPYFILE_ERROR_OPEN_SOURCE;
+
+	ret = copyfile_get_extents_fd(fd, extents, count);
+	hold_errno = errno;
+	close(fd);
+	errno = hold_errno;
+
+	return ret;
+}
@@ -0,0 +1,806 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_FLOCK
+#	include <sys/file.h>
+#endif
+
+/* The journal file is a header binding it to a single tree copy,
+ * followed by fixed-size records appended as the copy goes. A later
+ * record for the same inode replaces the earlier one. The records
+ * of the entries of a directory which is done are dead, and they are
+ * dropped by rewriting the journal now and then -- so that it holds
+ * little more than the path being walked. */
+
+static const char journal_magic[8] = "CFJRNL01";
+
+struct journal_header
+{
+	char magic[8];
+	/* the source root, and the hash of the destination path */
+	uint64_t root_dev;
+	uint64_t root_ino;
+	unsigned char dest_hash[COPYFILE_SHA256_SIZE];
+	char reserved[8];
+};
+
+enum journal_type
+{
+	/* a file copied */
+	JOURNAL_FILE = 1,
+	/* a directory whose contents are all copied */
+	JOURNAL_DIR,
+	/* a large file copied up to the offset */
+	JOURNAL_PARTIAL
+};
+
+struct journal_record
+{
+	uint64_t dev;
+	uint64_t ino;
+	/* the directory containing the entry (zero if not known) */
+	uint64_t parent_dev;
+	uint64_t parent_ino;
+	int64_t size;
+	int64_t mtime;
+	uint32_t mtime_nsec;
+	uint16_t type;
+	/* to notice a torn write at the end */
+	uint16_t check;
+	int64_t offset;
+};
+
+struct copyfile_journal
+{
+	int fd;
+	char* path;
+
+	struct journal_header header;
+	/* whether a tree copy is using the journal */
+	int active;
+
+	/* the current record of each inode, hashed by the inode */
+	struct journal_record* records;
+	size_t count;
+	size_t size;
+	/* the record index + 1 of each slot, 0 if free */
+	size_t* slots;
+	size_t nslots;
+
+	/* the records not written yet */
+	struct journal_record* pending;
+	size_t npending;
+	size_t pending_size;
+
+	/* the records in the file, and at the last rewrite */
+	size_t written;
+	size_t compacted;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+};
+
+static uint16_t record_check(const struct journal_record* r)
+{
+	struct journal_record tmp = *r;
+	const unsigned char* p = (const unsigned char*) &tmp;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	tmp.check = 0;
+	for (i = 0; i < sizeof(tmp); ++i)
+		h = (h ^ p[i]) * 16777619U;
+
+	return (uint16_t) (h ^ (h >> 16));
+}
+
+static void get_mtime(const struct stat* st, int64_t* sec, uint32_t* nsec)
+{
+#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC /* BSD */
+	*sec = st->st_mtimespec.tv_sec;
+	*nsec = st->st_mtimespec.tv_nsec;
+#else /*!HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+	*sec = st->st_mtim.tv_sec;
+	*nsec = st->st_mtim.tv_nsec;
+#endif /*HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+}
+
+static size_t slot_of(const copyfile_journal_t* j, uint64_t dev,
+		uint64_t ino)
+{
+	uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+
+	return (size_t) (h >> 32) & (j->nslots - 1);
+}
+
+/* the index of the record of (@dev, @ino), or (size_t) -1 */
+static size_t find(const copyfile_journal_t* j, uint64_t dev, uint64_t ino)
+{
+	size_t s;
+
+	if (!j->nslots)
+		return (size_t) -1;
+
+	for (s = slot_of(j, dev, ino); j->slots[s];
+			s = (s + 1) & (j->nslots - 1))
+	{
+		const struct journal_record* r = &j->records[j->slots[s] - 1];
+
+		if (r->dev == dev && r->ino == ino)
+			return j->slots[s] - 1;
+	}
+
+	return (size_t) -1;
+}
+
+static int rehash(copyfile_journal_t* j, size_t nslots)
+{
+	size_t* slots = calloc(nslots, sizeof(*slots));
+	size_t i;
+
+	if (!slots)
+		return -1;
+
+	free(j->slots);
+	j->slots = slots;
+	j->nslots = nslots;
+
+	for (i = 0; i < j->count; ++i)
+	{
+		size_t s = slot_of(j, j->records[i].dev, j->records[i].ino);
+
+		while (slots[s])
+			s = (s + 1) & (nslots - 1);
+		slots[s] = i + 1;
+	}
+
+	return 0;
+}
+
+/* store @r as the current record of its inode */
+static int insert(copyfile_journal_t* j, const struct journal_record* r)
+{
+	size_t i = find(j, r->dev, r->ino);
+
+	if (i != (size_t) -1)
+	{
+		j->records[i] = *r;
+		return 0;
+	}
+
+	if (j->count == j->size)
+	{
+		size_t new_size = j->size ? j->size * 2 : 1024;
+		struct journal_record* n = realloc(j->records,
+				new_size * sizeof(*n));
+
+		if (!n)
+			return -1;
+		j->records = n;
+		j->size = new_size;
+	}
+
+	j->records[j->count++] = *r;
+	/* keep the table at most half full */
+	if (j->count * 2 > j->nslots)
+		return rehash(j, j->nslots ? j->nslots * 2 : 2048);
+	else
+	{
+		size_t s = slot_of(j, r->dev, r->ino);
+
+		while (j->slots[s])
+			s = (s + 1) & (j->nslots - 1);
+		j->slots[s] = j->count;
+	}
+
+	return 0;
+}
+
+/* drop the records of the entries of the directories done */
+static int drop_dead(copyfile_journal_t* j)
+{
+	unsigned char* dead;
+	size_t i, live = 0;
+
+	if (!j->count)
+		return 0;
+	dead = malloc(j->count);
+	if (!dead)
+		return -1;
+
+	/* all the parents are looked up before moving anything */
+	for (i = 0; i < j->count; ++i)
+	{
+		const struct journal_record* r = &j->records[i];
+		size_t p = find(j, r->parent_dev, r->parent_ino);
+
+		dead[i] = p != (size_t) -1 && j->records[p].type == JOURNAL_DIR;
+	}
+
+	for (i = 0; i < j->count; ++i)
+	{
+		if (!dead[i])
+			j->records[live++] = j->records[i];
+	}
+	free(dead);
+
+	if (live == j->count)
+		return 0;
+
+	j->count = live;
+	return rehash(j, j->nslots);
+}
+
+static int write_all(int fd, const void* buf, size_t len)
+{
+	const char* p = buf;
+
+	while (len > 0)
+	{
+		ssize_t wr = write(fd, p, len);
+
+		if (wr == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		p += wr;
+		len -= wr;
+	}
+
+	return 0;
+}
+
+static int sync_data(int fd)
+{
+#ifdef HAVE_FDATASYNC
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+/* rewrite the journal with the live records only, replacing it
+ * atomically */
+static int compact(copyfile_journal_t* j)
+{
+	size_t len = strlen(j->path);
+	char* tmp_path = malloc(len + 5);
+	int fd = -1;
+	int saved_errno;
+
+	if (!tmp_path)
+		return -1;
+	memcpy(tmp_path, j->path, len);
+	memcpy(&tmp_path[len], ".new", 5);
+
+	if (drop_dead(j))
+		goto fail;
+
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, perm_file);
+	if (fd == -1)
+		goto fail;
+#ifdef HAVE_FLOCK
+	if (flock(fd, LOCK_EX | LOCK_NB))
+		goto fail;
+#endif
+	if (write_all(fd, &j->header, sizeof(j->header))
+			|| write_all(fd, j->records, j->count * sizeof(*j->records))
+			|| sync_data(fd) || rename(tmp_path, j->path))
+		goto fail;
+
+	close(j->fd);
+	j->fd = fd;
+	j->written = j->count;
+	j->compacted = j->count;
+	/* all the records are in the file now */
+	j->npending = 0;
+	free(tmp_path);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (fd != -1)
+	{
+		unlink(tmp_path);
+		close(fd);
+	}
+	free(tmp_path);
+	errno = saved_errno;
+	return -1;
+}
+
+/* read the records of the journal of @size bytes */
+static int load(copyfile_journal_t* j, off_t size)
+{
+	struct journal_record buf[256];
+	off_t offset = sizeof(j->header);
+	int torn = 0;
+
+	if (size < (off_t) sizeof(j->header)
+			|| pread(j->fd, &j->header, sizeof(j->header), 0)
+				!= sizeof(j->header)
+			|| memcmp(j->header.magic, journal_magic, sizeof(journal_magic)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (!torn && offset < size)
+	{
+		ssize_t rd = pread(j->fd, buf, sizeof(buf), offset);
+		size_t i, n;
+
+		if (rd == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!rd)
+			break;
+
+		n = rd / sizeof(*buf);
+		if (!n)
+			torn = 1;
+		for (i = 0; i < n; ++i)
+		{
+			if (buf[i].check != record_check(&buf[i])
+					|| !buf[i].type || buf[i].type > JOURNAL_PARTIAL)
+			{
+				torn = 1;
+				break;
+			}
+			if (insert(j, &buf[i]))
+				return -1;
+			++j->written;
+		}
+
+		offset += i * sizeof(*buf);
+	}
+
+	/* drop the partial record at the end, if any, and the dead ones */
+	if (drop_dead(j))
+		return -1;
+	j->compacted = j->count;
+	if (torn || offset != size || j->written != j->count)
+		return compact(j);
+	return 0;
+}
+
+copyfile_error_t copyfile_journal_open(copyfile_journal_t** journal,
+		const char* path)
+{
+	copyfile_journal_t* j = calloc(1, sizeof(*j));
+	struct stat st;
+	int saved_errno;
+
+	*journal = 0;
+	if (!j)
+		return COPYFILE_ERROR_MALLOC;
+
+	j->path = strdup(path);
+	if (!j->path)
+	{
+		free(j);
+		return COPYFILE_ERROR_MALLOC;
+	}
+
+	j->fd = open(path, O_RDWR | O_CREAT | O_APPEND, perm_file);
+	if (j->fd == -1)
+		goto fail;
+
+#ifdef HAVE_FLOCK
+	/* the journal can't be shared with other processes */
+	if (flock(j->fd, LOCK_EX | LOCK_NB))
+		goto fail;
+#endif
+
+	if (fstat(j->fd, &st))
+		goto fail;
+	if (st.st_size > 0 && load(j, st.st_size))
+		goto fail;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&j->lock, 0);
+#endif
+	*journal = j;
+	return COPYFILE_NO_ERROR;
+
+fail:
+	saved_errno = errno;
+	if (j->fd != -1)
+		close(j->fd);
+	free(j->records);
+	free(j->slots);
+	free(j->path);
+	free(j);
+	errno = saved_errno;
+	return COPYFILE_ERROR_JOURNAL;
+}
+
+void copyfile_journal_close(copyfile_journal_t* journal)
+{
+	if (!journal)
+		return;
+
+	close(journal->fd);
+	free(journal->records);
+	free(journal->slots);
+	free(journal->pending);
+	free(journal->path);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&journal->lock);
+#endif
+	free(journal);
+}
+
+copyfile_error_t copyfile_journal_begin(copyfile_journal_t* j,
+		const struct stat* st, const char* dest)
+{
+	struct journal_header h;
+	struct copyfile_sha256 s;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, journal_magic, sizeof(h.magic));
+	h.root_dev = st->st_dev;
+	h.root_ino = st->st_ino;
+	copyfile_sha256_init(&s);
+	copyfile_sha256_update(&s, dest, strlen(dest));
+	copyfile_sha256_final(&s, h.dest_hash);
+
+	/* the records of another copy are of no use */
+	if (memcmp(&h, &j->header, sizeof(h)))
+	{
+		j->header = h;
+		j->count = 0;
+		j->npending = 0;
+		j->written = 0;
+		j->compacted = 0;
+		if (j->nslots)
+			memset(j->slots, 0, j->nslots * sizeof(*j->slots));
+
+		if (ftruncate(j->fd, 0) || write_all(j->fd, &h, sizeof(h))
+				|| sync_data(j->fd))
+		{
+			/* don't append to a journal in an unknown state */
+			memset(&j->header, 0, sizeof(j->header));
+			return COPYFILE_ERROR_JOURNAL;
+		}
+	}
+
+	j->active = 1;
+	return COPYFILE_NO_ERROR;
+}
+
+void copyfile_journal_end(copyfile_journal_t* j)
+{
+	j->active = 0;
+}
+
+/* the record of @st, if it's still the same file */
+static const struct journal_record* find_same(const copyfile_journal_t* j,
+		const struct stat* st)
+{
+	size_t i = find(j, st->st_dev, st->st_ino);
+	const struct journal_record* r;
+	int64_t sec;
+	uint32_t nsec;
+
+	if (i == (size_t) -1)
+		return 0;
+
+	r = &j->records[i];
+	get_mtime(st, &sec, &nsec);
+	if (r->mtime != sec || r->mtime_nsec != nsec
+			|| (!S_ISDIR(st->st_mode) && r->size != st->st_size))
+		return 0;
+	return r;
+}
+
+int copyfile_journal_done(copyfile_journal_t* j, const struct stat* st)
+{
+	const struct journal_record* r;
+	int ret;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&j->lock);
+#endif
+	r = find_same(j, st);
+	ret = r && r->type == (S_ISDIR(st->st_mode) ? JOURNAL_DIR
+			: JOURNAL_FILE);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&j->lock);
+#endif
+
+	return ret;
+}
+
+/* record @st (of @type) as done up to @offset, to be written
+ * on the next sync */
+static int add_record(copyfile_journal_t* j, const struct stat* st,
+		enum journal_type type, dev_t parent_dev, ino_t parent_ino,
+		off_t offset)
+{
+	struct journal_record r;
+
+	memset(&r, 0, sizeof(r));
+	r.dev = st->st_dev;
+	r.ino = st->st_ino;
+	r.parent_dev = parent_dev;
+	r.parent_ino = parent_ino;
+	r.size = st->st_size;
+	get_mtime(st, &r.mtime, &r.mtime_nsec);
+	r.type = type;
+	r.offset = offset;
+	r.check = record_check(&r);
+
+	if (j->npending == j->pending_size)
+	{
+		size_t new_size = j->pending_size ? j->pending_size * 2 : 256;
+		struct journal_record* n = realloc(j->pending,
+				new_size * sizeof(*n));
+
+		if (!n)
+			return -1;
+		j->pending = n;
+		j->pending_size = new_size;
+	}
+
+	if (insert(j, &r))
+		return -1;
+	j->pending[j->npending++] = r;
+	return 0;
+}
+
+copyfile_error_t copyfile_journal_add(copyfile_journal_t* j,
+		const struct stat* st, dev_t parent_dev, ino_t parent_ino)
+{
+	int ret;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&j->lock);
+#endif
+	ret = add_record(j, st, S_ISDIR(st->st_mode) ? JOURNAL_DIR
+			: JOURNAL_FILE, parent_dev, parent_ino, 0);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&j->lock);
+#endif
+
+	return ret ? COPYFILE_ERROR_MALLOC : COPYFILE_NO_ERROR;
+}
+
+static int sync_locked(copyfile_journal_t* j)
+{
+	if (!j->npending)
+		return 0;
+	if (write_all(j->fd, j->pending, j->npending * sizeof(*j->pending))
+			|| sync_data(j->fd))
+		return -1;
+
+	j->written += j->npending;
+	j->npending = 0;
+
+	/* rewrite it once most of the records are dead */
+	if (j->written >= 2 * j->compacted + COPYFILE_JOURNAL_COMPACT)
+		return compact(j);
+	return 0;
+}
+
+copyfile_error_t copyfile_journal_sync(copyfile_journal_t* j)
+{
+	int ret;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&j->lock);
+#endif
+	ret = sync_locked(j);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&j->lock);
+#endif
+
+	return ret ? COPYFILE_ERROR_JOURNAL : COPYFILE_NO_ERROR;
+}
+
+/* the offset up to which the copy of @st is durable, or 0 */
+static off_t partial_offset(copyfile_journal_t* j, const struct stat* st)
+{
+	const struct journal_record* r;
+	off_t ret = 0;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&j->lock);
+#endif
+	r = find_same(j, st);
+	if (r && r->type == JOURNAL_PARTIAL)
+		ret = r->offset;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&j->lock);
+#endif
+
+	return ret;
+}
+
+static copyfile_error_t set_partial(copyfile_journal_t* j,
+		const struct stat* st, off_t offset)
+{
+	int ret;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&j->lock);
+#endif
+	ret = add_record(j, st, JOURNAL_PARTIAL, 0, 0, offset)
+		|| sync_locked(j);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&j->lock);
+#endif
+
+	return ret ? COPYFILE_ERROR_JOURNAL : COPYFILE_NO_ERROR;
+}
+
+/* copy the rest of the file from @offset, COPYFILE_JOURNAL_STEP
+ * at a time, making each step durable before recording it */
+static copyfile_error_t copy_steps(struct copyfile_range_copy* c,
+		copyfile_journal_t* j, const struct stat* st, off_t offset)
+{
+	copyfile_error_t ret;
+
+	if (!offset)
+	{
+		if (!copyfile_clone_stream(c->fd_in, c->fd_out))
+		{
+			++c->ctx->stats.clones;
+			c->progress.data.offset = st->st_size;
+			return copyfile_sync_fd(c->ctx, c->fd_out, 0);
+		}
+		copyfile_preallocate(c->fd_out, 0, st->st_size);
+	}
+
+	while (offset < st->st_size)
+	{
+		off_t len = st->st_size - offset;
+
+		if (len > COPYFILE_JOURNAL_STEP)
+			len = COPYFILE_JOURNAL_STEP;
+
+		ret = copyfile_copy_range(c, offset, len);
+		if (ret)
+			return ret;
+		offset += len;
+
+		if (offset < st->st_size)
+		{
+			if (sync_data(c->fd_out))
+				return COPYFILE_ERROR_SYNC;
+			ret = set_partial(j, st, offset);
+			if (ret)
+				return ret;
+		}
+	}
+
+	c->progress.data.offset = st->st_size;
+	if (ftruncate(c->fd_out, st->st_size))
+		return COPYFILE_ERROR_TRUNCATE;
+	return copyfile_sync_fd(c->ctx, c->fd_out, 0);
+}
+
+int copyfile_journal_archive(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_error_t* ret,
+		copyfile_callback_t callback, void* callback_data)
+{
+	copyfile_journal_t* j;
+	struct copyfile_range_copy c;
+	struct stat dst;
+	off_t offset;
+	int hold_errno;
+
+	if (!ctx || !ctx->journal || !ctx->journal->active
+			|| (ctx->options & COPYFILE_ATOMIC_PUBLISH)
+			|| !S_ISREG(st->st_mode)
+			|| st->st_size < COPYFILE_JOURNAL_LARGE_FILE)
+		return 0;
+	j = ctx->journal;
+
+	c.fd_in = open(source, O_RDONLY);
+	if (c.fd_in == -1)
+		return 0;
+
+#ifdef SEEK_HOLE
+	/* the sparse files are copied along their extents instead */
+	if (lseek(c.fd_in, 0, SEEK_HOLE) < st->st_size)
+	{
+		close(c.fd_in);
+		return 0;
+	}
+#endif
+
+	/* continue where the last copy stopped if the destination still
+	 * has that much */
+	offset = partial_offset(j, st);
+	c.fd_out = -1;
+	if (offset)
+	{
+		c.fd_out = open(dest, O_WRONLY);
+		if (c.fd_out != -1 && (fstat(c.fd_out, &dst)
+					|| !S_ISREG(dst.st_mode) || dst.st_size < offset))
+		{
+			close(c.fd_out);
+			c.fd_out = -1;
+		}
+	}
+	if (c.fd_out == -1)
+	{
+		offset = 0;
+		c.fd_out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, perm_file);
+		if (c.fd_out == -1)
+		{
+			hold_errno = errno;
+			close(c.fd_in);
+			errno = hold_errno;
+			if (result_flags)
+				*result_flags = 0;
+			*ret = COPYFILE_ERROR_OPEN_DEST;
+			return 1;
+		}
+	}
+
+	c.ctx = ctx;
+	c.progress.data.offset = offset;
+	c.progress.data.size = st->st_size;
+	c.opcount = 0;
+	c.callback = callback;
+	c.callback_data = callback_data;
+
+	*ret = copy_steps(&c, j, st, offset);
+	hold_errno = errno;
+	if (close(c.fd_out) && !*ret)
+	{
+		*ret = COPYFILE_ERROR_WRITE;
+		hold_errno = errno;
+	}
+	close(c.fd_in);
+
+	if (!*ret)
+	{
+		++ctx->stats.files;
+		if (callback && callback(COPYFILE_EOF, COPYFILE_REGULAR,
+					c.progress, callback_data, 0))
+			*ret = COPYFILE_ABORTED;
+		else
+		{
+			*ret = copyfile_sync_dir(ctx, dest);
+			if (!*ret)
+				*ret = copyfile_copy_metadata_ctx(ctx, source, dest, st,
+						flags, result_flags);
+			return 1;
+		}
+	}
+
+	if (result_flags)
+		*result_flags = 0;
+	errno = hold_errno;
+	return 1;
+}
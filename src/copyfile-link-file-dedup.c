@@ -9,12 +9,13 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #include <unistd.h>
 #include <errno.h>
 
-copyfile_error_t copyfile_link_file_dedup(const char* source,
-		const char* dest, const char* dup_copy,
+copyfile_error_t copyfile_link_file_dedup_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const char* dup_copy,
 		const struct stat* st, unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data)
 {
@@ -35,8 +36,12 @@ copyfile_error_t copyfile_link_file_dedup(const char* source,
 	}
 
 	/* Try to clone the duplicate-candidate first. */
-	if (!copyfile_clone_file(dup_copy, dest, st))
-		return copyfile_copy_metadata(source, dest, st,
+	if (ctx && (ctx->options & COPYFILE_PARTIAL_CLONE)
+			&& S_ISREG(st->st_mode)
+			? !copyfile_clone_partial(ctx, source, dup_copy, dest, st,
+				callback, callback_data)
+			: !copyfile_clone_file(dup_copy, dest, st))
+		return copyfile_copy_metadata_ctx(ctx, source, dest, st,
 				COPYFILE_COPY_ALL_METADATA, result_flags);
 
 #ifdef HAVE_LINK
@@ -63,7 +68,7 @@ copyfile_error_t copyfile_link_file_dedup(const char* source,
 							progress, callback_data, 0))
 					return COPYFILE_ABORTED;
 
-				return COPYFILE_NO_ERROR;
+				return copyfile_sync_dir(ctx, dest);
 			}
 			else if (callback)
 			{
@@ -85,7 +90,16 @@ copyfile_error_t copyfile_link_file_dedup(const char* source,
 	}
 #endif
 
-	return copyfile_archive_file(source, dest, st,
+	return copyfile_archive_file_ctx(ctx, source, dest, st,
 			COPYFILE_COPY_ALL_METADATA, result_flags,
 			callback, callback_data);
 }
+
+copyfile_error_t copyfile_link_file_dedup(const char* source,
+		const char* dest, const char* dup_copy,
+		const struct stat* st, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_link_file_dedup_ctx(0, source, dest, dup_copy, st,
+			result_flags, callback, callback_data);
+}
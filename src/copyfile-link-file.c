@@ -9,12 +9,14 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #include <unistd.h>
 #include <errno.h>
 
-copyfile_error_t copyfile_link_file(const char* source,
-		const char* dest, unsigned int* result_flags,
+copyfile_error_t copyfile_link_file_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest,
+		unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data)
 {
 #ifdef HAVE_LINK
@@ -41,7 +43,7 @@ copyfile_error_t copyfile_link_file(const char* source,
 							progress, callback_data, 0))
 					return COPYFILE_ABORTED;
 
-				return COPYFILE_NO_ERROR;
+				return copyfile_sync_dir(ctx, dest);
 			}
 			else if (callback)
 			{
@@ -63,7 +65,14 @@ copyfile_error_t copyfile_link_file(const char* source,
 	}
 #endif
 
-	return copyfile_archive_file(source, dest, 0,
-			COPYFILE_COPY_ALL_METADATA, result_flags,
+	return copyfile_archive_file_linking(ctx, source, dest, result_flags,
+			callback, callback_data);
+}
+
+copyfile_error_t copyfile_link_file(const char* source,
+		const char* dest, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_link_file_ctx(0, source, dest, result_flags,
 			callback, callback_data);
 }
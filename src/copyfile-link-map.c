@@ -0,0 +1,206 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum link_state
+{
+	/* the first link is being copied */
+	LINK_PENDING,
+	/* the copy is published in dest */
+	LINK_DONE,
+	/* copying failed; the next link is to be copied instead */
+	LINK_FAILED
+};
+
+struct copyfile_link_entry
+{
+	dev_t dev;
+	ino_t ino;
+	/* the number of links not seen yet */
+	nlink_t remaining;
+	enum link_state state;
+	char* dest;
+
+	struct copyfile_link_entry* next;
+};
+
+static size_t bucket_of(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t) dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) ino;
+
+	h *= 0xff51afd7ed558ccdULL;
+	return (h ^ (h >> 32)) % COPYFILE_LINK_MAP_BUCKETS;
+}
+
+static struct copyfile_link_entry** find_entry(struct copyfile_link_map* map,
+		const struct stat* st)
+{
+	struct copyfile_link_entry** e
+		= &map->buckets[bucket_of(st->st_dev, st->st_ino)];
+
+	for (; *e; e = &(*e)->next)
+	{
+		if ((*e)->dev == st->st_dev && (*e)->ino == st->st_ino)
+			break;
+	}
+
+	return e;
+}
+
+/* unlink *@e from its bucket and free it */
+static void drop_entry(struct copyfile_link_map* map,
+		struct copyfile_link_entry** e)
+{
+	struct copyfile_link_entry* victim = *e;
+
+	*e = victim->next;
+	free(victim->dest);
+	free(victim);
+	--map->count;
+}
+
+copyfile_error_t copyfile_link_map_init(struct copyfile_link_map* map)
+{
+	map->buckets = calloc(COPYFILE_LINK_MAP_BUCKETS,
+			sizeof(*map->buckets));
+	if (!map->buckets)
+		return COPYFILE_ERROR_MALLOC;
+	map->count = 0;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&map->lock, 0);
+	pthread_cond_init(&map->published, 0);
+#endif
+
+	return COPYFILE_NO_ERROR;
+}
+
+void copyfile_link_map_free(struct copyfile_link_map* map)
+{
+	size_t i;
+
+	for (i = 0; i < COPYFILE_LINK_MAP_BUCKETS; ++i)
+	{
+		while (map->buckets[i])
+			drop_entry(map, &map->buckets[i]);
+	}
+	free(map->buckets);
+
+#ifdef HAVE_PTHREAD
+	pthread_cond_destroy(&map->published);
+	pthread_mutex_destroy(&map->lock);
+#endif
+}
+
+enum copyfile_link_claim copyfile_link_map_claim(
+		struct copyfile_link_map* map, const struct stat* st,
+		char** target)
+{
+	struct copyfile_link_entry** e;
+	enum copyfile_link_claim ret;
+
+	*target = 0;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&map->lock);
+#endif
+
+	e = find_entry(map, st);
+	if (!*e)
+	{
+		ret = COPYFILE_LINK_UNTRACKED;
+
+		/* when full, further inodes are just copied */
+		if (map->count < COPYFILE_LINK_MAP_MAX)
+		{
+			struct copyfile_link_entry* n = malloc(sizeof(*n));
+
+			if (n)
+			{
+				n->dev = st->st_dev;
+				n->ino = st->st_ino;
+				n->remaining = st->st_nlink - 1;
+				n->state = LINK_PENDING;
+				n->dest = 0;
+				n->next = 0;
+				*e = n;
+				++map->count;
+				ret = COPYFILE_LINK_FIRST;
+			}
+		}
+	}
+	else
+	{
+#ifdef HAVE_PTHREAD
+		/* the entry can not disappear while we wait -- it is not
+		 * dropped before all the links are seen */
+		while ((*e)->state == LINK_PENDING)
+		{
+			pthread_cond_wait(&map->published, &map->lock);
+			e = find_entry(map, st);
+		}
+#endif
+
+		if ((*e)->remaining > 0)
+			--(*e)->remaining;
+
+		if ((*e)->state == LINK_DONE)
+		{
+			*target = strdup((*e)->dest);
+			ret = *target ? COPYFILE_LINK_FOUND : COPYFILE_LINK_UNTRACKED;
+			if (!(*e)->remaining)
+				drop_entry(map, e);
+		}
+		else
+		{
+			(*e)->state = LINK_PENDING;
+			ret = COPYFILE_LINK_FIRST;
+		}
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&map->lock);
+#endif
+
+	return ret;
+}
+
+void copyfile_link_map_publish(struct copyfile_link_map* map,
+		const struct stat* st, const char* dest)
+{
+	struct copyfile_link_entry** e;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&map->lock);
+#endif
+
+	e = find_entry(map, st);
+	if (*e)
+	{
+		if (!(*e)->remaining)
+			drop_entry(map, e);
+		else
+		{
+			(*e)->dest = dest ? strdup(dest) : 0;
+			(*e)->state = (*e)->dest ? LINK_DONE : LINK_FAILED;
+		}
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_cond_broadcast(&map->published);
+	pthread_mutex_unlock(&map->lock);
+#endif
+}
@@ -0,0 +1,573 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_MMAP
+#	include <sys/mman.h>
+#endif
+
+/* The manifest file consists of the header (with the fan-out table
+ * of the first hash byte), the sorted path hashes and the records,
+ * in the same order. A lookup reads a single fan-out slot, binary
+ * searches the (dense) hashes and reads a single record. */
+
+static const char manifest_magic[8] = "CFMANIF1";
+
+struct manifest_header
+{
+	char magic[8];
+	uint64_t count;
+	/* the number of hashes with the first byte up to i */
+	uint32_t fanout[256];
+};
+
+struct manifest_record
+{
+	uint64_t size;
+	uint64_t ino;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint32_t flags;
+	uint32_t reserved;
+	unsigned char hash[COPYFILE_SHA256_SIZE];
+};
+
+/* the record has the content hash */
+#define MANIFEST_HASHED 0x1
+
+struct copyfile_manifest
+{
+	unsigned char* map;
+	size_t map_size;
+
+	uint64_t count;
+	const uint32_t* fanout;
+	const uint64_t* hashes;
+	const struct manifest_record* records;
+};
+
+struct writer_entry
+{
+	uint64_t hash;
+	/* the later of the entries for the same path wins */
+	size_t seq;
+	struct manifest_record r;
+};
+
+struct copyfile_manifest_writer
+{
+	struct copyfile_tmpfile tmp;
+	int open;
+	char* path;
+	unsigned int flags;
+
+	struct writer_entry* entries;
+	size_t count;
+	size_t size;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+};
+
+/* FNV-1a of "source\0dest" */
+static uint64_t path_hash(const char* source, const char* dest)
+{
+	uint64_t h = 14695981039346656037ULL;
+	const unsigned char* p;
+
+	for (p = (const unsigned char*) source; *p; ++p)
+		h = (h ^ *p) * 1099511628211ULL;
+	h *= 1099511628211ULL;
+	for (p = (const unsigned char*) dest; *p; ++p)
+		h = (h ^ *p) * 1099511628211ULL;
+
+	return h;
+}
+
+static void get_times(const struct stat* st, struct manifest_record* r)
+{
+#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC /* BSD */
+	r->mtime = st->st_mtimespec.tv_sec;
+	r->mtime_nsec = st->st_mtimespec.tv_nsec;
+	r->ctime = st->st_ctimespec.tv_sec;
+	r->ctime_nsec = st->st_ctimespec.tv_nsec;
+#else /*!HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+	r->mtime = st->st_mtim.tv_sec;
+	r->mtime_nsec = st->st_mtim.tv_nsec;
+	r->ctime = st->st_ctim.tv_sec;
+	r->ctime_nsec = st->st_ctim.tv_nsec;
+#endif /*HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+}
+
+/* whether @st is the file of @r, unchanged */
+static int same_file(const struct manifest_record* r, const struct stat* st)
+{
+	struct manifest_record cur;
+
+	get_times(st, &cur);
+	return r->size == (uint64_t) st->st_size && r->ino == st->st_ino
+		&& r->mtime == cur.mtime && r->mtime_nsec == cur.mtime_nsec
+		&& r->ctime == cur.ctime && r->ctime_nsec == cur.ctime_nsec;
+}
+
+#ifdef HAVE_MMAP
+
+copyfile_error_t copyfile_manifest_open(copyfile_manifest_t** manifest,
+		const char* path)
+{
+	copyfile_manifest_t* m = malloc(sizeof(*m));
+	const struct manifest_header* h;
+	struct stat st;
+	int fd, saved_errno, i;
+
+	*manifest = 0;
+	if (!m)
+		return COPYFILE_ERROR_MALLOC;
+	m->map = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st))
+		goto fail;
+
+	if ((size_t) st.st_size < sizeof(*h))
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	m->map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (m->map == MAP_FAILED)
+	{
+		m->map = 0;
+		goto fail;
+	}
+	m->map_size = st.st_size;
+	close(fd);
+	fd = -1;
+
+	h = (const struct manifest_header*) m->map;
+	m->count = h->count;
+	m->fanout = h->fanout;
+	m->hashes = (const uint64_t*) (m->map + sizeof(*h));
+	m->records = (const struct manifest_record*) (m->hashes + m->count);
+
+	if (memcmp(h->magic, manifest_magic, sizeof(h->magic))
+			|| m->count > (m->map_size - sizeof(*h))
+				/ (sizeof(*m->hashes) + sizeof(*m->records))
+			|| sizeof(*h) + m->count * (sizeof(*m->hashes)
+				+ sizeof(*m->records)) != m->map_size
+			|| h->fanout[255] != m->count)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	for (i = 1; i < 256; ++i)
+	{
+		if (h->fanout[i] < h->fanout[i - 1])
+		{
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+
+	*manifest = m;
+	return COPYFILE_NO_ERROR;
+
+fail:
+	saved_errno = errno;
+	if (m->map)
+		munmap(m->map, m->map_size);
+	if (fd != -1)
+		close(fd);
+	free(m);
+	errno = saved_errno;
+	return COPYFILE_ERROR_MANIFEST;
+}
+
+void copyfile_manifest_close(copyfile_manifest_t* manifest)
+{
+	if (!manifest)
+		return;
+
+	munmap(manifest->map, manifest->map_size);
+	free(manifest);
+}
+
+/* the record of (@source, @dest), or NULL */
+static const struct manifest_record* find(const copyfile_manifest_t* m,
+		const char* source, const char* dest)
+{
+	uint64_t hash = path_hash(source, dest);
+	unsigned int b = hash >> 56;
+	size_t lo = b ? m->fanout[b - 1] : 0;
+	size_t hi = m->fanout[b];
+
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (m->hashes[mid] == hash)
+			return &m->records[mid];
+		if (m->hashes[mid] < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return 0;
+}
+
+#else /*!HAVE_MMAP*/
+
+copyfile_error_t copyfile_manifest_open(copyfile_manifest_t** manifest,
+		const char* path)
+{
+	*manifest = 0;
+	return COPYFILE_ERROR_UNSUPPORTED;
+}
+
+void copyfile_manifest_close(copyfile_manifest_t* manifest)
+{
+}
+
+static const struct manifest_record* find(const copyfile_manifest_t* m,
+		const char* source, const char* dest)
+{
+	return 0;
+}
+
+#endif /*HAVE_MMAP*/
+
+int copyfile_manifest_lookup(const copyfile_manifest_t* manifest,
+		const char* source, const char* dest,
+		copyfile_manifest_entry_t* entry)
+{
+	const struct manifest_record* r = find(manifest, source, dest);
+
+	if (!r)
+		return 0;
+
+	if (entry)
+	{
+		entry->size = r->size;
+		entry->ino = r->ino;
+		entry->mtime = r->mtime;
+		entry->mtime_nsec = r->mtime_nsec;
+		entry->ctime = r->ctime;
+		entry->ctime_nsec = r->ctime_nsec;
+		entry->hashed = !!(r->flags & MANIFEST_HASHED);
+		memcpy(entry->hash, r->hash, sizeof(entry->hash));
+	}
+	return 1;
+}
+
+int copyfile_manifest_unchanged(const copyfile_manifest_t* manifest,
+		const char* source, const char* dest, const struct stat* st)
+{
+	const struct manifest_record* r = find(manifest, source, dest);
+
+	return r && S_ISREG(st->st_mode) && same_file(r, st);
+}
+
+copyfile_error_t copyfile_manifest_writer_open(
+		copyfile_manifest_writer_t** writer, const char* path,
+		unsigned int flags)
+{
+	copyfile_manifest_writer_t* w = malloc(sizeof(*w));
+	copyfile_error_t ret;
+
+	*writer = 0;
+	if (!w)
+		return COPYFILE_ERROR_MALLOC;
+
+	w->path = strdup(path);
+	if (!w->path)
+	{
+		free(w);
+		return COPYFILE_ERROR_MALLOC;
+	}
+
+	/* fail early if it can't be written */
+	ret = copyfile_tmpfile_open(&w->tmp, path, perm_file);
+	if (ret)
+	{
+		int saved_errno = errno;
+
+		free(w->path);
+		free(w);
+		errno = saved_errno;
+		return ret;
+	}
+
+	w->open = 1;
+	w->flags = flags;
+	w->entries = 0;
+	w->count = 0;
+	w->size = 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&w->lock, 0);
+#endif
+	*writer = w;
+	return COPYFILE_NO_ERROR;
+}
+
+void copyfile_manifest_writer_close(copyfile_manifest_writer_t* writer)
+{
+	if (!writer)
+		return;
+
+	if (writer->open)
+		copyfile_tmpfile_discard(&writer->tmp);
+	free(writer->entries);
+	free(writer->path);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&writer->lock);
+#endif
+	free(writer);
+}
+
+/* add the record @r of (@source, @dest) */
+static copyfile_error_t add_record(copyfile_manifest_writer_t* w,
+		const char* source, const char* dest,
+		const struct manifest_record* r)
+{
+	struct writer_entry* e;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&w->lock);
+#endif
+
+	if (w->count == w->size)
+	{
+		size_t new_size = w->size ? w->size * 2 : 1024;
+		struct writer_entry* n = realloc(w->entries,
+				new_size * sizeof(*n));
+
+		if (!n)
+		{
+			ret = COPYFILE_ERROR_MALLOC;
+			goto out;
+		}
+		w->entries = n;
+		w->size = new_size;
+	}
+
+	e = &w->entries[w->count];
+	e->hash = path_hash(source, dest);
+	e->seq = w->count;
+	e->r = *r;
+	++w->count;
+
+out:
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&w->lock);
+#endif
+	return ret;
+}
+
+copyfile_error_t copyfile_manifest_writer_add(
+		copyfile_manifest_writer_t* writer, const char* source,
+		const char* dest, const struct stat* st)
+{
+	struct manifest_record r;
+
+	memset(&r, 0, sizeof(r));
+	r.size = st->st_size;
+	r.ino = st->st_ino;
+	get_times(st, &r);
+
+	if (writer->flags & COPYFILE_MANIFEST_CONTENT_HASH)
+	{
+		copyfile_error_t ret = copyfile_dedup_hash(0, source, r.hash);
+
+		if (ret)
+			return ret;
+		r.flags |= MANIFEST_HASHED;
+	}
+
+	return add_record(writer, source, dest, &r);
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+	const struct writer_entry* ea = a;
+	const struct writer_entry* eb = b;
+
+	if (ea->hash != eb->hash)
+		return ea->hash < eb->hash ? -1 : 1;
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static copyfile_error_t write_all(int fd, const void* buf, size_t len)
+{
+	const char* p = buf;
+
+	while (len > 0)
+	{
+		ssize_t wr = write(fd, p, len);
+
+		if (wr == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return COPYFILE_ERROR_WRITE;
+		}
+
+		p += wr;
+		len -= wr;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+/* write the entries of @part (0 for the hashes, 1 for the records),
+ * buffering them */
+static copyfile_error_t write_part(copyfile_manifest_writer_t* w,
+		size_t count, int part)
+{
+	union
+	{
+		uint64_t hashes[512];
+		struct manifest_record records[64];
+	} buf;
+	size_t used = 0;
+	size_t max = part ? 64 : 512;
+	size_t unit = part ? sizeof(*buf.records) : sizeof(*buf.hashes);
+	size_t i;
+	copyfile_error_t ret;
+
+	for (i = 0; i < count; ++i)
+	{
+		if (part)
+			buf.records[used++] = w->entries[i].r;
+		else
+			buf.hashes[used++] = w->entries[i].hash;
+
+		if (used == max || i == count - 1)
+		{
+			ret = write_all(w->tmp.fd, &buf, used * unit);
+			if (ret)
+				return ret;
+			used = 0;
+		}
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+copyfile_error_t copyfile_manifest_writer_commit(
+		copyfile_manifest_writer_t* writer)
+{
+	struct manifest_header h;
+	copyfile_error_t ret;
+	size_t i, count;
+
+	if (!writer->open)
+	{
+		errno = EINVAL;
+		return COPYFILE_ERROR_MANIFEST;
+	}
+
+	/* sort by the hash, and keep the last entry of each path */
+	qsort(writer->entries, writer->count, sizeof(*writer->entries),
+			compare_entries);
+	count = 0;
+	for (i = 0; i < writer->count; ++i)
+	{
+		if (i + 1 < writer->count
+				&& writer->entries[i + 1].hash == writer->entries[i].hash)
+			continue;
+		writer->entries[count++] = writer->entries[i];
+	}
+	writer->count = count;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, manifest_magic, sizeof(h.magic));
+	h.count = count;
+	for (i = 0; i < count; ++i)
+		++h.fanout[writer->entries[i].hash >> 56];
+	for (i = 1; i < 256; ++i)
+		h.fanout[i] += h.fanout[i - 1];
+
+	ret = write_all(writer->tmp.fd, &h, sizeof(h));
+	if (!ret)
+		ret = write_part(writer, count, 0);
+	if (!ret)
+		ret = write_part(writer, count, 1);
+	if (!ret && fsync(writer->tmp.fd))
+		ret = COPYFILE_ERROR_SYNC;
+
+	writer->open = 0;
+	if (ret)
+	{
+		copyfile_tmpfile_discard(&writer->tmp);
+		return ret;
+	}
+	return copyfile_tmpfile_publish(&writer->tmp, writer->path);
+}
+
+int copyfile_manifest_check(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_error_t* ret,
+		copyfile_callback_t callback, void* callback_data)
+{
+	const struct manifest_record* r;
+	struct stat dest_st;
+
+	if (!ctx || !ctx->manifest || (ctx->options & COPYFILE_NO_SKIP)
+			|| !S_ISREG(st->st_mode))
+		return 0;
+
+	r = find(ctx->manifest, source, dest);
+	if (!r || !same_file(r, st))
+		return 0;
+
+	/* the destination is trusted to be unchanged, but it has to be
+	 * there at least */
+#ifdef S_IFLNK
+	if (lstat(dest, &dest_st))
+		return 0;
+#else
+	if (stat(dest, &dest_st))
+		return 0;
+#endif
+	if (!S_ISREG(dest_st.st_mode))
+		return 0;
+
+	/* the new manifest lists it still */
+	if (ctx->manifest_writer)
+		add_record(ctx->manifest_writer, source, dest, r);
+
+	*ret = copyfile_up_to_date(ctx, st, flags, result_flags,
+			callback, callback_data);
+	return 1;
+}
+
+void copyfile_manifest_remember(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, const struct stat* st)
+{
+	/* failures only make the next run copy the file again */
+	if (ctx && ctx->manifest_writer && S_ISREG(st->st_mode))
+		copyfile_manifest_writer_add(ctx->manifest_writer, source, dest, st);
+}
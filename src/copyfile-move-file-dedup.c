@@ -9,13 +9,14 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 
-copyfile_error_t copyfile_move_file_dedup(const char* source,
-		const char* dest, const char* dup_copy,
+copyfile_error_t copyfile_move_file_dedup_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const char* dup_copy,
 		const struct stat* st, unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data)
 {
@@ -44,8 +45,12 @@ copyfile_error_t copyfile_move_file_dedup(const char* source,
 		return COPYFILE_ABORTED;
 
 	/* Try to clone the duplicate-candidate first. */
-	if (!copyfile_clone_file(dup_copy, dest, st))
-		ret = copyfile_copy_metadata(source, dest, st,
+	if (ctx && (ctx->options & COPYFILE_PARTIAL_CLONE)
+			&& S_ISREG(st->st_mode)
+			? !copyfile_clone_partial(ctx, source, dup_copy, dest, st,
+				callback, callback_data)
+			: !copyfile_clone_file(dup_copy, dest, st))
+		ret = copyfile_copy_metadata_ctx(ctx, source, dest, st,
 				COPYFILE_COPY_ALL_METADATA, result_flags);
 	else
 	{
@@ -74,7 +79,7 @@ copyfile_error_t copyfile_move_file_dedup(const char* source,
 						return COPYFILE_ERROR_UNLINK_SOURCE;
 				}
 
-				return COPYFILE_NO_ERROR;
+				return copyfile_sync_dir(ctx, dest);
 			}
 			else if (callback)
 			{
@@ -106,11 +111,14 @@ copyfile_error_t copyfile_move_file_dedup(const char* source,
 				return COPYFILE_ERROR_UNLINK_DEST;
 		}
 
-		ret = copyfile_archive_file(source, dest, 0,
-				COPYFILE_COPY_ALL_METADATA, result_flags,
+		ret = copyfile_archive_moved(ctx, source, dest, result_flags,
 				callback, callback_data);
 	}
 
+	/* the copy must be durable before the source is gone */
+	if (!ret)
+		ret = copyfile_sync_now(ctx, dest);
+
 	if (!ret)
 	{
 		while (unlink(source))
@@ -128,3 +136,12 @@ copyfile_error_t copyfile_move_file_dedup(const char* source,
 
 	return ret;
 }
+
+copyfile_error_t copyfile_move_file_dedup(const char* source,
+		const char* dest, const char* dup_copy,
+		const struct stat* st, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_move_file_dedup_ctx(0, source, dest, dup_copy, st,
+			result_flags, callback, callback_data);
+}
@@ -9,17 +9,44 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
+#include <sys/stat.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 
-copyfile_error_t copyfile_move_file(const char* source,
-		const char* dest, unsigned int* result_flags,
+copyfile_error_t copyfile_archive_moved(copyfile_ctx_t* ctx,
+		const char* source, const char* dest,
+		unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	unsigned int saved_options;
+	copyfile_error_t ret;
+
+	if (!ctx)
+		return copyfile_archive_file_ctx(ctx, source, dest, 0,
+				COPYFILE_COPY_ALL_METADATA, result_flags,
+				callback, callback_data);
+
+	saved_options = ctx->options;
+	ctx->options |= COPYFILE_NO_SKIP;
+	ret = copyfile_archive_file_ctx(ctx, source, dest, 0,
+			COPYFILE_COPY_ALL_METADATA, result_flags,
+			callback, callback_data);
+	ctx->options = saved_options;
+
+	return ret;
+}
+
+copyfile_error_t copyfile_move_file_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest,
+		unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data)
 {
 	copyfile_error_t ret;
 	copyfile_progress_t progress;
+	struct stat st;
 
 	progress.move.source = source;
 
@@ -52,7 +79,7 @@ copyfile_error_t copyfile_move_file(const char* source,
 					return COPYFILE_ERROR_UNLINK_SOURCE;
 			}
 
-			return COPYFILE_NO_ERROR;
+			return copyfile_sync_dir(ctx, dest);
 		}
 		else if (callback)
 		{
@@ -72,21 +99,36 @@ copyfile_error_t copyfile_move_file(const char* source,
 		}
 	}
 
-	while (unlink(dest) && errno != ENOENT)
+	if (ctx && (ctx->options & COPYFILE_PUNCH_SOURCE)
+#ifdef S_IFLNK
+			&& !lstat(source, &st)
+#else
+			&& !stat(source, &st)
+#endif
+			&& S_ISREG(st.st_mode))
+		ret = copyfile_move_punched(ctx, source, dest, &st, result_flags,
+				callback, callback_data);
+	else
 	{
-		if (callback)
+		while (unlink(dest) && errno != ENOENT)
 		{
-			if (callback(COPYFILE_ERROR_UNLINK_DEST, COPYFILE_MOVE,
-						progress, callback_data, 1))
+			if (callback)
+			{
+				if (callback(COPYFILE_ERROR_UNLINK_DEST, COPYFILE_MOVE,
+							progress, callback_data, 1))
+					return COPYFILE_ERROR_UNLINK_DEST;
+			}
+			else
 				return COPYFILE_ERROR_UNLINK_DEST;
 		}
-		else
-			return COPYFILE_ERROR_UNLINK_DEST;
+
+		ret = copyfile_archive_moved(ctx, source, dest, result_flags,
+				callback, callback_data);
 	}
 
-	ret = copyfile_archive_file(source, dest, 0,
-			COPYFILE_COPY_ALL_METADATA, result_flags,
-			callback, callback_data);
+	/* the copy must be durable before the source is gone */
+	if (!ret)
+		ret = copyfile_sync_now(ctx, dest);
 
 	if (!ret)
 	{
@@ -105,3 +147,11 @@ copyfile_error_t copyfile_move_file(const char* source,
 
 	return ret;
 }
+
+copyfile_error_t copyfile_move_file(const char* source,
+		const char* dest, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_move_file_ctx(0, source, dest, result_flags,
+			callback, callback_data);
+}
@@ -0,0 +1,345 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+#	define PUNCH_HOLES 1
+#endif
+
+/* put the name of the partial copy of @st into @arena:
+ * 'dir/.name.<device>-<inode>-<size>.partial'. the identity of
+ * the source makes sure that a leftover of another file is never
+ * resumed. (punching keeps the size of the source.) */
+static char* make_partial_name(struct copyfile_arena* arena,
+		const char* dest, const struct stat* st)
+{
+	const char* slash = strrchr(dest, '/');
+	size_t dlen = slash ? (size_t) (slash - dest) + 1 : 0;
+	char* buf = copyfile_arena_reserve(arena, strlen(dest) + 80);
+
+	if (!buf)
+		return 0;
+
+	memcpy(buf, dest, dlen);
+	sprintf(&buf[dlen], ".%s.%lx-%lu-%llu.partial", dest + dlen,
+			(unsigned long) st->st_dev, (unsigned long) st->st_ino,
+			(unsigned long long) st->st_size);
+	return buf;
+}
+
+/* copy the data from the current offset up to @end (or EOF, whichever
+ * comes first), at the same offsets in both files. */
+static copyfile_error_t copy_range(copyfile_ctx_t* ctx,
+		int fd_in, int fd_out, off_t end,
+		copyfile_progress_t* progress, unsigned int* opcount,
+		copyfile_callback_t callback, void* callback_data)
+{
+	size_t buf_size = ctx->buffer_size;
+	char* buf = copyfile_arena_reserve(&ctx->data, buf_size);
+
+	if (!buf)
+		return COPYFILE_ERROR_MALLOC;
+
+	while (progress->data.offset < end)
+	{
+		char* bufp = buf;
+		size_t len = buf_size;
+		ssize_t rd, wr;
+
+		if (callback)
+		{
+			if (!*opcount)
+			{
+				if (callback(COPYFILE_NO_ERROR, COPYFILE_REGULAR,
+							*progress, callback_data, 0))
+					return COPYFILE_ABORTED;
+			}
+
+			if (++*opcount >= ctx->callback_opcount)
+				*opcount = 0;
+		}
+
+		if ((off_t) len > end - progress->data.offset)
+			len = end - progress->data.offset;
+
+		rd = pread(fd_in, bufp, len, progress->data.offset);
+		if (rd == -1)
+		{
+			copyfile_error_t err = COPYFILE_ERROR_READ;
+
+			if (callback
+					? !callback(err, COPYFILE_REGULAR, *progress,
+						callback_data, errno != EINTR)
+					: errno == EINTR)
+				continue;
+			else
+				return err;
+		}
+		else if (rd == 0)
+			break;
+
+		while (rd > 0)
+		{
+			wr = pwrite(fd_out, bufp, rd, progress->data.offset);
+			if (wr == -1)
+			{
+				copyfile_error_t err = COPYFILE_ERROR_WRITE;
+
+				if (callback
+						? !callback(err, COPYFILE_REGULAR, *progress,
+							callback_data, errno != EINTR)
+						: errno == EINTR)
+					continue;
+				else
+					return err;
+			}
+			else
+			{
+				rd -= wr;
+				bufp += wr;
+
+				progress->data.offset += wr;
+			}
+		}
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+#ifdef PUNCH_HOLES
+/* release the copied range of the source. returns -1 on error,
+ * 0 if punching holes is not supported and 1 on success. */
+static int punch_source(int fd, off_t offset, off_t len,
+		const struct stat* st)
+{
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				offset, len))
+		return errno == EOPNOTSUPP || errno == ENOSYS ? 0 : -1;
+
+#	ifdef HAVE_FUTIMENS
+	/* punching updates the mtime; put it back, so that it can still
+	 * be copied if the move is interrupted and resumed. */
+	{
+		struct timespec times[2];
+
+		times[0] = st->st_atim;
+		times[1] = st->st_mtim;
+		futimens(fd, times);
+	}
+#	endif
+
+	return 1;
+}
+#endif /*PUNCH_HOLES*/
+
+/* sync the directory containing @path. */
+static copyfile_error_t sync_parent(const char* path)
+{
+	int fd = copyfile_open_parent(path);
+	int ret;
+	int saved_errno;
+
+	if (fd == -1)
+		return COPYFILE_ERROR_SYNC;
+
+	ret = fsync(fd);
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+
+	return ret ? COPYFILE_ERROR_SYNC : COPYFILE_NO_ERROR;
+}
+
+copyfile_error_t copyfile_move_punched(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	char name_buf[256];
+	struct copyfile_arena name;
+	const char* partial;
+	struct stat partial_st;
+	copyfile_progress_t progress;
+	unsigned int opcount = 0;
+	off_t start_offset;
+	int fd_in, fd_out;
+	int punch = 1;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	copyfile_error_t metadata_ret = COPYFILE_NO_ERROR;
+	int hold_errno = 0;
+	int metadata_errno = 0;
+
+	if (result_flags)
+		*result_flags = 0;
+
+	copyfile_arena_init(&name, name_buf, sizeof(name_buf));
+	partial = make_partial_name(&name, dest, st);
+	if (!partial)
+		return COPYFILE_ERROR_MALLOC;
+
+	fd_in = open(source, O_RDWR);
+	if (fd_in == -1 && errno != ENOENT)
+	{
+		/* not writable? we can still move it, just without releasing
+		 * the space progressively */
+		fd_in = open(source, O_RDONLY);
+		punch = 0;
+	}
+	if (fd_in == -1)
+	{
+		hold_errno = errno;
+		copyfile_arena_free(&name);
+		errno = hold_errno;
+		return COPYFILE_ERROR_OPEN_SOURCE;
+	}
+
+	fd_out = open(partial, O_WRONLY | O_CREAT, perm_file);
+	if (fd_out == -1)
+	{
+		hold_errno = errno;
+		close(fd_in);
+		copyfile_arena_free(&name);
+		errno = hold_errno;
+		return COPYFILE_ERROR_OPEN_DEST;
+	}
+
+	/* the partial copy is synced before the source is punched, so
+	 * everything up to its size is safe to skip. */
+	progress.data.offset = 0;
+	progress.data.size = st->st_size;
+	if (fstat(fd_out, &partial_st))
+	{
+		ret = COPYFILE_ERROR_STAT;
+		hold_errno = errno;
+	}
+	else if (partial_st.st_size <= st->st_size)
+		progress.data.offset = partial_st.st_size;
+	else if (ftruncate(fd_out, 0))
+	{
+		ret = COPYFILE_ERROR_TRUNCATE;
+		hold_errno = errno;
+	}
+	start_offset = progress.data.offset;
+
+	/* the name of the partial copy has to be durable before any
+	 * of the source is released as well */
+	if (!ret && punch)
+	{
+		ret = sync_parent(partial);
+		hold_errno = errno;
+	}
+
+	while (!ret && progress.data.offset < st->st_size)
+	{
+		off_t chunk_start = progress.data.offset;
+		off_t end = chunk_start + COPYFILE_PUNCH_CHUNK;
+
+		if (end > st->st_size)
+			end = st->st_size;
+
+		ret = copy_range(ctx, fd_in, fd_out, end, &progress, &opcount,
+				callback, callback_data);
+		if (ret)
+		{
+			hold_errno = errno;
+			break;
+		}
+
+		/* the copy has to be durable before the source is released */
+#ifdef HAVE_FDATASYNC
+		if (fdatasync(fd_out))
+#else
+		if (fsync(fd_out))
+#endif
+		{
+			ret = COPYFILE_ERROR_SYNC;
+			hold_errno = errno;
+			break;
+		}
+
+#ifdef PUNCH_HOLES
+		if (punch)
+		{
+			punch = punch_source(fd_in, chunk_start,
+					progress.data.offset - chunk_start, st);
+			if (punch == -1)
+			{
+				ret = COPYFILE_ERROR_PUNCH_SOURCE;
+				hold_errno = errno;
+				break;
+			}
+		}
+#endif
+
+		/* the source was truncated in the meantime */
+		if (progress.data.offset < end)
+			break;
+	}
+
+	ctx->stats.bytes += progress.data.offset - start_offset;
+	close(fd_in);
+
+	if (!ret && callback && callback(COPYFILE_EOF, COPYFILE_REGULAR,
+				progress, callback_data, 0))
+		ret = COPYFILE_ABORTED;
+
+	if (!ret)
+	{
+		metadata_ret = copyfile_copy_metadata_to(ctx, source, partial,
+				fd_out, st, COPYFILE_COPY_ALL_METADATA, result_flags);
+		metadata_errno = errno;
+
+		if (fsync(fd_out))
+		{
+			ret = COPYFILE_ERROR_SYNC;
+			hold_errno = errno;
+		}
+	}
+
+	if (close(fd_out) && !ret)
+	{
+		ret = COPYFILE_ERROR_WRITE;
+		hold_errno = errno;
+	}
+
+	/* the new name must be durable before the source is removed */
+	if (!ret)
+	{
+		if (rename(partial, dest))
+			ret = COPYFILE_ERROR_RENAME;
+		else
+			ret = sync_parent(dest);
+		hold_errno = errno;
+	}
+
+	copyfile_arena_free(&name);
+
+	if (ret)
+	{
+		if (result_flags)
+			*result_flags = 0;
+		errno = hold_errno;
+		return ret;
+	}
+
+	++ctx->stats.files;
+	errno = metadata_errno;
+	return metadata_ret;
+}
@@ -0,0 +1,281 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* remove @path, reporting errors the copyfile_move_file() way */
+static copyfile_error_t remove_source(const char* path, int is_dir,
+		copyfile_callback_t callback, void* callback_data)
+{
+	copyfile_progress_t progress;
+
+	progress.move.source = path;
+
+	while (is_dir ? rmdir(path) : unlink(path))
+	{
+		if (errno == ENOENT)
+			break;
+
+		if (!callback || callback(COPYFILE_ERROR_UNLINK_SOURCE,
+					COPYFILE_MOVE, progress, callback_data, 1))
+			return COPYFILE_ERROR_UNLINK_SOURCE;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+/* check whether @cur is the copy of @st made by the move */
+static int is_copy(const struct stat* st, const struct stat* cur)
+{
+	if ((st->st_mode & S_IFMT) != (cur->st_mode & S_IFMT))
+		return 0;
+	/* the timestamps may be coarser on the destination */
+	if (S_ISREG(st->st_mode))
+		return st->st_size == cur->st_size
+			&& st->st_mtime == cur->st_mtime;
+	return 1;
+}
+
+/* unlink the @count @files of a directory, in a single batch. the
+ * tree is listed again for removing, so only the files having a copy
+ * are removed -- the others were created or modified after they were
+ * copied. */
+static copyfile_error_t remove_files(copyfile_ctx_t* ctx,
+		const struct copyfile_walk_entry* files, size_t count,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct copyfile_meta_op* ops;
+	struct stat* cur;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	int saved_errno;
+	size_t ncopied = 0;
+	size_t i;
+
+	ops = malloc(count * sizeof(*ops));
+	cur = malloc(count * sizeof(*cur));
+	if (!ops || !cur)
+	{
+		free(ops);
+		free(cur);
+		return COPYFILE_ERROR_MALLOC;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		ops[i].opcode = COPYFILE_META_LSTAT;
+		ops[i].path = files[i].dest;
+		ops[i].st = &cur[i];
+		ops[i].chain = 0;
+	}
+	copyfile_meta_run(ctx, ops, count);
+
+	for (i = 0; i < count; ++i)
+	{
+		if (ops[i].error || !is_copy(&files[i].st, &cur[i]))
+			continue;
+
+		ops[ncopied].opcode = COPYFILE_META_UNLINK;
+		ops[ncopied].path = files[i].source;
+		ops[ncopied].chain = 0;
+		++ncopied;
+	}
+	copyfile_meta_run(ctx, ops, ncopied);
+
+	for (i = 0; i < ncopied; ++i)
+	{
+		copyfile_error_t lret;
+
+		if (!ops[i].error || ops[i].error == ENOENT)
+			continue;
+
+		/* try again, reporting the error */
+		lret = remove_source(ops[i].path, 0, callback, callback_data);
+		if (lret && !ret)
+		{
+			ret = lret;
+			saved_errno = errno;
+		}
+	}
+
+	free(ops);
+	free(cur);
+	if (ret)
+		errno = saved_errno;
+	return ret;
+}
+
+/* remove the copied tree @source. the directories are removed as they
+ * are left, so if any file was not removed, its parents stay as well
+ * (and are reported). */
+static copyfile_error_t remove_tree(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct copyfile_walk w;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	copyfile_error_t lret;
+	int saved_errno;
+
+	lret = copyfile_walk_open(&w, ctx, source, dest, st);
+	while (!lret)
+	{
+		enum copyfile_walk_event event;
+		const struct copyfile_walk_dir* d;
+
+		lret = copyfile_walk_next(&w, &event, &d);
+		if (lret || event == COPYFILE_WALK_END)
+			break;
+
+		if (event == COPYFILE_WALK_BATCH)
+		{
+			if (d->nfiles)
+				lret = remove_files(ctx, d->files, d->nfiles,
+						callback, callback_data);
+		}
+		else
+			lret = remove_source(d->source, 1, callback, callback_data);
+
+		if (lret && lret != COPYFILE_ERROR_MALLOC)
+		{
+			if (!ret)
+			{
+				ret = lret;
+				saved_errno = errno;
+			}
+			lret = COPYFILE_NO_ERROR;
+		}
+	}
+
+	if (lret && !ret)
+	{
+		ret = lret;
+		saved_errno = errno;
+	}
+	copyfile_walk_close(&w);
+
+	if (ret)
+		errno = saved_errno;
+	return ret;
+}
+
+/* the cross-device move: copy, make the copy durable, remove
+ * the source */
+static copyfile_error_t move_across(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		copyfile_callback_t callback, void* callback_data)
+{
+	copyfile_ctx_t* own_ctx = 0;
+	unsigned int saved_durability;
+	unsigned int saved_options;
+	copyfile_error_t ret;
+	int saved_errno;
+
+	if (!ctx)
+	{
+		ctx = own_ctx = copyfile_ctx_create();
+		if (!ctx)
+			return COPYFILE_ERROR_MALLOC;
+	}
+
+	/* the source must not be removed before the copy is durable.
+	 * syncing the filesystems once at the end is the cheapest way
+	 * of ensuring that. */
+	saved_durability = ctx->durability;
+	ctx->durability = COPYFILE_SYNC_BATCH | COPYFILE_SYNC_DIRS;
+	saved_options = ctx->options;
+	ctx->options |= COPYFILE_PRESERVE_HARDLINKS | COPYFILE_NO_SKIP;
+
+	ret = copyfile_copy_tree(ctx, source, dest, st,
+			COPYFILE_COPY_ALL_METADATA, callback, callback_data);
+	if (!ret)
+		ret = copyfile_ctx_commit(ctx);
+	ctx->durability = saved_durability;
+	ctx->options = saved_options;
+
+	if (!ret)
+		ret = remove_tree(ctx, source, dest, st, callback, callback_data);
+
+	saved_errno = errno;
+	copyfile_ctx_destroy(own_ctx);
+	errno = saved_errno;
+
+	return ret;
+}
+
+copyfile_error_t copyfile_move_tree_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct stat st;
+	copyfile_progress_t progress;
+
+#ifdef S_IFLNK
+	if (lstat(source, &st))
+		return COPYFILE_ERROR_STAT;
+#else
+	if (stat(source, &st))
+		return COPYFILE_ERROR_STAT;
+#endif
+
+	if (!S_ISDIR(st.st_mode))
+		return copyfile_move_file_ctx(ctx, source, dest, 0,
+				callback, callback_data);
+
+	progress.move.source = source;
+
+	if (callback && callback(COPYFILE_NO_ERROR, COPYFILE_MOVE,
+				progress, callback_data, 0))
+		return COPYFILE_ABORTED;
+
+	/* a single rename() if we're lucky */
+	while (1)
+	{
+		if (!rename(source, dest))
+		{
+			if (callback && callback(COPYFILE_EOF, COPYFILE_MOVE,
+					progress, callback_data, 0))
+				return COPYFILE_ABORTED;
+
+			return copyfile_sync_dir(ctx, dest);
+		}
+		else if (callback)
+		{
+			if (callback(COPYFILE_ERROR_RENAME, COPYFILE_MOVE,
+						progress, callback_data,
+						errno != EXDEV))
+				return COPYFILE_ERROR_RENAME;
+			else if (errno == EXDEV)
+				break;
+		}
+		else /* default error handling */
+		{
+			if (errno == EXDEV)
+				break;
+			else
+				return COPYFILE_ERROR_RENAME;
+		}
+	}
+
+	return move_across(ctx, source, dest, &st, callback, callback_data);
+}
+
+copyfile_error_t copyfile_move_tree(const char* source, const char* dest,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_move_tree_ctx(0, source, dest,
+			callback, callback_data);
+}
@@ -0,0 +1,277 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+struct parallel_state
+{
+	copyfile_job_t job;
+	void* data;
+
+	size_t count;
+	size_t next;
+	int stop;
+
+	copyfile_callback_t callback;
+	void* callback_data;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+	pthread_mutex_t callback_lock;
+#endif
+};
+
+unsigned int copyfile_thread_count(const copyfile_ctx_t* ctx)
+{
+#ifdef HAVE_PTHREAD
+	long n;
+
+	if (ctx && ctx->threads)
+		return ctx->threads;
+
+#	ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#	else
+	n = 1;
+#	endif
+	if (n < 1)
+		n = 1;
+	if (n > COPYFILE_DEFAULT_THREADS_MAX)
+		n = COPYFILE_DEFAULT_THREADS_MAX;
+	return n;
+#else
+	return 1;
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+
+/* the user callback may be called from multiple threads; make sure
+ * only one of them is inside it at a time. */
+static int serialized_callback(copyfile_error_t state,
+		copyfile_filetype_t type, copyfile_progress_t progress,
+		void* data, int default_return)
+{
+	struct parallel_state* s = data;
+	int saved_errno = errno;
+	int ret;
+
+	pthread_mutex_lock(&s->callback_lock);
+	errno = saved_errno;
+	ret = s->callback(state, type, progress, s->callback_data,
+			default_return);
+	saved_errno = errno;
+	pthread_mutex_unlock(&s->callback_lock);
+	errno = saved_errno;
+
+	return ret;
+}
+
+#endif /*HAVE_PTHREAD*/
+
+static void run_jobs(struct parallel_state* s, copyfile_ctx_t* ctx,
+		copyfile_callback_t callback, void* callback_data)
+{
+	while (1)
+	{
+		size_t i;
+
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&s->lock);
+#endif
+		i = s->next;
+		if (!s->stop && i < s->count)
+			++s->next;
+		else
+			i = s->count;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&s->lock);
+#endif
+
+		if (i == s->count)
+			break;
+
+		if (s->job(ctx, i, s->data, callback, callback_data))
+		{
+#ifdef HAVE_PTHREAD
+			pthread_mutex_lock(&s->lock);
+#endif
+			s->stop = 1;
+#ifdef HAVE_PTHREAD
+			pthread_mutex_unlock(&s->lock);
+#endif
+		}
+	}
+}
+
+#ifdef HAVE_PTHREAD
+
+struct worker
+{
+	pthread_t thread;
+	struct parallel_state* state;
+	copyfile_ctx_t* ctx;
+};
+
+static void* worker_main(void* data)
+{
+	struct worker* w = data;
+
+	run_jobs(w->state, w->ctx, w->state->callback
+			? serialized_callback : 0, w->state);
+	return 0;
+}
+
+/* create a context for a worker thread, with the same settings
+ * as @parent */
+static copyfile_ctx_t* fork_ctx(const copyfile_ctx_t* parent)
+{
+	copyfile_ctx_t* ctx = copyfile_ctx_create();
+
+	if (!ctx)
+		return 0;
+
+	ctx->buffer_size = parent->buffer_size;
+	ctx->callback_opcount = parent->callback_opcount;
+	ctx->options = parent->options;
+	ctx->durability = parent->durability;
+	ctx->threads = 1;
+	ctx->dedup_index = parent->dedup_index;
+	ctx->journal = parent->journal;
+	ctx->manifest = parent->manifest;
+	ctx->manifest_writer = parent->manifest_writer;
+	ctx->extent_map = parent->extent_map;
+	/* don't try to set up a ring which failed already */
+	ctx->uring_tried = parent->uring_tried && !parent->uring;
+
+	return ctx;
+}
+
+/* merge the statistics and pending commit of @child into @parent,
+ * and destroy @child */
+static void join_ctx(copyfile_ctx_t* parent, copyfile_ctx_t* child)
+{
+	unsigned int i, j;
+
+	parent->stats.files += child->stats.files;
+	parent->stats.directories += child->stats.directories;
+	parent->stats.symlinks += child->stats.symlinks;
+	parent->stats.specials += child->stats.specials;
+	parent->stats.clones += child->stats.clones;
+	parent->stats.xattrs += child->stats.xattrs;
+	parent->stats.up_to_date += child->stats.up_to_date;
+	parent->stats.deduplicated += child->stats.deduplicated;
+	parent->stats.links += child->stats.links;
+	parent->stats.bytes += child->stats.bytes;
+	parent->stats.shared += child->stats.shared;
+
+	/* hand over the filesystems to be synced by the parent's commit */
+	for (i = 0; i < child->sync_fs_used; ++i)
+	{
+		for (j = 0; j < parent->sync_fs_used; ++j)
+		{
+			if (parent->sync_fs[j].dev == child->sync_fs[i].dev)
+				break;
+		}
+
+		if (j < parent->sync_fs_used || copyfile_sync_add_fs(parent,
+					child->sync_fs[i].dev, child->sync_fs[i].fd))
+			close(child->sync_fs[i].fd);
+	}
+	child->sync_fs_used = 0;
+
+	copyfile_ctx_destroy(child);
+}
+
+#endif /*HAVE_PTHREAD*/
+
+void copyfile_parallel_run(copyfile_ctx_t* ctx, size_t count,
+		copyfile_job_t job, void* data,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct parallel_state s;
+	unsigned int threads = copyfile_thread_count(ctx);
+
+	s.job = job;
+	s.data = data;
+	s.count = count;
+	s.next = 0;
+	s.stop = 0;
+	s.callback = callback;
+	s.callback_data = callback_data;
+
+	if (threads > count)
+		threads = count;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&s.lock, 0);
+
+	if (threads > 1)
+	{
+		struct worker workers[COPYFILE_THREADS_MAX];
+		unsigned int started = 0;
+		unsigned int i;
+
+		if (threads > COPYFILE_THREADS_MAX)
+			threads = COPYFILE_THREADS_MAX;
+
+		pthread_mutex_init(&s.callback_lock, 0);
+
+		/* the calling thread is one of the workers */
+		for (i = 0; i < threads - 1; ++i)
+		{
+			struct worker* w = &workers[started];
+
+			w->state = &s;
+			w->ctx = 0;
+			if (ctx)
+			{
+				w->ctx = fork_ctx(ctx);
+				if (!w->ctx)
+					break;
+			}
+
+			if (pthread_create(&w->thread, 0, worker_main, w))
+			{
+				copyfile_ctx_destroy(w->ctx);
+				break;
+			}
+			++started;
+		}
+
+		run_jobs(&s, ctx, callback ? serialized_callback : 0, &s);
+
+		for (i = 0; i < started; ++i)
+		{
+			pthread_join(workers[i].thread, 0);
+			if (workers[i].ctx)
+				join_ctx(ctx, workers[i].ctx);
+		}
+
+		pthread_mutex_destroy(&s.lock);
+		pthread_mutex_destroy(&s.callback_lock);
+		return;
+	}
+#endif /*HAVE_PTHREAD*/
+
+	run_jobs(&s, ctx, callback, callback_data);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&s.lock);
+#endif
+}
@@ -0,0 +1,167 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+copyfile_error_t copyfile_prefetch_init(struct copyfile_prefetch* p,
+		const copyfile_batch_entry_t* entries, const size_t* order,
+		size_t count)
+{
+	p->sizes = calloc(count ? count : 1, sizeof(*p->sizes));
+	if (!p->sizes)
+		return COPYFILE_ERROR_MALLOC;
+
+	p->entries = entries;
+	p->order = order;
+	p->count = count;
+	p->next = 0;
+	p->released = 0;
+	p->window = 0;
+	p->depth = COPYFILE_PREFETCH_DEPTH_MIN;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&p->lock, 0);
+#endif
+
+	return COPYFILE_NO_ERROR;
+}
+
+void copyfile_prefetch_free(struct copyfile_prefetch* p)
+{
+	free(p->sizes);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&p->lock);
+#endif
+}
+
+/* ask the system to read the beginning of the file @e in background.
+ * returns the amount requested. */
+static off_t prefetch_file(const copyfile_batch_entry_t* e)
+{
+	struct stat buf;
+	const struct stat* st = e->st;
+	off_t len = 0;
+	int fd;
+
+	/* this brings in the inode as well */
+	if (!st)
+	{
+#ifdef S_IFLNK
+		if (lstat(e->source, &buf))
+			return 0;
+#else
+		if (stat(e->source, &buf))
+			return 0;
+#endif
+		st = &buf;
+	}
+
+	if (!S_ISREG(st->st_mode) || !st->st_size)
+		return 0;
+
+	len = st->st_size < COPYFILE_PREFETCH_FILE_MAX
+		? st->st_size : COPYFILE_PREFETCH_FILE_MAX;
+
+	fd = open(e->source, O_RDONLY | O_NONBLOCK);
+	if (fd == -1)
+		return 0;
+#ifdef HAVE_POSIX_FADVISE
+	if (posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED))
+		len = 0;
+#else
+	len = 0;
+#endif
+	close(fd);
+
+	return len;
+}
+
+void copyfile_prefetch_start(struct copyfile_prefetch* p, size_t pos)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&p->lock);
+#endif
+
+	/* the files being copied are not ahead anymore */
+	for (; p->released <= pos; ++p->released)
+		p->window -= p->sizes[p->released];
+	if (p->next <= pos)
+		p->next = pos + 1;
+
+	while (p->next < p->count && p->next <= pos + p->depth
+			&& p->window < COPYFILE_PREFETCH_WINDOW)
+	{
+		size_t i = p->next++;
+		const copyfile_batch_entry_t* e
+			= &p->entries[p->order ? p->order[i] : i];
+		off_t len;
+
+		/* the other workers can go on meanwhile */
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&p->lock);
+#endif
+		len = prefetch_file(e);
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&p->lock);
+#endif
+
+		if (i >= p->released)
+		{
+			p->sizes[i] = len;
+			p->window += len;
+		}
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&p->lock);
+#endif
+}
+
+void copyfile_prefetch_done(struct copyfile_prefetch* p,
+		long elapsed_us)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&p->lock);
+#endif
+
+	/* the files which take long to copy are likely to wait for
+	 * the storage -- look further ahead. otherwise, they come
+	 * from the cache already, so save the work. */
+	if (elapsed_us > COPYFILE_PREFETCH_SLOW_US)
+	{
+		p->depth *= 2;
+		if (p->depth > COPYFILE_PREFETCH_DEPTH_MAX)
+			p->depth = COPYFILE_PREFETCH_DEPTH_MAX;
+	}
+	else if (elapsed_us < COPYFILE_PREFETCH_SLOW_US / 4
+			&& p->depth > COPYFILE_PREFETCH_DEPTH_MIN)
+		--p->depth;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&p->lock);
+#endif
+}
+
+long copyfile_elapsed_us(const struct timeval* since)
+{
+	struct timeval now;
+
+	gettimeofday(&now, 0);
+	return (now.tv_sec - since->tv_sec) * 1000000L
+		+ (now.tv_usec - since->tv_usec);
+}
@@ -0,0 +1,84 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/stat.h>
+
+static int same_mtime(const struct stat* a, const struct stat* b)
+{
+#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC /* BSD */
+	return a->st_mtimespec.tv_sec == b->st_mtimespec.tv_sec
+		&& a->st_mtimespec.tv_nsec == b->st_mtimespec.tv_nsec;
+#else /*!HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+	return a->st_mtim.tv_sec == b->st_mtim.tv_sec
+		&& a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+#endif /*HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+}
+
+copyfile_error_t copyfile_up_to_date(copyfile_ctx_t* ctx,
+		const struct stat* st, unsigned int flags,
+		unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	if (!(flags & COPYFILE_COPY_ALL_METADATA))
+		flags |= COPYFILE_COPY_ALL_METADATA;
+	flags &= COPYFILE_COPY_ALL_METADATA;
+	if (result_flags)
+		*result_flags = COPYFILE_SKIPPED | flags
+			| (flags << COPYFILE_SAME_SHIFT);
+
+	++ctx->stats.up_to_date;
+
+	if (callback)
+	{
+		copyfile_progress_t progress;
+
+		progress.data.offset = st->st_size;
+		progress.data.size = st->st_size;
+
+		if (callback(COPYFILE_UP_TO_DATE, COPYFILE_REGULAR, progress,
+					callback_data, 0))
+			return COPYFILE_ABORTED;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+int copyfile_quick_check(copyfile_ctx_t* ctx, const char* dest,
+		const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_error_t* ret,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct stat dest_st;
+
+	if (!ctx || !(ctx->options & COPYFILE_QUICK_CHECK)
+			|| (ctx->options & COPYFILE_NO_SKIP))
+		return 0;
+	if (!S_ISREG(st->st_mode))
+		return 0;
+
+#ifdef S_IFLNK
+	if (lstat(dest, &dest_st))
+		return 0;
+#else
+	if (stat(dest, &dest_st))
+		return 0;
+#endif
+
+	if (!S_ISREG(dest_st.st_mode) || dest_st.st_size != st->st_size
+			|| !same_mtime(&dest_st, st))
+		return 0;
+
+	*ret = copyfile_up_to_date(ctx, st, flags, result_flags,
+			callback, callback_data);
+	return 1;
+}
@@ -0,0 +1,120 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#ifdef HAVE_LGETXATTR
+#	include <sys/xattr.h>
+#	include <string.h>
+#	include <errno.h>
+
+/* the initial list buffer size, big enough for most files */
+static const size_t initial_list_size = COPYFILE_BUFFER_SIZE / 2;
+
+static unsigned int classify_xattr(const char* name)
+{
+	if (!strncmp(name, "user.", 5) || !strncmp(name, "trusted.", 8))
+		return COPYFILE_XATTR_FOUND_REGULAR;
+	if (!strcmp(name, "system.posix_acl_access"))
+		return COPYFILE_XATTR_FOUND_ACL_ACCESS;
+	if (!strcmp(name, "system.posix_acl_default"))
+		return COPYFILE_XATTR_FOUND_ACL_DEFAULT;
+	if (!strcmp(name, "security.capability"))
+		return COPYFILE_XATTR_FOUND_CAP;
+	return 0;
+}
+
+copyfile_error_t copyfile_scan_xattr(copyfile_ctx_t* ctx,
+		struct copyfile_arena* arena, const char* source,
+		const struct stat* st, struct copyfile_xattr_scan* scan)
+{
+	size_t size = arena->size;
+	const char* n;
+
+	scan->list = 0;
+	scan->len = 0;
+	scan->found = 0;
+
+	if (st && copyfile_fs_lacks(ctx, st->st_dev, COPYFILE_FS_NO_XATTR))
+		return COPYFILE_NO_ERROR;
+
+	if (size < initial_list_size)
+		size = initial_list_size;
+
+	while (1)
+	{
+		char* buf = copyfile_arena_reserve(arena, size);
+
+		if (!buf)
+			return COPYFILE_ERROR_MALLOC;
+
+		/* try to fit the list in the buffer we have; query the size
+		 * only if it is too small. */
+		scan->len = llistxattr(source, buf, arena->size);
+		if (scan->len != -1)
+			break;
+
+		if (errno == ERANGE)
+		{
+			ssize_t needed = llistxattr(source, 0, 0);
+
+			if (needed == -1)
+				return COPYFILE_ERROR_XATTR_LIST;
+			/* it can grow in the meantime, so ask for a bit more */
+			size = needed + initial_list_size;
+		}
+		/* if source fs doesn't support them, it doesn't have them. */
+		else if (errno == EOPNOTSUPP)
+		{
+			scan->len = 0;
+			if (st)
+				copyfile_fs_set_lacks(ctx, st->st_dev, COPYFILE_FS_NO_XATTR);
+			return COPYFILE_NO_ERROR;
+		}
+		else
+			return COPYFILE_ERROR_XATTR_LIST;
+	}
+
+	scan->list = arena->ptr;
+	for (n = scan->list; n < &scan->list[scan->len]; n = strchr(n, 0) + 1)
+		scan->found |= classify_xattr(n);
+
+	return COPYFILE_NO_ERROR;
+}
+
+ssize_t copyfile_get_xattr(struct copyfile_arena* arena,
+		const char* path, const char* name)
+{
+	size_t size = arena->size;
+
+	if (size < initial_list_size)
+		size = initial_list_size;
+
+	while (1)
+	{
+		ssize_t len;
+		char* buf = copyfile_arena_reserve(arena, size);
+
+		if (!buf)
+			return -1;
+
+		len = lgetxattr(path, name, buf, arena->size);
+		if (len != -1 || errno != ERANGE)
+			return len;
+
+		len = lgetxattr(path, name, 0, 0);
+		if (len == -1)
+			return -1;
+		size = len + initial_list_size;
+	}
+}
+
+#endif /*HAVE_LGETXATTR*/
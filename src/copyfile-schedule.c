@@ -0,0 +1,120 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+struct schedule_key
+{
+	dev_t dev;
+	/* the files with a known location come first */
+	int by_inode;
+	uint64_t key;
+	size_t index;
+};
+
+static int compare_keys(const void* a, const void* b)
+{
+	const struct schedule_key* ka = a;
+	const struct schedule_key* kb = b;
+
+	if (ka->dev != kb->dev)
+		return ka->dev < kb->dev ? -1 : 1;
+	if (ka->by_inode != kb->by_inode)
+		return ka->by_inode - kb->by_inode;
+	if (ka->key != kb->key)
+		return ka->key < kb->key ? -1 : 1;
+	/* keep the listed order otherwise */
+	return ka->index < kb->index ? -1 : ka->index > kb->index;
+}
+
+static void find_key(struct schedule_key* k,
+		const copyfile_batch_entry_t* e, int physical)
+{
+	struct stat buf;
+	const struct stat* st = e->st;
+
+	k->dev = 0;
+	k->by_inode = 1;
+	k->key = 0;
+
+	if (!st)
+	{
+#ifdef S_IFLNK
+		if (lstat(e->source, &buf))
+			return;
+#else
+		if (stat(e->source, &buf))
+			return;
+#endif
+		st = &buf;
+	}
+
+	k->dev = st->st_dev;
+	k->key = st->st_ino;
+
+	if (physical && S_ISREG(st->st_mode) && st->st_size)
+	{
+		int fd = open(e->source, O_RDONLY);
+
+		if (fd != -1)
+		{
+			off_t location;
+
+			if (!copyfile_first_extent(fd, &location))
+			{
+				k->by_inode = 0;
+				k->key = location;
+			}
+			close(fd);
+		}
+	}
+}
+
+size_t* copyfile_schedule(const copyfile_ctx_t* ctx,
+		const copyfile_batch_entry_t* entries, size_t count)
+{
+	struct schedule_key* keys;
+	size_t* order;
+	size_t i;
+
+	if (!ctx || ctx->schedule == COPYFILE_SCHEDULE_LISTED || count < 2)
+		return 0;
+
+	keys = malloc(count * sizeof(*keys));
+	if (!keys)
+		return 0;
+	order = malloc(count * sizeof(*order));
+	if (!order)
+	{
+		free(keys);
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		find_key(&keys[i], &entries[i],
+				ctx->schedule == COPYFILE_SCHEDULE_PHYSICAL);
+		keys[i].index = i;
+	}
+
+	qsort(keys, count, sizeof(*keys), compare_keys);
+	for (i = 0; i < count; ++i)
+		order[i] = keys[i].index;
+
+	free(keys);
+	return order;
+}
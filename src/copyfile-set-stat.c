@@ -9,6 +9,7 @@
 
 #include "libcopyfile.h"
 #include "common.h"
+#include "internal.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -19,7 +20,7 @@
 #include <utime.h>
 #include <errno.h>
 
-static unsigned int copy_owner(const char* path,
+static unsigned int copy_owner(const char* path, int fd,
 		const struct stat* st, unsigned int flags)
 {
 #ifdef HAVE_CHOWN
@@ -29,6 +30,17 @@ static unsigned int copy_owner(const char* path,
 	gid_t new_group = flags & COPYFILE_COPY_GROUP
 		? st->st_gid : -1;
 
+#	ifdef HAVE_FCHOWN
+
+	if (fd != -1)
+	{
+		if (!fchown(fd, new_user, new_group))
+			return flags & COPYFILE_COPY_OWNER;
+		return 0;
+	}
+
+#	endif /*HAVE_FCHOWN*/
+
 #	ifdef HAVE_LCHOWN
 
 	if (!lchown(path, new_user, new_group))
@@ -54,9 +66,20 @@ static unsigned int copy_owner(const char* path,
 	return 0;
 }
 
-static unsigned int copy_mode(const char* path,
+static unsigned int copy_mode(const char* path, int fd,
 		const struct stat* st, unsigned int flags)
 {
+#ifdef HAVE_FCHMOD
+
+	if (fd != -1)
+	{
+		if (!fchmod(fd, st->st_mode & all_perm_bits))
+			return COPYFILE_COPY_MODE;
+		return 0;
+	}
+
+#endif /*HAVE_FCHMOD*/
+
 #ifdef HAVE_FCHMODAT
 
 #	ifdef S_IFLNK
@@ -91,7 +114,18 @@ static unsigned int copy_mode(const char* path,
 	return 0;
 }
 
-static unsigned int copy_times(const char* path,
+static void get_times(const struct stat* st, struct timespec t[2])
+{
+#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC /* BSD */
+	t[0] = st->st_atimespec;
+	t[1] = st->st_mtimespec;
+#else /*!HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+	t[0] = st->st_atim;
+	t[1] = st->st_mtim;
+#endif /*HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+}
+
+static unsigned int copy_times(const char* path, int fd,
 		const struct stat* st, unsigned int flags)
 {
 #ifndef HAVE_UTIMENSAT
@@ -110,13 +144,7 @@ static unsigned int copy_times(const char* path,
 	{
 		struct timespec t[2];
 
-#	ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC /* BSD */
-		t[0] = st->st_atimespec;
-		t[1] = st->st_mtimespec;
-#	else /*!HAVE_STRUCT_STAT_ST_ATIMESPEC*/
-		t[0] = st->st_atim;
-		t[1] = st->st_mtim;
-#	endif /*HAVE_STRUCT_STAT_ST_ATIMESPEC*/
+		get_times(st, t);
 
 #	ifdef HAVE_UTIMENSAT
 
@@ -125,6 +153,15 @@ static unsigned int copy_times(const char* path,
 		if (!(flags & COPYFILE_COPY_MTIME))
 			t[1].tv_nsec = UTIME_OMIT;
 
+#		ifdef HAVE_FUTIMENS
+		if (fd != -1)
+		{
+			if (!futimens(fd, t))
+				return (flags & COPYFILE_COPY_TIMES);
+			return 0;
+		}
+#		endif /*HAVE_FUTIMENS*/
+
 		{
 #	ifdef S_IFLNK
 			int at_flags = S_ISLNK(st->st_mode)
@@ -177,24 +214,87 @@ static unsigned int copy_times(const char* path,
 	return 0;
 }
 
-unsigned int copyfile_set_stat(const char* path,
-		const struct stat* st, unsigned int flags)
+/* find which of the requested properties are equal already */
+static unsigned int same_stat(const struct stat* st,
+		const struct stat* cur, unsigned int flags)
+{
+	unsigned int ret = 0;
+
+	if (st->st_uid == cur->st_uid)
+		ret |= COPYFILE_COPY_USER;
+	if (st->st_gid == cur->st_gid)
+		ret |= COPYFILE_COPY_GROUP;
+	if ((st->st_mode & all_perm_bits) == (cur->st_mode & all_perm_bits))
+		ret |= COPYFILE_COPY_MODE;
+
+	{
+		struct timespec want[2], have[2];
+
+		get_times(st, want);
+		get_times(cur, have);
+
+		if (want[0].tv_sec == have[0].tv_sec
+				&& want[0].tv_nsec == have[0].tv_nsec)
+			ret |= COPYFILE_COPY_ATIME;
+		if (want[1].tv_sec == have[1].tv_sec
+				&& want[1].tv_nsec == have[1].tv_nsec)
+			ret |= COPYFILE_COPY_MTIME;
+	}
+
+	return ret & flags;
+}
+
+unsigned int copyfile_set_stat_diff(const char* path, int fd,
+		const struct stat* st, const struct stat* cur,
+		unsigned int flags)
 {
 	unsigned int ret = 0;
+	unsigned int same = 0;
 
 	assert(st);
 
-	if (!flags)
-		flags = COPYFILE_COPY_STAT;
+	if (cur)
+		same = same_stat(st, cur, flags & COPYFILE_COPY_STAT);
 
-	if (flags & COPYFILE_COPY_OWNER)
-		ret |= copy_owner(path, st, flags);
+	if (flags & COPYFILE_COPY_OWNER & ~same)
+	{
+		unsigned int done = copy_owner(path, fd, st, flags & ~same);
+
+		/* chown() may have reset the special mode bits */
+		if (done)
+			same &= ~COPYFILE_COPY_MODE;
+		ret |= done;
+	}
 
-	if (flags & COPYFILE_COPY_MODE)
-		ret |= copy_mode(path, st, flags);
+	if (flags & COPYFILE_COPY_MODE & ~same)
+		ret |= copy_mode(path, fd, st, flags);
 
-	if (flags & COPYFILE_COPY_TIMES)
-		ret |= copy_times(path, st, flags);
+	if (flags & COPYFILE_COPY_TIMES & ~same)
+		ret |= copy_times(path, fd, st, flags & ~same);
+
+	return ret | same | (same << COPYFILE_SAME_SHIFT);
+}
+
+unsigned int copyfile_set_stat(const char* path,
+		const struct stat* st, unsigned int flags)
+{
+	struct stat buf;
+	const struct stat* cur = 0;
+
+	/* no properties requested means all of them, as before */
+	if (!(flags & ~COPYFILE_DIFF_METADATA))
+		flags |= COPYFILE_COPY_STAT;
+
+	if (flags & COPYFILE_DIFF_METADATA)
+	{
+#ifdef S_IFLNK
+		if (!lstat(path, &buf))
+			cur = &buf;
+#else
+		if (!stat(path, &buf))
+			cur = &buf;
+#endif
+	}
 
-	return ret;
+	return copyfile_set_stat_diff(path, -1, st, cur, flags);
 }
@@ -0,0 +1,286 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef O_DIRECTORY
+#	define O_DIRECTORY 0
+#endif
+
+/* whether files need to be synced one by one */
+static int sync_per_file(const copyfile_ctx_t* ctx)
+{
+	unsigned int mode = ctx->durability & COPYFILE_SYNC_MODE_MASK;
+
+#ifndef HAVE_SYNCFS
+	/* without syncfs(), the batch degrades to per-file syncing */
+	if (mode == COPYFILE_SYNC_BATCH)
+		return 1;
+#endif
+
+	return mode == COPYFILE_SYNC_FILE;
+}
+
+int copyfile_open_parent(const char* path)
+{
+	const char* slash = strrchr(path, '/');
+	char buf[256];
+	struct copyfile_arena name;
+	char* dir;
+	int fd;
+	int saved_errno;
+
+	if (!slash)
+		return open(".", O_RDONLY | O_DIRECTORY);
+	if (slash == path)
+		return open("/", O_RDONLY | O_DIRECTORY);
+
+	copyfile_arena_init(&name, buf, sizeof(buf));
+	dir = copyfile_arena_reserve(&name, slash - path + 1);
+	if (!dir)
+		return -1;
+
+	memcpy(dir, path, slash - path);
+	dir[slash - path] = 0;
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+	saved_errno = errno;
+	copyfile_arena_free(&name);
+	errno = saved_errno;
+	return fd;
+}
+
+copyfile_error_t copyfile_sync_add_fs(copyfile_ctx_t* ctx, dev_t dev,
+		int fd)
+{
+	if (ctx->sync_fs_used == ctx->sync_fs_size)
+	{
+		unsigned int new_size = ctx->sync_fs_size
+			? ctx->sync_fs_size * 2 : 4;
+		struct copyfile_sync_fs* n = realloc(ctx->sync_fs,
+				new_size * sizeof(*n));
+
+		if (!n)
+			return COPYFILE_ERROR_MALLOC;
+
+		ctx->sync_fs = n;
+		ctx->sync_fs_size = new_size;
+	}
+
+	ctx->sync_fs[ctx->sync_fs_used].dev = dev;
+	ctx->sync_fs[ctx->sync_fs_used].fd = fd;
+	++ctx->sync_fs_used;
+
+	return COPYFILE_NO_ERROR;
+}
+
+#ifdef HAVE_SYNCFS
+/* remember the filesystem holding @path for copyfile_ctx_commit(). */
+static copyfile_error_t register_fs(copyfile_ctx_t* ctx, const char* path)
+{
+	const char* slash = strrchr(path, '/');
+	size_t dlen = slash ? (size_t) (slash - path) + 1 : 0;
+	struct stat st;
+	unsigned int i;
+	int fd;
+
+	/* most of the time, files keep coming into the same directory */
+	if (ctx->sync_last_dir.ptr && dlen == ctx->sync_last_dir_len
+			&& !memcmp(ctx->sync_last_dir.ptr, path, dlen))
+		return COPYFILE_NO_ERROR;
+
+	fd = copyfile_open_parent(path);
+	if (fd == -1 || fstat(fd, &st))
+	{
+		int saved_errno = errno;
+
+		if (fd != -1)
+			close(fd);
+		errno = saved_errno;
+		return COPYFILE_ERROR_SYNC;
+	}
+
+	for (i = 0; i < ctx->sync_fs_used; ++i)
+	{
+		if (ctx->sync_fs[i].dev == st.st_dev)
+		{
+			close(fd);
+			fd = -1;
+			break;
+		}
+	}
+
+	if (fd != -1 && copyfile_sync_add_fs(ctx, st.st_dev, fd))
+	{
+		close(fd);
+		return COPYFILE_ERROR_MALLOC;
+	}
+
+	/* one byte more, since dlen may be 0 */
+	if (copyfile_arena_reserve(&ctx->sync_last_dir, dlen + 1))
+	{
+		memcpy(ctx->sync_last_dir.ptr, path, dlen);
+		ctx->sync_last_dir_len = dlen;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+#endif /*HAVE_SYNCFS*/
+
+copyfile_error_t copyfile_sync_fd(copyfile_ctx_t* ctx, int fd, int full)
+{
+	int ret;
+
+	if (!ctx || !sync_per_file(ctx))
+		return COPYFILE_NO_ERROR;
+
+#ifdef HAVE_FDATASYNC
+	if (!full)
+		ret = fdatasync(fd);
+	else
+#endif
+		ret = fsync(fd);
+
+	return ret ? COPYFILE_ERROR_SYNC : COPYFILE_NO_ERROR;
+}
+
+copyfile_error_t copyfile_sync_dir(copyfile_ctx_t* ctx, const char* path)
+{
+	if (!ctx)
+		return COPYFILE_NO_ERROR;
+
+	if (sync_per_file(ctx))
+	{
+		if (ctx->durability & COPYFILE_SYNC_DIRS)
+		{
+			int fd = copyfile_open_parent(path);
+			int ret;
+			int saved_errno;
+
+			if (fd == -1)
+				return COPYFILE_ERROR_SYNC;
+
+			ret = fsync(fd);
+			saved_errno = errno;
+			close(fd);
+			errno = saved_errno;
+
+			if (ret)
+				return COPYFILE_ERROR_SYNC;
+		}
+	}
+#ifdef HAVE_SYNCFS
+	else if ((ctx->durability & COPYFILE_SYNC_MODE_MASK)
+			== COPYFILE_SYNC_BATCH)
+		return register_fs(ctx, path);
+#endif
+
+	return COPYFILE_NO_ERROR;
+}
+
+copyfile_error_t copyfile_sync_now(copyfile_ctx_t* ctx, const char* path)
+{
+	struct stat st;
+	int fd;
+	int ret;
+	int saved_errno;
+
+	if (!ctx || !(ctx->durability & COPYFILE_SYNC_MODE_MASK))
+		return COPYFILE_NO_ERROR;
+
+#ifdef HAVE_SYNCFS
+	if (!sync_per_file(ctx))
+	{
+		copyfile_error_t sret = register_fs(ctx, path);
+
+		if (sret)
+			return sret;
+		return copyfile_ctx_commit(ctx);
+	}
+#endif
+
+	/* the metadata was set after the data sync; only the regular
+	 * files and directories can be opened safely for fsync() */
+#ifdef S_IFLNK
+	if (lstat(path, &st))
+		return COPYFILE_ERROR_SYNC;
+#else
+	if (stat(path, &st))
+		return COPYFILE_ERROR_SYNC;
+#endif
+	if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))
+	{
+		fd = open(path, O_RDONLY);
+		if (fd == -1)
+			return COPYFILE_ERROR_SYNC;
+
+		ret = fsync(fd);
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		if (ret)
+			return COPYFILE_ERROR_SYNC;
+	}
+
+	fd = copyfile_open_parent(path);
+	if (fd == -1)
+		return COPYFILE_ERROR_SYNC;
+
+	ret = fsync(fd);
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+
+	return ret ? COPYFILE_ERROR_SYNC : COPYFILE_NO_ERROR;
+}
+
+void copyfile_sync_forget(copyfile_ctx_t* ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->sync_fs_used; ++i)
+		close(ctx->sync_fs[i].fd);
+	ctx->sync_fs_used = 0;
+	ctx->sync_last_dir_len = 0;
+	copyfile_arena_free(&ctx->sync_last_dir);
+}
+
+copyfile_error_t copyfile_ctx_commit(copyfile_ctx_t* ctx)
+{
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	int saved_errno;
+
+#ifdef HAVE_SYNCFS
+	unsigned int i;
+
+	for (i = 0; i < ctx->sync_fs_used; ++i)
+	{
+		if (syncfs(ctx->sync_fs[i].fd) && !ret)
+		{
+			ret = COPYFILE_ERROR_SYNC;
+			saved_errno = errno;
+		}
+	}
+#endif
+
+	copyfile_sync_forget(ctx);
+
+	if (ret)
+		errno = saved_errno;
+	return ret;
+}
@@ -0,0 +1,253 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+/* the number of random names tried before giving up */
+static const int max_name_tries = 64;
+
+static const char name_chars[] =
+	"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+/* the length of the directory part of @path, including the trailing
+ * slash (if any). */
+static size_t dirname_len(const char* path)
+{
+	const char* slash = strrchr(path, '/');
+
+	return slash ? (size_t) (slash - path) + 1 : 0;
+}
+
+/* the names are made by the parallel workers concurrently */
+static unsigned long name_counter = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t name_counter_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static unsigned long next_name_counter(void)
+{
+	unsigned long ret;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&name_counter_lock);
+#endif
+	ret = ++name_counter;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&name_counter_lock);
+#endif
+
+	return ret;
+}
+
+/* put a new hidden temporary name for @dest into @arena:
+ * 'dir/.name.XXXXXX'. returns NULL on allocation failure. */
+static char* make_temp_name(struct copyfile_arena* arena, const char* dest)
+{
+	size_t dlen = dirname_len(dest);
+	size_t blen = strlen(dest + dlen);
+	char* buf = copyfile_arena_reserve(arena, dlen + blen + 10);
+	unsigned long r;
+	int i;
+
+	if (!buf)
+		return 0;
+
+	/* the names don't need to be unpredictable; O_EXCL protects us
+	 * from collisions and we just retry. */
+	r = (unsigned long) getpid() * 2654435761UL
+		^ (unsigned long) time(0) ^ (next_name_counter() * 40503UL);
+
+	memcpy(buf, dest, dlen);
+	buf[dlen] = '.';
+	memcpy(&buf[dlen + 1], dest + dlen, blen);
+	buf[dlen + blen + 1] = '.';
+	for (i = 0; i < 6; ++i)
+	{
+		buf[dlen + blen + 2 + i] = name_chars[r % (sizeof(name_chars) - 1)];
+		r /= sizeof(name_chars) - 1;
+	}
+	buf[dlen + blen + 8] = 0;
+
+	return buf;
+}
+
+#ifdef O_TMPFILE
+/* give a name to the anonymous file @fd. */
+static int link_fd(int fd, const char* path)
+{
+	char proc_path[32];
+
+#	ifdef AT_EMPTY_PATH
+	/* this requires CAP_DAC_READ_SEARCH on older kernels */
+	if (!linkat(fd, "", AT_FDCWD, path, AT_EMPTY_PATH))
+		return 0;
+	if (errno != ENOENT && errno != EPERM && errno != EINVAL)
+		return -1;
+#	endif
+
+	sprintf(proc_path, "/proc/self/fd/%d", fd);
+	return linkat(AT_FDCWD, proc_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+}
+#endif /*O_TMPFILE*/
+
+copyfile_error_t copyfile_tmpfile_open(struct copyfile_tmpfile* tmp,
+		const char* dest, mode_t mode)
+{
+	int i;
+
+	copyfile_arena_init(&tmp->name, tmp->name_buf, sizeof(tmp->name_buf));
+	tmp->path = 0;
+
+#ifdef O_TMPFILE
+	{
+		size_t dlen = dirname_len(dest);
+		char* dir = copyfile_arena_reserve(&tmp->name, dlen + 2);
+
+		if (!dir)
+			return COPYFILE_ERROR_MALLOC;
+
+		if (dlen)
+		{
+			memcpy(dir, dest, dlen);
+			dir[dlen] = 0;
+		}
+		else
+			strcpy(dir, ".");
+
+		tmp->fd = open(dir, O_TMPFILE | O_WRONLY, mode);
+		if (tmp->fd != -1)
+			return COPYFILE_NO_ERROR;
+
+		/* anything but 'not supported here' is a real error */
+		if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+			return COPYFILE_ERROR_OPEN_DEST;
+	}
+#endif /*O_TMPFILE*/
+
+	for (i = 0; i < max_name_tries; ++i)
+	{
+		tmp->path = make_temp_name(&tmp->name, dest);
+		if (!tmp->path)
+			return COPYFILE_ERROR_MALLOC;
+
+		tmp->fd = open(tmp->path, O_WRONLY | O_CREAT | O_EXCL, mode);
+		if (tmp->fd != -1)
+			return COPYFILE_NO_ERROR;
+		if (errno != EEXIST)
+			break;
+	}
+
+	{
+		int saved_errno = errno;
+
+		copyfile_arena_free(&tmp->name);
+		tmp->path = 0;
+		errno = saved_errno;
+	}
+	return COPYFILE_ERROR_OPEN_DEST;
+}
+
+copyfile_error_t copyfile_tmpfile_publish(struct copyfile_tmpfile* tmp,
+		const char* dest)
+{
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	int saved_errno;
+
+#ifdef O_TMPFILE
+	if (!tmp->path)
+	{
+		int i;
+
+		if (!link_fd(tmp->fd, dest))
+			goto done;
+		if (errno != EEXIST)
+		{
+			ret = COPYFILE_ERROR_LINK;
+			goto done;
+		}
+
+		/* linkat() can't replace, so the file needs a temporary name
+		 * for the short while before rename(). it is unlinked if that
+		 * fails; only a crash in between can leave it over. */
+		for (i = 0; i < max_name_tries; ++i)
+		{
+			tmp->path = make_temp_name(&tmp->name, dest);
+			if (!tmp->path)
+			{
+				ret = COPYFILE_ERROR_MALLOC;
+				goto done;
+			}
+
+			if (!link_fd(tmp->fd, tmp->path))
+				break;
+			tmp->path = 0;
+			if (errno != EEXIST)
+				break;
+		}
+
+		if (!tmp->path)
+		{
+			ret = COPYFILE_ERROR_LINK;
+			goto done;
+		}
+	}
+#endif /*O_TMPFILE*/
+
+	if (rename(tmp->path, dest))
+	{
+		ret = COPYFILE_ERROR_RENAME;
+		saved_errno = errno;
+		unlink(tmp->path);
+		errno = saved_errno;
+	}
+
+#ifdef O_TMPFILE
+done:
+#endif
+	saved_errno = errno;
+	if (close(tmp->fd) && !ret) /* delayed error? */
+	{
+		ret = COPYFILE_ERROR_WRITE;
+		saved_errno = errno;
+	}
+	copyfile_arena_free(&tmp->name);
+	tmp->path = 0;
+
+	errno = saved_errno;
+	return ret;
+}
+
+void copyfile_tmpfile_discard(struct copyfile_tmpfile* tmp)
+{
+	int saved_errno = errno;
+
+	/* an anonymous file just vanishes */
+	close(tmp->fd);
+	if (tmp->path)
+		unlink(tmp->path);
+	copyfile_arena_free(&tmp->name);
+	tmp->path = 0;
+
+	errno = saved_errno;
+}
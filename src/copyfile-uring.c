@@ -0,0 +1,425 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+/* liburing is not required; the ring is simple enough to drive
+ * directly */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_DECL_IORING_OP_MKDIRAT)
+#	if HAVE_DECL_IORING_OP_MKDIRAT && defined(STATX_BASIC_STATS)
+#		define COPYFILE_HAVE_URING 1
+#	endif
+#endif
+
+#ifdef COPYFILE_HAVE_URING
+#	include <linux/io_uring.h>
+#	include <sys/syscall.h>
+#	include <sys/mman.h>
+#	include <sys/sysmacros.h>
+#	include <fcntl.h>
+#endif
+
+static void run_sync(struct copyfile_meta_op* op)
+{
+	int ret;
+
+	switch (op->opcode)
+	{
+		case COPYFILE_META_LSTAT:
+#ifdef S_IFLNK
+			ret = lstat(op->path, op->st);
+#else
+			ret = stat(op->path, op->st);
+#endif
+			break;
+		case COPYFILE_META_MKDIR:
+#ifdef _WIN32
+			ret = mkdir(op->path);
+#else
+			ret = mkdir(op->path, perm_dir);
+#endif
+			break;
+		case COPYFILE_META_UNLINK:
+			ret = unlink(op->path);
+			break;
+		case COPYFILE_META_RMDIR:
+			ret = rmdir(op->path);
+			break;
+		default:
+			assert(not_reached);
+			errno = EINVAL;
+			ret = -1;
+	}
+
+	op->error = ret ? errno : 0;
+}
+
+#ifdef COPYFILE_HAVE_URING
+
+struct copyfile_uring
+{
+	int fd;
+	/* the number of operations submitted at a time */
+	unsigned int entries;
+
+	void* sq_ring;
+	size_t sq_ring_size;
+	unsigned int* sq_tail;
+	unsigned int sq_mask;
+	unsigned int* sq_array;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+
+	void* cq_ring;
+	size_t cq_ring_size;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe* cqes;
+
+	int supported[COPYFILE_META_MAX];
+	/* the results of the submitted COPYFILE_META_LSTAT */
+	struct statx stx[COPYFILE_URING_ENTRIES];
+};
+
+static const unsigned char opcodes[COPYFILE_META_MAX] =
+{
+	IORING_OP_STATX,
+	IORING_OP_MKDIRAT,
+	IORING_OP_UNLINKAT,
+	IORING_OP_UNLINKAT
+};
+
+static void uring_free(struct copyfile_uring* r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	free(r);
+}
+
+static void* map_ring(int fd, size_t size, off_t offset)
+{
+	void* p = mmap(0, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return p != MAP_FAILED ? p : 0;
+}
+
+/* set up a ring, or return NULL if io_uring can not be used */
+static struct copyfile_uring* uring_create(void)
+{
+	struct io_uring_params params;
+	struct io_uring_probe* probe;
+	struct copyfile_uring* r;
+	char* sq;
+	char* cq;
+	int i;
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		return 0;
+	memset(r, 0, sizeof(*r));
+
+	memset(&params, 0, sizeof(params));
+	r->fd = syscall(__NR_io_uring_setup, COPYFILE_URING_ENTRIES, &params);
+	if (r->fd == -1)
+	{
+		free(r);
+		return 0;
+	}
+
+	r->entries = params.sq_entries < COPYFILE_URING_ENTRIES
+		? params.sq_entries : COPYFILE_URING_ENTRIES;
+	r->sq_ring_size = params.sq_off.array
+		+ params.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->sq_ring = r->cq_ring = map_ring(r->fd, r->sq_ring_size,
+				IORING_OFF_SQ_RING);
+	}
+	else
+	{
+		r->sq_ring = map_ring(r->fd, r->sq_ring_size, IORING_OFF_SQ_RING);
+		r->cq_ring = map_ring(r->fd, r->cq_ring_size, IORING_OFF_CQ_RING);
+	}
+	r->sqes = map_ring(r->fd, r->sqes_size, IORING_OFF_SQES);
+	if (!r->sq_ring || !r->cq_ring || !r->sqes)
+	{
+		uring_free(r);
+		return 0;
+	}
+
+	sq = r->sq_ring;
+	r->sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+	r->sq_mask = *(unsigned int*) (sq + params.sq_off.ring_mask);
+	r->sq_array = (unsigned int*) (sq + params.sq_off.array);
+
+	cq = r->cq_ring;
+	r->cq_head = (unsigned int*) (cq + params.cq_off.head);
+	r->cq_tail = (unsigned int*) (cq + params.cq_off.tail);
+	r->cq_mask = *(unsigned int*) (cq + params.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+	/* the kernel may have the ring but not all the operations */
+	probe = malloc(sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	if (!probe)
+	{
+		uring_free(r);
+		return 0;
+	}
+	memset(probe, 0, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+				probe, 256))
+	{
+		free(probe);
+		uring_free(r);
+		return 0;
+	}
+
+	for (i = 0; i < COPYFILE_META_MAX; ++i)
+		r->supported[i] = opcodes[i] <= probe->last_op
+			&& (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+
+	return r;
+}
+
+static void statx_to_stat(const struct statx* stx, struct stat* st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* collect the completions in the ring */
+static void uring_reap(struct copyfile_uring* r,
+		struct copyfile_meta_op* ops, unsigned int* done)
+{
+	unsigned int head = *r->cq_head;
+	unsigned int cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != cq_tail; ++head)
+	{
+		const struct io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+		struct copyfile_meta_op* op = &ops[cqe->user_data];
+
+		op->error = cqe->res < 0 ? -cqe->res : 0;
+		if (!op->error && op->opcode == COPYFILE_META_LSTAT)
+			statx_to_stat(&r->stx[cqe->user_data], op->st);
+		++*done;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* submit @count (up to the ring size) operations at once, and wait
+ * for all of them. returns -1 if the ring failed; the operations
+ * which did not complete have error == -1 then. the ones submitted
+ * are waited for even so, as the kernel writes to the ring and reads
+ * the paths until they complete -- if even that fails, -2 is returned
+ * and the ring must not be freed. */
+static int uring_submit(struct copyfile_uring* r,
+		struct copyfile_meta_op* ops, unsigned int count)
+{
+	unsigned int tail = *r->sq_tail;
+	unsigned int submitted = 0;
+	unsigned int done = 0;
+	unsigned int i;
+	int hold_errno;
+
+	for (i = 0; i < count; ++i)
+	{
+		struct copyfile_meta_op* op = &ops[i];
+		unsigned int idx = (tail + i) & r->sq_mask;
+		struct io_uring_sqe* sqe = &r->sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcodes[op->opcode];
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t) op->path;
+		sqe->user_data = i;
+
+		switch (op->opcode)
+		{
+			case COPYFILE_META_LSTAT:
+				sqe->len = STATX_BASIC_STATS;
+				sqe->off = (uintptr_t) &r->stx[i];
+				sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+				break;
+			case COPYFILE_META_MKDIR:
+				sqe->len = perm_dir;
+				break;
+			case COPYFILE_META_RMDIR:
+				sqe->unlink_flags = AT_REMOVEDIR;
+				break;
+			default:
+				break;
+		}
+
+		/* unlike IOSQE_IO_LINK, the chain goes on after a failure */
+		if (op->chain && i + 1 < count)
+			sqe->flags = IOSQE_IO_HARDLINK;
+
+		r->sq_array[idx] = idx;
+		op->error = -1;
+	}
+	__atomic_store_n(r->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+	while (done < count)
+	{
+		long ret = syscall(__NR_io_uring_enter, r->fd, count - submitted,
+				count - done, IORING_ENTER_GETEVENTS, 0, 0);
+
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		submitted += ret;
+		uring_reap(r, ops, &done);
+	}
+
+	if (done == count)
+		return 0;
+
+	/* the ones not consumed by the kernel are never submitted now */
+	hold_errno = errno;
+	uring_reap(r, ops, &done);
+	while (done < submitted)
+	{
+		if (syscall(__NR_io_uring_enter, r->fd, 0, submitted - done,
+					IORING_ENTER_GETEVENTS, 0, 0) == -1 && errno != EINTR)
+		{
+			errno = hold_errno;
+			return -2;
+		}
+		uring_reap(r, ops, &done);
+	}
+
+	errno = hold_errno;
+	return -1;
+}
+
+#endif /*COPYFILE_HAVE_URING*/
+
+void copyfile_meta_run(copyfile_ctx_t* ctx, struct copyfile_meta_op* ops,
+		size_t count)
+{
+	size_t i = 0;
+
+#ifdef COPYFILE_HAVE_URING
+	struct copyfile_uring* r = 0;
+	struct copyfile_uring* own_ring = 0;
+	int ret;
+
+	if (ctx)
+	{
+		if (!ctx->uring_tried)
+		{
+			ctx->uring = uring_create();
+			ctx->uring_tried = 1;
+		}
+		r = ctx->uring;
+	}
+	else if (count >= COPYFILE_URING_MIN_BATCH)
+		r = own_ring = uring_create();
+
+	while (r && i < count)
+	{
+		size_t n;
+
+		/* the operations not supported by the kernel run in between,
+		 * keeping the order */
+		if (!r->supported[ops[i].opcode])
+		{
+			run_sync(&ops[i++]);
+			continue;
+		}
+
+		for (n = 1; n < r->entries && i + n < count
+				&& r->supported[ops[i + n].opcode]; ++n)
+			;
+
+		ret = uring_submit(r, &ops[i], n);
+		if (ret)
+		{
+			size_t j;
+
+			for (j = i; j < i + n; ++j)
+			{
+				if (ops[j].error == -1)
+					run_sync(&ops[j]);
+			}
+
+			/* don't try it again. a ring with operations still in
+			 * flight is leaked rather than freed under the kernel. */
+			if (ret != -2)
+				uring_free(r);
+			if (ctx)
+				ctx->uring = 0;
+			else
+				own_ring = 0;
+			r = 0;
+		}
+
+		i += n;
+	}
+
+	if (own_ring)
+		uring_free(own_ring);
+#endif
+
+	for (; i < count; ++i)
+		run_sync(&ops[i]);
+}
+
+void copyfile_meta_free(copyfile_ctx_t* ctx)
+{
+#ifdef COPYFILE_HAVE_URING
+	if (ctx->uring)
+		uring_free(ctx->uring);
+#endif
+	ctx->uring = 0;
+}
@@ -0,0 +1,543 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#	include <sys/syscall.h>
+#endif
+
+#ifndef O_DIRECTORY
+#	define O_DIRECTORY 0
+#endif
+#ifndef O_NOFOLLOW
+#	define O_NOFOLLOW 0
+#endif
+
+/* read the directories straight into the buffer if possible */
+#ifdef SYS_getdents64
+#	define COPYFILE_GETDENTS 1
+
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+#else
+#	ifndef NAME_MAX
+#		define NAME_MAX 255
+#	endif
+#endif
+
+static int is_dot(const char* name)
+{
+	return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+/* close the handle of @d, remembering where to reopen it. returns -1
+ * if it can not be reopened later. */
+static int close_dir(struct copyfile_walk* w, struct copyfile_walk_dir* d)
+{
+#ifdef COPYFILE_GETDENTS
+	if (d->fd == -1)
+		return 0;
+	if (!d->eof)
+	{
+		off_t pos = lseek(d->fd, 0, SEEK_CUR);
+
+		if (pos == -1)
+			return -1;
+		d->pos = pos;
+	}
+	close(d->fd);
+	d->fd = -1;
+#else
+	/* the position is the number of entries read already */
+	if (!d->dir)
+		return 0;
+	closedir(d->dir);
+	d->dir = 0;
+#endif
+
+	--w->open_dirs;
+	return 0;
+}
+
+/* the descriptor of the open directory @d, or -1 */
+static int dir_fd(const struct copyfile_walk_dir* d)
+{
+#ifdef COPYFILE_GETDENTS
+	return d->fd;
+#elif defined(HAVE_DIRFD)
+	return d->dir ? dirfd((DIR*) d->dir) : -1;
+#else
+	return -1;
+#endif
+}
+
+/* open the directory @d, verifying it is the one lstat()-ed. it is
+ * opened by name in its parent (reopened first if need be), so that
+ * neither a symlink nor a directory moved in place is walked into,
+ * and the length of the path does not matter. */
+static copyfile_error_t open_dir(struct copyfile_walk* w,
+		struct copyfile_walk_dir* d)
+{
+	size_t idx = d - w->dirs;
+	struct copyfile_walk_dir* parent = idx ? &w->dirs[idx - 1] : 0;
+	const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW;
+	struct stat st;
+	int fd = -1;
+	size_t i;
+
+#ifdef HAVE_OPENAT
+	if (parent && parent->fd == -1 && !parent->dir)
+	{
+		copyfile_error_t ret = open_dir(w, parent);
+
+		if (ret)
+			return ret;
+	}
+#endif
+
+	/* make room closing the directories nearest to the top -- they
+	 * are the last ones to be read again */
+	for (i = 0; w->open_dirs >= COPYFILE_WALK_FDS && i < w->depth; ++i)
+	{
+		if (&w->dirs[i] != d && &w->dirs[i] != parent)
+			close_dir(w, &w->dirs[i]);
+	}
+
+#ifdef HAVE_OPENAT
+	if (parent && dir_fd(parent) != -1)
+		fd = openat(dir_fd(parent), strrchr(d->source, '/') + 1, flags);
+	else
+#endif
+		fd = open(d->source, flags);
+	if (fd == -1)
+		return COPYFILE_ERROR_READDIR;
+
+	if (fstat(fd, &st))
+	{
+		int saved_errno = errno;
+
+		close(fd);
+		errno = saved_errno;
+		return COPYFILE_ERROR_READDIR;
+	}
+	/* replaced since; don't go on in another directory */
+	if (st.st_dev != d->st.st_dev || st.st_ino != d->st.st_ino)
+	{
+		close(fd);
+		errno = ESTALE;
+		return COPYFILE_ERROR_READDIR;
+	}
+
+#ifdef COPYFILE_GETDENTS
+	d->fd = fd;
+	if (d->pos && lseek(d->fd, d->pos, SEEK_SET) == -1)
+	{
+		int saved_errno = errno;
+
+		close(d->fd);
+		d->fd = -1;
+		errno = saved_errno;
+		return COPYFILE_ERROR_READDIR;
+	}
+#else
+#	ifdef HAVE_FDOPENDIR
+	d->dir = fdopendir(fd);
+	if (!d->dir)
+	{
+		int saved_errno = errno;
+
+		close(fd);
+		errno = saved_errno;
+		return COPYFILE_ERROR_READDIR;
+	}
+#	else
+	close(fd);
+	d->dir = opendir(d->source);
+	if (!d->dir)
+		return COPYFILE_ERROR_READDIR;
+#	endif
+	for (i = 0; i < (size_t) d->pos; ++i)
+	{
+		if (!readdir(d->dir))
+			break;
+	}
+#endif
+
+	++w->open_dirs;
+	return COPYFILE_NO_ERROR;
+}
+
+static copyfile_error_t push_dir(struct copyfile_walk* w,
+		const char* source, const char* dest, const struct stat* st)
+{
+	struct copyfile_walk_dir* d;
+	size_t slen = strlen(source);
+	size_t dlen = strlen(dest);
+	char* path;
+	copyfile_error_t ret;
+
+	if (w->depth == w->dirs_size)
+	{
+		size_t new_size = w->dirs_size ? w->dirs_size * 2 : 16;
+		struct copyfile_walk_dir* dirs = realloc(w->dirs,
+				new_size * sizeof(*dirs));
+
+		if (!dirs)
+			return COPYFILE_ERROR_MALLOC;
+
+		memset(&dirs[w->dirs_size], 0,
+				(new_size - w->dirs_size) * sizeof(*dirs));
+		w->dirs = dirs;
+		w->dirs_size = new_size;
+	}
+
+	/* the storage of a directory left is reused */
+	d = &w->dirs[w->depth];
+	path = copyfile_arena_reserve(&d->path, slen + dlen + 2);
+	if (!path)
+		return COPYFILE_ERROR_MALLOC;
+	memcpy(path, source, slen + 1);
+	memcpy(&path[slen + 1], dest, dlen + 1);
+
+	d->source = path;
+	d->dest = &path[slen + 1];
+	d->st = *st;
+	d->ndirs = 0;
+	d->next_dir = 0;
+	d->nfiles = 0;
+	d->fd = -1;
+	d->dir = 0;
+	d->pos = 0;
+	d->eof = 0;
+
+	ret = open_dir(w, d);
+	if (ret)
+		return ret;
+
+	++w->depth;
+	return COPYFILE_NO_ERROR;
+}
+
+/* read the next names of @d into the dents buffer. returns
+ * the number of names (0 at the end) or -1 on error. the names
+ * are listed in the names arena. */
+static ssize_t read_names(struct copyfile_walk* w,
+		struct copyfile_walk_dir* d, const char*** names)
+{
+	const char** list;
+	size_t count = 0;
+	char* buf;
+
+	if (d->fd == -1 && !d->dir && open_dir(w, d))
+		return -1;
+
+	buf = copyfile_arena_reserve(&w->dents, COPYFILE_WALK_BUFFER);
+	if (!buf)
+		return -1;
+
+#ifdef COPYFILE_GETDENTS
+	while (1)
+	{
+		long rd = syscall(SYS_getdents64, d->fd, buf, COPYFILE_WALK_BUFFER);
+		long off;
+
+		if (rd == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rd == 0)
+		{
+			d->eof = 1;
+			close_dir(w, d);
+			return 0;
+		}
+
+		/* every entry takes at least 20 bytes */
+		list = (const char**) copyfile_arena_reserve(&w->names,
+				(rd / 20 + 1) * sizeof(*list));
+		if (!list)
+			return -1;
+
+		for (off = 0; off < rd; )
+		{
+			struct linux_dirent64* de = (struct linux_dirent64*) &buf[off];
+
+			if (!is_dot(de->d_name))
+				list[count++] = de->d_name;
+			off += de->d_reclen;
+		}
+
+		/* just the dots, read on */
+		if (count)
+			break;
+	}
+#else
+	{
+		size_t used = 0;
+
+		list = (const char**) copyfile_arena_reserve(&w->names,
+				COPYFILE_WALK_BUFFER / 2 * sizeof(*list));
+		if (!list)
+			return -1;
+
+		/* as long as any name fits */
+		while (used + NAME_MAX + 1 <= COPYFILE_WALK_BUFFER)
+		{
+			struct dirent* de;
+			size_t len;
+
+			errno = 0;
+			de = readdir(d->dir);
+			if (!de)
+			{
+				if (errno)
+					return -1;
+				d->eof = 1;
+				close_dir(w, d);
+				break;
+			}
+
+			++d->pos;
+			if (is_dot(de->d_name))
+				continue;
+
+			len = strlen(de->d_name) + 1;
+			memcpy(&buf[used], de->d_name, len);
+			list[count++] = &buf[used];
+			used += len;
+		}
+	}
+#endif
+
+	*names = list;
+	return count;
+}
+
+/* grow the entry lists of @d to hold @count entries */
+static int reserve_entries(struct copyfile_walk_dir* d, size_t count)
+{
+	struct copyfile_walk_entry* dirs;
+	struct copyfile_walk_entry* files;
+
+	if (count <= d->entries_size)
+		return 0;
+
+	dirs = realloc(d->dirs, count * sizeof(*dirs));
+	if (!dirs)
+		return -1;
+	d->dirs = dirs;
+	files = realloc(d->files, count * sizeof(*files));
+	if (!files)
+		return -1;
+	d->files = files;
+
+	d->entries_size = count;
+	return 0;
+}
+
+/* read and stat() the next batch of entries of @d */
+static copyfile_error_t read_batch(struct copyfile_walk* w,
+		struct copyfile_walk_dir* d)
+{
+	const char** names;
+	struct copyfile_meta_op* ops;
+	struct stat* st;
+	size_t slen = strlen(d->source);
+	size_t dlen = strlen(d->dest);
+	size_t size = 0;
+	ssize_t count;
+	ssize_t i;
+	char* p;
+
+	d->ndirs = 0;
+	d->next_dir = 0;
+	d->nfiles = 0;
+
+	count = read_names(w, d, &names);
+	if (count == -1)
+		return errno == ENOMEM ? COPYFILE_ERROR_MALLOC
+			: COPYFILE_ERROR_READDIR;
+	if (!count)
+		return COPYFILE_NO_ERROR;
+
+	/* the paths, as "source/name\0dest/name\0" */
+	for (i = 0; i < count; ++i)
+		size += slen + dlen + 2 * strlen(names[i]) + 4;
+
+	p = copyfile_arena_reserve(&d->names, size);
+	ops = (struct copyfile_meta_op*) copyfile_arena_reserve(&w->ops,
+			count * sizeof(*ops));
+	st = (struct stat*) copyfile_arena_reserve(&w->st, count * sizeof(*st));
+	if (!p || !ops || !st || reserve_entries(d, count))
+		return COPYFILE_ERROR_MALLOC;
+
+	for (i = 0; i < count; ++i)
+	{
+		size_t nlen = strlen(names[i]);
+
+		ops[i].opcode = COPYFILE_META_LSTAT;
+		ops[i].path = p;
+		ops[i].st = &st[i];
+		ops[i].chain = 0;
+
+		memcpy(p, d->source, slen);
+		p[slen] = '/';
+		memcpy(&p[slen + 1], names[i], nlen + 1);
+		p += slen + nlen + 2;
+		memcpy(p, d->dest, dlen);
+		p[dlen] = '/';
+		memcpy(&p[dlen + 1], names[i], nlen + 1);
+		p += dlen + nlen + 2;
+	}
+
+	/* stat() them all at once */
+	copyfile_meta_run(w->ctx, ops, count);
+
+	for (i = 0; i < count; ++i)
+	{
+		struct copyfile_walk_entry* e;
+
+		if (ops[i].error)
+		{
+			/* removed in the meantime? */
+			if (ops[i].error == ENOENT)
+				continue;
+			errno = ops[i].error;
+			return COPYFILE_ERROR_STAT;
+		}
+		if (w->skip && w->skip(w->skip_data, &st[i]))
+			continue;
+
+		if (S_ISDIR(st[i].st_mode))
+			e = &d->dirs[d->ndirs++];
+		else
+			e = &d->files[d->nfiles++];
+
+		e->source = ops[i].path;
+		e->dest = ops[i].path + strlen(ops[i].path) + 1;
+		e->st = st[i];
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+copyfile_error_t copyfile_walk_open(struct copyfile_walk* w,
+		copyfile_ctx_t* ctx, const char* source, const char* dest,
+		const struct stat* st)
+{
+	copyfile_error_t ret;
+	int saved_errno;
+
+	memset(w, 0, sizeof(*w));
+	w->ctx = ctx;
+	copyfile_arena_init(&w->dents, 0, 0);
+	copyfile_arena_init(&w->names, 0, 0);
+	copyfile_arena_init(&w->ops, 0, 0);
+	copyfile_arena_init(&w->st, 0, 0);
+
+	ret = push_dir(w, source, dest, st);
+	if (ret)
+	{
+		saved_errno = errno;
+		copyfile_walk_close(w);
+		errno = saved_errno;
+	}
+
+	return ret;
+}
+
+copyfile_error_t copyfile_walk_next(struct copyfile_walk* w,
+		enum copyfile_walk_event* event,
+		const struct copyfile_walk_dir** dir)
+{
+	while (w->depth > 0)
+	{
+		struct copyfile_walk_dir* d = &w->dirs[w->depth - 1];
+		copyfile_error_t ret;
+
+		/* depth-first: the subdirectories of the batch go first */
+		if (d->next_dir < d->ndirs)
+		{
+			const struct copyfile_walk_entry* e = &d->dirs[d->next_dir++];
+
+			ret = push_dir(w, e->source, e->dest, &e->st);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		if (!d->eof)
+		{
+			ret = read_batch(w, d);
+			if (ret)
+				return ret;
+			if (!d->ndirs && !d->nfiles)
+				continue;
+
+			*event = COPYFILE_WALK_BATCH;
+			*dir = d;
+			return COPYFILE_NO_ERROR;
+		}
+
+		/* the storage stays until the next directory is entered */
+		--w->depth;
+		*event = COPYFILE_WALK_LEAVE;
+		*dir = d;
+		return COPYFILE_NO_ERROR;
+	}
+
+	*event = COPYFILE_WALK_END;
+	*dir = 0;
+	return COPYFILE_NO_ERROR;
+}
+
+void copyfile_walk_close(struct copyfile_walk* w)
+{
+	size_t i;
+
+	for (i = 0; i < w->dirs_size; ++i)
+	{
+		struct copyfile_walk_dir* d = &w->dirs[i];
+
+		if (i < w->depth)
+			close_dir(w, d);
+		copyfile_arena_free(&d->path);
+		copyfile_arena_free(&d->names);
+		free(d->dirs);
+		free(d->files);
+	}
+	free(w->dirs);
+
+	copyfile_arena_free(&w->dents);
+	copyfile_arena_free(&w->names);
+	copyfile_arena_free(&w->ops);
+	copyfile_arena_free(&w->st);
+	memset(w, 0, sizeof(*w));
+}
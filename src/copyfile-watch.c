@@ -0,0 +1,1429 @@
+/* libcopyfile
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "libcopyfile.h"
+#include "common.h"
+#include "internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#	include <sys/inotify.h>
+#	include <poll.h>
+#endif
+#if defined(HAVE_SYS_FANOTIFY_H) && defined(HAVE_NAME_TO_HANDLE_AT)
+#	include <sys/fanotify.h>
+/* the renames need to be reported with both names */
+#	if defined(FAN_REPORT_DFID_NAME) && defined(FAN_RENAME)
+#		define USE_FANOTIFY 1
+#	endif
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/* The changes are taken from the notifications about the entries
+ * of the directories of the tree: with inotify, each directory is
+ * watched on its own; with fanotify, the whole filesystem is marked,
+ * and the events name the directory by its file handle. Either way,
+ * the directories are mapped to their paths, which are kept up
+ * as the directories are renamed.
+ *
+ * The paths changed are gathered until the tree is quiet for a moment,
+ * and then each of them is synced from what it is at that time. */
+
+static const uint32_t inotify_mask = IN_CREATE | IN_DELETE | IN_MODIFY
+	| IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO
+	| IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+#ifdef USE_FANOTIFY
+static const uint64_t fanotify_mask = FAN_CREATE | FAN_DELETE | FAN_MODIFY
+	| FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_RENAME | FAN_ONDIR;
+#endif
+
+/* a key (a watch descriptor, a file handle or a path), with the path
+ * it maps to */
+struct watch_entry
+{
+	unsigned char* key;
+	size_t key_len;
+	char* path;
+};
+
+/* the entries, indexed by a hash table of their positions (plus one,
+ * zero for the empty slots). the paths used as keys include
+ * the terminating null, unless they are looked up by prefix. */
+struct watch_table
+{
+	struct watch_entry* entries;
+	size_t count;
+	size_t size;
+
+	size_t* slots;
+	size_t nslots;
+};
+
+/* a rename seen (to is NULL until paired, with inotify) */
+struct watch_move
+{
+	uint32_t cookie;
+	int is_dir;
+	char* from;
+	char* to;
+};
+
+struct copyfile_watch
+{
+	char* source;
+	char* dest;
+	unsigned int flags;
+	dev_t dev;
+
+	int fd;
+	int fanotify;
+	int stop[2];
+
+	unsigned int debounce;
+	unsigned int reconcile;
+
+	/* the directories watched, and the paths changed */
+	struct watch_table dirs;
+	struct watch_table pending;
+	struct watch_move* moves;
+	size_t nmoves;
+	size_t moves_size;
+	/* set when the events were lost */
+	int overflow;
+
+	struct copyfile_arena events;
+	/* the paths of an event (relative to the source) */
+	struct copyfile_arena rel_from;
+	struct copyfile_arena rel_to;
+	/* the paths being synced */
+	struct copyfile_arena src_path;
+	struct copyfile_arena dst_path;
+};
+
+static size_t key_hash(const unsigned char* key, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+	{
+		h ^= key[i];
+		h *= 1099511628211ULL;
+	}
+
+	return (size_t) (h ^ (h >> 32));
+}
+
+static void table_index(struct watch_table* t)
+{
+	size_t i;
+
+	memset(t->slots, 0, t->nslots * sizeof(*t->slots));
+	for (i = 0; i < t->count; ++i)
+	{
+		size_t s = key_hash(t->entries[i].key, t->entries[i].key_len)
+			& (t->nslots - 1);
+
+		while (t->slots[s])
+			s = (s + 1) & (t->nslots - 1);
+		t->slots[s] = i + 1;
+	}
+}
+
+static struct watch_entry* table_find(const struct watch_table* t,
+		const void* key, size_t len)
+{
+	size_t s;
+
+	if (!t->nslots)
+		return 0;
+
+	for (s = key_hash(key, len) & (t->nslots - 1); t->slots[s];
+			s = (s + 1) & (t->nslots - 1))
+	{
+		struct watch_entry* e = &t->entries[t->slots[s] - 1];
+
+		if (e->key_len == len && !memcmp(e->key, key, len))
+			return e;
+	}
+
+	return 0;
+}
+
+/* add @key mapping to @path (which may be NULL), or remap it if it
+ * is there already */
+static copyfile_error_t table_add(struct watch_table* t,
+		const void* key, size_t len, const char* path)
+{
+	struct watch_entry* e = table_find(t, key, len);
+	char* new_path = 0;
+
+	if (path)
+	{
+		new_path = strdup(path);
+		if (!new_path)
+			return COPYFILE_ERROR_MALLOC;
+	}
+
+	if (e)
+	{
+		free(e->path);
+		e->path = new_path;
+		return COPYFILE_NO_ERROR;
+	}
+
+	if (t->count == t->size)
+	{
+		size_t new_size = t->size ? t->size * 2 : 64;
+		struct watch_entry* new_entries = realloc(t->entries,
+				new_size * sizeof(*new_entries));
+		size_t* new_slots;
+
+		if (!new_entries)
+		{
+			free(new_path);
+			return COPYFILE_ERROR_MALLOC;
+		}
+		t->entries = new_entries;
+
+		new_slots = realloc(t->slots, new_size * 2 * sizeof(*new_slots));
+		if (!new_slots)
+		{
+			free(new_path);
+			return COPYFILE_ERROR_MALLOC;
+		}
+		t->slots = new_slots;
+		t->nslots = new_size * 2;
+		t->size = new_size;
+		table_index(t);
+	}
+
+	e = &t->entries[t->count];
+	e->key = malloc(len ? len : 1);
+	if (!e->key)
+	{
+		free(new_path);
+		return COPYFILE_ERROR_MALLOC;
+	}
+	memcpy(e->key, key, len);
+	e->key_len = len;
+	e->path = new_path;
+
+	{
+		size_t s = key_hash(e->key, len) & (t->nslots - 1);
+
+		while (t->slots[s])
+			s = (s + 1) & (t->nslots - 1);
+		t->slots[s] = ++t->count;
+	}
+
+	return COPYFILE_NO_ERROR;
+}
+
+static void table_clear(struct watch_table* t)
+{
+	size_t i;
+
+	for (i = 0; i < t->count; ++i)
+	{
+		free(t->entries[i].key);
+		free(t->entries[i].path);
+	}
+	t->count = 0;
+	if (t->nslots)
+		memset(t->slots, 0, t->nslots * sizeof(*t->slots));
+}
+
+static void table_free(struct watch_table* t)
+{
+	table_clear(t);
+	free(t->entries);
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+/* check whether @path is @prefix or within it */
+static int is_within(const char* path, const char* prefix)
+{
+	size_t len = strlen(prefix);
+
+	/* the root holds everything */
+	if (!len)
+		return 1;
+	return !strncmp(path, prefix, len)
+		&& (path[len] == '/' || path[len] == 0);
+}
+
+/* replace @from with @to at the start of @path, if it is within it */
+static copyfile_error_t rebase(char** path, const char* from,
+		const char* to)
+{
+	size_t from_len = strlen(from);
+	size_t to_len = strlen(to);
+	char* new_path;
+
+	if (!is_within(*path, from))
+		return COPYFILE_NO_ERROR;
+
+	new_path = malloc(to_len + strlen(*path + from_len) + 1);
+	if (!new_path)
+		return COPYFILE_ERROR_MALLOC;
+	memcpy(new_path, to, to_len);
+	strcpy(new_path + to_len, *path + from_len);
+
+	free(*path);
+	*path = new_path;
+	return COPYFILE_NO_ERROR;
+}
+
+/* join @rel with the root @root, in @a */
+static const char* full_path(struct copyfile_arena* a, const char* root,
+		const char* rel)
+{
+	size_t root_len = strlen(root);
+	size_t rel_len = strlen(rel);
+	char* p = copyfile_arena_reserve(a, root_len + rel_len + 2);
+
+	if (!p)
+		return 0;
+
+	memcpy(p, root, root_len);
+	if (rel_len)
+	{
+		p[root_len++] = '/';
+		memcpy(p + root_len, rel, rel_len);
+	}
+	p[root_len + rel_len] = 0;
+	return p;
+}
+
+/* the path of the entry @name of the directory @dir (relative
+ * to the source root), in @a */
+static const char* child_path(struct copyfile_arena* a, const char* dir,
+		const char* name)
+{
+	if (!strcmp(name, "."))
+		name = "";
+	if (!*dir)
+		return full_path(a, name, "");
+	return full_path(a, dir, name);
+}
+
+/* the path of @path (within the walked tree) relative to the source */
+static const char* relative_path(const struct copyfile_watch* w,
+		const char* path)
+{
+	path += strlen(w->source);
+	while (*path == '/')
+		++path;
+	return path;
+}
+
+/* watch the directory @rel (@path) */
+static copyfile_error_t add_dir(struct copyfile_watch* w,
+		const char* path, const char* rel, const struct stat* st)
+{
+#ifdef USE_FANOTIFY
+	if (w->fanotify)
+	{
+		struct
+		{
+			struct file_handle fh;
+			unsigned char f_handle[MAX_HANDLE_SZ];
+		} h;
+		unsigned char key[sizeof(int) + MAX_HANDLE_SZ];
+		int mount_id;
+
+		/* the mark covers a single filesystem */
+		if (st->st_dev != w->dev)
+		{
+			errno = EXDEV;
+			return COPYFILE_ERROR_WATCH;
+		}
+
+		h.fh.handle_bytes = MAX_HANDLE_SZ;
+		if (name_to_handle_at(AT_FDCWD, path, &h.fh, &mount_id, 0))
+			return COPYFILE_ERROR_WATCH;
+
+		memcpy(key, &h.fh.handle_type, sizeof(int));
+		memcpy(key + sizeof(int), h.fh.f_handle, h.fh.handle_bytes);
+		return table_add(&w->dirs, key, sizeof(int) + h.fh.handle_bytes,
+				rel);
+	}
+#endif
+
+	{
+		int wd = inotify_add_watch(w->fd, path, inotify_mask);
+
+		if (wd == -1)
+			return COPYFILE_ERROR_WATCH;
+		return table_add(&w->dirs, &wd, sizeof(wd), rel);
+	}
+}
+
+static int skip_files(void* data, const struct stat* st)
+{
+	(void) data;
+	return !S_ISDIR(st->st_mode);
+}
+
+/* watch the directory @rel and all the directories within it.
+ * the directories which vanish meanwhile are skipped. */
+static copyfile_error_t add_tree(struct copyfile_watch* w, const char* rel)
+{
+	struct copyfile_walk walk;
+	struct stat st;
+	const char* path = full_path(&w->src_path, w->source, rel);
+	copyfile_error_t ret;
+
+	if (!path)
+		return COPYFILE_ERROR_MALLOC;
+	if (lstat(path, &st) || !S_ISDIR(st.st_mode))
+		return COPYFILE_NO_ERROR;
+
+	ret = add_dir(w, path, rel, &st);
+	if (ret)
+		return errno == ENOENT ? COPYFILE_NO_ERROR : ret;
+
+	if (copyfile_walk_open(&walk, 0, path, path, &st))
+		return COPYFILE_NO_ERROR;
+	walk.skip = skip_files;
+
+	while (!ret)
+	{
+		enum copyfile_walk_event event;
+		const struct copyfile_walk_dir* d;
+		size_t i;
+
+		if (copyfile_walk_next(&walk, &event, &d)
+				|| event == COPYFILE_WALK_END)
+			break;
+		if (event != COPYFILE_WALK_BATCH)
+			continue;
+
+		for (i = 0; i < d->ndirs && !ret; ++i)
+		{
+			const struct copyfile_walk_entry* e = &d->dirs[i];
+
+			ret = add_dir(w, e->source, relative_path(w, e->source),
+					&e->st);
+			if (ret && errno == ENOENT)
+				ret = COPYFILE_NO_ERROR;
+		}
+	}
+
+	copyfile_walk_close(&walk);
+	return ret;
+}
+
+/* stop watching the directories within the paths (relative
+ * to the source) in @gone */
+static void forget_dirs(struct copyfile_watch* w,
+		const struct watch_table* gone)
+{
+	size_t i;
+	size_t kept = 0;
+
+	for (i = 0; i < w->dirs.count; ++i)
+	{
+		struct watch_entry* e = &w->dirs.entries[i];
+		char* p = e->path;
+		int drop = 0;
+
+		/* check the path and all its parents */
+		while (!drop)
+		{
+			char* slash = strchr(p, '/');
+			size_t len = slash ? (size_t) (slash - e->path)
+				: strlen(e->path);
+
+			drop = !!table_find(gone, e->path, len);
+			if (!slash)
+				break;
+			p = slash + 1;
+		}
+
+		if (!drop)
+		{
+			w->dirs.entries[kept++] = *e;
+			continue;
+		}
+
+		if (!w->fanotify)
+		{
+			int wd;
+
+			memcpy(&wd, e->key, sizeof(wd));
+			inotify_rm_watch(w->fd, wd);
+		}
+		free(e->key);
+		free(e->path);
+	}
+
+	if (kept != w->dirs.count)
+	{
+		w->dirs.count = kept;
+		table_index(&w->dirs);
+	}
+}
+
+/* the path @rel was changed */
+static copyfile_error_t note(struct copyfile_watch* w, const char* rel)
+{
+	return table_add(&w->pending, rel, strlen(rel) + 1, 0);
+}
+
+/* the directory @rel appeared: watch it, and copy it whole */
+static copyfile_error_t note_dir(struct copyfile_watch* w,
+		const char* rel)
+{
+	copyfile_error_t ret = add_tree(w, rel);
+
+	/* the watches over the limit are made up for by the reconciliation */
+	if (ret && ret != COPYFILE_ERROR_MALLOC)
+		ret = COPYFILE_NO_ERROR;
+	if (!ret)
+		ret = note(w, rel);
+	return ret;
+}
+
+/* @from (a directory if @is_dir) is being renamed (@cookie pairing
+ * the inotify events) */
+static copyfile_error_t note_move(struct copyfile_watch* w,
+		uint32_t cookie, int is_dir, const char* from)
+{
+	struct watch_move* m;
+
+	if (w->nmoves == w->moves_size)
+	{
+		size_t new_size = w->moves_size ? w->moves_size * 2 : 16;
+		struct watch_move* new_moves = realloc(w->moves,
+				new_size * sizeof(*new_moves));
+
+		if (!new_moves)
+			return COPYFILE_ERROR_MALLOC;
+		w->moves = new_moves;
+		w->moves_size = new_size;
+	}
+
+	m = &w->moves[w->nmoves];
+	m->cookie = cookie;
+	m->is_dir = is_dir;
+	m->from = strdup(from);
+	m->to = 0;
+	if (!m->from)
+		return COPYFILE_ERROR_MALLOC;
+	++w->nmoves;
+
+	return COPYFILE_NO_ERROR;
+}
+
+/* @m was renamed to @to, within the tree */
+static copyfile_error_t moved(struct copyfile_watch* w,
+		struct watch_move* m, const char* to)
+{
+	int rekey = 0;
+	size_t i;
+
+	m->to = strdup(to);
+	if (!m->to)
+		return COPYFILE_ERROR_MALLOC;
+
+	/* the directories keep being watched under the new name */
+	if (m->is_dir)
+	{
+		for (i = 0; i < w->dirs.count; ++i)
+		{
+			if (rebase(&w->dirs.entries[i].path, m->from, to))
+				return COPYFILE_ERROR_MALLOC;
+		}
+	}
+
+	/* and the changes to be synced went along */
+	for (i = 0; i < w->pending.count; ++i)
+	{
+		struct watch_entry* e = &w->pending.entries[i];
+		char* key;
+
+		if (!is_within((const char*) e->key, m->from))
+			continue;
+
+		key = (char*) e->key;
+		if (rebase(&key, m->from, to))
+			return COPYFILE_ERROR_MALLOC;
+		e->key = (unsigned char*) key;
+		e->key_len = strlen(key) + 1;
+		rekey = 1;
+	}
+	if (rekey)
+		table_index(&w->pending);
+
+	return COPYFILE_NO_ERROR;
+}
+
+/* handle a single event: @mask of the entry @name of the directory
+ * watched as @dir */
+static copyfile_error_t inotify_event(struct copyfile_watch* w,
+		const struct watch_entry* dir, uint32_t mask, uint32_t cookie,
+		const char* name)
+{
+	const char* rel = child_path(&w->rel_from, dir->path, name);
+	int is_dir = !!(mask & IN_ISDIR);
+
+	if (!rel)
+		return COPYFILE_ERROR_MALLOC;
+
+	if (mask & IN_MOVED_FROM)
+		return note_move(w, cookie, is_dir, rel);
+	if (mask & IN_MOVED_TO)
+	{
+		size_t i;
+
+		for (i = w->nmoves; i > 0; --i)
+		{
+			struct watch_move* m = &w->moves[i - 1];
+
+			if (!m->to && m->cookie == cookie)
+				return moved(w, m, rel);
+		}
+	}
+
+	if (is_dir && (mask & (IN_CREATE | IN_MOVED_TO)))
+		return note_dir(w, rel);
+	return note(w, rel);
+}
+
+static copyfile_error_t read_inotify(struct copyfile_watch* w)
+{
+	char* buf = w->events.ptr;
+
+	while (1)
+	{
+		ssize_t rd = read(w->fd, buf, w->events.size);
+		ssize_t pos;
+
+		if (rd == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return COPYFILE_NO_ERROR;
+			return COPYFILE_ERROR_WATCH;
+		}
+
+		for (pos = 0; pos < rd; )
+		{
+			const struct inotify_event* ev
+				= (const struct inotify_event*) (buf + pos);
+			const struct watch_entry* dir;
+			copyfile_error_t ret;
+
+			pos += sizeof(*ev) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				w->overflow = 1;
+				continue;
+			}
+
+			/* IN_IGNORED too; the removed directories are forgotten
+			 * as the removal is synced */
+			dir = table_find(&w->dirs, &ev->wd, sizeof(ev->wd));
+			if (!dir || !(ev->mask & inotify_mask))
+				continue;
+
+			ret = inotify_event(w, dir, ev->mask, ev->cookie,
+					ev->len ? ev->name : "");
+			if (ret)
+				return ret;
+		}
+	}
+}
+
+#ifdef USE_FANOTIFY
+
+/* find the directory watched named by the file handle @fh */
+static const struct watch_entry* fanotify_dir(
+		const struct copyfile_watch* w, const struct file_handle* fh)
+{
+	unsigned char key[sizeof(int) + MAX_HANDLE_SZ];
+
+	if (fh->handle_bytes > MAX_HANDLE_SZ)
+		return 0;
+	memcpy(key, &fh->handle_type, sizeof(int));
+	memcpy(key + sizeof(int), fh->f_handle, fh->handle_bytes);
+	return table_find(&w->dirs, key, sizeof(int) + fh->handle_bytes);
+}
+
+/* handle a single event, with the @from and @to entries (relative
+ * to the source) of a rename, or the entry @from changed otherwise.
+ * NULL stands for an entry outside the tree. */
+static copyfile_error_t fanotify_event(struct copyfile_watch* w,
+		uint64_t mask, const char* from, const char* to)
+{
+	int is_dir = !!(mask & FAN_ONDIR);
+	copyfile_error_t ret;
+
+	if (!(mask & FAN_RENAME))
+	{
+		if (is_dir && (mask & FAN_CREATE))
+			return note_dir(w, from);
+		return note(w, from);
+	}
+
+	/* moved in or out of the tree */
+	if (!from)
+		return is_dir ? note_dir(w, to) : note(w, to);
+	if (!to)
+		return note(w, from);
+
+	ret = note_move(w, 0, is_dir, from);
+	if (!ret)
+		ret = moved(w, &w->moves[w->nmoves - 1], to);
+	return ret;
+}
+
+static copyfile_error_t read_fanotify(struct copyfile_watch* w)
+{
+	char* buf = w->events.ptr;
+
+	while (1)
+	{
+		ssize_t rd = read(w->fd, buf, w->events.size);
+		const struct fanotify_event_metadata* meta;
+
+		if (rd == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return COPYFILE_NO_ERROR;
+			return COPYFILE_ERROR_WATCH;
+		}
+
+		for (meta = (const struct fanotify_event_metadata*) buf;
+				FAN_EVENT_OK(meta, rd); meta = FAN_EVENT_NEXT(meta, rd))
+		{
+			const char* paths[2] = { 0, 0 };
+			size_t pos;
+			copyfile_error_t ret;
+
+			if (meta->vers != FANOTIFY_METADATA_VERSION)
+			{
+				errno = EPROTO;
+				return COPYFILE_ERROR_WATCH;
+			}
+			if (meta->fd >= 0)
+				close(meta->fd);
+			if (meta->mask & FAN_Q_OVERFLOW)
+			{
+				w->overflow = 1;
+				continue;
+			}
+
+			/* the directories the event names; their paths are built
+			 * in the two arenas */
+			for (pos = meta->metadata_len; pos + sizeof(struct
+						fanotify_event_info_header) <= meta->event_len; )
+			{
+				const struct fanotify_event_info_fid* info
+					= (const struct fanotify_event_info_fid*)
+					((const char*) meta + pos);
+				const struct file_handle* fh
+					= (const struct file_handle*) info->handle;
+				const struct watch_entry* dir;
+				const char* name = "";
+				int slot;
+
+				pos += info->hdr.len;
+				if (!info->hdr.len)
+					break;
+
+				switch (info->hdr.info_type)
+				{
+					case FAN_EVENT_INFO_TYPE_DFID_NAME:
+					case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+						name = (const char*) fh->f_handle + fh->handle_bytes;
+						/* fallthrough */
+					case FAN_EVENT_INFO_TYPE_DFID:
+						slot = 0;
+						break;
+					case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+						name = (const char*) fh->f_handle + fh->handle_bytes;
+						slot = 1;
+						break;
+					default:
+						continue;
+				}
+
+				dir = fanotify_dir(w, fh);
+				if (!dir)
+					continue;
+				paths[slot] = child_path(slot ? &w->rel_to
+						: &w->rel_from, dir->path, name);
+				if (!paths[slot])
+					return COPYFILE_ERROR_MALLOC;
+			}
+
+			if (!paths[0] && (!paths[1] || !(meta->mask & FAN_RENAME)))
+				continue;
+
+			ret = fanotify_event(w, meta->mask, paths[0], paths[1]);
+			if (ret)
+				return ret;
+		}
+	}
+}
+
+/* mark the filesystem of the source, and find the directories
+ * of the tree */
+static copyfile_error_t open_fanotify(struct copyfile_watch* w)
+{
+	copyfile_error_t ret;
+
+	w->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK
+			| FAN_REPORT_DFID_NAME, O_RDONLY | O_CLOEXEC);
+	if (w->fd == -1)
+		return COPYFILE_ERROR_WATCH;
+	w->fanotify = 1;
+
+	if (fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				fanotify_mask, AT_FDCWD, w->source))
+		return COPYFILE_ERROR_WATCH;
+
+	ret = add_tree(w, "");
+	return ret;
+}
+
+#endif /*USE_FANOTIFY*/
+
+static copyfile_error_t open_inotify(struct copyfile_watch* w)
+{
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd == -1)
+		return COPYFILE_ERROR_WATCH;
+
+	return add_tree(w, "");
+}
+
+/* remove the destination @path (a whole tree if it is a directory) */
+static copyfile_error_t remove_dest(copyfile_ctx_t* ctx, const char* path,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct copyfile_walk walk;
+	struct stat st;
+	copyfile_progress_t progress;
+	copyfile_error_t ret;
+
+	if (lstat(path, &st))
+		return COPYFILE_NO_ERROR;
+
+	if (!S_ISDIR(st.st_mode))
+	{
+		progress.move.source = path;
+		while (unlink(path) && errno != ENOENT)
+		{
+			if (!callback || callback(COPYFILE_ERROR_UNLINK_DEST,
+						COPYFILE_MOVE, progress, callback_data, 1))
+				return COPYFILE_ERROR_UNLINK_DEST;
+		}
+		return COPYFILE_NO_ERROR;
+	}
+
+	ret = copyfile_walk_open(&walk, ctx, path, path, &st);
+	while (!ret)
+	{
+		enum copyfile_walk_event event;
+		const struct copyfile_walk_dir* d;
+		size_t i;
+
+		ret = copyfile_walk_next(&walk, &event, &d);
+		if (ret || event == COPYFILE_WALK_END)
+			break;
+
+		if (event == COPYFILE_WALK_BATCH)
+		{
+			for (i = 0; i < d->nfiles && !ret; ++i)
+				ret = remove_dest(ctx, d->files[i].source,
+						callback, callback_data);
+			continue;
+		}
+
+		progress.move.source = d->source;
+		while (rmdir(d->source) && errno != ENOENT)
+		{
+			if (!callback || callback(COPYFILE_ERROR_UNLINK_DEST,
+						COPYFILE_MOVE, progress, callback_data, 1))
+			{
+				ret = COPYFILE_ERROR_UNLINK_DEST;
+				break;
+			}
+		}
+	}
+
+	copyfile_walk_close(&walk);
+	return ret;
+}
+
+/* apply the rename @m onto the destination */
+static copyfile_error_t sync_move(copyfile_ctx_t* ctx,
+		struct copyfile_watch* w, const struct watch_move* m,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct stat st;
+	const char* from;
+	const char* to;
+	char* slash;
+	copyfile_error_t ret;
+
+	/* paired with inotify only if moved within the tree */
+	if (!m->to)
+		return note(w, m->from);
+
+	/* the new name is synced afterwards, in case anything changed
+	 * before the rename; if the old one was not copied yet (or
+	 * the new parent is not there yet), that copies it */
+	ret = note(w, m->to);
+	if (ret)
+		return ret;
+
+	from = full_path(&w->src_path, w->dest, m->from);
+	to = full_path(&w->dst_path, w->dest, m->to);
+	if (!from || !to)
+		return COPYFILE_ERROR_MALLOC;
+	if (lstat(from, &st))
+		return COPYFILE_NO_ERROR;
+
+	slash = strrchr(to, '/');
+	*slash = 0;
+	if (lstat(to, &st) || !S_ISDIR(st.st_mode))
+		return note(w, m->from);
+	*slash = '/';
+
+	if (m->is_dir)
+		ret = copyfile_move_tree_ctx(ctx, from, to,
+				callback, callback_data);
+	else
+		ret = copyfile_move_file_ctx(ctx, from, to, 0,
+				callback, callback_data);
+
+	/* the old name is synced on its own then (removed, if it is gone
+	 * from the source), and the new one copied */
+	if (ret && ret != COPYFILE_ABORTED && ret != COPYFILE_ERROR_MALLOC)
+	{
+		int saved_errno = errno;
+		copyfile_error_t nret = note(w, m->from);
+
+		if (nret)
+			return nret;
+		errno = saved_errno;
+	}
+	return ret;
+}
+
+static int path_cmp(const void* a, const void* b)
+{
+	return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+/* sync the changed path @rel. returns COPYFILE_EOF if it is
+ * a directory copied whole. */
+static copyfile_error_t sync_path(copyfile_ctx_t* ctx,
+		struct copyfile_watch* w, const char* rel, unsigned int flags,
+		struct watch_table* gone,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct stat st;
+	struct stat dst_st;
+	const char* source = full_path(&w->src_path, w->source, rel);
+	const char* dest = full_path(&w->dst_path, w->dest, rel);
+	int dest_exists;
+	copyfile_error_t ret;
+
+	if (!source || !dest)
+		return COPYFILE_ERROR_MALLOC;
+
+	if (lstat(source, &st))
+	{
+		if (errno != ENOENT && errno != ENOTDIR)
+			return COPYFILE_NO_ERROR;
+
+		/* looked up by prefix, without the null */
+		ret = table_add(gone, rel, strlen(rel), 0);
+		if (!ret && (w->flags & COPYFILE_WATCH_DELETE))
+			ret = remove_dest(ctx, dest, callback, callback_data);
+		return ret;
+	}
+
+	dest_exists = !lstat(dest, &dst_st);
+	/* replaced with another type of file; the symlinks and special
+	 * files can't be copied over either */
+	if (dest_exists && (!S_ISDIR(st.st_mode) != !S_ISDIR(dst_st.st_mode)
+				|| (!S_ISDIR(dst_st.st_mode) && !S_ISREG(dst_st.st_mode))))
+	{
+		ret = remove_dest(ctx, dest, callback, callback_data);
+		if (ret)
+			return ret;
+		dest_exists = 0;
+	}
+
+	if (!S_ISDIR(st.st_mode))
+		return copyfile_archive_file_ctx(ctx, source, dest, &st, flags, 0,
+				callback, callback_data);
+	/* a directory whose entries are synced on their own */
+	if (dest_exists)
+	{
+		copyfile_copy_metadata_ctx(ctx, source, dest, &st, flags, 0);
+		return COPYFILE_NO_ERROR;
+	}
+
+	/* the paths are reused by the tree copy */
+	source = strdup(source);
+	dest = source ? strdup(dest) : 0;
+	if (!dest)
+	{
+		free((char*) source);
+		return COPYFILE_ERROR_MALLOC;
+	}
+	ret = copyfile_archive_tree_ctx(ctx, source, dest, flags,
+			callback, callback_data);
+	free((char*) source);
+	free((char*) dest);
+
+	return ret == COPYFILE_ABORTED || ret == COPYFILE_ERROR_MALLOC
+		? ret : COPYFILE_EOF;
+}
+
+/* add the first @len characters of @path to @parents */
+static copyfile_error_t note_parent(struct copyfile_watch* w,
+		struct watch_table* parents, const char* path, size_t len)
+{
+	char* key = copyfile_arena_reserve(&w->rel_from, len + 1);
+
+	if (!key)
+		return COPYFILE_ERROR_MALLOC;
+	memcpy(key, path, len);
+	key[len] = 0;
+	return table_add(parents, key, len + 1, 0);
+}
+
+/* keep the first error (and its errno) in @ret, returning non-zero
+ * if it stops the mirroring */
+static int keep_error(copyfile_error_t* ret, int* saved_errno,
+		copyfile_error_t err)
+{
+	if (err && !*ret)
+	{
+		*ret = err;
+		*saved_errno = errno;
+	}
+	return err == COPYFILE_ABORTED || err == COPYFILE_ERROR_MALLOC;
+}
+
+/* sync all the changes gathered. the errors in individual paths do not
+ * stop it; the first one is returned. */
+static copyfile_error_t flush(copyfile_ctx_t* ctx,
+		struct copyfile_watch* w, unsigned int flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	struct watch_table gone;
+	struct watch_table parents;
+	char** paths = 0;
+	const char* copied = 0;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	copyfile_error_t first = COPYFILE_NO_ERROR;
+	int saved_errno = 0;
+	size_t i;
+
+	memset(&gone, 0, sizeof(gone));
+	memset(&parents, 0, sizeof(parents));
+
+	/* the renames go first, in the order they were done. the ones
+	 * which fail are synced as paths instead. */
+	for (i = 0; i < w->nmoves; ++i)
+	{
+		if (!ret)
+		{
+			ret = sync_move(ctx, w, &w->moves[i], callback, callback_data);
+			if (!keep_error(&first, &saved_errno, ret))
+				ret = COPYFILE_NO_ERROR;
+		}
+		free(w->moves[i].from);
+		free(w->moves[i].to);
+	}
+	w->nmoves = 0;
+
+	if (!ret && w->pending.count)
+	{
+		paths = malloc(w->pending.count * sizeof(*paths));
+		if (!paths)
+			ret = COPYFILE_ERROR_MALLOC;
+	}
+
+	if (!ret && w->pending.count)
+	{
+		for (i = 0; i < w->pending.count; ++i)
+			paths[i] = (char*) w->pending.entries[i].key;
+		/* the parents go before their entries */
+		qsort(paths, w->pending.count, sizeof(*paths), path_cmp);
+
+		for (i = 0; i < w->pending.count && !ret; ++i)
+		{
+			const char* slash;
+
+			/* copied along with a directory */
+			if (copied && is_within(paths[i], copied))
+				continue;
+
+			ret = sync_path(ctx, w, paths[i], flags, &gone,
+					callback, callback_data);
+			if (ret == COPYFILE_EOF)
+			{
+				copied = paths[i];
+				ret = COPYFILE_NO_ERROR;
+			}
+			else if (!keep_error(&first, &saved_errno, ret))
+				ret = COPYFILE_NO_ERROR;
+
+			/* the directory changed with its entries */
+			slash = strrchr(paths[i], '/');
+			if (!ret && *paths[i])
+				ret = note_parent(w, &parents, paths[i],
+						slash ? (size_t) (slash - paths[i]) : 0);
+		}
+	}
+
+	/* with the times of the source, after the entries are done */
+	for (i = 0; i < parents.count && !ret; ++i)
+	{
+		struct stat st;
+		const char* rel = (const char*) parents.entries[i].key;
+		const char* source = full_path(&w->src_path, w->source, rel);
+		const char* dest = full_path(&w->dst_path, w->dest, rel);
+
+		if (!source || !dest)
+			ret = COPYFILE_ERROR_MALLOC;
+		else if (!lstat(source, &st) && S_ISDIR(st.st_mode))
+			copyfile_copy_metadata_ctx(ctx, source, dest, &st, flags, 0);
+	}
+
+	if (gone.count)
+		forget_dirs(w, &gone);
+
+	free(paths);
+	table_free(&gone);
+	table_free(&parents);
+	if (ret)
+		return ret;
+	table_clear(&w->pending);
+	errno = saved_errno;
+	return first;
+}
+
+static long elapsed_ms(const struct timeval* since)
+{
+	struct timeval now;
+
+	gettimeofday(&now, 0);
+	return (now.tv_sec - since->tv_sec) * 1000L
+		+ (now.tv_usec - since->tv_usec) / 1000;
+}
+
+#endif /*HAVE_SYS_INOTIFY_H*/
+
+copyfile_error_t copyfile_watch_open(copyfile_watch_t** watch,
+		const char* source, const char* dest, unsigned int flags)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	struct copyfile_watch* w;
+	struct stat st;
+	copyfile_error_t ret = COPYFILE_NO_ERROR;
+	int saved_errno;
+	size_t len;
+
+	if (lstat(source, &st))
+		return COPYFILE_ERROR_STAT;
+	if (!S_ISDIR(st.st_mode))
+	{
+		errno = ENOTDIR;
+		return COPYFILE_ERROR_WATCH;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return COPYFILE_ERROR_MALLOC;
+	w->fd = -1;
+	w->stop[0] = w->stop[1] = -1;
+	w->flags = flags;
+	w->dev = st.st_dev;
+	w->debounce = COPYFILE_WATCH_DEBOUNCE;
+	w->reconcile = COPYFILE_WATCH_RECONCILE;
+	copyfile_arena_init(&w->events, 0, 0);
+	copyfile_arena_init(&w->rel_from, 0, 0);
+	copyfile_arena_init(&w->rel_to, 0, 0);
+	copyfile_arena_init(&w->src_path, 0, 0);
+	copyfile_arena_init(&w->dst_path, 0, 0);
+
+	w->source = strdup(source);
+	w->dest = strdup(dest);
+	if (!w->source || !w->dest
+			|| !copyfile_arena_reserve(&w->events, COPYFILE_WATCH_BUFFER))
+		ret = COPYFILE_ERROR_MALLOC;
+
+	if (!ret)
+	{
+		/* the paths are joined with a slash */
+		for (len = strlen(w->source); len > 1 && w->source[len-1] == '/'; )
+			w->source[--len] = 0;
+		for (len = strlen(w->dest); len > 1 && w->dest[len-1] == '/'; )
+			w->dest[--len] = 0;
+
+		if (pipe(w->stop)
+				|| fcntl(w->stop[0], F_SETFL, O_NONBLOCK)
+				|| fcntl(w->stop[1], F_SETFL, O_NONBLOCK)
+				|| fcntl(w->stop[0], F_SETFD, FD_CLOEXEC)
+				|| fcntl(w->stop[1], F_SETFD, FD_CLOEXEC))
+			ret = COPYFILE_ERROR_WATCH;
+	}
+
+#ifdef USE_FANOTIFY
+	/* not having to watch each directory, but it takes privileges */
+	if (!ret && !(flags & COPYFILE_WATCH_INOTIFY))
+	{
+		ret = open_fanotify(w);
+		if (ret && ret != COPYFILE_ERROR_MALLOC)
+		{
+			if (w->fd != -1)
+				close(w->fd);
+			w->fd = -1;
+			w->fanotify = 0;
+			table_clear(&w->dirs);
+			ret = COPYFILE_NO_ERROR;
+		}
+	}
+#endif
+
+	if (!ret && !w->fanotify)
+		ret = open_inotify(w);
+
+	if (ret)
+	{
+		saved_errno = errno;
+		copyfile_watch_close(w);
+		errno = saved_errno;
+		return ret;
+	}
+
+	*watch = w;
+	return COPYFILE_NO_ERROR;
+#else
+	errno = ENOSYS;
+	return COPYFILE_ERROR_UNSUPPORTED;
+#endif
+}
+
+void copyfile_watch_set_debounce(copyfile_watch_t* watch,
+		unsigned int ms)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	watch->debounce = ms ? ms : COPYFILE_WATCH_DEBOUNCE;
+#endif
+}
+
+void copyfile_watch_set_reconcile(copyfile_watch_t* watch,
+		unsigned int seconds)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	watch->reconcile = seconds;
+#endif
+}
+
+copyfile_error_t copyfile_watch_run(copyfile_watch_t* watch,
+		unsigned int flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+	return copyfile_watch_run_ctx(0, watch, flags,
+			callback, callback_data);
+}
+
+copyfile_error_t copyfile_watch_run_ctx(copyfile_ctx_t* ctx,
+		copyfile_watch_t* watch, unsigned int flags,
+		copyfile_callback_t callback, void* callback_data)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	struct copyfile_watch* w = watch;
+	struct timeval reconciled;
+	struct timeval first;
+	struct timeval last;
+	int gathering = 0;
+	copyfile_error_t ret;
+	copyfile_error_t err = COPYFILE_NO_ERROR;
+	int saved_errno = 0;
+
+	gettimeofday(&first, 0);
+	last = first;
+
+	/* the watches are set up already, so nothing is missed between */
+	ret = copyfile_archive_tree_ctx(ctx, w->source, w->dest, flags,
+			callback, callback_data);
+	if (ret == COPYFILE_ABORTED)
+		return ret;
+	keep_error(&err, &saved_errno, ret);
+	gettimeofday(&reconciled, 0);
+
+	while (1)
+	{
+		struct pollfd fds[2];
+		long timeout = -1;
+		int n;
+
+		if (gathering)
+		{
+			/* until quiet, but no longer than a few debounce periods */
+			long quiet = (long) w->debounce - elapsed_ms(&last);
+			long max = (long) w->debounce * COPYFILE_WATCH_MAX_DELAY
+				- elapsed_ms(&first);
+
+			timeout = quiet < max ? quiet : max;
+		}
+		else if (w->reconcile)
+			timeout = (long) w->reconcile * 1000 - elapsed_ms(&reconciled);
+		if ((gathering || w->reconcile) && timeout < 0)
+			timeout = 0;
+
+		fds[0].fd = w->fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = w->stop[0];
+		fds[1].events = POLLIN;
+
+		n = poll(fds, 2, (int) timeout);
+		if (n == -1 && errno != EINTR)
+			return COPYFILE_ERROR_WATCH;
+
+		if (n > 0 && fds[1].revents)
+		{
+			char c;
+
+			while (read(w->stop[0], &c, 1) == 1)
+				;
+			errno = saved_errno;
+			return err;
+		}
+
+		if (n > 0 && fds[0].revents)
+		{
+			size_t seen = w->pending.count + w->nmoves;
+
+#ifdef USE_FANOTIFY
+			if (w->fanotify)
+				ret = read_fanotify(w);
+			else
+#endif
+				ret = read_inotify(w);
+			if (ret)
+				return ret;
+
+			if (w->pending.count + w->nmoves != seen || w->overflow)
+			{
+				gettimeofday(&last, 0);
+				if (!gathering)
+					first = last;
+				gathering = 1;
+			}
+		}
+
+		if (gathering && (elapsed_ms(&last) >= (long) w->debounce
+					|| elapsed_ms(&first)
+					>= (long) w->debounce * COPYFILE_WATCH_MAX_DELAY))
+		{
+			ret = flush(ctx, w, flags, callback, callback_data);
+			if (keep_error(&err, &saved_errno, ret))
+				return ret;
+			gathering = 0;
+		}
+
+		/* the events lost are made up for by syncing the whole tree
+		 * (the removals excepted) */
+		if (!gathering && (w->overflow || (w->reconcile
+					&& elapsed_ms(&reconciled) >= (long) w->reconcile * 1000)))
+		{
+			w->overflow = 0;
+			ret = add_tree(w, "");
+			if (ret == COPYFILE_ERROR_MALLOC)
+				return ret;
+			ret = copyfile_archive_tree_ctx(ctx, w->source, w->dest, flags,
+					callback, callback_data);
+			if (ret == COPYFILE_ABORTED)
+				return ret;
+			keep_error(&err, &saved_errno, ret);
+			gettimeofday(&reconciled, 0);
+		}
+	}
+#else
+	errno = ENOSYS;
+	return COPYFILE_ERROR_UNSUPPORTED;
+#endif
+}
+
+void copyfile_watch_stop(copyfile_watch_t* watch)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	char c = 0;
+	ssize_t wr;
+
+	/* async-signal-safe. if the pipe is full, it is set already. */
+	wr = write(watch->stop[1], &c, 1);
+	(void) wr;
+#endif
+}
+
+void copyfile_watch_close(copyfile_watch_t* watch)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	size_t i;
+
+	if (!watch)
+		return;
+
+	if (watch->fd != -1)
+		close(watch->fd);
+	if (watch->stop[0] != -1)
+		close(watch->stop[0]);
+	if (watch->stop[1] != -1)
+		close(watch->stop[1]);
+
+	for (i = 0; i < watch->nmoves; ++i)
+	{
+		free(watch->moves[i].from);
+		free(watch->moves[i].to);
+	}
+	free(watch->moves);
+	table_free(&watch->dirs);
+	table_free(&watch->pending);
+	copyfile_arena_free(&watch->events);
+	copyfile_arena_free(&watch->rel_from);
+	copyfile_arena_free(&watch->rel_to);
+	copyfile_arena_free(&watch->src_path);
+	copyfile_arena_free(&watch->dst_path);
+	free(watch->source);
+	free(watch->dest);
+	free(watch);
+#endif
+}
@@ -0,0 +1,734 @@
+/* libcopyfile -- internal structures and helpers
+ * (c) 2012 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license.
+ */
+
+#pragma once
+
+#ifndef COPYFILE_INTERNAL_H
+#define COPYFILE_INTERNAL_H 1
+
+#include "libcopyfile.h"
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+/* a reusable, growable buffer. it can start with caller-provided
+ * (usually on-stack) storage which won't be freed. */
+struct copyfile_arena
+{
+	char* ptr;
+	size_t size;
+	int is_static;
+};
+
+static inline void copyfile_arena_init(struct copyfile_arena* a,
+		char* storage, size_t size)
+{
+	a->ptr = storage;
+	a->size = size;
+	a->is_static = !!storage;
+}
+
+/* ensure the arena can hold at least @size bytes. the contents are not
+ * preserved. returns NULL on allocation failure, leaving the arena
+ * intact. */
+static inline char* copyfile_arena_reserve(struct copyfile_arena* a,
+		size_t size)
+{
+	if (size > a->size)
+	{
+		char* p = a->is_static ? malloc(size) : realloc(a->ptr, size);
+
+		if (!p)
+			return 0;
+
+		a->ptr = p;
+		a->size = size;
+		a->is_static = 0;
+	}
+
+	return a->ptr;
+}
+
+static inline void copyfile_arena_free(struct copyfile_arena* a)
+{
+	if (!a->is_static)
+		free(a->ptr);
+	copyfile_arena_init(a, 0, 0);
+}
+
+/* features found missing on a particular (source) filesystem */
+enum copyfile_fs_lacks
+{
+	COPYFILE_FS_NO_XATTR = 0x01,
+	COPYFILE_FS_NO_ACL = 0x02,
+	COPYFILE_FS_NO_CAP = 0x04
+};
+
+#define COPYFILE_FS_CACHE_SIZE 8
+
+struct copyfile_fs_cache_entry
+{
+	dev_t dev;
+	unsigned int lacks;
+};
+
+/* a filesystem to be synced by copyfile_ctx_commit() */
+struct copyfile_sync_fs
+{
+	dev_t dev;
+	int fd;
+};
+
+/* COPYFILE_SAME_* = COPYFILE_COPY_* << COPYFILE_SAME_SHIFT */
+#define COPYFILE_SAME_SHIFT 16
+
+/* an option set internally while the source of a move is copied:
+ * the source is removed afterwards, so no file may be skipped
+ * as up-to-date (by COPYFILE_QUICK_CHECK or the manifest) */
+#define COPYFILE_NO_SKIP 0x80000000U
+/* an option set internally while the files of a tree are copied:
+ * their destinations are not checked for block devices, which only
+ * a single file copied is written onto */
+#define COPYFILE_NO_BLOCKDEV 0x40000000U
+
+struct copyfile_ctx
+{
+	size_t buffer_size;
+	unsigned int callback_opcount;
+	unsigned int options;
+	unsigned int durability;
+	unsigned int threads;
+	unsigned int schedule;
+
+	struct copyfile_arena data;
+	struct copyfile_arena xattr_list;
+	struct copyfile_arena xattr_value;
+	struct copyfile_arena xattr_cmp;
+	struct copyfile_arena symlink;
+
+	struct copyfile_fs_cache_entry fs_cache[COPYFILE_FS_CACHE_SIZE];
+	unsigned int fs_cache_used;
+	unsigned int fs_cache_next;
+
+	struct copyfile_sync_fs* sync_fs;
+	unsigned int sync_fs_used;
+	unsigned int sync_fs_size;
+	/* the directory part of the last path registered for batch sync */
+	struct copyfile_arena sync_last_dir;
+	size_t sync_last_dir_len;
+
+	/* not owned by the context */
+	copyfile_dedup_index_t* dedup_index;
+	copyfile_journal_t* journal;
+	const copyfile_manifest_t* manifest;
+	copyfile_manifest_writer_t* manifest_writer;
+	/* the shared extents copied by the running batch or tree copy
+	 * (COPYFILE_PRESERVE_SHARING) */
+	struct copyfile_extent_map* extent_map;
+	/* the hard links copied by the running tree copy, shared by its
+	 * batches (COPYFILE_PRESERVE_HARDLINKS) */
+	struct copyfile_link_map* link_map;
+
+	/* the ring for the batches of metadata operations, set up
+	 * on first use */
+	struct copyfile_uring* uring;
+	int uring_tried;
+
+	copyfile_stats_t stats;
+};
+
+/* check whether the filesystem @dev is known to lack @feature.
+ * @ctx may be NULL (in which case nothing is known). */
+int copyfile_fs_lacks(const copyfile_ctx_t* ctx, dev_t dev,
+		enum copyfile_fs_lacks feature);
+/* record that the filesystem @dev lacks @feature. */
+void copyfile_fs_set_lacks(copyfile_ctx_t* ctx, dev_t dev,
+		enum copyfile_fs_lacks feature);
+
+/* sync the written file @fd if the durability mode of @ctx requires
+ * doing that immediately. @full requests fsync() rather than
+ * fdatasync() (i.e. if metadata was set via @fd). */
+copyfile_error_t copyfile_sync_fd(copyfile_ctx_t* ctx, int fd, int full);
+/* handle the directory entry of newly created @path -- sync its parent
+ * directory or remember its filesystem for copyfile_ctx_commit(). */
+copyfile_error_t copyfile_sync_dir(copyfile_ctx_t* ctx, const char* path);
+/* make @path (its data, metadata and name) durable right away if
+ * the durability mode of @ctx asks for syncing at all. in batch mode,
+ * this commits everything written so far. used before the original
+ * of a moved file is removed. */
+copyfile_error_t copyfile_sync_now(copyfile_ctx_t* ctx, const char* path);
+/* add the filesystem @dev, open as @fd, to be synced on commit.
+ * the fd is owned by @ctx afterwards. */
+copyfile_error_t copyfile_sync_add_fs(copyfile_ctx_t* ctx, dev_t dev,
+		int fd);
+/* open the directory containing @path (for syncing). */
+int copyfile_open_parent(const char* path);
+/* drop the filesystems remembered for the commit without syncing. */
+void copyfile_sync_forget(copyfile_ctx_t* ctx);
+
+/* a job for copyfile_parallel_run(): process item @i using
+ * the worker's context @ctx (which may be NULL). the @callback should
+ * be used instead of the user's one. returning non-zero stops
+ * dispatching further items. */
+typedef int (*copyfile_job_t)(copyfile_ctx_t* ctx, size_t i, void* data,
+		copyfile_callback_t callback, void* callback_data);
+
+/* the number of worker threads to use with @ctx */
+unsigned int copyfile_thread_count(const copyfile_ctx_t* ctx);
+/* run @job for items 0..@count-1 using a pool of worker threads
+ * (including the calling one). each worker gets its own context
+ * with the settings of @ctx; the statistics and pending commit are
+ * merged back into @ctx. calls to @callback are serialized. */
+void copyfile_parallel_run(copyfile_ctx_t* ctx, size_t count,
+		copyfile_job_t job, void* data,
+		copyfile_callback_t callback, void* callback_data);
+
+/* the metadata operations which can be run in batches */
+enum copyfile_meta_opcode
+{
+	/* lstat() (stat() without symlinks) into st */
+	COPYFILE_META_LSTAT,
+	/* mkdir() with the default permissions */
+	COPYFILE_META_MKDIR,
+	COPYFILE_META_UNLINK,
+	COPYFILE_META_RMDIR,
+
+	COPYFILE_META_MAX
+};
+
+struct copyfile_meta_op
+{
+	enum copyfile_meta_opcode opcode;
+	const char* path;
+	struct stat* st;
+	/* don't start the next operation before this one is done
+	 * (whatever its result) */
+	int chain;
+	/* the errno value, or 0 on success */
+	int error;
+};
+
+/* run the @count operations @ops. on Linux, they are submitted
+ * through io_uring, COPYFILE_URING_ENTRIES at a time; otherwise
+ * (or if not supported by the kernel), they are run one by one.
+ * the ring is kept in @ctx, which may be NULL. */
+void copyfile_meta_run(copyfile_ctx_t* ctx, struct copyfile_meta_op* ops,
+		size_t count);
+/* release the ring of @ctx. */
+void copyfile_meta_free(copyfile_ctx_t* ctx);
+
+/* a file found by the tree walk */
+struct copyfile_walk_entry
+{
+	const char* source;
+	const char* dest;
+	struct stat st;
+};
+
+/* a directory being listed by the tree walk */
+struct copyfile_walk_dir
+{
+	const char* source;
+	const char* dest;
+	struct stat st;
+
+	/* the last batch of entries read. the directories are entered
+	 * in turn before reading the next batch. */
+	struct copyfile_walk_entry* dirs;
+	size_t ndirs;
+	size_t next_dir;
+	struct copyfile_walk_entry* files;
+	size_t nfiles;
+	size_t entries_size;
+
+	/* the open directory (-1 or NULL if closed to stay within the fd
+	 * budget), and the position to reopen it at */
+	int fd;
+	void* dir;
+	off_t pos;
+	int eof;
+
+	/* the paths of the directory and of its entries */
+	struct copyfile_arena path;
+	struct copyfile_arena names;
+};
+
+/* a streaming depth-first walk of a directory tree. only
+ * the directories on the current path are held, each with a single
+ * batch of entries (up to a COPYFILE_WALK_BUFFER read), and no more
+ * than COPYFILE_WALK_FDS of them are kept open. */
+struct copyfile_walk
+{
+	copyfile_ctx_t* ctx;
+
+	struct copyfile_walk_dir* dirs;
+	size_t depth;
+	size_t dirs_size;
+	unsigned int open_dirs;
+
+	/* if set (after copyfile_walk_open()), the entries for which
+	 * it returns non-zero are left out, and not walked into */
+	int (*skip)(void* data, const struct stat* st);
+	void* skip_data;
+
+	/* reused for reading and stat()-ing each batch */
+	struct copyfile_arena dents;
+	struct copyfile_arena names;
+	struct copyfile_arena ops;
+	struct copyfile_arena st;
+};
+
+enum copyfile_walk_event
+{
+	/* the whole tree was listed */
+	COPYFILE_WALK_END,
+	/* a batch of entries of a directory was read. the subdirectories
+	 * found are walked next. */
+	COPYFILE_WALK_BATCH,
+	/* the contents of a directory were all listed */
+	COPYFILE_WALK_LEAVE
+};
+
+/* start walking the directory tree @source (not following symlinks),
+ * mapping it onto @dest. @st is the lstat() of @source. the entries of
+ * each batch are stat()-ed at once, using @ctx (may be NULL).
+ * a directory found replaced when (re)opened fails the walk with
+ * COPYFILE_ERROR_READDIR and ESTALE. */
+copyfile_error_t copyfile_walk_open(struct copyfile_walk* w,
+		copyfile_ctx_t* ctx, const char* source, const char* dest,
+		const struct stat* st);
+/* get the next @event of the walk, in the directory @dir. the data is
+ * valid until the next call. */
+copyfile_error_t copyfile_walk_next(struct copyfile_walk* w,
+		enum copyfile_walk_event* event,
+		const struct copyfile_walk_dir** dir);
+void copyfile_walk_close(struct copyfile_walk* w);
+
+/* bind @journal to the tree copy of the directory @st into @dest,
+ * starting it over if it was used for another one, until
+ * copyfile_journal_end(). */
+copyfile_error_t copyfile_journal_begin(copyfile_journal_t* journal,
+		const struct stat* st, const char* dest);
+void copyfile_journal_end(copyfile_journal_t* journal);
+/* check whether the file or directory @st is recorded as done. */
+int copyfile_journal_done(copyfile_journal_t* journal,
+		const struct stat* st);
+/* record the file or directory @st, in the directory (@parent_dev,
+ * @parent_ino) as done. it is written on the next sync. */
+copyfile_error_t copyfile_journal_add(copyfile_journal_t* journal,
+		const struct stat* st, dev_t parent_dev, ino_t parent_ino);
+/* write the records added, and sync them. */
+copyfile_error_t copyfile_journal_sync(copyfile_journal_t* journal);
+
+/* with a journal bound to the running tree copy in @ctx, copy
+ * the large regular file @source in recorded steps, continuing from
+ * the last step recorded. returns 1 if done so, with the result in
+ * @ret; otherwise 0, and the file is to be copied normally. */
+int copyfile_journal_archive(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_error_t* ret,
+		copyfile_callback_t callback, void* callback_data);
+
+/* with a manifest in @ctx, skip the regular file @source if it was
+ * copied into @dest unchanged (reporting it as up-to-date). returns 1
+ * if skipped, with the result in @ret; otherwise 0. */
+int copyfile_manifest_check(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_error_t* ret,
+		copyfile_callback_t callback, void* callback_data);
+/* add the copy of @source into @dest to the manifest writer of @ctx
+ * (if any). */
+void copyfile_manifest_remember(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, const struct stat* st);
+
+/* copy the directory tree @source as it is walked: create
+ * the directories, copy the files in parallel, in chunks of up to
+ * COPYFILE_TREE_CHUNK, and copy the metadata of each directory after
+ * its contents. with a journal in @ctx, what was recorded as done is
+ * skipped, and the chunks done are recorded. */
+copyfile_error_t copyfile_copy_tree(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/* Internal metadata functions accept the destination both as a path
+ * and as an open file descriptor. If @fd is not -1, it is used instead
+ * of the path wherever the platform supports that. @path can be NULL
+ * if the file has no name (yet). */
+
+/* copyfile_set_stat() with an explicit current stat() of the file.
+ * if @cur is NULL, all properties are set unconditionally. */
+unsigned int copyfile_set_stat_diff(const char* path, int fd,
+		const struct stat* st, const struct stat* cur,
+		unsigned int flags);
+
+/* copyfile_copy_metadata() with the destination given as an fd. */
+copyfile_error_t copyfile_copy_metadata_to(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int dest_fd,
+		const struct stat* st, unsigned int flags,
+		unsigned int* result_flags);
+
+/* copyfile_copy_acl() and copyfile_copy_cap() with the destination
+ * given as an fd. */
+copyfile_error_t copyfile_copy_acl_to(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int dest_fd,
+		const struct stat* st);
+copyfile_error_t copyfile_copy_cap_to(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int dest_fd,
+		const struct stat* st);
+
+/* copy the contents of regular file @fd_in into @fd_out (clone,
+ * preallocate, copy, truncate). the fds are not closed. if
+ * @expected_size is up to COPYFILE_SMALL_FILE, @fd_out needs to be
+ * empty; the file is copied with a single read and write then.
+ * @blockdev tells whether @fd_out is a block device, written
+ * in place. */
+copyfile_error_t copyfile_copy_fd(copyfile_ctx_t* ctx,
+		int fd_in, int fd_out, int blockdev, off_t expected_size,
+		copyfile_callback_t callback, void* callback_data);
+
+/* report the regular file @st as up-to-date (as skipped,
+ * with the metadata of @flags the same). */
+copyfile_error_t copyfile_up_to_date(copyfile_ctx_t* ctx,
+		const struct stat* st, unsigned int flags,
+		unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/* check whether the regular file @dest is up-to-date with @st
+ * in COPYFILE_QUICK_CHECK mode. if it is, report it and return 1
+ * with the final result stored in @ret; otherwise, return 0. */
+int copyfile_quick_check(copyfile_ctx_t* ctx, const char* dest,
+		const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_error_t* ret,
+		copyfile_callback_t callback, void* callback_data);
+
+/* the EXDEV fallback of copyfile_move_file_ctx(): copy @source with
+ * copyfile_archive_file_ctx() and all the metadata, never skipping it
+ * as up-to-date. */
+copyfile_error_t copyfile_archive_moved(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/* the EXDEV fallback of copyfile_move_file_ctx() with
+ * COPYFILE_PUNCH_SOURCE: copy the regular file @source in chunks into
+ * a partial file next to @dest, releasing each chunk of the source
+ * once its copy is durable. resumes a partial file left over. */
+copyfile_error_t copyfile_move_punched(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/* the map of the multiply linked regular files copied by a batch
+ * (COPYFILE_PRESERVE_HARDLINKS), keyed by the source device and inode.
+ * an entry is dropped when all its links have been seen, and no more
+ * than COPYFILE_LINK_MAP_MAX are kept. */
+struct copyfile_link_map
+{
+	struct copyfile_link_entry** buckets;
+	size_t count;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t published;
+#endif
+};
+
+enum copyfile_link_claim
+{
+	/* copy the file (the map is full) */
+	COPYFILE_LINK_UNTRACKED,
+	/* copy the file, then copyfile_link_map_publish() the result */
+	COPYFILE_LINK_FIRST,
+	/* hard link the file to the returned target */
+	COPYFILE_LINK_FOUND
+};
+
+copyfile_error_t copyfile_link_map_init(struct copyfile_link_map* map);
+void copyfile_link_map_free(struct copyfile_link_map* map);
+/* look the source file @st up in @map. if another link to it is being
+ * copied, wait for it to finish. with COPYFILE_LINK_FOUND, *@target
+ * is set to a newly allocated path of the copy. */
+enum copyfile_link_claim copyfile_link_map_claim(
+		struct copyfile_link_map* map, const struct stat* st,
+		char** target);
+/* publish the copy of @st claimed with COPYFILE_LINK_FIRST as @dest,
+ * or NULL if it failed (another link will be copied then). */
+void copyfile_link_map_publish(struct copyfile_link_map* map,
+		const struct stat* st, const char* dest);
+
+/* copyfile_get_extents() for an open file. */
+copyfile_error_t copyfile_get_extents_fd(int fd,
+		copyfile_extent_t** extents, size_t* count);
+/* find the physical location of the first extent of @fd. returns 0
+ * on success, -1 if it is not known. */
+int copyfile_first_extent(int fd, off_t* physical);
+
+/* the order in which the @count batch @entries are to be started
+ * (per the schedule of @ctx), as a newly allocated array of indexes.
+ * returns NULL for the listed order (or if it can not be found). */
+size_t* copyfile_schedule(const copyfile_ctx_t* ctx,
+		const copyfile_batch_entry_t* entries, size_t count);
+
+/* the state of a copy done range by range */
+struct copyfile_range_copy
+{
+	copyfile_ctx_t* ctx;
+	int fd_in;
+	int fd_out;
+
+	copyfile_progress_t progress;
+	unsigned int opcount;
+	copyfile_callback_t callback;
+	void* callback_data;
+};
+
+/* report the progress at @offset to the callback (every
+ * callback_opcount calls). */
+copyfile_error_t copyfile_range_progress(struct copyfile_range_copy* c,
+		off_t offset);
+/* copy [@offset, @offset + @len) of the input, stopping at EOF. */
+copyfile_error_t copyfile_copy_range(struct copyfile_range_copy* c,
+		off_t offset, off_t len);
+
+/* allocate [@offset, @offset + @len) of @fd if possible. */
+void copyfile_preallocate(int fd, off_t offset, off_t len);
+
+/* copy the regular file @fd_in into @fd_out along its data
+ * (SEEK_DATA/SEEK_HOLE): only the data is copied, and the holes are
+ * skipped -- or preallocated, if the source has all of its blocks
+ * allocated (so they are unwritten extents). returns
+ * COPYFILE_ERROR_UNSUPPORTED without doing anything if the source
+ * has no holes, or they can't be found. */
+copyfile_error_t copyfile_copy_extents(copyfile_ctx_t* ctx,
+		int fd_in, int fd_out,
+		copyfile_callback_t callback, void* callback_data);
+
+/* copy the regular file @fd_in onto the block device @fd_out, in place
+ * and without truncating. the zero regions are discarded (or zeroed
+ * out) rather than written. fails with ENOSPC before writing anything
+ * if the file does not fit. returns COPYFILE_ERROR_UNSUPPORTED if
+ * @fd_out is not a block device. */
+copyfile_error_t copyfile_copy_blockdev(copyfile_ctx_t* ctx,
+		int fd_in, int fd_out,
+		copyfile_callback_t callback, void* callback_data);
+
+/* the first copies of the shared source extents found in a batch
+ * (COPYFILE_PRESERVE_SHARING). it is safe to use from multiple
+ * threads. */
+typedef struct copyfile_extent_map copyfile_extent_map_t;
+
+copyfile_extent_map_t* copyfile_extent_map_create(void);
+void copyfile_extent_map_destroy(copyfile_extent_map_t* map);
+
+/* with an extent map set in @ctx, copy the regular file @source having
+ * shared extents, cloning the extents which were copied before from
+ * their copies. returns 1 if done so, with the result in @ret;
+ * otherwise 0, and the file is to be copied normally. */
+int copyfile_shared_archive(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_error_t* ret,
+		copyfile_callback_t callback, void* callback_data);
+
+/* the read-ahead of the upcoming files of a batch (COPYFILE_PREFETCH).
+ * the positions are those of the dispatch order. */
+struct copyfile_prefetch
+{
+	const copyfile_batch_entry_t* entries;
+	const size_t* order;
+	size_t count;
+
+	/* the next position to prefetch, the first one still ahead */
+	size_t next;
+	size_t released;
+	/* the amount prefetched for each position, and for those ahead */
+	off_t* sizes;
+	off_t window;
+	/* the number of files to look ahead, adjusted to the latency */
+	size_t depth;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+};
+
+copyfile_error_t copyfile_prefetch_init(struct copyfile_prefetch* p,
+		const copyfile_batch_entry_t* entries, const size_t* order,
+		size_t count);
+void copyfile_prefetch_free(struct copyfile_prefetch* p);
+/* the file at @pos is being started; prefetch the ones after it. */
+void copyfile_prefetch_start(struct copyfile_prefetch* p, size_t pos);
+/* a file took @elapsed_us to copy; adjust the depth. */
+void copyfile_prefetch_done(struct copyfile_prefetch* p,
+		long elapsed_us);
+/* the time passed since @since, in microseconds. */
+long copyfile_elapsed_us(const struct timeval* since);
+
+/* copyfile_archive_file_ctx() for the fallback of
+ * copyfile_link_file_ctx(). a duplicate from the dedup index may be
+ * hard-linked then (if its stat() metadata matches). */
+copyfile_error_t copyfile_archive_file_linking(copyfile_ctx_t* ctx,
+		const char* source, const char* dest,
+		unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data);
+
+#define COPYFILE_SHA256_SIZE 32
+
+struct copyfile_sha256
+{
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char buf[64];
+};
+
+void copyfile_sha256_init(struct copyfile_sha256* s);
+void copyfile_sha256_update(struct copyfile_sha256* s,
+		const void* data, size_t len);
+void copyfile_sha256_final(struct copyfile_sha256* s,
+		unsigned char digest[COPYFILE_SHA256_SIZE]);
+
+/* hash the contents of the file @path. */
+copyfile_error_t copyfile_dedup_hash(copyfile_ctx_t* ctx, const char* path,
+		unsigned char hash[COPYFILE_SHA256_SIZE]);
+
+/* the contents key of a file in the dedup index. the hash is computed
+ * lazily, only if a file of the same size is known. */
+struct copyfile_dedup_key
+{
+	off_t size;
+	int hashed;
+	unsigned char hash[COPYFILE_SHA256_SIZE];
+};
+
+/* find a duplicate of the regular file @path in @index, skipping
+ * the file itself and @exclude (if non-NULL). @key needs to be
+ * initialized with hashed = 0 (or a known hash); the hash is stored
+ * there if computed. *@dup_copy is set to a newly allocated path,
+ * or NULL if none is found. */
+copyfile_error_t copyfile_dedup_find(copyfile_ctx_t* ctx,
+		copyfile_dedup_index_t* index, const char* path,
+		const struct stat* st, const struct stat* exclude,
+		struct copyfile_dedup_key* key, char** dup_copy);
+/* add the regular file @path to @index, using the hash from @key
+ * if it's known (and the size matches). */
+copyfile_error_t copyfile_dedup_add(copyfile_ctx_t* ctx,
+		copyfile_dedup_index_t* index, const char* path,
+		const struct copyfile_dedup_key* key);
+
+/* with a dedup index set in @ctx, copy @source from a known
+ * duplicate (or hard link the duplicate if @may_link). returns 1 if
+ * done so, with the result in @ret; otherwise 0, and @key is to be
+ * passed to copyfile_dedup_remember() after copying. */
+int copyfile_dedup_archive(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, int may_link,
+		struct copyfile_dedup_key* key, copyfile_error_t* ret,
+		copyfile_callback_t callback, void* callback_data);
+/* add the copied @dest to the dedup index of @ctx (if any). */
+void copyfile_dedup_remember(copyfile_ctx_t* ctx, const char* dest,
+		const struct copyfile_dedup_key* key);
+
+/* copy the regular file @source into @dest, cloning the blocks that
+ * are the same in @dup_copy (COPYFILE_PARTIAL_CLONE). returns
+ * COPYFILE_ERROR_IOCTL_CLONE (or COPYFILE_ERROR_UNSUPPORTED) without
+ * reading anything if cloning from @dup_copy is not possible. */
+copyfile_error_t copyfile_clone_partial(copyfile_ctx_t* ctx,
+		const char* source, const char* dup_copy, const char* dest,
+		const struct stat* st,
+		copyfile_callback_t callback, void* callback_data);
+
+/* a new file being written out of sight, to be published under its
+ * final name when complete */
+struct copyfile_tmpfile
+{
+	int fd;
+	/* the hidden temporary name if O_TMPFILE could not be used,
+	 * NULL if the file is anonymous */
+	const char* path;
+
+	struct copyfile_arena name;
+	char name_buf[256];
+};
+
+/* open a new temporary file in the directory of @dest. */
+copyfile_error_t copyfile_tmpfile_open(struct copyfile_tmpfile* tmp,
+		const char* dest, mode_t mode);
+/* atomically put the file in place of @dest, replacing it if it exists,
+ * and close it. on failure, the temporary file is removed. */
+copyfile_error_t copyfile_tmpfile_publish(struct copyfile_tmpfile* tmp,
+		const char* dest);
+/* close and remove the temporary file. errno is preserved. */
+void copyfile_tmpfile_discard(struct copyfile_tmpfile* tmp);
+
+/* copy the regular file @source into a temporary file, and publish it
+ * as @dest. if @st is non-NULL, the metadata is copied before
+ * publishing and the result of that is stored in @metadata_ret. */
+copyfile_error_t copyfile_copy_regular_atomic(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, off_t expected_size,
+		const struct stat* st, unsigned int flags,
+		unsigned int* result_flags, copyfile_error_t* metadata_ret,
+		copyfile_callback_t callback, void* callback_data);
+
+#ifdef HAVE_LGETXATTR
+
+/* kinds of extended attributes found by copyfile_scan_xattr() */
+enum copyfile_xattr_found
+{
+	COPYFILE_XATTR_FOUND_REGULAR = 0x01,
+	COPYFILE_XATTR_FOUND_ACL_ACCESS = 0x02,
+	COPYFILE_XATTR_FOUND_ACL_DEFAULT = 0x04,
+	COPYFILE_XATTR_FOUND_CAP = 0x08,
+
+	COPYFILE_XATTR_FOUND_ACL = COPYFILE_XATTR_FOUND_ACL_ACCESS
+		| COPYFILE_XATTR_FOUND_ACL_DEFAULT
+};
+
+struct copyfile_xattr_scan
+{
+	/* null-separated list of names, valid as long as the arena */
+	const char* list;
+	ssize_t len;
+	unsigned int found;
+};
+
+/* list the extended attributes of @source (not following symlinks)
+ * into @arena with a single call whenever possible, and classify
+ * them. if the filesystem does not support xattrs, an empty list is
+ * returned. */
+copyfile_error_t copyfile_scan_xattr(copyfile_ctx_t* ctx,
+		struct copyfile_arena* arena, const char* source,
+		const struct stat* st, struct copyfile_xattr_scan* scan);
+
+/* get the value of xattr @name of @path into @arena, growing it
+ * if necessary. returns the value length or -1 on error (errno). */
+ssize_t copyfile_get_xattr(struct copyfile_arena* arena,
+		const char* path, const char* name);
+
+/* copy the regular attributes from a list obtained via
+ * copyfile_scan_xattr(). if @same is non-NULL, attributes equal
+ * on @dest are not rewritten, and *@same tells whether all were. */
+copyfile_error_t copyfile_copy_xattr_list(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int dest_fd,
+		const struct copyfile_xattr_scan* scan, int* same);
+
+/* copy a single attribute @name verbatim. */
+copyfile_error_t copyfile_copy_xattr_raw(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, int dest_fd,
+		const char* name);
+
+/* check whether @name has the same value on @source and @dest
+ * (or is missing on both). returns 0 if it differs or on error. */
+int copyfile_same_xattr(copyfile_ctx_t* ctx, const char* source,
+		const char* dest, int dest_fd, const char* name);
+
+#endif /*HAVE_LGETXATTR*/
+
+#endif /*COPYFILE_INTERNAL_H*/
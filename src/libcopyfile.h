@@ -59,6 +59,15 @@ typedef enum
 	COPYFILE_ERROR_UNLINK_SOURCE,
 	COPYFILE_ERROR_UNLINK_DEST,
 	COPYFILE_ERROR_IOCTL_CLONE,
+	COPYFILE_ERROR_SYNC,
+	COPYFILE_ERROR_READDIR,
+	COPYFILE_ERROR_PUNCH_SOURCE,
+	COPYFILE_ERROR_INDEX,
+	COPYFILE_ERROR_IOCTL_DEDUPE,
+	COPYFILE_ERROR_IOCTL_FIEMAP,
+	COPYFILE_ERROR_JOURNAL,
+	COPYFILE_ERROR_MANIFEST,
+	COPYFILE_ERROR_WATCH,
 	COPYFILE_ERROR_DOMAIN_MAX,
 
 	/**
@@ -91,6 +100,12 @@ typedef enum
 	 * A special end-of-file status constant for callback.
 	 */
 	COPYFILE_EOF,
+	/**
+	 * A special status constant for callback, used instead
+	 * of COPYFILE_EOF when the destination was found up-to-date
+	 * and the copy was skipped (see COPYFILE_QUICK_CHECK).
+	 */
+	COPYFILE_UP_TO_DATE,
 
 	COPYFILE_ERROR_MAX
 } copyfile_error_t;
@@ -170,7 +185,56 @@ typedef enum
 	 * All metadata.
 	 */
 	COPYFILE_COPY_ALL_METADATA = COPYFILE_COPY_STAT
-		| COPYFILE_COPY_XATTR | COPYFILE_COPY_ACL | COPYFILE_COPY_CAP
+		| COPYFILE_COPY_XATTR | COPYFILE_COPY_ACL | COPYFILE_COPY_CAP,
+
+	/**
+	 * Mode modifiers. These don't select any metadata on their own;
+	 * if none of the flags above is given along with them, all
+	 * metadata is copied.
+	 */
+
+	/**
+	 * Copy ACLs and capabilities as raw extended attribute values
+	 * (system.posix_acl_access, system.posix_acl_default
+	 * and security.capability) where the platform stores them so,
+	 * without decoding them through libacl and libcap.
+	 *
+	 * If the raw value is refused by the destination (e.g. a capability
+	 * bound to another user namespace), the library call is used
+	 * instead. Since no decoding is done, this works even if ACL
+	 * or capability support is disabled.
+	 */
+	COPYFILE_RAW_METADATA = 0x0100,
+	/**
+	 * Compare the metadata of the destination file first, and change
+	 * only the properties which differ. This avoids dirtying
+	 * the destination inode when it is up-to-date already (e.g. when
+	 * syncing a mostly-unchanged mirror).
+	 */
+	COPYFILE_DIFF_METADATA = 0x0200,
+
+	/**
+	 * Result flags for COPYFILE_DIFF_METADATA. Each of them is set
+	 * in the result (along with the respective COPYFILE_COPY_* flag)
+	 * if the destination had the correct value already and therefore
+	 * it was not written.
+	 */
+	COPYFILE_SAME_USER = COPYFILE_COPY_USER << 16,
+	COPYFILE_SAME_GROUP = COPYFILE_COPY_GROUP << 16,
+	COPYFILE_SAME_MODE = COPYFILE_COPY_MODE << 16,
+	COPYFILE_SAME_MTIME = COPYFILE_COPY_MTIME << 16,
+	COPYFILE_SAME_ATIME = COPYFILE_COPY_ATIME << 16,
+	COPYFILE_SAME_XATTR = COPYFILE_COPY_XATTR << 16,
+	COPYFILE_SAME_ACL = COPYFILE_COPY_ACL << 16,
+	COPYFILE_SAME_CAP = COPYFILE_COPY_CAP << 16,
+
+	/**
+	 * A result flag stating that the destination was found up-to-date
+	 * (see COPYFILE_QUICK_CHECK) and nothing was written. All
+	 * the requested COPYFILE_COPY_* and COPYFILE_SAME_* flags are set
+	 * along with it.
+	 */
+	COPYFILE_SKIPPED = 0x01000000
 } copyfile_metadata_flag_t;
 
 /**
@@ -351,6 +415,500 @@ typedef int (*copyfile_callback_t)(copyfile_error_t state,
  */
 const char* copyfile_error_message(copyfile_error_t err);
 
+/**
+ * An opaque copy context.
+ *
+ * The context holds reusable buffers (for data, extended attributes
+ * and symlink targets), cached information about filesystem features,
+ * tuning parameters and statistics. Passing the same context to
+ * the *_ctx() function variants allows a long-running program to reach
+ * a steady state where no memory is allocated per file.
+ *
+ * The *_ctx() variants take the context as their first argument
+ * and otherwise work like the functions without the suffix, using
+ * the context for the buffers, caches, tuning and statistics (and
+ * the options set in it). Their descriptions below only say what
+ * differs.
+ *
+ * A single context must not be used by multiple threads at the same
+ * time. Whenever a *_ctx() function accepts a context, NULL can be
+ * passed instead to get the default behavior (the same as the variant
+ * without context).
+ */
+typedef struct copyfile_ctx copyfile_ctx_t;
+
+/**
+ * An opaque type holding an open deduplication index, see
+ * copyfile_dedup_index_open().
+ */
+typedef struct copyfile_dedup_index copyfile_dedup_index_t;
+
+/**
+ * An opaque type holding an open checkpoint journal, see
+ * copyfile_journal_open().
+ */
+typedef struct copyfile_journal copyfile_journal_t;
+
+/**
+ * Opaque types holding an open manifest of copied files, and one
+ * being written, see copyfile_manifest_open()
+ * and copyfile_manifest_writer_open().
+ */
+typedef struct copyfile_manifest copyfile_manifest_t;
+typedef struct copyfile_manifest_writer copyfile_manifest_writer_t;
+
+/**
+ * An opaque type holding a tree being watched for changes, see
+ * copyfile_watch_open().
+ */
+typedef struct copyfile_watch copyfile_watch_t;
+
+/**
+ * Constants for copy context options.
+ */
+typedef enum
+{
+	/**
+	 * Write regular files out of sight and publish them atomically
+	 * when complete, so that other processes never see a partially
+	 * written file.
+	 *
+	 * The file is created anonymously (O_TMPFILE) in the destination
+	 * directory, its contents and metadata are copied through
+	 * the descriptor, and it is finally linked in place. If
+	 * the destination exists already, the new file is linked under
+	 * a hidden temporary name and renamed over it. In this mode,
+	 * an existing destination is always replaced; symbolic links
+	 * and special files are not written through.
+	 *
+	 * Where O_TMPFILE is not supported, a hidden temporary file
+	 * ('.name.XXXXXX' in the destination directory) is used instead.
+	 * With O_TMPFILE, the same hidden name is given to the file
+	 * for the moment between linking it and renaming it over
+	 * an existing destination. The hidden file is removed on every
+	 * failure, but it may be left over if the process is killed
+	 * or the system crashes.
+	 *
+	 * This applies to copyfile_copy_regular_ctx(),
+	 * copyfile_archive_file_ctx() and the functions using them.
+	 */
+	COPYFILE_ATOMIC_PUBLISH = 0x0001,
+	/**
+	 * Skip copying regular files whose destination is up-to-date
+	 * already, like rsync's quick check: the destination is
+	 * a regular file of the same size and modification time
+	 * (with nanosecond precision, as set by copyfile_set_stat()).
+	 * Neither the contents nor the metadata are copied then.
+	 *
+	 * The skipped files are reported with the COPYFILE_SKIPPED result
+	 * flag, the COPYFILE_UP_TO_DATE callback status and counted
+	 * in the up_to_date statistic.
+	 *
+	 * Note that a changed file is not noticed if its size and mtime
+	 * are the same (e.g. if the mtime was reset on purpose).
+	 *
+	 * This applies to copyfile_archive_file_ctx(),
+	 * copyfile_archive_file_dedup_ctx() and the functions using them
+	 * without replacing the destination first.
+	 */
+	COPYFILE_QUICK_CHECK = 0x0002,
+	/**
+	 * When a regular file needs to be copied across filesystems
+	 * in copyfile_move_file_ctx(), release the space of the source
+	 * progressively. The file is copied in chunks (of 64 MiB) into
+	 * a partial file, '.name.<device>-<inode>-<size>.partial' in
+	 * the destination directory; after each chunk is synced to the disk
+	 * (along with the name of the partial file), it is punched out
+	 * of the source (fallocate() with FALLOC_FL_PUNCH_HOLE). When
+	 * complete, the file is renamed into place, and the source is
+	 * removed. This way, a file can be moved off a nearly full
+	 * filesystem.
+	 *
+	 * If the move is interrupted, the source is left with a hole
+	 * at the beginning and the partial file holds the missing data.
+	 * Repeating the move with this option resumes it at the end
+	 * of the partial file. Never retry it without this option, since
+	 * the punched source would be copied as is.
+	 *
+	 * The destination is always replaced. If the platform or
+	 * the source filesystem can not punch holes (or the source is
+	 * not writable), the file is moved the same way without
+	 * releasing the space early.
+	 */
+	COPYFILE_PUNCH_SOURCE = 0x0004,
+	/**
+	 * Do not assume that the dup_copy passed to the *_dedup_ctx()
+	 * functions has the same contents as the source; use it as
+	 * an older version of the file instead.
+	 *
+	 * The source is compared with the duplicate block by block
+	 * (in aligned blocks of 128 KiB). The runs of matching blocks are
+	 * cloned from the duplicate (FICLONERANGE), and only the blocks
+	 * which differ are written from the source. This way, a new
+	 * version of a file shares most of its storage with the previous
+	 * one. Both files are read completely.
+	 *
+	 * If cloning from the duplicate is not possible (e.g. it is
+	 * on another filesystem), the functions behave as if cloning
+	 * the whole duplicate failed, and the contents are copied from
+	 * the source.
+	 */
+	COPYFILE_PARTIAL_CLONE = 0x0008,
+	/**
+	 * Preserve the hard links between the regular files copied
+	 * by copyfile_archive_batch_ctx() and copyfile_archive_tree_ctx().
+	 *
+	 * The first file found of an inode with more than one link is
+	 * copied, and the remaining ones are hard-linked to its copy
+	 * instead (or left alone if they are linked to it already). Links
+	 * to the same inode are handled by one thread at a time.
+	 *
+	 * At most 65536 inodes are remembered at a time; an inode is
+	 * forgotten once all its links have been seen. The links beyond
+	 * that limit, and those which can not be linked (e.g. EMLINK), are
+	 * copied separately.
+	 *
+	 * copyfile_move_tree_ctx() always preserves hard links when
+	 * copying.
+	 */
+	COPYFILE_PRESERVE_HARDLINKS = 0x0010,
+	/**
+	 * Preserve the sharing of data between the regular files copied
+	 * by copyfile_archive_batch_ctx() and copyfile_archive_tree_ctx()
+	 * (e.g. reflinked files and snapshots).
+	 *
+	 * The extents of every source file are read (FIEMAP). The files
+	 * having shared extents are copied extent by extent, and
+	 * the physical location of each shared extent is remembered along
+	 * with its copy. When the same extent is found in another file
+	 * later, it is cloned from the earlier copy (FICLONERANGE) rather
+	 * than written again. The holes in such files are not written.
+	 *
+	 * This requires a destination filesystem supporting reflinks.
+	 * The extents are remembered only once their file is complete,
+	 * so files copied concurrently may not share them. At most 262144
+	 * extents are remembered.
+	 */
+	COPYFILE_PRESERVE_SHARING = 0x0020,
+	/**
+	 * Read the upcoming files ahead in copyfile_archive_batch_ctx()
+	 * and copyfile_archive_tree_ctx(), so that their data is
+	 * in the cache when they are copied.
+	 *
+	 * When a file is started, the following ones (in the order of
+	 * the schedule) are looked up and the system is asked to read
+	 * them in background (posix_fadvise() with POSIX_FADV_WILLNEED).
+	 * At most 1 MiB of each file and 32 MiB in total is requested
+	 * ahead. The number of files looked ahead starts at 4 and grows
+	 * (up to 128) while the files take long to copy, i.e. while
+	 * the reads wait for the storage, and shrinks again once they
+	 * come from the cache.
+	 *
+	 * This helps with many small files on a network or rotational
+	 * storage. It costs an additional open() of every file.
+	 */
+	COPYFILE_PREFETCH = 0x0040
+} copyfile_option_t;
+
+/**
+ * Constants for copy context durability modes.
+ *
+ * The value consists of one of the modes and any of the modifiers.
+ */
+typedef enum
+{
+	/**
+	 * Do not sync anything; leave it to the system (the default).
+	 */
+	COPYFILE_SYNC_NONE = 0,
+	/**
+	 * Sync each regular file's data (fdatasync()) before closing it.
+	 * With COPYFILE_ATOMIC_PUBLISH, the file is synced with its
+	 * metadata (fsync()) before being published. Otherwise, metadata
+	 * set after the file is closed is not covered.
+	 */
+	COPYFILE_SYNC_FILE = 1,
+	/**
+	 * Do not sync files one by one. Instead, remember the filesystems
+	 * written to, and sync each of them once (syncfs()) when
+	 * copyfile_ctx_commit() is called. This amortizes the flush cost
+	 * over any number of files, and covers all the data and metadata.
+	 *
+	 * If syncfs() is not supported by the platform, this is
+	 * equivalent to COPYFILE_SYNC_FILE.
+	 */
+	COPYFILE_SYNC_BATCH = 2,
+
+	COPYFILE_SYNC_MODE_MASK = 0x00ff,
+
+	/**
+	 * Additionally sync the parent directory after a file is created
+	 * (or published), so that the new name is durable as well. This
+	 * is implied by the syncfs() done in COPYFILE_SYNC_BATCH mode.
+	 */
+	COPYFILE_SYNC_DIRS = 0x0100
+} copyfile_durability_t;
+
+/**
+ * Constants for the order in which the batch and tree functions start
+ * copying the files.
+ */
+typedef enum
+{
+	/**
+	 * The order of the batch entries; for the trees, the order
+	 * of the directory listing (the default).
+	 */
+	COPYFILE_SCHEDULE_LISTED = 0,
+	/**
+	 * The order of the physical location of the source files
+	 * on the device (of the first extent, as listed by
+	 * copyfile_get_extents()). The files whose location is not known
+	 * follow in the order of their inode numbers.
+	 *
+	 * This reduces the seeking when reading from rotational disks.
+	 * The files are started in that order, each written by a single
+	 * thread; use a single thread (or a few) to keep the reads
+	 * sequential.
+	 */
+	COPYFILE_SCHEDULE_PHYSICAL,
+	/**
+	 * The order of the inode numbers of the source files. This is
+	 * a cheaper approximation of the physical order on many
+	 * filesystems.
+	 */
+	COPYFILE_SCHEDULE_INODE
+} copyfile_schedule_t;
+
+/**
+ * Statistics collected in a copy context.
+ */
+typedef struct
+{
+	/**
+	 * The number of regular files, directories, symbolic links
+	 * and other special files created successfully.
+	 */
+	unsigned long files;
+	unsigned long directories;
+	unsigned long symlinks;
+	unsigned long specials;
+
+	/**
+	 * The number of regular files whose contents were cloned (CoW)
+	 * rather than copied.
+	 */
+	unsigned long clones;
+	/**
+	 * The number of extended attributes set.
+	 */
+	unsigned long xattrs;
+	/**
+	 * The number of files skipped as up-to-date
+	 * (see COPYFILE_QUICK_CHECK).
+	 */
+	unsigned long up_to_date;
+	/**
+	 * The number of regular files copied from (or hard-linked to)
+	 * a duplicate found in the deduplication index.
+	 */
+	unsigned long deduplicated;
+	/**
+	 * The number of regular files hard-linked to the copy of another
+	 * link (see COPYFILE_PRESERVE_HARDLINKS).
+	 */
+	unsigned long links;
+
+	/**
+	 * The amount of data cloned from the earlier copies of shared
+	 * extents instead of being written
+	 * (see COPYFILE_PRESERVE_SHARING).
+	 */
+	off_t shared;
+
+	/**
+	 * The amount of data copied through copyfile_copy_stream_ctx().
+	 */
+	off_t bytes;
+} copyfile_stats_t;
+
+/**
+ * Create a new copy context, using default tuning parameters.
+ *
+ * Returns the new context, or NULL if memory allocation fails.
+ */
+copyfile_ctx_t* copyfile_ctx_create(void);
+
+/**
+ * Destroy the copy context @ctx, releasing all its buffers. NULL is
+ * accepted and ignored.
+ */
+void copyfile_ctx_destroy(copyfile_ctx_t* ctx);
+
+/**
+ * Set the size of the data buffer used for stream copy. The buffer
+ * is allocated on first use and reused afterwards.
+ *
+ * Passing 0 restores the default (COPYFILE_BUFFER_SIZE).
+ */
+void copyfile_ctx_set_buffer_size(copyfile_ctx_t* ctx, size_t size);
+
+/**
+ * Set the progress throttle -- the number of read/write operations
+ * between consecutive progress callbacks.
+ *
+ * Passing 0 restores the default (COPYFILE_CALLBACK_OPCOUNT).
+ */
+void copyfile_ctx_set_callback_opcount(copyfile_ctx_t* ctx,
+		unsigned int opcount);
+
+/**
+ * Set the options (a bit-field of copyfile_option_t values) for @ctx,
+ * replacing the previous ones. No options are set by default.
+ */
+void copyfile_ctx_set_options(copyfile_ctx_t* ctx, unsigned int options);
+
+/**
+ * Get the options currently set for @ctx.
+ */
+unsigned int copyfile_ctx_get_options(const copyfile_ctx_t* ctx);
+
+/**
+ * Set the number of worker threads used by the batch and tree
+ * functions, including the calling thread.
+ *
+ * Passing 0 restores the default (the number of online CPUs, but not
+ * more than 8). If the library was built without thread support,
+ * a single thread is always used.
+ */
+void copyfile_ctx_set_threads(copyfile_ctx_t* ctx, unsigned int threads);
+
+/**
+ * Set the order in which the batch and tree functions start copying
+ * the files (a copyfile_schedule_t value). The default is
+ * COPYFILE_SCHEDULE_LISTED.
+ */
+void copyfile_ctx_set_schedule(copyfile_ctx_t* ctx,
+		copyfile_schedule_t schedule);
+
+/**
+ * Set the deduplication index consulted by @ctx, or NULL to stop
+ * using one (the default). The index is not owned by the context,
+ * and it must be kept open as long as it is set.
+ *
+ * With an index, copyfile_archive_file_ctx() (and the functions using
+ * it, including the copy fallback of copyfile_link_file_ctx()
+ * and copyfile_move_file_ctx()) looks up every non-empty regular file
+ * in it. If a file with the same contents is found, the copy is done
+ * as with copyfile_archive_file_dedup_ctx(), that is cloning
+ * the duplicate where possible. For copyfile_link_file_ctx(),
+ * the duplicate is hard-linked instead if its mode, owner
+ * and modification time are the same as the source's. Otherwise,
+ * the file is copied normally and the destination is added
+ * to the index.
+ *
+ * Failures of the index are ignored; the file is copied normally
+ * then.
+ */
+void copyfile_ctx_set_dedup_index(copyfile_ctx_t* ctx,
+		copyfile_dedup_index_t* index);
+
+/**
+ * Set the checkpoint journal of the tree copies done with @ctx, or NULL
+ * to stop using one (the default). The journal is not owned by
+ * the context, and it must be kept open as long as it is set.
+ *
+ * With a journal, copyfile_archive_tree_ctx() (and the copy done by
+ * copyfile_move_tree_ctx()) records the files and the directories as
+ * they are done, and a copy run again after an interruption skips
+ * them: the directories whose contents were all copied are not walked
+ * at all, and the files are just lstat()-ed -- the records are looked
+ * up by the source's inode, so that renames don't matter. An entry is
+ * skipped only if its size and modification time are the same as when
+ * it was recorded; neither its data nor the destination is checked.
+ * Files with other hard links are not skipped with
+ * COPYFILE_PRESERVE_HARDLINKS, so that the links can be found again.
+ *
+ * Regular files of at least 128 MiB (except sparse ones, or with
+ * COPYFILE_ATOMIC_PUBLISH) are copied in steps of 64 MiB, each synced
+ * to the disk and recorded, so that an interrupted copy continues
+ * from the last step.
+ *
+ * The records are written (and synced) once per batch of files. They
+ * are recorded only after the files are committed in
+ * COPYFILE_SYNC_BATCH mode; in the other modes, the journal itself
+ * survives a crash of the system, but the copies it records may not.
+ */
+void copyfile_ctx_set_journal(copyfile_ctx_t* ctx,
+		copyfile_journal_t* journal);
+
+/**
+ * Set the manifest of a previous run consulted by @ctx, or NULL to stop
+ * using one (the default). The manifest is not owned by the context,
+ * and it must be kept open as long as it is set.
+ *
+ * With a manifest, copyfile_archive_file_ctx() (and the batch and tree
+ * functions using it) skips a regular file if it is recorded
+ * in the manifest with the same source and destination paths, and its
+ * size, inode number, modification and status change times are still
+ * the same. The file is reported as up-to-date (like with
+ * COPYFILE_QUICK_CHECK). The destination is only checked to be
+ * a regular file still; its contents are assumed not to have been
+ * changed since. The moves never skip files this way, as their source
+ * is removed afterwards.
+ */
+void copyfile_ctx_set_manifest(copyfile_ctx_t* ctx,
+		const copyfile_manifest_t* manifest);
+
+/**
+ * Set the manifest @writer to which @ctx adds the regular files copied
+ * by copyfile_archive_file_ctx() (and the batch and tree functions
+ * using it), including the ones found up-to-date. NULL stops adding
+ * them (the default). The writer is not owned by the context.
+ */
+void copyfile_ctx_set_manifest_writer(copyfile_ctx_t* ctx,
+		copyfile_manifest_writer_t* writer);
+
+/**
+ * Set the durability mode (a copyfile_durability_t value) for @ctx.
+ */
+void copyfile_ctx_set_durability(copyfile_ctx_t* ctx,
+		unsigned int durability);
+
+/**
+ * Commit the files written using @ctx in COPYFILE_SYNC_BATCH mode,
+ * i.e. sync all the filesystems they were written to. When this
+ * returns successfully, all the files (including their names
+ * and metadata) written since the previous commit are durable.
+ *
+ * In other modes, this does nothing. Destroying the context drops
+ * the uncommitted state without syncing.
+ *
+ * Returns 0 on success, an error otherwise. errno will hold the system
+ * error code.
+ */
+copyfile_error_t copyfile_ctx_commit(copyfile_ctx_t* ctx);
+
+/**
+ * Get the statistics collected in @ctx since its creation or the last
+ * copyfile_ctx_reset_stats() call.
+ *
+ * The returned pointer is valid until @ctx is destroyed.
+ */
+const copyfile_stats_t* copyfile_ctx_get_stats(const copyfile_ctx_t* ctx);
+
+/**
+ * Reset the statistics collected in @ctx.
+ */
+void copyfile_ctx_reset_stats(copyfile_ctx_t* ctx);
+
+/**
+ * Forget cached information about filesystem features (e.g. lack
+ * of extended attribute support). This should be called if
+ * the filesystems may have been remounted with different options.
+ */
+void copyfile_ctx_flush_caches(copyfile_ctx_t* ctx);
+
 /**
  * Copy the contents of an input stream onto an output stream.
  *
@@ -390,6 +948,13 @@ copyfile_error_t copyfile_copy_stream(int fd_in, int fd_out,
 		off_t* offset_store, off_t expected_size,
 		copyfile_callback_t callback, void* callback_data);
 
+/**
+ * Like copyfile_copy_stream(), with @ctx.
+ */
+copyfile_error_t copyfile_copy_stream_ctx(copyfile_ctx_t* ctx,
+		int fd_in, int fd_out, off_t* offset_store, off_t expected_size,
+		copyfile_callback_t callback, void* callback_data);
+
 /**
  * Clone the contents of an input stream onto an output stream
  * using Copy-on-Write if possible.
@@ -417,7 +982,19 @@ copyfile_error_t copyfile_clone_stream(int fd_in, int fd_out);
  *
  * The @expected_size can hold the expected size of the file,
  * or otherwise be 0. If it's non-zero, the function will try to
- * preallocate a space for the new file.
+ * preallocate a space for the new file. Files of up to 4 KiB are
+ * copied with a single read and write instead (the cloning is not
+ * attempted then).
+ *
+ * If @dest is a block device, the file is written onto it in place,
+ * even with COPYFILE_ATOMIC_PUBLISH (the files copied as a part
+ * of a tree are not checked for that). The device is neither truncated
+ * nor preallocated, and the data past the end of the file is kept.
+ * The regions of zeros (and the holes) are discarded or zeroed out
+ * by the device instead of being written, and the rest is written
+ * directly, in large aligned chunks. If the file is larger than
+ * the device, COPYFILE_ERROR_WRITE (ENOSPC) is returned before
+ * anything is written.
  *
  * If @callback is non-NULL, it will be used to report progress and/or
  * errors. The @callback_data will be passed to it. For more details,
@@ -434,6 +1011,102 @@ copyfile_error_t copyfile_copy_regular(const char* source,
 		const char* dest, off_t expected_size,
 		copyfile_callback_t callback, void* callback_data);
 
+/**
+ * Like copyfile_copy_regular(), with @ctx.
+ */
+copyfile_error_t copyfile_copy_regular_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, off_t expected_size,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * A single destination of copyfile_copy_regular_fanout()
+ * and copyfile_copy_stream_fanout().
+ */
+typedef struct
+{
+	/**
+	 * The full destination path, for copyfile_copy_regular_fanout()
+	 * (input).
+	 */
+	const char* dest;
+	/**
+	 * The output stream, for copyfile_copy_stream_fanout(); -1 to skip
+	 * the entry (input).
+	 */
+	int fd;
+
+	/**
+	 * The result for this destination and the errno value in case
+	 * of failure, the amount of data written to it, and whether it was
+	 * cloned instead (output).
+	 */
+	copyfile_error_t result;
+	int result_errno;
+	off_t written;
+	int cloned;
+} copyfile_fanout_entry_t;
+
+/**
+ * Copy the contents of an input stream onto @count output streams
+ * (the @fd of the @entries), reading it only once.
+ *
+ * The data is read into a few shared buffers, and written to each
+ * stream by a thread of its own (if the library was built with thread
+ * support), so the destinations are written in parallel; a slower one
+ * holds the others back by the size of the buffers at most. If
+ * writing a stream fails, it is dropped (its @result is set) and
+ * the others are written on.
+ *
+ * The @expected_size and @callback work as with copyfile_copy_stream().
+ * The callback may be called from different threads, but the calls
+ * are serialized; the write errors do not tell the destination.
+ * A read error fails all the destinations not dropped yet.
+ *
+ * Returns 0 if all the streams were written successfully, the result
+ * of the first failing entry otherwise. errno will hold the system
+ * error code.
+ */
+copyfile_error_t copyfile_copy_stream_fanout(int fd_in,
+		copyfile_fanout_entry_t* entries, size_t count,
+		off_t expected_size,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * Like copyfile_copy_stream_fanout(), with @ctx.
+ */
+copyfile_error_t copyfile_copy_stream_fanout_ctx(copyfile_ctx_t* ctx,
+		int fd_in, copyfile_fanout_entry_t* entries, size_t count,
+		off_t expected_size,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * Copy the contents of a regular file onto @count new files (the @dest
+ * of the @entries), reading it only once. This is equivalent
+ * to calling copyfile_copy_regular() for each of them, except for
+ * the source being read once.
+ *
+ * Each destination is tried to be cloned first, on its own; the ones
+ * which can't be cloned are written from a single stream, as with
+ * copyfile_copy_stream_fanout(). A destination which fails (to be
+ * opened, written or synced) does not stop the others.
+ *
+ * Returns 0 if all the files were copied successfully, the result
+ * of the first failing entry otherwise. errno will hold the system
+ * error code.
+ */
+copyfile_error_t copyfile_copy_regular_fanout(const char* source,
+		copyfile_fanout_entry_t* entries, size_t count,
+		off_t expected_size,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * Like copyfile_copy_regular_fanout(), with @ctx.
+ */
+copyfile_error_t copyfile_copy_regular_fanout_ctx(copyfile_ctx_t* ctx,
+		const char* source, copyfile_fanout_entry_t* entries,
+		size_t count, off_t expected_size,
+		copyfile_callback_t callback, void* callback_data);
+
 /**
  * Copy the symlink to a new location, preserving the destination.
  *
@@ -454,6 +1127,13 @@ copyfile_error_t copyfile_copy_symlink(const char* source,
 		const char* dest, size_t expected_length,
 		copyfile_callback_t callback, void* callback_data);
 
+/**
+ * Like copyfile_copy_symlink(), with @ctx.
+ */
+copyfile_error_t copyfile_copy_symlink_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, size_t expected_length,
+		copyfile_callback_t callback, void* callback_data);
+
 /**
  * Create a special (incopiable) file.
  *
@@ -511,6 +1191,13 @@ copyfile_error_t copyfile_copy_file(const char* source,
 		const char* dest, const struct stat* st,
 		copyfile_callback_t callback, void* callback_data);
 
+/**
+ * Like copyfile_copy_file(), with @ctx.
+ */
+copyfile_error_t copyfile_copy_file_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		copyfile_callback_t callback, void* callback_data);
+
 /**
  * Try to clone file to a new location, using atomic clone operation.
  *
@@ -552,9 +1239,15 @@ copyfile_error_t copyfile_clone_file(const char* source,
  * COPYFILE_COPY_STAT).  For more fine-grained control, see
  * the description of copyfile_metadata_flag_t.
  *
+ * If COPYFILE_DIFF_METADATA is passed, the current metadata of @path
+ * is obtained first and only the differing properties are changed.
+ * Passed alone, it implies COPYFILE_COPY_STAT as 0 does.
+ *
  * Returns a bit-field explaining which operations were done
  * successfully. For each successful change, a flag (from
- * copyfile_metadata_flag_t) will be set.
+ * copyfile_metadata_flag_t) will be set. For each property found
+ * equal in COPYFILE_DIFF_METADATA mode, the respective
+ * COPYFILE_SAME_* flag will be set as well.
  */
 unsigned int copyfile_set_stat(const char* path,
 		const struct stat* st, unsigned int flags);
@@ -567,7 +1260,9 @@ unsigned int copyfile_set_stat(const char* path,
  * attributes, it will return COPYFILE_NO_ERROR (since there's nothing
  * to copy).
  *
- * Otherwise, it will try hard to copy all the extended attributes.
+ * Otherwise, it will try hard to copy all the regular extended
+ * attributes (on GNU/Linux, the ones in 'user' and 'trusted'
+ * namespaces).
  * The call will return COPYFILE_NO_ERROR if all attributes were copied
  * correctly, or the first error which occurs. Note that in case
  * of an error other than ENOTSUP (xattr unsupported on destination
@@ -582,6 +1277,12 @@ unsigned int copyfile_set_stat(const char* path,
 copyfile_error_t copyfile_copy_xattr(const char* source,
 		const char* dest, const struct stat* st);
 
+/**
+ * Like copyfile_copy_xattr(), with @ctx.
+ */
+copyfile_error_t copyfile_copy_xattr_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st);
+
 /**
  * Copy ACLs of a file.
  *
@@ -598,6 +1299,12 @@ copyfile_error_t copyfile_copy_xattr(const char* source,
 copyfile_error_t copyfile_copy_acl(const char* source,
 		const char* dest, const struct stat* st);
 
+/**
+ * Like copyfile_copy_acl(), with @ctx.
+ */
+copyfile_error_t copyfile_copy_acl_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st);
+
 /**
  * Copy capabilities of a file.
  *
@@ -614,12 +1321,23 @@ copyfile_error_t copyfile_copy_acl(const char* source,
 copyfile_error_t copyfile_copy_cap(const char* source,
 		const char* dest, const struct stat* st);
 
+/**
+ * Like copyfile_copy_cap(), with @ctx.
+ */
+copyfile_error_t copyfile_copy_cap_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st);
+
 /**
  * Copy common file metadata.
  *
  * This involves copying basic stat() metadata, extended attributes
  * and ACLs.
  *
+ * Where ACLs and capabilities are stored as extended attributes
+ * (GNU/Linux), the attribute list is obtained once and used for all
+ * three. ACLs and capabilities are then copied only if the source file
+ * actually has them; otherwise, they are left alone on the destination.
+ *
  * If lstat() result for the source file is available, a pointer to it
  * should be passed as @st. Otherwise, @st should be NULL.
  *
@@ -630,7 +1348,9 @@ copyfile_error_t copyfile_copy_cap(const char* source,
  *
  * If @result_flags is not NULL, the bit-field pointed by it will
  * contain a copy of flags explaining which operations were done
- * successfully (it will be reset to zero first).
+ * successfully (it will be reset to zero first). In
+ * COPYFILE_DIFF_METADATA mode, COPYFILE_SAME_* flags will be set
+ * for the metadata which was correct already.
  *
  * Note that only read/input errors are returned by function. Unless
  * lstat() call fails, the call attempts to copy all metadata even
@@ -645,6 +1365,13 @@ copyfile_error_t copyfile_copy_metadata(const char* source,
 		const char* dest, const struct stat* st,
 		unsigned int flags, unsigned int* result_flags);
 
+/**
+ * Like copyfile_copy_metadata(), with @ctx.
+ */
+copyfile_error_t copyfile_copy_metadata_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int flags, unsigned int* result_flags);
+
 /**
  * Copy the given file to a new location, preserving given metadata.
  *
@@ -684,6 +1411,14 @@ copyfile_error_t copyfile_archive_file(const char* source,
 		unsigned int flags, unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data);
 
+/**
+ * Like copyfile_archive_file(), with @ctx.
+ */
+copyfile_error_t copyfile_archive_file_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const struct stat* st,
+		unsigned int flags, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data);
+
 /**
  * Hard-link the given file to a new location, fallback to copy.
  *
@@ -722,6 +1457,14 @@ copyfile_error_t copyfile_link_file(const char* source,
 		const char* dest, unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data);
 
+/**
+ * Like copyfile_link_file(), with @ctx.
+ */
+copyfile_error_t copyfile_link_file_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest,
+		unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data);
+
 /**
  * Move the given file to a new location, fallback to copy + unlink.
  *
@@ -761,6 +1504,14 @@ copyfile_error_t copyfile_move_file(const char* source,
 		const char* dest, unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data);
 
+/**
+ * Like copyfile_move_file(), with @ctx.
+ */
+copyfile_error_t copyfile_move_file_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest,
+		unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data);
+
 /**
  * Copy the given file to a new location, preserving given metadata.
  * Contents are copied from @dup_copy which is assumed to have the same
@@ -802,6 +1553,15 @@ copyfile_error_t copyfile_archive_file_dedup(const char* source,
 		unsigned int flags, unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data);
 
+/**
+ * Like copyfile_archive_file_dedup(), with @ctx.
+ */
+copyfile_error_t copyfile_archive_file_dedup_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const char* dup_copy,
+		const struct stat* st, unsigned int flags,
+		unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data);
+
 /**
  * Hard-link the given file to a new location, fallback to copy.
  * In the latter case, contents are copied from @dup_copy which is
@@ -844,6 +1604,14 @@ copyfile_error_t copyfile_link_file_dedup(const char* source,
 		const struct stat* st, unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data);
 
+/**
+ * Like copyfile_link_file_dedup(), with @ctx.
+ */
+copyfile_error_t copyfile_link_file_dedup_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const char* dup_copy,
+		const struct stat* st, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data);
+
 /**
  * Move the given file to a new location, fallback to copy + unlink.
  * In the latter case, contents are copied from @dup_copy which is
@@ -890,4 +1658,552 @@ copyfile_error_t copyfile_move_file_dedup(const char* source,
 		const struct stat* st, unsigned int* result_flags,
 		copyfile_callback_t callback, void* callback_data);
 
+/**
+ * Like copyfile_move_file_dedup(), with @ctx.
+ */
+copyfile_error_t copyfile_move_file_dedup_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, const char* dup_copy,
+		const struct stat* st, unsigned int* result_flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * A single file to be copied by copyfile_archive_batch().
+ */
+typedef struct
+{
+	/**
+	 * The source and the full destination path (input).
+	 */
+	const char* source;
+	const char* dest;
+	/**
+	 * The lstat() result for @source if available, NULL otherwise
+	 * (input).
+	 */
+	const struct stat* st;
+
+	/**
+	 * The result of copyfile_archive_file() for this entry, the errno
+	 * value in case of failure and the result flags (output). If
+	 * the batch was aborted before the entry was processed, @result
+	 * is COPYFILE_ABORTED.
+	 */
+	copyfile_error_t result;
+	int result_errno;
+	unsigned int result_flags;
+} copyfile_batch_entry_t;
+
+/**
+ * Copy a number of files, preserving given metadata, in parallel.
+ *
+ * This calls copyfile_archive_file() for each of the @count @entries,
+ * using a pool of worker threads (see copyfile_ctx_set_threads()).
+ * The files are started in the order chosen with
+ * copyfile_ctx_set_schedule(), but they may complete in any order,
+ * so all the destination directories need to exist beforehand.
+ *
+ * The @flags parameter is passed to copyfile_archive_file() for every
+ * file. The results are stored in the entries.
+ *
+ * If @callback is non-NULL, it is used for all the files. It may be
+ * called from different threads, but the calls are serialized. If it
+ * aborts a copy, no more files are started.
+ *
+ * In COPYFILE_SYNC_BATCH mode, the files are durable only after
+ * a successful copyfile_ctx_commit().
+ *
+ * Returns 0 if all the files were copied successfully, the result
+ * of the first failing entry otherwise. errno will hold the system
+ * error code.
+ */
+copyfile_error_t copyfile_archive_batch(copyfile_batch_entry_t* entries,
+		size_t count, unsigned int flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * Like copyfile_archive_batch(), with @ctx.
+ */
+copyfile_error_t copyfile_archive_batch_ctx(copyfile_ctx_t* ctx,
+		copyfile_batch_entry_t* entries, size_t count,
+		unsigned int flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * Copy a directory tree to a new location, preserving given metadata.
+ *
+ * This is roughly equivalent to 'cp -a'. If @source is not
+ * a directory, it is equivalent to copyfile_archive_file().
+ *
+ * The tree is copied as it is walked (depth-first), so that only
+ * the directories on the current path are held in memory. The
+ * directories are created as they are found, the remaining files are
+ * copied in parallel in batches (like with copyfile_archive_batch()),
+ * and the metadata of each directory is copied once all its contents
+ * are. Symbolic links are not followed.
+ *
+ * If a destination directory exists already, it is reused, so this
+ * can be used to sync a tree again (especially with
+ * COPYFILE_QUICK_CHECK). The symbolic links and special files found
+ * in the destination are removed and created again.
+ *
+ * The @flags parameter can specify which metadata should be copied.
+ * To copy all available metadata, specify 0 (which results in
+ * COPYFILE_COPY_ALL_METADATA).
+ *
+ * If @callback is non-NULL, it will be used to report progress and/or
+ * errors. It may be called from different threads, but the calls are
+ * serialized.
+ *
+ * Errors in individual files do not stop the copy. The first error
+ * is returned, except for COPYFILE_ABORTED which is returned
+ * immediately. If a directory can not be listed, the walk stops
+ * there (the files listed before are copied still).
+ *
+ * Returns 0 on success, an error otherwise. errno will hold the system
+ * error code.
+ */
+copyfile_error_t copyfile_archive_tree(const char* source,
+		const char* dest, unsigned int flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * Like copyfile_archive_tree(), with @ctx.
+ */
+copyfile_error_t copyfile_archive_tree_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest, unsigned int flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * Move a directory tree to a new location, fallback to copy + remove.
+ *
+ * The tree is renamed if possible. If @source and @dest are
+ * on different filesystems, the tree is copied with all the metadata
+ * and hard links like with copyfile_archive_tree() (with
+ * COPYFILE_PRESERVE_HARDLINKS), the copy is synced to the disk
+ * and only then the source files are removed (in batches, a directory
+ * at a time). Only the files whose copy is found are removed, so
+ * the files changed during the move stay in the source, and their
+ * directories fail to be removed. If the copy fails, the source is
+ * left intact. If @source is not a directory, this is equivalent
+ * to copyfile_move_file().
+ *
+ * If @callback is non-NULL, it will be used to report progress and/or
+ * errors, like with copyfile_move_file() and copyfile_archive_tree().
+ *
+ * Returns 0 on success, an error otherwise. errno will hold the system
+ * error code.
+ */
+copyfile_error_t copyfile_move_tree(const char* source, const char* dest,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * Like copyfile_move_tree(), with @ctx.
+ */
+copyfile_error_t copyfile_move_tree_ctx(copyfile_ctx_t* ctx,
+		const char* source, const char* dest,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * A regular file recorded in a manifest, see copyfile_manifest_lookup().
+ */
+typedef struct
+{
+	/**
+	 * The size and the inode number of the source file when it was
+	 * copied.
+	 */
+	off_t size;
+	ino_t ino;
+	/**
+	 * Its modification and status change times.
+	 */
+	time_t mtime;
+	long mtime_nsec;
+	time_t ctime;
+	long ctime_nsec;
+
+	/**
+	 * Non-zero if the SHA-256 @hash of the contents was recorded.
+	 */
+	int hashed;
+	unsigned char hash[32];
+} copyfile_manifest_entry_t;
+
+/**
+ * Flags for copyfile_manifest_writer_open().
+ */
+typedef enum
+{
+	/**
+	 * Record the SHA-256 hash of the contents of each file. The files
+	 * are read again to hash them, right after being copied. The files
+	 * skipped per a manifest keep the hash recorded there (if any).
+	 */
+	COPYFILE_MANIFEST_CONTENT_HASH = 0x01
+} copyfile_manifest_flags_t;
+
+/**
+ * Open the manifest stored in the file @path, and store it in
+ * @manifest.
+ *
+ * A manifest lists the regular files copied by a run, keyed by
+ * the hash of their source and destination paths (as given), with
+ * the state of the source when it was copied. It is a sorted array
+ * memory mapped read-only, so opening it costs nothing and a lookup
+ * touches a few pages at most, whatever the number of files.
+ *
+ * Returns 0 on success, an error otherwise (COPYFILE_ERROR_MANIFEST
+ * with errno set to EINVAL if the file is not a valid manifest,
+ * COPYFILE_ERROR_UNSUPPORTED if mmap() is not available).
+ */
+copyfile_error_t copyfile_manifest_open(copyfile_manifest_t** manifest,
+		const char* path);
+
+/**
+ * Close the @manifest. NULL is accepted and ignored.
+ */
+void copyfile_manifest_close(copyfile_manifest_t* manifest);
+
+/**
+ * Look up the copy of @source into @dest in @manifest. If it is found,
+ * store its record in @entry (unless NULL) and return 1; otherwise,
+ * return 0.
+ */
+int copyfile_manifest_lookup(const copyfile_manifest_t* manifest,
+		const char* source, const char* dest,
+		copyfile_manifest_entry_t* entry);
+
+/**
+ * Check whether the regular file @source, whose lstat() is @st, is
+ * the same as when it was copied into @dest per @manifest (see
+ * copyfile_ctx_set_manifest()). Returns non-zero if it is.
+ */
+int copyfile_manifest_unchanged(const copyfile_manifest_t* manifest,
+		const char* source, const char* dest, const struct stat* st);
+
+/**
+ * Start writing a manifest to the file @path, and store the writer
+ * in @writer. @flags is a copyfile_manifest_flags_t bitmask.
+ *
+ * The entries are gathered in memory, and written out sorted
+ * by copyfile_manifest_writer_commit(), replacing @path atomically.
+ * The writer can be shared between threads (including the workers
+ * of the batch functions). Note that @path can be the manifest being
+ * used, as the file is replaced and not changed in place.
+ *
+ * Returns 0 on success, an error otherwise.
+ */
+copyfile_error_t copyfile_manifest_writer_open(
+		copyfile_manifest_writer_t** writer, const char* path,
+		unsigned int flags);
+
+/**
+ * Add the regular file @source copied into @dest, whose lstat()
+ * is @st, to @writer. If the same paths were added already, the entry
+ * is replaced.
+ *
+ * Returns 0 on success, an error otherwise.
+ */
+copyfile_error_t copyfile_manifest_writer_add(
+		copyfile_manifest_writer_t* writer, const char* source,
+		const char* dest, const struct stat* st);
+
+/**
+ * Write out the manifest, synced to the disk. This can be done once;
+ * the writer still needs to be closed afterwards.
+ *
+ * Returns 0 on success, an error otherwise.
+ */
+copyfile_error_t copyfile_manifest_writer_commit(
+		copyfile_manifest_writer_t* writer);
+
+/**
+ * Close the manifest @writer, dropping the manifest unless it was
+ * committed. NULL is accepted and ignored.
+ */
+void copyfile_manifest_writer_close(copyfile_manifest_writer_t* writer);
+
+/**
+ * Flags for copyfile_watch_open().
+ */
+typedef enum
+{
+	/**
+	 * Remove the files and the directories removed from the source
+	 * (or renamed out of it) from the destination as well. Otherwise,
+	 * their copies are left.
+	 */
+	COPYFILE_WATCH_DELETE = 0x01,
+	/**
+	 * Watch each directory with inotify, even if the filesystem can be
+	 * watched as a whole with fanotify.
+	 */
+	COPYFILE_WATCH_INOTIFY = 0x02
+} copyfile_watch_flags_t;
+
+/**
+ * Start watching the directory tree @source for changes, to be mirrored
+ * into @dest by copyfile_watch_run(), and store the watch in @watch.
+ * @flags is a copyfile_watch_flags_t bitmask.
+ *
+ * On Linux, if the process is privileged enough, the whole filesystem
+ * of @source is marked with fanotify, reporting the changes with
+ * the directory file handles; this needs no resources per directory,
+ * but the directories mounted within the tree are not watched.
+ * Otherwise, each directory is watched with inotify (up to the limit
+ * of watches of the user).
+ *
+ * Returns 0 on success, an error otherwise (COPYFILE_ERROR_WATCH
+ * if the tree can not be watched, e.g. with ENOSPC if it has more
+ * directories than watches allowed; COPYFILE_ERROR_UNSUPPORTED if
+ * the platform can not watch for changes).
+ */
+copyfile_error_t copyfile_watch_open(copyfile_watch_t** watch,
+		const char* source, const char* dest, unsigned int flags);
+
+/**
+ * Set the time the tree has to be quiet for before the changes are
+ * synced, in milliseconds. The changes are synced after ten times that
+ * at most, even if the tree keeps changing.
+ *
+ * Passing 0 restores the default (200 ms).
+ */
+void copyfile_watch_set_debounce(copyfile_watch_t* watch,
+		unsigned int ms);
+
+/**
+ * Set the interval of syncing the whole tree again, in seconds, as
+ * a safety net for the changes the notifications may have missed.
+ * Passing 0 disables it. The default is an hour.
+ */
+void copyfile_watch_set_reconcile(copyfile_watch_t* watch,
+		unsigned int seconds);
+
+/**
+ * Mirror the tree watched by @watch, until stopped with
+ * copyfile_watch_stop() or aborted by @callback.
+ *
+ * The whole tree is copied first, like with copyfile_archive_tree().
+ * Then, the paths changed are gathered until the tree is quiet (see
+ * copyfile_watch_set_debounce()), and each is synced as it is then:
+ * the files are copied with copyfile_archive_file(), the new
+ * directories with copyfile_archive_tree(), and the renames are done
+ * in the destination with copyfile_move_file()
+ * and copyfile_move_tree(). The directories containing the changes get
+ * their metadata copied again. Each file changed is copied again,
+ * even if it turns out unchanged.
+ *
+ * If the notifications were lost (the queue overflowed), and once in
+ * a while (see copyfile_watch_set_reconcile()), the whole tree is
+ * synced again with copyfile_archive_tree(); the removals are not
+ * caught then.
+ *
+ * The @flags parameter can specify which metadata should be copied,
+ * as with copyfile_archive_file().
+ *
+ * If @callback is non-NULL, it will be used to report progress and/or
+ * errors. The errors of the removals (with COPYFILE_WATCH_DELETE) are
+ * reported as COPYFILE_ERROR_UNLINK_DEST, with the COPYFILE_MOVE type
+ * and the path removed as the move source. The errors in individual
+ * files do not stop mirroring; a rename which fails is done as a copy
+ * of the new name and a sync of the old one instead.
+ *
+ * Returns when stopped the first error in individual files, or 0 if
+ * there was none (the changes gathered but not synced yet are
+ * dropped), COPYFILE_ABORTED if aborted, an error otherwise
+ * (COPYFILE_ERROR_WATCH if the notifications failed). errno will hold
+ * the system error code.
+ */
+copyfile_error_t copyfile_watch_run(copyfile_watch_t* watch,
+		unsigned int flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * Like copyfile_watch_run(), with @ctx. With COPYFILE_QUICK_CHECK set
+ * in @ctx, the files which turn out unchanged are not copied again.
+ */
+copyfile_error_t copyfile_watch_run_ctx(copyfile_ctx_t* ctx,
+		copyfile_watch_t* watch, unsigned int flags,
+		copyfile_callback_t callback, void* callback_data);
+
+/**
+ * Make copyfile_watch_run() on @watch return. This can be called from
+ * another thread, or from a signal handler.
+ */
+void copyfile_watch_stop(copyfile_watch_t* watch);
+
+/**
+ * Stop watching and close @watch. NULL is accepted and ignored.
+ */
+void copyfile_watch_close(copyfile_watch_t* watch);
+
+/**
+ * Open the checkpoint journal stored in the file @path, creating it
+ * if it does not exist, and store it in @journal. See
+ * copyfile_ctx_set_journal().
+ *
+ * A journal belongs to a single tree copy, that is a source directory
+ * and a destination path (as given). When used for another one, it is
+ * started over. The records of the directories done are dropped now
+ * and then, so the journal stays small. The journal file is locked, so
+ * it can be open only once at a time. It can be removed when the copy
+ * is done, or to start it over.
+ *
+ * Returns 0 on success, an error otherwise (COPYFILE_ERROR_JOURNAL
+ * with errno set to EINVAL if the file is not a valid journal).
+ */
+copyfile_error_t copyfile_journal_open(copyfile_journal_t** journal,
+		const char* path);
+
+/**
+ * Close the checkpoint @journal. NULL is accepted and ignored.
+ */
+void copyfile_journal_close(copyfile_journal_t* journal);
+
+/**
+ * Open the deduplication index stored in the file @path, creating it
+ * if it does not exist, and store it in @index.
+ *
+ * The index maps the contents of regular files (their size and
+ * SHA-256 hash) to the paths where they were seen, to find candidates
+ * for the dup_copy argument of the *_dedup() functions. It is memory
+ * mapped, and grows as files are added. Files of a size not known
+ * to the index are rejected without being read, and a Bloom filter
+ * rejects most of the other misses without walking the entries.
+ *
+ * The paths are stored as given, so they should be absolute unless
+ * the working directory stays the same. The index file is locked,
+ * so it can be open only once at a time; it can be shared between
+ * threads (including the workers of the batch functions). It is not
+ * crash-safe -- if it gets damaged, it can be simply removed.
+ *
+ * Returns 0 on success, an error otherwise (COPYFILE_ERROR_INDEX
+ * with errno set to EINVAL if the file is not a valid index,
+ * COPYFILE_ERROR_UNSUPPORTED if mmap() is not available).
+ */
+copyfile_error_t copyfile_dedup_index_open(copyfile_dedup_index_t** index,
+		const char* path);
+
+/**
+ * Close the deduplication @index. NULL is accepted and ignored.
+ */
+void copyfile_dedup_index_close(copyfile_dedup_index_t* index);
+
+/**
+ * Find a regular file with the same contents as the regular file
+ * @path in @index. If @st is non-NULL, it should be the lstat() of
+ * @path.
+ *
+ * Files which disappeared or changed (size or mtime) since they were
+ * indexed are skipped. The file itself is never returned.
+ *
+ * On success, *@dup_copy is set to a newly allocated path of
+ * the duplicate (to be free()d), or NULL if none is known. Returns 0
+ * on success, an error otherwise.
+ */
+copyfile_error_t copyfile_dedup_index_lookup(copyfile_dedup_index_t* index,
+		const char* path, const struct stat* st, char** dup_copy);
+
+/**
+ * Add the regular file @path to @index, hashing its contents.
+ * If it is in the index already, its entry is refreshed.
+ *
+ * Returns 0 on success, an error otherwise.
+ */
+copyfile_error_t copyfile_dedup_index_insert(copyfile_dedup_index_t* index,
+		const char* path);
+
+/**
+ * Make the existing file @dest share the storage of its contents with
+ * @dup_copy, where they are the same. Nothing is copied; the kernel
+ * compares the files range by range (FIDEDUPERANGE) and shares
+ * the extents of the identical ranges. This way, a file written by
+ * a byte copy can be turned into a clone afterwards.
+ *
+ * Only the common length of the files is compared, in aligned ranges
+ * of 16 MiB. A range which differs is compared again in pieces
+ * of 1 MiB, and the pieces which differ are left alone. If the sizes
+ * of the files differ, the unaligned end of the common length is left
+ * alone as well.
+ *
+ * If @reclaimed is not NULL, it will be set to the number of bytes
+ * that are shared now. Note that this includes ranges which were
+ * shared already before the call.
+ *
+ * Returns 0 on success, an error otherwise. errno will hold the system
+ * error code. If the platform does not support FIDEDUPERANGE,
+ * COPYFILE_ERROR_UNSUPPORTED will be returned.
+ */
+copyfile_error_t copyfile_dedup_file(const char* dup_copy,
+		const char* dest, off_t* reclaimed);
+
+/**
+ * Like copyfile_dedup_file(), with @ctx.
+ *
+ * @dup_copy may be NULL, in which case a duplicate of @dest is looked
+ * up in the deduplication index of @ctx. If there is no index or no
+ * duplicate is known, nothing is done.
+ */
+copyfile_error_t copyfile_dedup_file_ctx(copyfile_ctx_t* ctx,
+		const char* dup_copy, const char* dest, off_t* reclaimed);
+
+/**
+ * Flags describing a file extent.
+ */
+typedef enum
+{
+	/**
+	 * The data is shared with other files (e.g. reflinks, snapshots).
+	 */
+	COPYFILE_EXTENT_SHARED = 0x01,
+	/**
+	 * The space is allocated, but the data was not written (it reads
+	 * back as zeros).
+	 */
+	COPYFILE_EXTENT_UNWRITTEN = 0x02,
+	/**
+	 * The physical location is not known or does not identify the data
+	 * (e.g. delayed allocation, inline or encoded data).
+	 */
+	COPYFILE_EXTENT_UNKNOWN = 0x04
+} copyfile_extent_flag_t;
+
+/**
+ * A file extent, as listed by copyfile_get_extents().
+ */
+typedef struct
+{
+	/**
+	 * The offset in the file, the offset on the device (in bytes)
+	 * and the length. The last extent may extend past the end
+	 * of the file.
+	 */
+	off_t logical;
+	off_t physical;
+	off_t length;
+	/**
+	 * A bit-field of copyfile_extent_flag_t values.
+	 */
+	unsigned int flags;
+} copyfile_extent_t;
+
+/**
+ * List the extents of the file @path (FIEMAP), in the order of their
+ * offsets in the file. The ranges not covered by any extent are holes.
+ * The file's pending writes are flushed first, so that all of its data
+ * has a location.
+ *
+ * The physical locations can be used e.g. to order the reads from
+ * a rotational disk.
+ *
+ * On success, *@extents is set to a newly allocated array (to be
+ * free()d) and *@count to the number of extents in it. Returns 0
+ * on success, an error otherwise (COPYFILE_ERROR_IOCTL_FIEMAP if
+ * the filesystem does not support listing the extents,
+ * COPYFILE_ERROR_UNSUPPORTED if the platform does not). errno will
+ * hold the system error code.
+ */
+copyfile_error_t copyfile_get_extents(const char* path,
+		copyfile_extent_t** extents, size_t* count);
+
 #endif /*COPYFILE_H*/
@@ -0,0 +1,42 @@
+#!/bin/sh
+# a symlink or a FIFO replaced in the source is replaced in the mirror
+# too, rather than failing with EEXIST
+
+copyfile=${COPYFILE:-./util/copyfile}
+tmp=$(mktemp -d) || exit 99
+pid=
+trap 'test -n "$pid" && kill $pid 2>/dev/null; rm -rf "$tmp"' EXIT
+
+# wait up to 10 s for the condition @1
+wait_for() {
+	i=0
+	while ! eval "$1"; do
+		i=$((i + 1))
+		test $i -lt 100 || return 1
+		sleep 0.1
+	done
+}
+
+mkdir "$tmp/src" || exit 99
+ln -s foo "$tmp/src/s" || exit 99
+mkfifo "$tmp/src/p" || exit 77
+
+"$copyfile" -r -w "$tmp/src" "$tmp/dst" 2>"$tmp/log" &
+pid=$!
+wait_for 'test -p "$tmp/dst/p"' || { cat "$tmp/log"; exit 1; }
+# the watches are set up before the first copy
+kill -0 $pid 2>/dev/null || exit 77
+
+ln -sfn bar "$tmp/src/s"
+rm "$tmp/src/p"
+ln -s baz "$tmp/src/p"
+
+wait_for 'test "$(readlink "$tmp/dst/s")" = bar \
+		&& test "$(readlink "$tmp/dst/p")" = baz'
+ret=$?
+
+kill $pid
+wait $pid
+pid=
+cat "$tmp/log"
+test $ret = 0 && ! grep -q 'File exists' "$tmp/log"
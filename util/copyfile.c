@@ -11,12 +11,13 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <signal.h>
 
 #ifdef HAVE_GETOPT_LONG
 #	include <getopt.h>
 #endif
 
-static const char* const copyfile_opts = "aclmPD:hV";
+static const char* const copyfile_opts = "acdlmrwWPD:I:J:M:hV";
 
 #ifdef HAVE_GETOPT_LONG
 
@@ -24,10 +25,18 @@ static const struct option copyfile_long_opts[] =
 {
 	{ "archive", no_argument, 0, 'a' },
 	{ "clone", no_argument, 0, 'c' },
+	{ "dedupe", no_argument, 0, 'd' },
 	{ "link", no_argument, 0, 'l' },
+	{ "move", no_argument, 0, 'm' },
+	{ "recursive", no_argument, 0, 'r' },
+	{ "watch", no_argument, 0, 'w' },
+	{ "watch-delete", no_argument, 0, 'W' },
 	{ "progress", no_argument, 0, 'P' },
 
 	{ "duplicate-from", required_argument, 0, 'D' },
+	{ "dedup-index", required_argument, 0, 'I' },
+	{ "journal", required_argument, 0, 'J' },
+	{ "manifest", required_argument, 0, 'M' },
 
 	{ "help", no_argument, 0, 'h' },
 	{ "version", no_argument, 0, 'V' },
@@ -42,18 +51,43 @@ static const char* const copyfile_help_usage =
 "\n"
 "Copy a single file SOURCE to a new full path DEST. DEST must not\n"
 "be just a directory, it has to contain the filename as well.\n"
+"\n"
+"With --dedupe, make the existing file DEST share storage with SOURCE\n"
+"instead. SOURCE can be omitted if --dedup-index is given.\n"
 "\n";
 
 static const char* const copyfile_help_options =
 "  -a, --archive         copy file metadata as well\n"
 "  -c, --clone           try to atomically clone file (may leave stale file)\n"
+"  -d, --dedupe          do not copy; share the identical ranges of DEST\n"
+"                        with SOURCE (FIDEDUPERANGE) and report the number\n"
+"                        of bytes reclaimed\n"
 "  -l, --link            try to create a hard link first, fall back to copy\n"
 "                        (implies --archive)\n"
 "  -m, --move            move (rename) instead of copying, fall back to copy\n"
 "                        and remove (implies --archive)\n"
+"  -r, --recursive       copy (or move) a whole directory tree, copying\n"
+"                        multiple files in parallel (implies --archive)\n"
 "  -D, --duplicate-from DUP-SOURCE\n"
 "                        clone file contents from file DUP-SOURCE (which has\n"
 "                        the same contents and is better candidate for CoW)\n"
+"  -I, --dedup-index INDEX\n"
+"                        look up files with the same contents in the index\n"
+"                        file INDEX (created if necessary) and clone or link\n"
+"                        them instead of copying; add the new copies to it\n"
+"  -J, --journal JOURNAL\n"
+"                        record the progress of a --recursive copy in\n"
+"                        the file JOURNAL, and skip what was done already\n"
+"                        when run again after an interruption\n"
+"  -M, --manifest MANIFEST\n"
+"                        skip the files unchanged since they were copied\n"
+"                        per the manifest file MANIFEST (without looking\n"
+"                        at DEST), and write the new manifest to it\n"
+"  -w, --watch           after a --recursive copy, keep watching SOURCE\n"
+"                        and mirror the changes into DEST until\n"
+"                        interrupted\n"
+"  -W, --watch-delete    like --watch, and remove what is removed from\n"
+"                        SOURCE from DEST as well\n"
 "  -P, --progress        enable verbose progress reporting\n"
 "\n"
 "  -h, --help            print help message\n"
@@ -93,14 +127,44 @@ static int progress_callback(copyfile_error_t state,
 	return default_return;
 }
 
+static copyfile_watch_t* watch = 0;
+
+static void stop_watch(int sig)
+{
+	(void) sig;
+	copyfile_watch_stop(watch);
+}
+
+/* while watching, the errors are reported and passed over */
+static int watch_callback(copyfile_error_t state,
+		copyfile_filetype_t ftype, copyfile_progress_t prog,
+		void* data, int default_return)
+{
+	copyfile_callback_t progress = *(copyfile_callback_t*) data;
+
+	if (state != COPYFILE_NO_ERROR && state != COPYFILE_EOF
+			&& state != COPYFILE_UP_TO_DATE && default_return)
+		perror(copyfile_error_message(state));
+	else if (progress)
+		return progress(state, ftype, prog, data, default_return);
+
+	return default_return;
+}
+
 int main(int argc, char* argv[])
 {
 	int opt_archive = 0;
 	int opt_clone = 0;
+	int opt_dedupe = 0;
 	int opt_link = 0;
 	int opt_move = 0;
+	int opt_recursive = 0;
+	int opt_watch = 0;
 
 	const char* duplicate_from = 0;
+	const char* dedup_index = 0;
+	const char* journal_path = 0;
+	const char* manifest_path = 0;
 
 	copyfile_callback_t opt_progress = 0;
 
@@ -126,15 +190,36 @@ int main(int argc, char* argv[])
 			case 'c':
 				opt_clone = 1;
 				break;
+			case 'd':
+				opt_dedupe = 1;
+				break;
 			case 'l':
 				opt_link = 1;
 				break;
 			case 'm':
 				opt_move = 1;
 				break;
+			case 'r':
+				opt_recursive = 1;
+				break;
+			case 'w':
+				opt_watch = 1;
+				break;
+			case 'W':
+				opt_watch = COPYFILE_WATCH_DELETE;
+				break;
 			case 'D':
 				duplicate_from = optarg;
 				break;
+			case 'I':
+				dedup_index = optarg;
+				break;
+			case 'J':
+				journal_path = optarg;
+				break;
+			case 'M':
+				manifest_path = optarg;
+				break;
 			case 'P':
 				opt_progress = progress_callback;
 				break;
@@ -155,7 +240,11 @@ int main(int argc, char* argv[])
 
 	{
 		int remain_opts = argc - optind;
-		if (remain_opts != 2)
+
+		/* the source is looked up in the index */
+		if (opt_dedupe && dedup_index && remain_opts == 1)
+			;
+		else if (remain_opts != 2)
 		{
 			if (remain_opts < 2)
 				fprintf(stderr, "%s: missing %s parameter\n", argv[0],
@@ -174,52 +263,184 @@ int main(int argc, char* argv[])
 					argv[0]);
 			return 1;
 		}
+
+		if (opt_recursive && (opt_link || opt_clone || duplicate_from))
+		{
+			fprintf(stderr, "%s: --recursive can be used only with --archive and --move\n",
+					argv[0]);
+			return 1;
+		}
+
+		if (opt_watch && (!opt_recursive || opt_move || manifest_path))
+		{
+			fprintf(stderr, "%s: --watch can be used only with --recursive\n",
+					argv[0]);
+			return 1;
+		}
+
+		if (journal_path && !opt_recursive)
+		{
+			fprintf(stderr, "%s: --journal can be used only with --recursive\n",
+					argv[0]);
+			return 1;
+		}
+
+		if (manifest_path && ((!opt_archive && !opt_recursive)
+					|| opt_dedupe || opt_link || opt_move || opt_clone
+					|| duplicate_from))
+		{
+			fprintf(stderr, "%s: --manifest can be used only with --archive and --recursive\n",
+					argv[0]);
+			return 1;
+		}
+
+		if (opt_dedupe && (opt_link || opt_move || opt_clone
+					|| opt_recursive || duplicate_from))
+		{
+			fprintf(stderr, "%s: --dedupe can not be used with other modes\n",
+					argv[0]);
+			return 1;
+		}
 	}
 
 	{
 		const char* source = argv[optind];
 		const char* dest = argv[optind+1];
 
-		int ret;
+		copyfile_ctx_t* ctx = 0;
+		copyfile_dedup_index_t* index = 0;
+		copyfile_journal_t* journal = 0;
+		copyfile_manifest_t* manifest = 0;
+		copyfile_manifest_writer_t* manifest_writer = 0;
+		int ret = COPYFILE_NO_ERROR;
 
-		if (duplicate_from)
+		if (dedup_index || journal_path || manifest_path || opt_watch)
+		{
+			ctx = copyfile_ctx_create();
+			if (!ctx)
+				ret = COPYFILE_ERROR_MALLOC;
+			if (!ret && dedup_index)
+				ret = copyfile_dedup_index_open(&index, dedup_index);
+			if (!ret && journal_path)
+				ret = copyfile_journal_open(&journal, journal_path);
+			if (!ret && manifest_path)
+			{
+				/* there's none on the first run */
+				if (access(manifest_path, F_OK) == 0)
+					ret = copyfile_manifest_open(&manifest, manifest_path);
+				if (!ret)
+					ret = copyfile_manifest_writer_open(&manifest_writer,
+							manifest_path, 0);
+			}
+
+			if (ret)
+			{
+				perror(copyfile_error_message(ret));
+				copyfile_manifest_close(manifest);
+				copyfile_journal_close(journal);
+				copyfile_dedup_index_close(index);
+				copyfile_ctx_destroy(ctx);
+				return 1;
+			}
+
+			copyfile_ctx_set_dedup_index(ctx, index);
+			copyfile_ctx_set_journal(ctx, journal);
+			copyfile_ctx_set_manifest(ctx, manifest);
+			copyfile_ctx_set_manifest_writer(ctx, manifest_writer);
+			/* the files found unchanged are not copied again */
+			if (opt_watch)
+				copyfile_ctx_set_options(ctx, COPYFILE_QUICK_CHECK);
+		}
+
+		if (opt_dedupe)
+		{
+			off_t reclaimed;
+
+			if (!dest)
+			{
+				dest = source;
+				source = 0;
+			}
+
+			ret = copyfile_dedup_file_ctx(ctx, source, dest, &reclaimed);
+			if (!ret)
+				printf("%s: %lu KiB reclaimed\n", dest,
+						(unsigned long) (reclaimed >> 10));
+		}
+		else if (opt_watch)
+		{
+			ret = copyfile_watch_open(&watch, source, dest,
+					opt_watch & COPYFILE_WATCH_DELETE);
+			if (!ret)
+			{
+				signal(SIGINT, stop_watch);
+				signal(SIGTERM, stop_watch);
+				ret = copyfile_watch_run_ctx(ctx, watch, 0,
+						watch_callback, &opt_progress);
+				copyfile_watch_close(watch);
+			}
+		}
+		else if (opt_recursive)
 		{
 			if (opt_move)
-				ret = copyfile_move_file_dedup(source, dest, duplicate_from,
-						0, 0, opt_progress, 0);
+				ret = copyfile_move_tree_ctx(ctx, source, dest,
+						opt_progress, 0);
+			else
+				ret = copyfile_archive_tree_ctx(ctx, source, dest, 0,
+						opt_progress, 0);
+		}
+		else if (duplicate_from)
+		{
+			if (opt_move)
+				ret = copyfile_move_file_dedup_ctx(ctx, source, dest,
+						duplicate_from, 0, 0, opt_progress, 0);
 			else if (opt_link)
-				ret = copyfile_link_file_dedup(source, dest, duplicate_from,
-						0, 0, opt_progress, 0);
+				ret = copyfile_link_file_dedup_ctx(ctx, source, dest,
+						duplicate_from, 0, 0, opt_progress, 0);
 			else if (opt_archive)
-				ret = copyfile_archive_file_dedup(source, dest, duplicate_from,
-						0, 0, 0, opt_progress, 0);
+				ret = copyfile_archive_file_dedup_ctx(ctx, source, dest,
+						duplicate_from, 0, 0, 0, opt_progress, 0);
 			else if (opt_clone)
 				ret = copyfile_clone_file(duplicate_from, dest, 0);
 			else
-				ret = copyfile_copy_file(duplicate_from, dest, 0,
+				ret = copyfile_copy_file_ctx(ctx, duplicate_from, dest, 0,
 						opt_progress, 0);
 		}
 		else
 		{
 			if (opt_move)
-				ret = copyfile_move_file(source, dest, 0, opt_progress, 0);
+				ret = copyfile_move_file_ctx(ctx, source, dest, 0,
+						opt_progress, 0);
 			else if (opt_link)
-				ret = copyfile_link_file(source, dest, 0, opt_progress, 0);
+				ret = copyfile_link_file_ctx(ctx, source, dest, 0,
+						opt_progress, 0);
 			else if (opt_archive)
-				ret = copyfile_archive_file(source, dest, 0, 0, 0,
+				ret = copyfile_archive_file_ctx(ctx, source, dest, 0, 0, 0,
 						opt_progress, 0);
 			else if (opt_clone)
 				ret = copyfile_clone_file(source, dest, 0);
 			else
-				ret = copyfile_copy_file(source, dest, 0, opt_progress, 0);
+				ret = copyfile_copy_file_ctx(ctx, source, dest, 0,
+						opt_progress, 0);
 		}
 
-		if (!ret)
-			return 0;
-		else
+		/* the files copied are listed even if some failed */
+		if (manifest_writer && ret != COPYFILE_ABORTED)
 		{
-			perror(copyfile_error_message(ret));
-			return 1;
+			int manifest_ret = copyfile_manifest_writer_commit(manifest_writer);
+
+			if (manifest_ret && !ret)
+				ret = manifest_ret;
 		}
+
+		if (ret)
+			perror(copyfile_error_message(ret));
+
+		copyfile_manifest_writer_close(manifest_writer);
+		copyfile_manifest_close(manifest);
+		copyfile_journal_close(journal);
+		copyfile_dedup_index_close(index);
+		copyfile_ctx_destroy(ctx);
+		return !!ret;
 	}
 }